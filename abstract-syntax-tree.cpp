@@ -1,32 +1,121 @@
 #include <iostream>
 
+#include "llvm/ADT/APFloat.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Verifier.h"
+
 #include "abstract-syntax-tree.hpp"
+#include "code-generator.hpp"
+
+namespace
+{
 
-llvm::Value* NumberExprAST::codegen()
+// A hash-consed node reached again within one function reuses its value.
+// Bodies are a single basic block, so the first emission dominates every
+// later use.
+llvm::Value* emit(ExprAST& e, CodeGenContext& cg)
 {
-   return llvm::ConstantFP::get(context, llvm::APFloat(val));
+   if(!e.shared)
+   {
+      return e.codegen(cg);
+   }
+   auto it = cg.sharedValues.find(&e);
+   if(it != cg.sharedValues.end())
+   {
+      return it->second;
+   }
+   llvm::Value* value = e.codegen(cg);
+   cg.sharedValues.emplace(&e, value);
+   return value;
 }
 
-llvm::Value* VariableExprAST::codegen()
+} // namespace
+
+// Children are detached before their parent is deleted, so no node
+// destructor recurses; the worklist holds the detached subtrees.
+void ExprDeleter::operator()(ExprAST* e) const
 {
-   llvm::Value* value = namedValues[name];
-   if(!value)
+   if(e->arenaOwned)
+   {
+      return;
+   }
+   if(e->getKind() == ExprAST::Kind::number || e->getKind() == ExprAST::Kind::variable)
+   {
+      delete e;
+      return;
+   }
+   // reused across calls; entries below base belong to an outer call
+   thread_local std::vector<ExprAST*> pending{};
+   std::size_t const base = pending.size();
+   pending.push_back(e);
+   auto detach = [](ExprPtr& child)
+   {
+      if(child && !child->arenaOwned)
+      {
+         pending.push_back(child.release());
+      }
+   };
+   while(pending.size() > base)
    {
-      std::cerr << "Unknown variable name: " << name;
+      ExprAST* node = pending.back();
+      pending.pop_back();
+      switch(node->getKind())
+      {
+         case ExprAST::Kind::unary:
+         {
+            detach(static_cast<UnaryExprAST*>(node)->operand);
+            break;
+         }
+         case ExprAST::Kind::binary:
+         {
+            auto bin = static_cast<BinaryExprAST*>(node);
+            detach(bin->lhs);
+            detach(bin->rhs);
+            break;
+         }
+         case ExprAST::Kind::call:
+         {
+            for(auto& arg : static_cast<CallExprAST*>(node)->args)
+            {
+               detach(arg);
+            }
+            break;
+         }
+         default:
+         {
+            break;
+         }
+      }
+      delete node;
+   }
+}
+
+llvm::Value* NumberExprAST::codegen(CodeGenContext& cg)
+{
+   return llvm::ConstantFP::get(cg.context(), llvm::APFloat(val));
+}
+
+llvm::Value* VariableExprAST::codegen(CodeGenContext& cg)
+{
+   if(slot >= cg.argValues.size())
+   {
+      std::cerr << "Unresolved variable name: " << name;
       return nullptr;
    }
-   return value;
+   return cg.argValues[slot];
 }
 
-llvm::Value* BinaryExprAST::codegen()
+llvm::Value* BinaryExprAST::codegen(CodeGenContext& cg)
 {
-   llvm::Value* left = lhs->codegen();
-   llvm::Value* right = rhs->codegen();
+   llvm::Value* left = emit(*lhs, cg);
+   llvm::Value* right = emit(*rhs, cg);
    if(!left || !right)
    {
       return nullptr;
    }
 
+   llvm::IRBuilder<>& builder = cg.builder();
    switch(op)
    {
       case('+'):
@@ -44,19 +133,42 @@ llvm::Value* BinaryExprAST::codegen()
       case('<'):
       {
          left = builder.CreateFCmpULT(left, right, "cmptmp");
-         return builder.CreateUIToFP(left, llvm::Type::getDoubleTy(context), "booltmp");
+         return builder.CreateUIToFP(left, llvm::Type::getDoubleTy(cg.context()), "booltmp");
       }
       default:
       {
-         std::cerr << "Invalid binary operator";
-         return nullptr;
+         // user-defined: a call to its "binary<c>" definition
+         llvm::Function* f = cg.function(std::string("binary") + op);
+         if(!f)
+         {
+            std::cerr << "Invalid binary operator";
+            return nullptr;
+         }
+         llvm::Value* ops[] = {left, right};
+         return builder.CreateCall(f, ops, "binop");
       }
    }
 }
 
-llvm::Value* CallExprAST::codegen()
+llvm::Value* UnaryExprAST::codegen(CodeGenContext& cg)
+{
+   llvm::Value* value = emit(*operand, cg);
+   if(!value)
+   {
+      return nullptr;
+   }
+   llvm::Function* f = cg.function(std::string("unary") + opcode);
+   if(!f)
+   {
+      std::cerr << "Unknown unary operator";
+      return nullptr;
+   }
+   return cg.builder().CreateCall(f, value, "unop");
+}
+
+llvm::Value* CallExprAST::codegen(CodeGenContext& cg)
 {
-   llvm::Function *calleeFunc{mod->getFunction(callee)};
+   llvm::Function *calleeFunc{cg.function(callee)};
    if(!calleeFunc)
    {
       std::cerr << "Unknown function referenced";
@@ -72,40 +184,41 @@ llvm::Value* CallExprAST::codegen()
    std::vector<llvm::Value*> argsV{};
    for(unsigned long i{0}, e{args.size()}; i != e; ++i)
    {
-      argsV.push_back(args[i]->codegen());
+      argsV.push_back(emit(*args[i], cg));
       if(!argsV.back())
       {
          return nullptr;
       }
    }
 
-   return builder.CreateCall(calleeFunc, argsV, "calltmp");
+   return cg.builder().CreateCall(calleeFunc, argsV, "calltmp");
 }
 
-llvm::Function* PrototypeAST::codegen()
+llvm::Function* PrototypeAST::codegen(CodeGenContext& cg)
 {
-   std::vector<llvm::Type*> doubles(args.size(), llvm::Type::getDoubleTy(context));
+   std::vector<llvm::Type*> doubles(args.size(), llvm::Type::getDoubleTy(cg.context()));
 
-   llvm::FunctionType* ft = llvm::FunctionType::get(llvm::Type::getDoubleTy(context), doubles, false);
+   llvm::FunctionType* ft = llvm::FunctionType::get(llvm::Type::getDoubleTy(cg.context()), doubles, false);
 
-   llvm::Function* f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name, mod.get());
+   llvm::Function* f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name.str(), cg.module());
+   cg.declared(name, args.size());
 
    unsigned idx{0};
 
    for(auto& arg : f->args())
    {
-      arg.setName(args[idx++]);
+      arg.setName(args[idx++].str());
    }
 
    return f;
 }
 
-llvm::Value* FunctionAST::codegen()
+llvm::Value* FunctionAST::codegen(CodeGenContext& cg)
 {
-   llvm::Function* func = mod->getFunction(proto->getName());
+   llvm::Function* func = cg.module().getFunction(proto->getName());
    if(!func)
    {
-      func = proto->codegen();
+      func = proto->codegen(cg);
    }
 
    if(!func)
@@ -119,18 +232,13 @@ llvm::Value* FunctionAST::codegen()
       return nullptr;
    }
 
-   llvm::BasicBlock* bb = llvm::BasicBlock::Create(context, "entry", func);
-   builder.SetInsertPoint(bb);
-
-   namedValues.clear();
-   for(auto& arg : func->args())
-   {
-      namedValues[std::string(arg.getName())] = &arg;
-   }
+   llvm::BasicBlock* bb = llvm::BasicBlock::Create(cg.context(), "entry", func);
+   cg.builder().SetInsertPoint(bb);
+   cg.beginFunction(*func);
 
-   if(llvm::Value* retVal = body->codegen())
+   if(llvm::Value* retVal = emit(*body, cg))
    {
-      builder.CreateRet(retVal);
+      cg.builder().CreateRet(retVal);
       verifyFunction(*func);
       return func;
    }
@@ -138,3 +246,247 @@ llvm::Value* FunctionAST::codegen()
    return nullptr;
 
 }
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+#include "parser.hpp"
+#include "resolver.hpp"
+
+#include <thread>
+
+namespace
+{
+
+std::unique_ptr<FunctionAST> parseDef(std::string_view src, OperatorTable& ops)
+{
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   return parseDefinition(tok, cur, ops);
+}
+
+std::unique_ptr<FunctionAST> parseDef(std::string_view src)
+{
+   OperatorTable ops{};
+   return parseDef(src, ops);
+}
+
+std::size_t instructionCount(llvm::Function const* f)
+{
+   std::size_t n{};
+   for(auto const& bb : *f)
+   {
+      n += bb.size();
+   }
+   return n;
+}
+
+} // namespace
+
+class hash_cons_test : public testing::Test
+{
+   public:
+      void SetUp() override
+      {
+         arena->setHashConsing(true);
+      }
+
+      std::shared_ptr<AstArena> arena{std::make_shared<AstArena>()};
+      CodeGenContext cg{"hash_cons_test"};
+};
+
+TEST_F(hash_cons_test, shares_equal_subtrees)
+{
+   std::unique_ptr<FunctionAST> def{};
+   {
+      ArenaScope scope{arena};
+      def = parseDef("def fib(x) fib(x-1)+fib(x-2) + (x*x)*(x*x)");
+   }
+   ASSERT_TRUE(def != nullptr);
+   auto sum = llvm::cast<BinaryExprAST>(def->body.get());
+   auto squares = llvm::cast<BinaryExprAST>(sum->rhs.get());
+   EXPECT_EQ(squares->lhs.get(), squares->rhs.get());
+   EXPECT_TRUE(squares->lhs->shared);
+
+   auto calls = llvm::cast<BinaryExprAST>(sum->lhs.get());
+   auto first = llvm::cast<CallExprAST>(calls->lhs.get());
+   auto second = llvm::cast<CallExprAST>(calls->rhs.get());
+   EXPECT_NE(first, second);
+   auto xMinus1 = llvm::cast<BinaryExprAST>(first->args[0].get());
+   auto xMinus2 = llvm::cast<BinaryExprAST>(second->args[0].get());
+   EXPECT_EQ(xMinus1->lhs.get(), xMinus2->lhs.get());
+   EXPECT_NE(xMinus1->rhs.get(), xMinus2->rhs.get());
+
+   // same structure as the tree built without sharing
+   EXPECT_EQ(*def, *parseDef("def fib(x) fib(x-1)+fib(x-2) + (x*x)*(x*x)"));
+}
+
+TEST_F(hash_cons_test, codegen_emits_shared_nodes_once)
+{
+   auto tree = parseDef("def sq(x y) (x*y+1)*(x*y+1)");
+   std::unique_ptr<FunctionAST> dag{};
+   {
+      ArenaScope scope{arena};
+      dag = parseDef("def sqd(x y) (x*y+1)*(x*y+1)");
+   }
+   ASSERT_TRUE(tree && dag);
+   Resolver resolver{};
+   ASSERT_TRUE(resolver.resolve(*tree) && resolver.resolve(*dag));
+
+   auto treeFn = llvm::cast<llvm::Function>(tree->codegen(cg));
+   auto dagFn = llvm::cast<llvm::Function>(dag->codegen(cg));
+   ASSERT_TRUE(treeFn && dagFn);
+   EXPECT_FALSE(llvm::verifyFunction(*dagFn, &llvm::errs()));
+   // fmul, fadd, fmul, fadd, fmul, ret against fmul, fadd, fmul, ret
+   EXPECT_EQ(instructionCount(treeFn), 6u);
+   EXPECT_EQ(instructionCount(dagFn), 4u);
+}
+
+TEST_F(hash_cons_test, calls_are_not_shared)
+{
+   // each call written is emitted, user operators included
+   OperatorTable ops{};
+   auto un = parseDef("def unary~(v) v", ops);
+   std::unique_ptr<FunctionAST> def{};
+   {
+      ArenaScope scope{arena};
+      def = parseDef("def f(x) putchard(65) + putchard(65) + (~x)*(~x) + (putchard(65)+1)*(putchard(65)+1)", ops);
+   }
+   ASSERT_TRUE(un && def);
+   auto product = llvm::cast<BinaryExprAST>(llvm::cast<BinaryExprAST>(def->body.get())->rhs.get());
+   EXPECT_NE(product->lhs.get(), product->rhs.get());
+   EXPECT_FALSE(product->lhs->callFree());
+
+   auto ext = std::make_unique<PrototypeAST>("putchard", std::vector<std::string>{"c"});
+   Resolver resolver{};
+   ASSERT_TRUE(resolver.resolve(*ext) && resolver.resolve(*un) && resolver.resolve(*def));
+   ASSERT_TRUE(ext->codegen(cg) && un->codegen(cg));
+   auto fn = llvm::cast<llvm::Function>(def->codegen(cg));
+   ASSERT_TRUE(fn);
+   EXPECT_FALSE(llvm::verifyFunction(*fn, &llvm::errs()));
+   std::size_t putchards{};
+   std::size_t unaries{};
+   for(auto const& inst : fn->getEntryBlock())
+   {
+      if(auto call = llvm::dyn_cast<llvm::CallInst>(&inst))
+      {
+         (call->getCalledFunction()->getName() == "putchard" ? putchards : unaries)++;
+      }
+   }
+   EXPECT_EQ(putchards, 4u);
+   EXPECT_EQ(unaries, 2u);
+}
+
+TEST_F(hash_cons_test, off_by_default)
+{
+   std::unique_ptr<FunctionAST> def{};
+   {
+      ArenaScope scope{std::make_shared<AstArena>()};
+      def = parseDef("def f(x) x*x");
+   }
+   auto product = llvm::cast<BinaryExprAST>(def->body.get());
+   EXPECT_NE(product->lhs.get(), product->rhs.get());
+}
+
+TEST(codegen_test, variables_index_slots)
+{
+   CodeGenContext cg{"codegen_test"};
+   auto def = parseDef("def f(x y) y - x");
+   ASSERT_TRUE(def);
+   // unresolved bodies are refused
+   auto old = std::cerr.rdbuf(nullptr);
+   EXPECT_EQ(def->codegen(cg), nullptr);
+   std::cerr.rdbuf(old);
+
+   Resolver resolver{};
+   ASSERT_TRUE(resolver.resolve(*def));
+   auto fn = llvm::cast<llvm::Function>(def->codegen(cg));
+   ASSERT_TRUE(fn);
+   auto& sub = llvm::cast<llvm::BinaryOperator>(fn->getEntryBlock().front());
+   EXPECT_EQ(sub.getOperand(0), fn->getArg(1));
+   EXPECT_EQ(sub.getOperand(1), fn->getArg(0));
+}
+
+TEST(codegen_test, operators_lower_to_calls)
+{
+   CodeGenContext cg{"codegen_test"};
+   OperatorTable ops{};
+   auto bin = parseDef("def binary: 1 (a b) b", ops);
+   auto un = parseDef("def unary~(v) 0 - v", ops);
+   auto use = parseDef("def use(x y) ~x : y", ops);
+   ASSERT_TRUE(bin && un && use);
+   Resolver resolver{};
+   ASSERT_TRUE(resolver.resolve(*bin) && resolver.resolve(*un) && resolver.resolve(*use));
+   ASSERT_TRUE(bin->codegen(cg) && un->codegen(cg));
+   auto useFn = llvm::cast<llvm::Function>(use->codegen(cg));
+   ASSERT_TRUE(useFn);
+   EXPECT_FALSE(llvm::verifyFunction(*useFn, &llvm::errs()));
+   std::vector<llvm::StringRef> callees{};
+   for(auto const& inst : useFn->getEntryBlock())
+   {
+      if(auto call = llvm::dyn_cast<llvm::CallInst>(&inst))
+      {
+         callees.push_back(call->getCalledFunction()->getName());
+      }
+   }
+   EXPECT_EQ(callees, (std::vector<llvm::StringRef>{"unary~", "binary:"}));
+}
+
+TEST(codegen_test, taken_modules_redeclare_callees)
+{
+   CodeGenContext cg{"codegen_test"};
+   auto g = parseDef("def g(a b) a*b");
+   auto f = parseDef("def f(x) g(x, x) + 1");
+   Resolver resolver{};
+   ASSERT_TRUE(resolver.resolve(*g) && resolver.resolve(*f));
+   ASSERT_TRUE(g->codegen(cg));
+   llvm::orc::ThreadSafeModule first = cg.takeModule();
+   ASSERT_TRUE(f->codegen(cg));
+
+   // g is defined in the first module and only declared in the second
+   EXPECT_FALSE(first.getModuleUnlocked()->getFunction("g")->isDeclaration());
+   llvm::Function* declared = cg.module().getFunction("g");
+   ASSERT_TRUE(declared);
+   EXPECT_TRUE(declared->isDeclaration());
+   EXPECT_EQ(declared->arg_size(), 2u);
+   EXPECT_FALSE(llvm::verifyModule(cg.module(), &llvm::errs()));
+}
+
+// sessions share no state, so each thread can compile on its own
+TEST(codegen_test, sessions_run_in_parallel)
+{
+   std::vector<std::unique_ptr<FunctionAST>> defs{};
+   Resolver resolver{};
+   for(int i{}; i < 64; i++)
+   {
+      defs.push_back(parseDef("def f" + std::to_string(i) + "(x y) (x*y + " + std::to_string(i) + ") * (x - y)"));
+      ASSERT_TRUE(defs.back() && resolver.resolve(*defs.back()));
+   }
+   std::vector<std::size_t> emitted(4);
+   std::vector<std::thread> threads{};
+   for(std::size_t t{}; t < emitted.size(); t++)
+   {
+      threads.emplace_back([&, t]
+      {
+         CodeGenContext cg{"thread" + std::to_string(t)};
+         for(int round{}; round < 20; round++)
+         {
+            for(auto const& def : defs)
+            {
+               emitted[t] += def->codegen(cg) != nullptr;
+            }
+            cg.takeModule();
+         }
+      });
+   }
+   for(auto& t : threads)
+   {
+      t.join();
+   }
+   for(std::size_t n : emitted)
+   {
+      EXPECT_EQ(n, 20 * defs.size());
+   }
+}
+
+#endif
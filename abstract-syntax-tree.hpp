@@ -1,50 +1,176 @@
+#ifndef __ABSTRACT_SYNTAX_TREE_H_
+#define __ABSTRACT_SYNTAX_TREE_H_
+
 #include <string>
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <memory_resource>
+
+#include "llvm/Support/Casting.h"
+
+#include "ast-arena.hpp"
+#include "symbol-table.hpp"
+
+namespace llvm
+{
+class Function;
+class Value;
+} // namespace llvm
 
-#include "llvm/ADT/APFloat.h"
-#include "llvm/ADT/STLExtras.h"
-#include "llvm/IR/BasicBlock.h"
-#include "llvm/IR/Constants.h"
-#include "llvm/IR/DerivedTypes.h"
-#include "llvm/IR/Function.h"
-#include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/Module.h"
-#include "llvm/IR/Type.h"
-#include "llvm/IR/Verifier.h"
-
-static llvm::LLVMContext context{};
-static llvm::IRBuilder<> builder(context);
-static std::unique_ptr<llvm::Module> mod{};
-static std::map<std::string, llvm::Value*> namedValues{};
+// all codegen() state lives in the session (code-generator.hpp)
+class CodeGenContext;
 
+class ExprAST;
 class NumberExprAST;
 class VariableExprAST;
+class UnaryExprAST;
 class BinaryExprAST;
 class CallExprAST;
 class PrototypeAST;
 class FunctionAST;
+class TopLevelExprAST;
+
+// Owning pointer to an expression node.  Nodes built by makeExpr inside an
+// ArenaScope live in the arena and are left alone here; heap nodes
+// (std::make_unique, or makeExpr outside a scope) are deleted, a whole
+// subtree without recursion however deep it is.
+struct ExprDeleter
+{
+   ExprDeleter() = default;
+   template< class T >
+   ExprDeleter(std::default_delete<T>) {}
+   void operator()(ExprAST* e) const;
+};
+using ExprPtr = std::unique_ptr<ExprAST, ExprDeleter>;
 
+// 64-bit structural hashing.  Names enter through Symbol::stableHash, not
+// their ids, so hashes are the same in every run.
+inline std::uint64_t hashCombine(std::uint64_t seed, std::uint64_t v)
+{
+   v *= 0x9e3779b97f4a7c15ull;
+   v ^= v >> 32;
+   return (seed ^ v) * 0xff51afd7ed558ccdull + 0x632be59bd9b4e019ull;
+}
+
+// Expression nodes carry a kind tag for O(1) dispatch (llvm::isa, dyn_cast
+// and cast via classof, no RTTI) and the structural hash of their subtree,
+// computed once in the constructor from the children's.  Structurally
+// equal subtrees hash equal, so comparisons reject on the hash first.
+// Nodes are treated as immutable once built; editing a child in place
+// leaves the cached hash stale.  Likewise whether the subtree calls
+// anything, which decides if hash-consing may share it.
 class ExprAST
 {
    public:
+      enum class Kind : std::uint8_t
+      {
+         number,
+         variable,
+         unary,
+         binary,
+         call,
+      };
+
+      ExprAST(Kind k, std::uint64_t h, bool noCall = true)
+         : kind{k}
+         , hash{h}
+         , noCalls{noCall}
+      {}
       virtual ~ExprAST() {};
-      virtual llvm::Value* codegen() = 0;
+      virtual llvm::Value* codegen(CodeGenContext& cg) = 0;
       friend bool operator==(ExprAST const& lhs, ExprAST const& rhs);
+
+      Kind getKind() const { return kind; }
+      std::uint64_t structuralHash() const { return hash; }
+      // no call, user operator included, anywhere in the subtree
+      bool callFree() const { return noCalls; }
+
+      bool arenaOwned{false};
+      // handed out more than once by hash-consing (see AstArena)
+      bool shared{false};
+
+      // slot or function id not yet bound by the Resolver
+      static constexpr std::uint32_t unresolved{~0u};
+
+   protected:
+      ExprAST(ExprAST const&) = default;
+
+   private:
+      Kind const kind;
+      std::uint64_t const hash;
+      bool const noCalls;
 };
 
+// Construct an expression node in the current arena, or on the heap
+// outside any ArenaScope.  With hash-consing on, an existing node equal to
+// the new one is returned instead; its children must come from the same
+// arena.  Subtrees that call anything are never shared: codegen reuses a
+// shared node's value, and each call written must still happen.
+template< class T, class... Args >
+ExprPtr makeExpr(Args&&... args)
+{
+   if(AstArena* arena = currentArena(); arena && arena->hashConsing())
+   {
+      // build on the stack, and only move into the arena if new.  Children
+      // are canonical already, so == stops at their identity check.
+      T candidate(std::forward<Args>(args)...);
+      bool const consable = candidate.callFree();
+      if(consable)
+      {
+         auto [first, last] = arena->candidates(candidate.structuralHash());
+         for(auto it = first; it != last; ++it)
+         {
+            if(*it->second == candidate)
+            {
+               it->second->shared = true;
+               return ExprPtr{it->second};
+            }
+         }
+      }
+      T* node = new(arena->allocate(sizeof(T), alignof(T))) T(std::move(candidate));
+      node->arenaOwned = true;
+      if(consable)
+      {
+         arena->remember(node->structuralHash(), node);
+      }
+      return ExprPtr{node};
+   }
+   else if(arena)
+   {
+      T* node = new(arena->allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+      node->arenaOwned = true;
+      return ExprPtr{node};
+   }
+   return ExprPtr{new T(std::forward<Args>(args)...)};
+}
+
 class NumberExprAST : public ExprAST
 {
    public:
       NumberExprAST(double v)
-         : val{v}
+         : ExprAST{Kind::number, hashCombine(static_cast<std::uint64_t>(Kind::number), bits(v))}
+         , val{v}
       {}
-      virtual llvm::Value* codegen();
+      NumberExprAST(NumberExprAST&&) = default;
+      static bool classof(ExprAST const* e) { return e->getKind() == Kind::number; }
+      virtual llvm::Value* codegen(CodeGenContext& cg);
+      double value() const { return val; }
 
       friend bool operator==(NumberExprAST const& lhs, NumberExprAST const& rhs);
    private:
+      // 0.0 == -0.0, so both must hash alike
+      static std::uint64_t bits(double v)
+      {
+         std::uint64_t b{};
+         v = v == 0 ? 0.0 : v;
+         std::memcpy(&b, &v, sizeof b);
+         return b;
+      }
+
       double val;
 
 };
@@ -52,86 +178,192 @@ class NumberExprAST : public ExprAST
 class VariableExprAST : public ExprAST
 {
    public:
-      VariableExprAST(std::string const& n)
-         : name{n}
+      VariableExprAST(Symbol n)
+         : ExprAST{Kind::variable, hashCombine(static_cast<std::uint64_t>(Kind::variable), n.stableHash())}
+         , name{n}
       {}
-      virtual llvm::Value* codegen();
+      VariableExprAST(VariableExprAST&&) = default;
+      static bool classof(ExprAST const* e) { return e->getKind() == Kind::variable; }
+      virtual llvm::Value* codegen(CodeGenContext& cg);
 
       friend bool operator==(VariableExprAST const& lhs, VariableExprAST const& rhs);
 
-      std::string name;
+      Symbol name;
+      // index into the enclosing function's parameters, set by the Resolver.
+      // Not part of the node's structure; hash-consing never shares a node
+      // between functions (AstArena::startItem), so there is one.
+      std::uint32_t slot{unresolved};
 
 };
 
+// prefix use of a user-defined operator, lowered to a call of "unary<c>"
+class UnaryExprAST : public ExprAST
+{
+   public:
+      UnaryExprAST(char o, ExprPtr e)
+         : ExprAST{Kind::unary, hashCombine(hashCombine(static_cast<std::uint64_t>(Kind::unary), o),
+                                            e->structuralHash()), false}
+         , opcode{o}
+         , operand{std::move(e)}
+      {}
+      UnaryExprAST(UnaryExprAST&&) = default;
+      static bool classof(ExprAST const* e) { return e->getKind() == Kind::unary; }
+      virtual llvm::Value* codegen(CodeGenContext& cg);
+
+      friend bool operator==(UnaryExprAST const& lhs, UnaryExprAST const& rhs);
+
+      char opcode;
+      ExprPtr operand;
+};
+
 class BinaryExprAST : public ExprAST
 {
    public:
-      BinaryExprAST(char o, std::unique_ptr<ExprAST> l, std::unique_ptr<ExprAST> r)
-         : op{o}
+      BinaryExprAST(char o, ExprPtr l, ExprPtr r)
+         : ExprAST{Kind::binary, hashCombine(hashCombine(hashCombine(static_cast<std::uint64_t>(Kind::binary), o),
+                                                         l->structuralHash()), r->structuralHash()),
+                   builtin(o) && l->callFree() && r->callFree()}
+         , op{o}
          , lhs{std::move(l)}
          , rhs{std::move(r)}
       {}
-      virtual llvm::Value* codegen();
+      BinaryExprAST(BinaryExprAST&&) = default;
+      static bool classof(ExprAST const* e) { return e->getKind() == Kind::binary; }
+      virtual llvm::Value* codegen(CodeGenContext& cg);
 
       friend bool operator==(BinaryExprAST const& lhs, BinaryExprAST const& rhs);
 
       char op;
-      std::unique_ptr<ExprAST> lhs;
-      std::unique_ptr<ExprAST> rhs;
+      ExprPtr lhs;
+      ExprPtr rhs;
+
+   private:
+      // the rest lower to a call of "binary<c>"
+      static bool builtin(char o) { return o == '+' || o == '-' || o == '*' || o == '<'; }
 };
 
 
 class CallExprAST : public ExprAST
 {
    public:
-      CallExprAST(std::string const& c, std::vector<std::unique_ptr<ExprAST>> a)
-         : callee{c}
+      // a is allocated from the node's arena (see currentResource)
+      CallExprAST(Symbol c, std::pmr::vector<ExprPtr> a)
+         : ExprAST{Kind::call, hashOf(c, a), false}
+         , callee{c}
          , args{std::move(a)}
       {}
-   virtual llvm::Value* codegen();
+      CallExprAST(Symbol c, std::vector<std::unique_ptr<ExprAST>> a)
+         : ExprAST{Kind::call, hashOf(c, a), false}
+         , callee{c}
+         , args(std::make_move_iterator(a.begin()), std::make_move_iterator(a.end()), currentResource())
+      {}
+      CallExprAST(CallExprAST&&) = default;
+      static bool classof(ExprAST const* e) { return e->getKind() == Kind::call; }
+   virtual llvm::Value* codegen(CodeGenContext& cg);
 
    friend bool operator==(CallExprAST const& lhs, CallExprAST const& rhs);
 
-      std::string callee;
-      std::vector<std::unique_ptr<ExprAST>> args;
+      Symbol callee;
+      std::pmr::vector<ExprPtr> args;
+      // the Resolver's id for callee
+      std::uint32_t calleeId{unresolved};
+
+   private:
+      template< class Args >
+      static std::uint64_t hashOf(Symbol c, Args const& a)
+      {
+         std::uint64_t h = hashCombine(hashCombine(static_cast<std::uint64_t>(Kind::call), c.stableHash()), a.size());
+         for(auto const& arg : a)
+         {
+            h = hashCombine(h, arg->structuralHash());
+         }
+         return h;
+      }
 };
 
 class PrototypeAST
 {
    public:
-      PrototypeAST(std::string const& n, std::vector<std::string> a)
+      PrototypeAST(Symbol n, std::pmr::vector<Symbol> a, bool op = false, unsigned prec = 0)
          : name{n}
          , args{std::move(a)}
+         , isOperator{op}
+         , precedence{prec}
+      {}
+      PrototypeAST(Symbol n, std::vector<Symbol> const& a)
+         : name{n}
+         , args(a.begin(), a.end(), currentResource())
       {}
-   llvm::Function* codegen();
-   std::string getName() {return name;}
+      PrototypeAST(Symbol n, std::vector<std::string> const& a)
+         : name{n}
+         , args(a.begin(), a.end(), currentResource())
+      {}
+   llvm::Function* codegen(CodeGenContext& cg);
+   std::string_view getName() {return name.str();}
+
+   // operator definitions are named "unary<c>" / "binary<c>"
+   bool isUnaryOp() const { return isOperator && args.size() == 1; }
+   bool isBinaryOp() const { return isOperator && args.size() == 2; }
+   char getOperatorName() const { return name.str().back(); }
+
+   // name and parameter names; computed on demand, prototypes are small
+   std::uint64_t structuralHash() const
+   {
+      std::uint64_t h = hashCombine(hashCombine(name.stableHash(), precedence), args.size());
+      for(Symbol arg : args)
+      {
+         h = hashCombine(h, arg.stableHash());
+      }
+      return h;
+   }
 
    friend bool operator==(PrototypeAST const& lhs, PrototypeAST const& rhs);
 
-      std::string name;
-      std::vector<std::string> args;
+      // keeps the arena holding args alive; declared first so it goes last
+      std::shared_ptr<AstArena> arena{currentArenaOwner()};
+      Symbol name;
+      std::pmr::vector<Symbol> args;
+      bool isOperator{false};
+      unsigned precedence{0}; // binary operators only
+      // source offset of the item, for diagnostics
+      std::size_t offset{0};
+      // the Resolver's id for name; unresolved for top-level expressions
+      std::uint32_t id{ExprAST::unresolved};
 };
 
 class FunctionAST
 {
    public:
-      FunctionAST(std::unique_ptr<PrototypeAST> p, std::unique_ptr<ExprAST> b)
+      FunctionAST(std::unique_ptr<PrototypeAST> p, ExprPtr b)
          : proto(std::move(p))
          , body(std::move(b))
       {}
-   llvm::Value* codegen();
+      virtual ~FunctionAST() = default;
+   llvm::Value* codegen(CodeGenContext& cg);
+   std::uint64_t structuralHash() const { return hashCombine(proto->structuralHash(), body->structuralHash()); }
 
    friend bool operator==(FunctionAST const& lhs, FunctionAST const& rhs);
 
 
+      // keeps the body's arena alive; declared first so it goes last
+      std::shared_ptr<AstArena> arena{currentArenaOwner()};
       std::unique_ptr<PrototypeAST> proto;
-      std::unique_ptr<ExprAST> body;
+      ExprPtr body;
+};
+
+// A top-level expression, wrapped in an anonymous function (empty name)
+class TopLevelExprAST final : public FunctionAST
+{
+   public:
+      using FunctionAST::FunctionAST;
 };
 inline bool operator!=(ExprAST const& lhs, ExprAST const& rhs){ return !operator==(lhs,rhs); }
 inline bool operator==(NumberExprAST const& lhs, NumberExprAST const& rhs){ return lhs.val == rhs.val; }
 inline bool operator!=(NumberExprAST const& lhs, NumberExprAST const& rhs){ return !operator==(lhs,rhs); }
 inline bool operator==(VariableExprAST const& lhs, VariableExprAST const& rhs){ return lhs.name == rhs.name; }
 inline bool operator!=(VariableExprAST const& lhs, VariableExprAST const& rhs){ return !operator==(lhs,rhs); }
+inline bool operator==(UnaryExprAST const& lhs, UnaryExprAST const& rhs){ return (lhs.opcode == rhs.opcode) && (*(lhs.operand) == *(rhs.operand)); }
+inline bool operator!=(UnaryExprAST const& lhs, UnaryExprAST const& rhs){ return !operator==(lhs,rhs); }
 inline bool operator==(BinaryExprAST const& lhs, BinaryExprAST const& rhs){ return (lhs.op == rhs.op) && (*(lhs.lhs) == *(rhs.lhs)) && (*(lhs.rhs) == *(rhs.rhs)); }
 inline bool operator==(CallExprAST const& lhs, CallExprAST const& rhs)
 {
@@ -143,36 +375,49 @@ inline bool operator==(CallExprAST const& lhs, CallExprAST const& rhs)
    return (lhs.callee == rhs.callee) && (res);
 }
 inline bool operator!=(CallExprAST const& lhs, CallExprAST const& rhs){ return !operator==(lhs,rhs); }
-inline bool operator==(PrototypeAST const& lhs, PrototypeAST const& rhs) { return (lhs.name == rhs.name) && (lhs.args == rhs.args); }
+inline bool operator==(PrototypeAST const& lhs, PrototypeAST const& rhs)
+{
+   return (lhs.name == rhs.name) && (lhs.args == rhs.args) &&
+          (lhs.isOperator == rhs.isOperator) && (lhs.precedence == rhs.precedence);
+}
 inline bool operator!=(PrototypeAST const& lhs, PrototypeAST const& rhs){ return !operator==(lhs,rhs); }
 inline bool operator==(FunctionAST const& lhs, FunctionAST const& rhs){ return (*(lhs.proto) == *(rhs.proto)) && (*(lhs.body) == *(rhs.body)); }
 inline bool operator!=(FunctionAST const& lhs, FunctionAST const& rhs){ return !operator==(lhs,rhs); }
 
 inline bool operator==(ExprAST const& lhs, ExprAST const& rhs)
 {
-   if(dynamic_cast<NumberExprAST const*>(&lhs) && dynamic_cast<NumberExprAST const*>(&rhs))
+   if(&lhs == &rhs)
    {
-      return operator==(*dynamic_cast<NumberExprAST const*>(&lhs), *dynamic_cast<NumberExprAST const*>(&rhs));
+      return true;
    }
-   else if(dynamic_cast<VariableExprAST const*>(&lhs) && dynamic_cast<VariableExprAST const*>(&rhs))
+   if(lhs.structuralHash() != rhs.structuralHash() || lhs.getKind() != rhs.getKind())
    {
-      return operator==(*dynamic_cast<VariableExprAST const*>(&lhs), *dynamic_cast<VariableExprAST const*>(&rhs));
+      return false;
    }
-   else if(dynamic_cast<BinaryExprAST const*>(&lhs) && dynamic_cast<BinaryExprAST const*>(&rhs))
+   switch(lhs.getKind())
    {
-      return operator==(*dynamic_cast<BinaryExprAST const*>(&lhs), *dynamic_cast<BinaryExprAST const*>(&rhs));
-   }
-   else if(dynamic_cast<CallExprAST const*>(&lhs) && dynamic_cast<CallExprAST const*>(&rhs))
-   {
-      return operator==(*dynamic_cast<CallExprAST const*>(&lhs), *dynamic_cast<CallExprAST const*>(&rhs));
-   }
-   else if(dynamic_cast<PrototypeAST const*>(&lhs) && dynamic_cast<PrototypeAST const*>(&rhs))
-   {
-      return operator==(*dynamic_cast<PrototypeAST const*>(&lhs), *dynamic_cast<PrototypeAST const*>(&rhs));
-   }
-   else if(dynamic_cast<FunctionAST const*>(&lhs) && dynamic_cast<FunctionAST const*>(&rhs))
-   {
-      return operator==(*dynamic_cast<FunctionAST const*>(&lhs), *dynamic_cast<FunctionAST const*>(&rhs));
+      case ExprAST::Kind::number:
+      {
+         return llvm::cast<NumberExprAST>(lhs) == llvm::cast<NumberExprAST>(rhs);
+      }
+      case ExprAST::Kind::variable:
+      {
+         return llvm::cast<VariableExprAST>(lhs) == llvm::cast<VariableExprAST>(rhs);
+      }
+      case ExprAST::Kind::unary:
+      {
+         return llvm::cast<UnaryExprAST>(lhs) == llvm::cast<UnaryExprAST>(rhs);
+      }
+      case ExprAST::Kind::binary:
+      {
+         return llvm::cast<BinaryExprAST>(lhs) == llvm::cast<BinaryExprAST>(rhs);
+      }
+      case ExprAST::Kind::call:
+      {
+         return llvm::cast<CallExprAST>(lhs) == llvm::cast<CallExprAST>(rhs);
+      }
    }
    return false;
 }
+
+#endif // __ABSTRACT_SYNTAX_TREE_H_
@@ -0,0 +1,73 @@
+#include "ast-arena.hpp"
+
+#include <utility>
+
+namespace
+{
+
+thread_local std::shared_ptr<AstArena> activeArena{};
+
+} // namespace
+
+AstArena* currentArena()
+{
+   return activeArena.get();
+}
+
+std::shared_ptr<AstArena> const& currentArenaOwner()
+{
+   return activeArena;
+}
+
+std::pmr::memory_resource* currentResource()
+{
+   return activeArena ? activeArena->resource() : std::pmr::get_default_resource();
+}
+
+ArenaScope::ArenaScope(std::shared_ptr<AstArena> arena)
+   : previous{std::exchange(activeArena, std::move(arena))}
+{}
+
+ArenaScope::~ArenaScope()
+{
+   activeArena = std::move(previous);
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+TEST(ast_arena_test, scopes_nest)
+{
+   EXPECT_EQ(currentArena(), nullptr);
+   EXPECT_EQ(currentResource(), std::pmr::get_default_resource());
+   auto outer = std::make_shared<AstArena>();
+   auto inner = std::make_shared<AstArena>();
+   {
+      ArenaScope a{outer};
+      EXPECT_EQ(currentArena(), outer.get());
+      {
+         ArenaScope b{inner};
+         EXPECT_EQ(currentArena(), inner.get());
+         EXPECT_EQ(currentResource(), inner->resource());
+      }
+      EXPECT_EQ(currentArena(), outer.get());
+   }
+   EXPECT_EQ(currentArena(), nullptr);
+}
+
+TEST(ast_arena_test, bump_allocation)
+{
+   AstArena arena{64};
+   char* first = static_cast<char*>(arena.allocate(24, 8));
+   char* second = static_cast<char*>(arena.allocate(24, 8));
+   EXPECT_EQ(second - first, 24);
+   EXPECT_EQ(arena.bytesUsed(), 48u);
+   // spills into a new block once the first is full
+   for(int i{}; i < 100; i++)
+   {
+      EXPECT_NE(arena.allocate(24, 8), nullptr);
+   }
+   EXPECT_EQ(arena.bytesUsed(), 48u + 2400u);
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef __AST_ARENA_H_
+#define __AST_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <utility>
+
+class ExprAST;
+
+// Bump allocator owning the expression nodes of one top-level item or one
+// whole compilation.  Nodes placed here are never destroyed one by one:
+// the arena hands out memory by bumping a pointer and releases all of it
+// at once when the last owner lets go.  Not thread-safe; one arena is
+// filled by one parsing thread.
+class AstArena
+{
+      // the structural hash is already well mixed
+      struct IdentityHash
+      {
+         std::size_t operator()(std::uint64_t h) const { return h; }
+      };
+      using ConsTable = std::unordered_multimap<std::uint64_t, ExprAST*, IdentityHash>;
+
+   public:
+      explicit AstArena(std::size_t initialSize = 1024)
+         : pool{initialSize}
+      {}
+
+      AstArena(AstArena const&) = delete;
+      AstArena& operator=(AstArena const&) = delete;
+
+      void* allocate(std::size_t size, std::size_t align)
+      {
+         used += size;
+         return pool.allocate(size, align);
+      }
+
+      // for arena-backed containers (argument lists)
+      std::pmr::memory_resource* resource() { return &pool; }
+
+      // bytes handed out by allocate(), not counting container storage
+      std::size_t bytesUsed() const { return used; }
+
+      // Hash-consing: while on, makeExpr hands back the existing node for
+      // a structurally equal subtree instead of building a copy, so the
+      // arena holds a DAG.  Nodes are keyed by their structural hash.
+      // Subtrees containing a call are left out (see makeExpr).
+      void setHashConsing(bool on) { consing = on; }
+      bool hashConsing() const { return consing; }
+
+      // Sharing stops at top-level items: the Resolver binds variables
+      // per function, and a node shared by two functions would hold only
+      // one binding.  Whatever builds an item in an arena (the parser, an
+      // AST image, the Simplifier) calls this as it starts, and later
+      // nodes are not consed with earlier ones.
+      void startItem() { consed.clear(); }
+
+      using ConsRange = std::pair<ConsTable::const_iterator, ConsTable::const_iterator>;
+      ConsRange candidates(std::uint64_t hash) const { return consed.equal_range(hash); }
+      void remember(std::uint64_t hash, ExprAST* node) { consed.emplace(hash, node); }
+
+   private:
+      std::pmr::monotonic_buffer_resource pool;
+      std::size_t used{};
+      bool consing{false};
+      ConsTable consed{};
+};
+
+// The arena nodes are placed in while a scope is active on this thread,
+// nullptr outside any scope (nodes then go on the heap).
+AstArena* currentArena();
+std::shared_ptr<AstArena> const& currentArenaOwner();
+
+// memory resource for node-owned containers: the current arena's, or the
+// default (heap) resource
+std::pmr::memory_resource* currentResource();
+
+// Route node allocation on this thread to arena until the scope ends.
+// Scopes nest; the previous arena is restored on exit.
+class ArenaScope
+{
+   public:
+      explicit ArenaScope(std::shared_ptr<AstArena> arena);
+      ~ArenaScope();
+
+      ArenaScope(ArenaScope const&) = delete;
+      ArenaScope& operator=(ArenaScope const&) = delete;
+
+   private:
+      std::shared_ptr<AstArena> previous;
+};
+
+#endif // __AST_ARENA_H_
@@ -0,0 +1,801 @@
+#include "ast-image.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+// numbers the temporaries this process writes images to
+std::atomic<std::uint64_t> temporaries{0};
+
+// a directory we may not write to is not worth a message on every run
+bool readOnly(int error)
+{
+   return error == EACCES || error == EROFS || error == EPERM;
+}
+
+// byte offsets of the sections after the header, and the file size
+struct Layout
+{
+   std::uint64_t numbers;
+   std::uint64_t items;
+   std::uint64_t nodes;
+   std::uint64_t refs;
+   std::uint64_t stringIndex;
+   std::uint64_t stringData;
+   std::uint64_t size;
+
+   explicit Layout(image::Header const& h)
+      : numbers{sizeof(image::Header)}
+      , items{numbers + std::uint64_t{h.numberCount} * sizeof(double)}
+      , nodes{items + std::uint64_t{h.itemCount} * sizeof(image::Item)}
+      , refs{nodes + std::uint64_t{h.nodeCount} * sizeof(image::Node)}
+      , stringIndex{refs + std::uint64_t{h.refCount} * sizeof(std::uint32_t)}
+      , stringData{stringIndex + (std::uint64_t{h.stringCount} + 1) * sizeof(std::uint32_t)}
+      , size{stringData + h.stringBytes}
+   {}
+};
+
+// Builds the sections in memory, then writes them out in one go
+class ImageWriter
+{
+   public:
+      void add(TopLevelItem const& item);
+      bool write(char const* path, SourceStamp source) const;
+
+   private:
+      void add(PrototypeAST const& proto, ExprAST const* body, image::ItemKind kind);
+      std::uint32_t string(Symbol s);
+      std::uint32_t expression(ExprAST const& root);
+
+      std::vector<double> numbers{};
+      std::vector<image::Item> items{};
+      std::vector<image::Node> nodes{};
+      std::vector<std::uint32_t> refs{};
+      // string 0 is the empty name
+      std::vector<std::uint32_t> stringIndex{0, 0};
+      std::string stringData{};
+      std::unordered_map<Symbol, std::uint32_t> strings{{Symbol{}, 0}};
+      // shared nodes already written, by address
+      std::unordered_map<ExprAST const*, std::uint32_t> written{};
+
+      // reused between expressions
+      std::vector<std::pair<ExprAST const*, bool>> pending{};
+      std::vector<std::uint32_t> emitted{};
+};
+
+void ImageWriter::add(TopLevelItem const& item)
+{
+   if(auto const* fn = std::get_if<std::unique_ptr<FunctionAST>>(&item))
+   {
+      add(*(*fn)->proto, (*fn)->body.get(), image::ItemKind::definition);
+   }
+   else if(auto const* expr = std::get_if<std::unique_ptr<TopLevelExprAST>>(&item))
+   {
+      add(*(*expr)->proto, (*expr)->body.get(), image::ItemKind::expression);
+   }
+   else
+   {
+      add(*std::get<std::unique_ptr<PrototypeAST>>(item), nullptr, image::ItemKind::declaration);
+   }
+}
+
+void ImageWriter::add(PrototypeAST const& proto, ExprAST const* body, image::ItemKind kind)
+{
+   image::Item rec{};
+   rec.offset = proto.offset;
+   rec.name = string(proto.name);
+   rec.firstParam = refs.size();
+   rec.paramCount = proto.args.size();
+   for(Symbol arg : proto.args)
+   {
+      refs.push_back(string(arg));
+   }
+   rec.body = body ? expression(*body) : image::none;
+   rec.precedence = proto.precedence;
+   rec.kind = kind;
+   rec.isOperator = proto.isOperator;
+   items.push_back(rec);
+}
+
+std::uint32_t ImageWriter::string(Symbol s)
+{
+   auto [it, added] = strings.try_emplace(s, stringIndex.size() - 1);
+   if(added)
+   {
+      stringData += s.str();
+      stringIndex.push_back(stringData.size());
+   }
+   return it->second;
+}
+
+// Post order with an explicit stack, so depth is no concern
+std::uint32_t ImageWriter::expression(ExprAST const& root)
+{
+   pending.clear();
+   pending.push_back({&root, false});
+   while(!pending.empty())
+   {
+      auto [node, expanded] = pending.back();
+      pending.pop_back();
+      if(!expanded)
+      {
+         if(node->shared)
+         {
+            if(auto it = written.find(node); it != written.end())
+            {
+               emitted.push_back(it->second);
+               continue;
+            }
+         }
+         pending.push_back({node, true});
+         // pushed right to left, so they are written left to right
+         if(auto const* un = llvm::dyn_cast<UnaryExprAST>(node))
+         {
+            pending.push_back({un->operand.get(), false});
+         }
+         else if(auto const* bin = llvm::dyn_cast<BinaryExprAST>(node))
+         {
+            pending.push_back({bin->rhs.get(), false});
+            pending.push_back({bin->lhs.get(), false});
+         }
+         else if(auto const* call = llvm::dyn_cast<CallExprAST>(node))
+         {
+            for(auto arg = call->args.rbegin(); arg != call->args.rend(); ++arg)
+            {
+               pending.push_back({arg->get(), false});
+            }
+         }
+         continue;
+      }
+
+      // the children's indices are on top of emitted, left to right
+      std::uint32_t const self = nodes.size();
+      image::Node rec{};
+      rec.kind = node->getKind();
+      rec.shared = node->shared;
+      switch(node->getKind())
+      {
+         case ExprAST::Kind::number:
+         {
+            rec.a = numbers.size();
+            numbers.push_back(llvm::cast<NumberExprAST>(*node).value());
+            break;
+         }
+         case ExprAST::Kind::variable:
+         {
+            rec.a = string(llvm::cast<VariableExprAST>(*node).name);
+            break;
+         }
+         case ExprAST::Kind::unary:
+         {
+            rec.op = llvm::cast<UnaryExprAST>(*node).opcode;
+            rec.a = self - emitted.back();
+            emitted.pop_back();
+            break;
+         }
+         case ExprAST::Kind::binary:
+         {
+            rec.op = llvm::cast<BinaryExprAST>(*node).op;
+            rec.b = self - emitted.back();
+            emitted.pop_back();
+            rec.a = self - emitted.back();
+            emitted.pop_back();
+            break;
+         }
+         case ExprAST::Kind::call:
+         {
+            auto const& call = llvm::cast<CallExprAST>(*node);
+            std::size_t const first = emitted.size() - call.args.size();
+            rec.a = string(call.callee);
+            rec.b = refs.size();
+            refs.push_back(call.args.size());
+            for(std::size_t i{first}; i < emitted.size(); i++)
+            {
+               refs.push_back(self - emitted[i]);
+            }
+            emitted.resize(first);
+            break;
+         }
+      }
+      nodes.push_back(rec);
+      if(node->shared)
+      {
+         written.emplace(node, self);
+      }
+      emitted.push_back(self);
+   }
+   std::uint32_t top{emitted.back()};
+   emitted.pop_back();
+   return top;
+}
+
+bool ImageWriter::write(char const* path, SourceStamp source) const
+{
+   constexpr std::size_t limit{std::numeric_limits<std::uint32_t>::max()};
+   if(numbers.size() >= limit || items.size() >= limit || nodes.size() >= limit || refs.size() >= limit ||
+      stringIndex.size() >= limit || stringData.size() >= limit)
+   {
+      std::cerr << "Module too large for an AST image: " << path << "\n";
+      return false;
+   }
+
+   image::Header header{};
+   header.magic = image::magic;
+   header.version = AstImage::version;
+   header.sourceSize = source.size;
+   header.sourceMtime = source.mtime;
+   header.numberCount = numbers.size();
+   header.itemCount = items.size();
+   header.nodeCount = nodes.size();
+   header.refCount = refs.size();
+   header.stringCount = stringIndex.size() - 1;
+   header.stringBytes = stringData.size();
+
+   // unique per process and write, so concurrent runs never share one
+   std::string const temporary{std::string(path) + ".tmp." + std::to_string(getpid()) + "." +
+                               std::to_string(temporaries.fetch_add(1, std::memory_order_relaxed))};
+   {
+      errno = 0;
+      std::ofstream out{temporary, std::ios::binary | std::ios::trunc};
+      if(!out)
+      {
+         if(!readOnly(errno))
+         {
+            std::cerr << "Unable to write AST image: " << temporary << "\n";
+         }
+         return false;
+      }
+      auto put = [&out](void const* data, std::size_t size)
+      {
+         out.write(static_cast<char const*>(data), size);
+      };
+      put(&header, sizeof header);
+      put(numbers.data(), numbers.size() * sizeof(double));
+      put(items.data(), items.size() * sizeof(image::Item));
+      put(nodes.data(), nodes.size() * sizeof(image::Node));
+      put(refs.data(), refs.size() * sizeof(std::uint32_t));
+      put(stringIndex.data(), stringIndex.size() * sizeof(std::uint32_t));
+      put(stringData.data(), stringData.size());
+      if(!out.flush())
+      {
+         std::cerr << "Unable to write AST image: " << temporary << "\n";
+         std::remove(temporary.c_str());
+         return false;
+      }
+   }
+   if(std::rename(temporary.c_str(), path) != 0)
+   {
+      if(!readOnly(errno))
+      {
+         std::cerr << "Unable to write AST image: " << path << "\n";
+      }
+      std::remove(temporary.c_str());
+      return false;
+   }
+   return true;
+}
+
+} // namespace
+
+std::optional<SourceStamp> SourceStamp::of(char const* path)
+{
+   struct stat st{};
+   if(stat(path, &st) != 0)
+   {
+      return std::nullopt;
+   }
+   return SourceStamp{static_cast<std::uint64_t>(st.st_size),
+                      std::int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec};
+}
+
+bool writeAstImage(char const* path, std::vector<TopLevelItem> const& items, SourceStamp source)
+{
+   ImageWriter writer{};
+   for(TopLevelItem const& item : items)
+   {
+      writer.add(item);
+   }
+   return writer.write(path, source);
+}
+
+AstImage::~AstImage()
+{
+   if(mapping)
+   {
+      munmap(mapping, mappedSize);
+   }
+}
+
+std::unique_ptr<AstImage> AstImage::open(char const* path)
+{
+   int fd = ::open(path, O_RDONLY);
+   if(fd < 0)
+   {
+      if(errno != ENOENT)
+      {
+         std::cerr << "Unable to open AST image: " << path << "\n";
+      }
+      return nullptr;
+   }
+
+   struct stat st{};
+   if(fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(image::Header))
+   {
+      std::cerr << "Not an AST image: " << path << "\n";
+      close(fd);
+      return nullptr;
+   }
+   void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(m == MAP_FAILED)
+   {
+      std::cerr << "Unable to map AST image: " << path << "\n";
+      return nullptr;
+   }
+
+   std::unique_ptr<AstImage> res{new AstImage()};
+   res->mapping = m;
+   res->mappedSize = st.st_size;
+   char const* base = static_cast<char const*>(m);
+   res->header = reinterpret_cast<image::Header const*>(base);
+   image::Header const& header = *res->header;
+   if(header.magic != image::magic)
+   {
+      std::cerr << "Not an AST image: " << path << "\n";
+      return nullptr;
+   }
+   if(header.version != version)
+   {
+      std::cerr << "Unsupported AST image version " << header.version << ": " << path << "\n";
+      return nullptr;
+   }
+   Layout const layout{header};
+   if(layout.size != res->mappedSize)
+   {
+      std::cerr << "Truncated AST image: " << path << "\n";
+      return nullptr;
+   }
+   res->numbers = reinterpret_cast<double const*>(base + layout.numbers);
+   res->items = reinterpret_cast<image::Item const*>(base + layout.items);
+   res->nodes = reinterpret_cast<image::Node const*>(base + layout.nodes);
+   res->refs = reinterpret_cast<std::uint32_t const*>(base + layout.refs);
+   res->stringIndex = reinterpret_cast<std::uint32_t const*>(base + layout.stringIndex);
+   res->stringData = base + layout.stringData;
+
+   // the string table is small next to the nodes; checking it here lets
+   // string() go unchecked
+   std::uint32_t const* index = res->stringIndex;
+   bool sorted{index[0] == 0 && index[header.stringCount] == header.stringBytes};
+   for(std::uint32_t s{}; sorted && s < header.stringCount; s++)
+   {
+      sorted = index[s] <= index[s + 1];
+   }
+   if(!sorted)
+   {
+      std::cerr << "Corrupt AST image: " << path << "\n";
+      return nullptr;
+   }
+   res->interned.resize(header.stringCount);
+   return res;
+}
+
+Symbol AstImage::symbol(std::uint32_t s) const
+{
+   if(interned[s].empty())
+   {
+      interned[s] = Symbol(string(s));
+   }
+   return interned[s];
+}
+
+std::optional<TopLevelItem> AstImage::item(std::size_t i, OperatorTable* operators) const
+{
+   image::Item const& rec = items[i];
+   auto corrupt = [&]() -> std::optional<TopLevelItem>
+   {
+      reportError(rec.offset, "Corrupt AST image item " + std::to_string(i));
+      return std::nullopt;
+   };
+   std::uint32_t const stringCount{header->stringCount};
+   if(rec.name >= stringCount || rec.firstParam > header->refCount ||
+      rec.paramCount > header->refCount - rec.firstParam || rec.kind > image::ItemKind::expression ||
+      (rec.kind != image::ItemKind::declaration && rec.body >= header->nodeCount))
+   {
+      return corrupt();
+   }
+
+   // the parser's rule: each item in an arena of its own, unless one is set
+   std::optional<ArenaScope> itemScope{};
+   if(!currentArena())
+   {
+      itemScope.emplace(std::make_shared<AstArena>());
+   }
+   currentArena()->startItem();
+   std::pmr::vector<Symbol> params{currentResource()};
+   params.reserve(rec.paramCount);
+   for(std::uint32_t p{}; p < rec.paramCount; p++)
+   {
+      std::uint32_t s{refs[rec.firstParam + p]};
+      if(s >= stringCount)
+      {
+         return corrupt();
+      }
+      params.push_back(symbol(s));
+   }
+   auto proto = std::make_unique<PrototypeAST>(symbol(rec.name), std::move(params), rec.isOperator, rec.precedence);
+   proto->offset = rec.offset;
+   if(rec.isOperator)
+   {
+      if(proto->name.empty() || (!proto->isUnaryOp() && !proto->isBinaryOp()) || rec.precedence > 100)
+      {
+         return corrupt();
+      }
+      if(operators)
+      {
+         // as parsePrototype does
+         operators->define(*proto);
+      }
+   }
+
+   if(rec.kind == image::ItemKind::declaration)
+   {
+      return TopLevelItem{std::move(proto)};
+   }
+   ExprPtr body = expression(rec.body);
+   if(!body)
+   {
+      return corrupt();
+   }
+   if(rec.kind == image::ItemKind::definition)
+   {
+      return TopLevelItem{std::make_unique<FunctionAST>(std::move(proto), std::move(body))};
+   }
+   return TopLevelItem{std::make_unique<TopLevelExprAST>(std::move(proto), std::move(body))};
+}
+
+// Rebuilds the tree under root with an explicit stack.  Children are
+// checked to lie before their parent, so a corrupt file cannot loop; a
+// shared node is built once and handed out again, as hash-consing would.
+// nullptr if a record is out of range.
+ExprPtr AstImage::expression(std::uint32_t root) const
+{
+   std::vector<std::pair<std::uint32_t, bool>> pending{{root, false}};
+   std::vector<ExprPtr> values{};
+   std::unordered_map<std::uint32_t, ExprAST*> built{};
+   auto child = [&](std::uint32_t n, std::uint32_t distance)
+   {
+      if(distance == 0 || distance > n)
+      {
+         return false;
+      }
+      pending.push_back({n - distance, false});
+      return true;
+   };
+
+   while(!pending.empty())
+   {
+      auto [n, expanded] = pending.back();
+      pending.pop_back();
+      image::Node const& rec = nodes[n];
+      if(!expanded)
+      {
+         if(rec.shared)
+         {
+            if(auto it = built.find(n); it != built.end())
+            {
+               values.push_back(ExprPtr{it->second});
+               continue;
+            }
+         }
+         pending.push_back({n, true});
+         bool ok{true};
+         switch(rec.kind)
+         {
+            case ExprAST::Kind::number:
+            {
+               ok = rec.a < header->numberCount;
+               break;
+            }
+            case ExprAST::Kind::variable:
+            {
+               ok = rec.a < header->stringCount;
+               break;
+            }
+            case ExprAST::Kind::unary:
+            {
+               ok = child(n, rec.a);
+               break;
+            }
+            case ExprAST::Kind::binary:
+            {
+               ok = child(n, rec.b) && child(n, rec.a);
+               break;
+            }
+            case ExprAST::Kind::call:
+            {
+               ok = rec.a < header->stringCount && rec.b < header->refCount &&
+                    refs[rec.b] < header->refCount - rec.b;
+               for(std::uint32_t k{ok ? refs[rec.b] : 0}; ok && k > 0; k--)
+               {
+                  ok = child(n, refs[rec.b + k]);
+               }
+               break;
+            }
+            default:
+            {
+               ok = false;
+               break;
+            }
+         }
+         if(!ok)
+         {
+            return nullptr;
+         }
+         continue;
+      }
+
+      ExprPtr node{};
+      switch(rec.kind)
+      {
+         case ExprAST::Kind::number:
+         {
+            node = makeExpr<NumberExprAST>(numbers[rec.a]);
+            break;
+         }
+         case ExprAST::Kind::variable:
+         {
+            node = makeExpr<VariableExprAST>(symbol(rec.a));
+            break;
+         }
+         case ExprAST::Kind::unary:
+         {
+            ExprPtr operand = std::move(values.back());
+            values.pop_back();
+            node = makeExpr<UnaryExprAST>(rec.op, std::move(operand));
+            break;
+         }
+         case ExprAST::Kind::binary:
+         {
+            ExprPtr rhs = std::move(values.back());
+            values.pop_back();
+            ExprPtr lhs = std::move(values.back());
+            values.pop_back();
+            node = makeExpr<BinaryExprAST>(rec.op, std::move(lhs), std::move(rhs));
+            break;
+         }
+         case ExprAST::Kind::call:
+         {
+            std::pmr::vector<ExprPtr> args{currentResource()};
+            args.reserve(refs[rec.b]);
+            auto first = values.end() - refs[rec.b];
+            std::move(first, values.end(), std::back_inserter(args));
+            values.erase(first, values.end());
+            node = makeExpr<CallExprAST>(symbol(rec.a), std::move(args));
+            break;
+         }
+      }
+      if(rec.shared)
+      {
+         node->shared = true;
+         built.emplace(n, node.get());
+      }
+      values.push_back(std::move(node));
+   }
+   return std::move(values.back());
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <array>
+#include <iterator>
+#include <sstream>
+
+namespace
+{
+
+std::vector<TopLevelItem> parseAll(std::string_view src)
+{
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   return parseModule(tok, cur);
+}
+
+class ast_image_test : public ::testing::Test
+{
+   protected:
+      void SetUp() override
+      {
+         int fd = mkstemp(path);
+         ASSERT_GE(fd, 0);
+         close(fd);
+      }
+      void TearDown() override
+      {
+         std::remove(path);
+      }
+
+      char path[32]{"/tmp/kaleidoscope-XXXXXX"};
+};
+
+bool sameItem(TopLevelItem const& lhs, TopLevelItem const& rhs)
+{
+   return lhs.index() == rhs.index() &&
+          std::visit([&](auto const& l)
+          {
+             auto const& r = std::get<std::decay_t<decltype(l)>>(rhs);
+             return *l == *r;
+          }, lhs);
+}
+
+} // namespace
+
+TEST_F(ast_image_test, round_trip)
+{
+   std::string const src{"extern sin(a)\ndef binary| 5 (a b) a\ndef unary!(v) v\n"
+                         "def foo(x y) y*sin(x) + foo(x, 1.5) | !x\nfoo(1, 2)"};
+   auto items = parseAll(src);
+   ASSERT_EQ(items.size(), 5u);
+   ASSERT_TRUE(writeAstImage(path, items, {src.size(), 42}));
+
+   // loading registers the operators again
+   OperatorTable ops{};
+   auto image = AstImage::open(path);
+   ASSERT_NE(image, nullptr);
+   EXPECT_TRUE(image->freshFor({src.size(), 42}));
+   EXPECT_FALSE(image->freshFor({src.size(), 43}));
+   ASSERT_EQ(image->size(), items.size());
+   for(std::size_t i{}; i < items.size(); i++)
+   {
+      auto loaded = image->item(i, &ops);
+      ASSERT_TRUE(loaded);
+      EXPECT_TRUE(sameItem(*loaded, items[i])) << "item " << i;
+   }
+   EXPECT_EQ(ops.precedence('|'), 5);
+   EXPECT_TRUE(ops.isUnary('!'));
+
+   auto foo = image->item(3);
+   auto const& fn = *std::get<std::unique_ptr<FunctionAST>>(*foo);
+   EXPECT_EQ(fn.proto->offset, src.find("foo(x y)"));
+   EXPECT_NE(fn.arena, nullptr);
+   EXPECT_TRUE(fn.body->arenaOwned);
+}
+
+TEST_F(ast_image_test, shared_nodes_stored_once)
+{
+   auto arena = std::make_shared<AstArena>();
+   arena->setHashConsing(true);
+   std::vector<TopLevelItem> items{};
+   {
+      ArenaScope scope{arena};
+      items = parseAll("def f(x y) (x*y+1)*(x*y+1)");
+   }
+   ASSERT_TRUE(writeAstImage(path, items, {}));
+   auto image = AstImage::open(path);
+   ASSERT_NE(image, nullptr);
+   // x, y, x*y, 1, +, and the product
+   EXPECT_EQ(image->itemRecord(0).body, 5u);
+
+   auto loaded = image->item(0);
+   ASSERT_TRUE(loaded);
+   auto& square = llvm::cast<BinaryExprAST>(*std::get<std::unique_ptr<FunctionAST>>(*loaded)->body);
+   EXPECT_EQ(square.lhs.get(), square.rhs.get());
+   EXPECT_TRUE(square.lhs->shared);
+   EXPECT_TRUE(sameItem(*loaded, items[0]));
+}
+
+TEST_F(ast_image_test, deep_nesting)
+{
+   std::size_t const depth{100000};
+   std::string src{"def deep(x) "};
+   src.append(depth, '(');
+   src += "x";
+   src.append(depth, ')');
+   src += " + !x";
+   auto items = parseAll("def unary!(v) v " + src);
+   ASSERT_EQ(items.size(), 2u);
+   ASSERT_TRUE(writeAstImage(path, items, {}));
+   auto image = AstImage::open(path);
+   ASSERT_NE(image, nullptr);
+   auto loaded = image->item(1);
+   ASSERT_TRUE(loaded);
+   EXPECT_TRUE(sameItem(*loaded, items[1]));
+}
+
+TEST_F(ast_image_test, rejects_bad_files)
+{
+   std::stringstream err{};
+   auto old = std::cerr.rdbuf(err.rdbuf());
+   EXPECT_EQ(AstImage::open("/nonexistent/kaleidoscope.kast"), nullptr);
+   EXPECT_EQ(err.str(), "");
+
+   std::ofstream(path) << "def foo(x) x";
+   EXPECT_EQ(AstImage::open(path), nullptr);
+
+   auto items = parseAll("def foo(x) x + 1");
+   ASSERT_TRUE(writeAstImage(path, items, {}));
+   std::string bytes{};
+   {
+      std::ifstream in{path, std::ios::binary};
+      bytes.assign(std::istreambuf_iterator<char>(in), {});
+   }
+   auto rewrite = [&](std::string const& contents)
+   {
+      std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+   };
+
+   std::string future{bytes};
+   future[4] = 9;
+   rewrite(future);
+   EXPECT_EQ(AstImage::open(path), nullptr);
+
+   rewrite(bytes.substr(0, bytes.size() - 1));
+   EXPECT_EQ(AstImage::open(path), nullptr);
+   std::cerr.rdbuf(old);
+   EXPECT_NE(err.str().find("Unsupported AST image version 9"), std::string::npos);
+
+   // a child that does not come before its parent is caught when the
+   // item is built
+   std::string forward{bytes};
+   std::size_t const rootNode{sizeof(image::Header) + sizeof(double) + sizeof(image::Item) + 2 * sizeof(image::Node)};
+   ASSERT_EQ(static_cast<ExprAST::Kind>(forward[rootNode]), ExprAST::Kind::binary);
+   forward[rootNode + 4] = 0;
+   rewrite(forward);
+   auto image = AstImage::open(path);
+   ASSERT_NE(image, nullptr);
+   Diagnostics diags{};
+   DiagnosticScope scope{diags};
+   EXPECT_FALSE(image->item(0));
+   ASSERT_EQ(diags.errorCount(), 1u);
+   EXPECT_EQ(diags.all()[0].message, "Corrupt AST image item 0");
+}
+
+TEST_F(ast_image_test, unwritable_directory)
+{
+   auto items = parseAll("def foo(x) x + 1");
+   std::stringstream err{};
+   auto old = std::cerr.rdbuf(err.rdbuf());
+   // a missing directory is a mistake worth reporting
+   EXPECT_FALSE(writeAstImage("/nonexistent/kaleidoscope.kast", items, {}));
+   EXPECT_NE(err.str().find("Unable to write AST image"), std::string::npos);
+
+   // one we may not write to is silent
+   char directory[32]{"/tmp/kaleidoscope-XXXXXX"};
+   ASSERT_NE(mkdtemp(directory), nullptr);
+   chmod(directory, 0500);
+   if(access(directory, W_OK) != 0)
+   {
+      err.str("");
+      EXPECT_FALSE(writeAstImage((std::string(directory) + "/foo.kast").c_str(), items, {}));
+      EXPECT_EQ(err.str(), "");
+   }
+   std::cerr.rdbuf(old);
+   rmdir(directory);
+}
+
+TEST_F(ast_image_test, source_stamp)
+{
+   std::ofstream(path) << "def foo(x) x";
+   auto stamp = SourceStamp::of(path);
+   ASSERT_TRUE(stamp);
+   EXPECT_EQ(stamp->size, 12u);
+   EXPECT_EQ(SourceStamp::of(path), stamp);
+   EXPECT_FALSE(SourceStamp::of("/nonexistent/kaleidoscope.ks"));
+}
+
+#endif
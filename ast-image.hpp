@@ -0,0 +1,165 @@
+#ifndef __AST_IMAGE_H_
+#define __AST_IMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "parser.hpp"
+
+// Identifies the version of a source file an image was written from
+struct SourceStamp
+{
+   std::uint64_t size{};
+   std::int64_t mtime{}; // nanoseconds since the epoch
+
+   // nullopt if path cannot be stat'ed
+   static std::optional<SourceStamp> of(char const* path);
+
+   friend bool operator==(SourceStamp lhs, SourceStamp rhs) { return lhs.size == rhs.size && lhs.mtime == rhs.mtime; }
+   friend bool operator!=(SourceStamp lhs, SourceStamp rhs) { return !(lhs == rhs); }
+};
+
+// On-disk layout, in host byte order, in this order after the header:
+//
+//    numbers       double[numberCount]
+//    items         image::Item[itemCount]
+//    nodes         image::Node[nodeCount], each expression in post order
+//    refs          uint32[refCount], parameter names and call arguments
+//    string index  uint32[stringCount + 1], offsets into the string data
+//    string data   stringBytes of names, not terminated
+//
+// Names are string table indices; string 0 is the empty name.  A node
+// refers to its children by their distance back from itself, so children
+// always come first and a subtree shared by hash-consing is stored once.
+namespace image
+{
+
+constexpr std::uint32_t magic{0x5453414b}; // "KAST"
+constexpr std::uint32_t none{~0u};
+
+struct Header
+{
+   std::uint32_t magic;
+   std::uint32_t version;
+   std::uint64_t sourceSize;
+   std::int64_t sourceMtime;
+   std::uint32_t numberCount;
+   std::uint32_t itemCount;
+   std::uint32_t nodeCount;
+   std::uint32_t refCount;
+   std::uint32_t stringCount;
+   std::uint32_t stringBytes;
+};
+
+enum class ItemKind : std::uint8_t
+{
+   definition,
+   declaration,
+   expression,
+};
+
+struct Item
+{
+   std::uint64_t offset; // in the source, for diagnostics
+   std::uint32_t name;
+   std::uint32_t firstParam; // into refs
+   std::uint32_t paramCount;
+   std::uint32_t body; // none for declarations
+   std::uint32_t precedence;
+   ItemKind kind;
+   bool isOperator;
+   std::uint16_t reserved;
+};
+
+//    number    a = index into numbers
+//    variable  a = name
+//    unary     a = distance to the operand, op
+//    binary    a = distance to lhs, b = distance to rhs, op
+//    call      a = callee name, b = index into refs, where the argument
+//              count is followed by the arguments' distances
+struct Node
+{
+   ExprAST::Kind kind;
+   char op;
+   bool shared; // referenced more than once
+   std::uint8_t reserved;
+   std::uint32_t a;
+   std::uint32_t b;
+};
+
+static_assert(sizeof(Header) == 48 && sizeof(Item) == 32 && sizeof(Node) == 12);
+
+} // namespace image
+
+// Write items as an image at path, stamped with the source they were
+// parsed from.  The file is written beside path, under a name of this
+// process's own, and renamed into place, so readers never see half an
+// image.  false on failure, reported unless the directory is read-only or
+// not ours to write.
+bool writeAstImage(char const* path, std::vector<TopLevelItem> const& items, SourceStamp source);
+
+// A parsed module loaded back from an image.  The file is mapped and read
+// in place: opening checks the header and the string table only, and an
+// item's nodes are read when it is materialized with item(), so the cost
+// of a load is proportional to what is used.  Resolver slots and ids are
+// not stored; resolve items again after loading.  Not thread-safe.
+class AstImage
+{
+   public:
+      static constexpr std::uint32_t version{1};
+
+      // nullptr if path is not a valid image of this version (a missing
+      // file is expected, and reported by the result alone)
+      static std::unique_ptr<AstImage> open(char const* path);
+      ~AstImage();
+
+      AstImage(AstImage const&) = delete;
+      AstImage& operator=(AstImage const&) = delete;
+
+      SourceStamp source() const { return {header->sourceSize, header->sourceMtime}; }
+      // written from the current version of the source
+      bool freshFor(SourceStamp current) const { return source() == current; }
+
+      std::size_t size() const { return header->itemCount; }
+
+      // Build item i as the parser would have, in the current arena or in a
+      // new one of its own, registering user-defined operators in
+      // operators, if given, for whatever is parsed after the load.
+      // nullopt (after reporting) if the item is corrupt.
+      std::optional<TopLevelItem> item(std::size_t i, OperatorTable* operators = nullptr) const;
+
+      // in-place access to the raw records
+      image::Item const& itemRecord(std::size_t i) const { return items[i]; }
+      image::Node const& node(std::uint32_t n) const { return nodes[n]; }
+      double number(std::uint32_t n) const { return numbers[nodes[n].a]; }
+      std::string_view string(std::uint32_t s) const
+      {
+         return {stringData + stringIndex[s], stringIndex[s + 1] - stringIndex[s]};
+      }
+
+   private:
+      AstImage() = default;
+
+      // string s interned, once per image
+      Symbol symbol(std::uint32_t s) const;
+      ExprPtr expression(std::uint32_t root) const;
+
+      void* mapping{nullptr};
+      std::size_t mappedSize{};
+
+      image::Header const* header{};
+      double const* numbers{};
+      image::Item const* items{};
+      image::Node const* nodes{};
+      std::uint32_t const* refs{};
+      std::uint32_t const* stringIndex{};
+      char const* stringData{};
+
+      mutable std::vector<Symbol> interned{};
+};
+
+#endif // __AST_IMAGE_H_
@@ -0,0 +1,818 @@
+#include <benchmark/benchmark.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <cstring>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "ast-image.hpp"
+#include "bytecode-vm.hpp"
+#include "char-class.hpp"
+#include "code-generator.hpp"
+#include "flat-ast.hpp"
+#include "incremental-parser.hpp"
+#include "jit.hpp"
+#include "object-cache.hpp"
+#include "optimizer.hpp"
+#include "lexer.hpp"
+#include "parallel-parser.hpp"
+#include "parser.hpp"
+#include "resolver.hpp"
+#include "simplifier.hpp"
+#include "stream-reader.hpp"
+#include "token-stream.hpp"
+
+#include "llvm/Support/FileSystem.h"
+
+// every allocation in the process, for the allocs_per_item counters
+static std::atomic<std::size_t> allocations{};
+static std::atomic<std::size_t> allocatedBytes{};
+
+void* operator new(std::size_t size)
+{
+   allocations.fetch_add(1, std::memory_order_relaxed);
+   allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+   if(void* p = std::malloc(size))
+   {
+      return p;
+   }
+   throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+
+constexpr std::size_t sourceSize{4 << 20};
+
+// roughly what our generated sources look like: banner comments between
+// short definitions
+std::string const& commentHeavySource()
+{
+   static std::string const src = []
+   {
+      std::string s{};
+      while(s.size() < sourceSize)
+      {
+         s += "# ------------------------------------------------------------------------\n"
+              "# generated table entry, do not edit; regenerate from the schema instead\n"
+              "# ------------------------------------------------------------------------\n"
+              "def entry(x y) x*y+0.5;\n";
+      }
+      return s;
+   }();
+   return src;
+}
+
+// deeply indented, column aligned output
+std::string const& whitespaceHeavySource()
+{
+   static std::string const src = []
+   {
+      std::string s{};
+      while(s.size() < sourceSize)
+      {
+         s += "def                    aligned(x    y)\n"
+              "                                           x    +    y\n"
+              "\t\t\t\t\t\t\t\t                                 ;\n";
+      }
+      return s;
+   }();
+   return src;
+}
+
+// generated constant tables: long runs of literals
+std::string const& numericHeavySource()
+{
+   static std::string const src = []
+   {
+      std::string s{};
+      for(unsigned i{}; s.size() < sourceSize; i++)
+      {
+         s += "   0.0001234567 + 1.5e-9 * " + std::to_string(i * 7919 % 100003) + ".0625 + 98765.4321 * 2.5E+3 +\n";
+      }
+      return s;
+   }();
+   return src;
+}
+
+void lexBuffer(benchmark::State& state, std::string const& src)
+{
+   Token tok{};
+   for(auto _ : state)
+   {
+      BufferCursor cur{src};
+      do
+      {
+         gettok(tok, cur);
+      } while(tok.type != TokenType::eof);
+      benchmark::DoNotOptimize(tok);
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * src.size());
+   state.SetLabel(scanKernelName());
+}
+
+void lexStream(benchmark::State& state, std::string const& src)
+{
+   Token tok{};
+   for(auto _ : state)
+   {
+      std::istringstream io{src};
+      do
+      {
+         gettok(tok, io);
+      } while(tok.type != TokenType::eof);
+      benchmark::DoNotOptimize(tok);
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * src.size());
+}
+
+void BM_lex_buffer_comments(benchmark::State& state) { lexBuffer(state, commentHeavySource()); }
+void BM_lex_buffer_whitespace(benchmark::State& state) { lexBuffer(state, whitespaceHeavySource()); }
+void BM_lex_buffer_numbers(benchmark::State& state) { lexBuffer(state, numericHeavySource()); }
+void BM_lex_stream_numbers(benchmark::State& state) { lexStream(state, numericHeavySource()); }
+void BM_lex_stream_comments(benchmark::State& state) { lexStream(state, commentHeavySource()); }
+void BM_lex_stream_whitespace(benchmark::State& state) { lexStream(state, whitespaceHeavySource()); }
+
+// expression-heavy definitions, for the parser benchmarks
+std::string const& expressionSource()
+{
+   static std::string const src = []
+   {
+      std::string s{};
+      for(unsigned i{}; s.size() < sourceSize / 4; i++)
+      {
+         s += "def poly" + std::to_string(i % 64) + "(x y) (x*x + 2*x*y + y*y) * (x - y) < poly(x+1, y-1) * 3;\n";
+      }
+      return s;
+   }();
+   return src;
+}
+
+template< class Source >
+void parseAll(benchmark::State& state, Source& src)
+{
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, src);
+   while(tok.type == TokenType::def)
+   {
+      auto def = parseDefinition(tok, src, ops);
+      benchmark::DoNotOptimize(def);
+      gettok(tok, src);
+   }
+}
+
+void BM_parse_stream(benchmark::State& state)
+{
+   for(auto _ : state)
+   {
+      std::istringstream io{expressionSource()};
+      parseAll(state, static_cast<std::istream&>(io));
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * expressionSource().size());
+}
+
+void BM_parse_buffer(benchmark::State& state)
+{
+   for(auto _ : state)
+   {
+      BufferCursor cur{expressionSource()};
+      parseAll(state, cur);
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * expressionSource().size());
+}
+
+// tokenizing is outside the timed region: this is the parser's side of
+// the batch, tokenize-once path
+void BM_parse_token_stream(benchmark::State& state)
+{
+   auto ts = TokenStream::tokenize(expressionSource());
+   for(auto _ : state)
+   {
+      TokenCursor cur{&ts};
+      parseAll(state, cur);
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * expressionSource().size());
+}
+
+void BM_tokenize(benchmark::State& state)
+{
+   for(auto _ : state)
+   {
+      auto ts = TokenStream::tokenize(expressionSource());
+      benchmark::DoNotOptimize(ts);
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * expressionSource().size());
+}
+
+std::vector<std::unique_ptr<FunctionAST>> parseDefinitions(std::string const& src)
+{
+   std::vector<std::unique_ptr<FunctionAST>> defs{};
+   BufferCursor cur{src};
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, cur);
+   while(tok.type == TokenType::def)
+   {
+      defs.push_back(parseDefinition(tok, cur, ops));
+      gettok(tok, cur);
+   }
+   return defs;
+}
+
+// Parse every definition, keep them all (one compilation), then free them.
+// Heap: a node per make_unique plus each argument vector.  Arena: one
+// arena per compilation, released in one go; optionally hash-consed.
+void parseAndFree(benchmark::State& state, bool arena, bool hashCons = false)
+{
+   std::size_t items{};
+   std::size_t nodeBytes{};
+   std::size_t const before = allocations.load();
+   for(auto _ : state)
+   {
+      std::optional<ArenaScope> scope{};
+      if(arena)
+      {
+         auto owner = std::make_shared<AstArena>(64 << 10);
+         owner->setHashConsing(hashCons);
+         scope.emplace(owner);
+      }
+      auto defs = parseDefinitions(expressionSource());
+      items += defs.size();
+      nodeBytes = arena ? currentArena()->bytesUsed() : 0;
+   }
+   state.counters["allocs_per_item"] = double(allocations.load() - before) / items;
+   if(arena)
+   {
+      state.counters["node_kb"] = nodeBytes / 1024.0;
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * expressionSource().size());
+}
+
+void BM_parse_free_heap(benchmark::State& state) { parseAndFree(state, false); }
+void BM_parse_free_arena(benchmark::State& state) { parseAndFree(state, true); }
+void BM_parse_free_hash_cons(benchmark::State& state) { parseAndFree(state, true, true); }
+
+// One expression nested state.range(0) levels deep (parentheses, a right
+// leaning sum and calls), parsed onto the heap and freed.  Depth costs
+// heap for the parser's stacks, not call stack.
+std::string const& deepSource(std::size_t depth)
+{
+   static std::string src{};
+   if(src.size() < depth)
+   {
+      src.clear();
+      std::string close(depth, ')');
+      src += std::string(depth, '(') + "x" + close + "+";
+      for(std::size_t i{}; i < depth; i++)
+      {
+         src += "x+(";
+      }
+      src += "1" + close + "*";
+      for(std::size_t i{}; i < depth; i++)
+      {
+         src += "f(1, ";
+      }
+      src += "2" + close;
+   }
+   return src;
+}
+
+void BM_parse_deep_nesting(benchmark::State& state)
+{
+   std::string const& src = deepSource(state.range(0));
+   for(auto _ : state)
+   {
+      BufferCursor cur{src};
+      Token tok{};
+      OperatorTable ops{};
+      gettok(tok, cur);
+      auto e = parseExpression(tok, cur, ops);
+      if(!e)
+      {
+         state.SkipWithError("parse failed");
+         break;
+      }
+      e.reset();
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * src.size());
+}
+
+// Structural equality of every definition against an identical copy: the
+// pointer tree (heap nodes) against the flat form.  Both report their
+// footprint per expression node.
+void BM_ast_equal_tree(benchmark::State& state)
+{
+   std::size_t const before = allocatedBytes.load();
+   auto lhs = parseDefinitions(expressionSource());
+   std::size_t const bytes = allocatedBytes.load() - before;
+   auto rhs = parseDefinitions(expressionSource());
+   for(auto _ : state)
+   {
+      bool same{true};
+      for(std::size_t i{}; i < lhs.size(); i++)
+      {
+         same &= *lhs[i] == *rhs[i];
+      }
+      benchmark::DoNotOptimize(same);
+   }
+   state.counters["bytes_per_node"] = double(bytes) / FlatAST::fromSource(expressionSource()).size();
+}
+
+void BM_ast_equal_flat(benchmark::State& state)
+{
+   auto lhs = FlatAST::fromSource(expressionSource());
+   auto rhs = FlatAST::fromSource(expressionSource());
+   for(auto _ : state)
+   {
+      bool same{true};
+      for(std::size_t i{}; i < lhs.functions().size(); i++)
+      {
+         same &= lhs.equal(lhs.functions()[i].body, rhs, rhs.functions()[i].body);
+      }
+      benchmark::DoNotOptimize(same);
+   }
+   state.counters["bytes_per_node"] = double(lhs.memoryBytes()) / lhs.size();
+}
+
+// whole-module baseline for the parallel front end: same work, one thread
+void BM_parse_module(benchmark::State& state)
+{
+   for(auto _ : state)
+   {
+      BufferCursor cur{expressionSource()};
+      Token tok{};
+      gettok(tok, cur);
+      auto items = parseModule(tok, cur);
+      benchmark::DoNotOptimize(items);
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * expressionSource().size());
+}
+
+// Name resolution of a parsed module: slot binding, call ids and arity
+// checks for every definition
+void BM_resolve(benchmark::State& state)
+{
+   std::string src{"extern g(a b);\n"};
+   for(unsigned i{}; src.size() < sourceSize / 4; i++)
+   {
+      src += "def f" + std::to_string(i) + "(x y) (x*x + 2*x*y + y*y) * (x - y) < g(x+1, y-1) * 3;\n";
+   }
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   auto items = parseModule(tok, cur);
+   for(auto _ : state)
+   {
+      Resolver resolver{};
+      for(auto& item : items)
+      {
+         if(!resolver.resolve(item))
+         {
+            state.SkipWithError("resolution failed");
+            return;
+         }
+      }
+   }
+   state.SetItemsProcessed(int64_t(state.iterations()) * items.size());
+}
+
+// IR generation for the module BM_resolve resolves, one session per
+// benchmark thread; sessions share no state, so threads do not contend
+void BM_codegen(benchmark::State& state)
+{
+   static std::vector<TopLevelItem> const items = []
+   {
+      std::string src{"extern g(a b);\n"};
+      for(unsigned i{}; src.size() < sourceSize / 16; i++)
+      {
+         src += "def f" + std::to_string(i) + "(x y) (x*x + 2*x*y + y*y) * (x - y) < g(x+1, y-1) * 3;\n";
+      }
+      BufferCursor cur{src};
+      Token tok{};
+      gettok(tok, cur);
+      auto parsed = parseModule(tok, cur);
+      Resolver resolver{};
+      for(auto& item : parsed)
+      {
+         resolver.resolve(item);
+      }
+      return parsed;
+   }();
+   for(auto _ : state)
+   {
+      CodeGenContext cg{};
+      for(auto const& item : items)
+      {
+         llvm::Value* v = std::visit([&cg](auto const& node) -> llvm::Value* { return node->codegen(cg); }, item);
+         benchmark::DoNotOptimize(v);
+      }
+   }
+   state.SetItemsProcessed(int64_t(state.iterations()) * items.size());
+}
+
+// The optimizer at -O<range(0)> over one module of numeric definitions;
+// codegen is not timed
+void BM_optimize(benchmark::State& state)
+{
+   std::string src{};
+   for(unsigned i{}; i < 512; i++)
+   {
+      src += "def k" + std::to_string(i) + "(x y) (x*x + 2*x*y + y*y) * (x - y) + (x+1)*(x+1)*(y-1) - x*1\n";
+   }
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   auto items = parseModule(tok, cur);
+   Resolver resolver{};
+   for(auto& item : items)
+   {
+      resolver.resolve(item);
+   }
+   OptimizerOptions opts{};
+   opts.level = state.range(0);
+   Optimizer optimizer{opts};
+   for(auto _ : state)
+   {
+      state.PauseTiming();
+      CodeGenContext cg{};
+      for(auto& item : items)
+      {
+         std::get<std::unique_ptr<FunctionAST>>(item)->codegen(cg);
+      }
+      state.ResumeTiming();
+      optimizer.run(cg.module());
+   }
+   state.SetItemsProcessed(int64_t(state.iterations()) * items.size());
+}
+
+// Codegen of mostly constant definitions, as generated code tends to be,
+// without (0) and with (1) AST simplification first; the simplification
+// is timed with it.  Reports the IR instructions emitted per definition.
+void BM_simplify_codegen(benchmark::State& state)
+{
+   std::string src{};
+   for(unsigned i{}; i < 2048; i++)
+   {
+      std::string const n{std::to_string(i)};
+      src += "def c" + n + "(x y) (2*" + n + "+x*1-0) * (4*5-1) + (1<2)*y - (y*1)*(3-2) + x*(0+1)*" + n + "\n";
+   }
+   std::size_t instructions{};
+   for(auto _ : state)
+   {
+      state.PauseTiming();
+      BufferCursor cur{src};
+      Token tok{};
+      gettok(tok, cur);
+      auto items = parseModule(tok, cur);
+      Resolver resolver{};
+      for(auto& item : items)
+      {
+         resolver.resolve(item);
+      }
+      state.ResumeTiming();
+      CodeGenContext cg{};
+      Simplifier simplifier{};
+      for(auto& item : items)
+      {
+         if(state.range(0))
+         {
+            simplifier.simplify(item);
+         }
+         std::get<std::unique_ptr<FunctionAST>>(item)->codegen(cg);
+      }
+      instructions = cg.module().getInstructionCount();
+      state.PauseTiming();
+      items.clear();
+      state.ResumeTiming();
+   }
+   state.counters["instructions"] = double(instructions) / 2048;
+   state.SetItemsProcessed(int64_t(state.iterations()) * 2048);
+}
+
+// Time to the first result of a module of definitions under the lazy JIT,
+// from resolving it to the value of an expression calling range(0)
+// distinct functions: only those are compiled, so the time follows the
+// calls rather than the size of the module.  With a tier threshold,
+// range(1), they are compiled by the fast tier instead.
+void BM_jit_first_result(benchmark::State& state)
+{
+   static std::string const src = []
+   {
+      std::string s{};
+      for(unsigned i{}; s.size() < sourceSize / 16; i++)
+      {
+         s += "def f" + std::to_string(i) + "(x y) (x*x + 2*x*y + y*y) * (x - y) < (x+1) * (y-1) * 3\n";
+      }
+      return s;
+   }();
+   std::string call{"0"};
+   for(int64_t i{}; i < state.range(0); i++)
+   {
+      call += " + f" + std::to_string(i) + "(1, 2)";
+   }
+   BufferCursor callCur{call};
+   Token callTok{};
+   gettok(callTok, callCur);
+   auto expr = parseModule(callTok, callCur);
+
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   auto items = parseModule(tok, cur);
+   std::size_t compiled{};
+   for(auto _ : state)
+   {
+      auto jit = KaleidoscopeJIT::create({}, TieringOptions{static_cast<std::uint64_t>(state.range(1))});
+      CodeGenContext cg{};
+      Resolver resolver{};
+      for(auto& item : items)
+      {
+         resolver.resolve(item);
+         jit->run(item, cg);
+      }
+      resolver.resolve(expr.front());
+      benchmark::DoNotOptimize(jit->run(expr.front(), cg));
+      compiled = jit->compiledModules();
+   }
+   state.counters["compiled"] = compiled;
+   state.counters["functions"] = items.size();
+}
+
+// Time to the first result of 64 called definitions with an object cache:
+// range(0) 0 empties the cache before each run, 1 leaves it warm, so every
+// module is loaded instead of optimized and compiled
+void BM_jit_cached_first_result(benchmark::State& state)
+{
+   std::string src{};
+   std::string call{"0"};
+   for(unsigned i{}; i < 64; i++)
+   {
+      src += "def f" + std::to_string(i) + "(x y) (x*x + 2*x*y + y*y) * (x - y) < (x+1) * (y-1) * 3\n";
+      call += " + f" + std::to_string(i) + "(1, 2)";
+   }
+   src += call + "\n";
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   auto items = parseModule(tok, cur);
+
+   char dir[] = "/tmp/kaleidoscope-bench-XXXXXX";
+   if(!mkdtemp(dir))
+   {
+      state.SkipWithError("no temporary directory");
+      return;
+   }
+   std::size_t hits{};
+   for(auto _ : state)
+   {
+      if(state.range(0) == 0)
+      {
+         state.PauseTiming();
+         llvm::sys::fs::remove_directories(dir);
+         state.ResumeTiming();
+      }
+      auto jit = KaleidoscopeJIT::create({}, {}, ObjectCacheOptions{dir});
+      CodeGenContext cg{};
+      Resolver resolver{};
+      for(auto& item : items)
+      {
+         resolver.resolve(item);
+         benchmark::DoNotOptimize(jit->run(item, cg));
+      }
+      hits = jit->objectCache()->hits();
+   }
+   llvm::sys::fs::remove_directories(dir);
+   state.counters["hits"] = hits;
+}
+
+// Time to the first result of a short script, from an empty backend:
+// range(0) 0 is the lazy JIT at -O2, 1 the bytecode VM
+void BM_first_result(benchmark::State& state)
+{
+   static std::string const src{
+      "extern sin(x)\n"
+      "def sq(x) x*x\n"
+      "def binary| 5 (a b) a + b\n"
+      "def dist(x y) sq(x) + sq(y) - 2*x*y\n"
+      "def wave(x) sin(x) * sq(x) | dist(x, 1)\n"
+      "wave(2) + dist(3, 4) * (1 < 2)\n"};
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   auto items = parseModule(tok, cur);
+   bool const vm{state.range(0) == 1};
+   for(auto _ : state)
+   {
+      Resolver resolver{};
+      std::optional<double> result{};
+      if(vm)
+      {
+         BytecodeVM backend{};
+         for(auto& item : items)
+         {
+            resolver.resolve(item);
+            result = backend.run(item);
+         }
+      }
+      else
+      {
+         auto jit = KaleidoscopeJIT::create();
+         CodeGenContext cg{};
+         for(auto& item : items)
+         {
+            resolver.resolve(item);
+            result = jit->run(item, cg);
+         }
+      }
+      benchmark::DoNotOptimize(result);
+   }
+   state.SetLabel(vm ? "vm" : "jit");
+}
+
+// Latency until the first item can be handed on: the pull parser stops
+// after one item, where parseModule above reads the whole module first
+void BM_parser_first_item(benchmark::State& state)
+{
+   for(auto _ : state)
+   {
+      BufferCursor cur{expressionSource()};
+      Parser<BufferCursor> parser{cur};
+      auto item = parser.next();
+      benchmark::DoNotOptimize(item);
+   }
+}
+
+// Cold start from an image of the module parseModule reads above: opening
+// it (state.range(0) == 0), or opening it and building every item (1)
+void BM_load_image(benchmark::State& state)
+{
+   char path[] = "/tmp/kaleidoscope-XXXXXX";
+   int fd = mkstemp(path);
+   close(fd);
+   {
+      BufferCursor cur{expressionSource()};
+      Token tok{};
+      gettok(tok, cur);
+      writeAstImage(path, parseModule(tok, cur), {});
+   }
+   for(auto _ : state)
+   {
+      auto image = AstImage::open(path);
+      if(!image)
+      {
+         state.SkipWithError("no image");
+         break;
+      }
+      for(std::size_t i{}; state.range(0) && i < image->size(); i++)
+      {
+         auto item = image->item(i);
+         benchmark::DoNotOptimize(item);
+      }
+   }
+   std::remove(path);
+   state.SetBytesProcessed(int64_t(state.iterations()) * expressionSource().size());
+}
+
+// scaling of the parallel front end with the worker count (state.range(0))
+void BM_parse_parallel(benchmark::State& state)
+{
+   for(auto _ : state)
+   {
+      auto items = parseModuleParallel(expressionSource(), state.range(0));
+      benchmark::DoNotOptimize(items);
+   }
+   state.SetBytesProcessed(int64_t(state.iterations()) * expressionSource().size());
+}
+
+// ~100k lines, the size of file the editor integration struggles with
+std::string const& editorSource()
+{
+   static std::string const src = []
+   {
+      std::string s{};
+      for(unsigned i{}; i < 25000; i++)
+      {
+         s += "# helper " + std::to_string(i) + "\n"
+              "def helper" + std::to_string(i) + "(x y)\n"
+              "   (x + y) * (x - y) + helper(x, y - 1)\n"
+              "   < 100;\n";
+      }
+      return s;
+   }();
+   return src;
+}
+
+void BM_editor_full_reparse(benchmark::State& state)
+{
+   for(auto _ : state)
+   {
+      BufferCursor cur{editorSource()};
+      Token tok{};
+      gettok(tok, cur);
+      auto items = parseModule(tok, cur);
+      benchmark::DoNotOptimize(items);
+   }
+}
+
+// one keystroke in the middle of the file: insert a digit, then delete it
+void BM_editor_incremental_edit(benchmark::State& state)
+{
+   IncrementalParser inc{editorSource()};
+   std::size_t pos = inc.text().find("< 100", inc.text().size() / 2) + 2;
+   bool inserted{false};
+   for(auto _ : state)
+   {
+      if(inserted)
+      {
+         inc.edit(pos, 1, "");
+      }
+      else
+      {
+         inc.edit(pos, 0, "7");
+      }
+      inserted = !inserted;
+   }
+   state.counters["reparsed_regions"] = inc.lastReparsed();
+}
+
+// Generated code piped through stdin: state.range(0) MB produced on the fly
+// and parsed item by item through a ChunkedReader.  Peak RSS should not
+// move with the stream length.
+void BM_parse_streaming(benchmark::State& state)
+{
+   std::string const& block = expressionSource();
+   // whole copies of the block, so the last item is not cut short
+   std::uint64_t const total = (std::uint64_t(state.range(0)) << 20) / block.size() * block.size();
+   std::size_t items{};
+   for(auto _ : state)
+   {
+      std::uint64_t produced{};
+      ChunkedReader in{[&](char* buf, std::size_t size) -> std::size_t
+      {
+         std::size_t n = std::min<std::uint64_t>({size, total - produced, block.size() - produced % block.size()});
+         std::memcpy(buf, block.data() + produced % block.size(), n);
+         produced += n;
+         return n;
+      }};
+      Token tok{};
+      OperatorTable ops{};
+      gettok(tok, in);
+      parseItems(tok, in, ops, [&items](TopLevelItem item)
+      {
+         benchmark::DoNotOptimize(item);
+         items++;
+      });
+   }
+   rusage usage{};
+   getrusage(RUSAGE_SELF, &usage);
+   state.counters["peak_rss_mb"] = usage.ru_maxrss / 1024.0;
+   state.counters["items"] = items / state.iterations();
+   state.SetBytesProcessed(int64_t(state.iterations()) * total);
+}
+
+} // namespace
+
+BENCHMARK(BM_lex_buffer_comments);
+BENCHMARK(BM_lex_buffer_whitespace);
+BENCHMARK(BM_lex_buffer_numbers);
+BENCHMARK(BM_lex_stream_comments);
+BENCHMARK(BM_lex_stream_whitespace);
+BENCHMARK(BM_lex_stream_numbers);
+
+BENCHMARK(BM_parse_stream);
+BENCHMARK(BM_parse_buffer);
+BENCHMARK(BM_tokenize);
+BENCHMARK(BM_parse_token_stream);
+BENCHMARK(BM_parse_free_heap);
+BENCHMARK(BM_parse_free_arena);
+BENCHMARK(BM_parse_free_hash_cons);
+BENCHMARK(BM_parse_module);
+BENCHMARK(BM_load_image)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_resolve)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_codegen)->ThreadRange(1, std::max(1u, std::thread::hardware_concurrency()))->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_simplify_codegen)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_optimize)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_jit_first_result)->Args({1, 0})->Args({64, 0})->Args({64, 1000})->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_jit_cached_first_result)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_first_result)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_parser_first_item)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_parse_deep_nesting)->Arg(1000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ast_equal_tree)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ast_equal_flat)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_parse_streaming)->Arg(16)->Arg(128)->Iterations(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_editor_full_reparse)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_editor_incremental_edit)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_parse_parallel)->DenseRange(1, std::max(1u, std::thread::hardware_concurrency()))->UseRealTime();
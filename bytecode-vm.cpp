@@ -0,0 +1,563 @@
+#include "bytecode-vm.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <variant>
+
+#include <dlfcn.h>
+
+#if defined(__GNUC__)
+// labels as values, in GCC and Clang
+#define KALEIDOSCOPE_THREADED_DISPATCH
+#endif
+
+namespace
+{
+
+// operands are 16 bits
+constexpr std::uint32_t operandLimit{std::numeric_limits<std::uint16_t>::max() + 1u};
+// calls deep enough to be runaway recursion
+constexpr std::size_t maxFrames{1u << 20};
+// externs with more parameters are not bound
+constexpr std::size_t maxNativeParams{6};
+
+bool isBuiltinOperator(char op)
+{
+   return op == '+' || op == '-' || op == '*' || op == '<';
+}
+
+double callNative(void* f, std::uint16_t arity, double const* a)
+{
+   switch(arity)
+   {
+      case 0: return reinterpret_cast<double (*)()>(f)();
+      case 1: return reinterpret_cast<double (*)(double)>(f)(a[0]);
+      case 2: return reinterpret_cast<double (*)(double, double)>(f)(a[0], a[1]);
+      case 3: return reinterpret_cast<double (*)(double, double, double)>(f)(a[0], a[1], a[2]);
+      case 4: return reinterpret_cast<double (*)(double, double, double, double)>(f)(a[0], a[1], a[2], a[3]);
+      case 5: return reinterpret_cast<double (*)(double, double, double, double, double)>(f)(a[0], a[1], a[2], a[3], a[4]);
+      default: return reinterpret_cast<double (*)(double, double, double, double, double, double)>(f)(a[0], a[1], a[2], a[3], a[4], a[5]);
+   }
+}
+
+char const* mnemonic(BytecodeVM::Op op)
+{
+   switch(op)
+   {
+      case BytecodeVM::Op::loadk: return "loadk";
+      case BytecodeVM::Op::move: return "move";
+      case BytecodeVM::Op::add: return "add";
+      case BytecodeVM::Op::sub: return "sub";
+      case BytecodeVM::Op::mul: return "mul";
+      case BytecodeVM::Op::lt: return "lt";
+      case BytecodeVM::Op::call: return "call";
+      case BytecodeVM::Op::ret: return "ret";
+   }
+   return "?";
+}
+
+} // namespace
+
+std::optional<double> BytecodeVM::run(TopLevelItem const& item)
+{
+   if(auto const* expr = std::get_if<std::unique_ptr<TopLevelExprAST>>(&item))
+   {
+      Function entry{};
+      if(!lower(**expr, entry))
+      {
+         return std::nullopt;
+      }
+      return execute(entry);
+   }
+   if(auto const* fn = std::get_if<std::unique_ptr<FunctionAST>>(&item))
+   {
+      PrototypeAST const& proto = *(*fn)->proto;
+      // known by name first: a user-defined operator may call itself
+      ids[std::string(proto.name.str())] = proto.id;
+      Function lowered{};
+      if(lower(**fn, lowered))
+      {
+         if(functions.size() <= proto.id)
+         {
+            functions.resize(proto.id + 1);
+         }
+         functions[proto.id] = std::move(lowered);
+      }
+      return std::nullopt;
+   }
+   bind(*std::get<std::unique_ptr<PrototypeAST>>(item));
+   return std::nullopt;
+}
+
+// An extern is bound to the host's function of that name if there is one;
+// calling one that is not is reported, as by the JIT
+bool BytecodeVM::bind(PrototypeAST const& proto)
+{
+   std::string const name{proto.name.str()};
+   ids[name] = proto.id;
+   if(functions.size() <= proto.id)
+   {
+      functions.resize(proto.id + 1);
+   }
+   Function& f = functions[proto.id];
+   f.name = name;
+   f.params = static_cast<std::uint16_t>(proto.args.size());
+   if(proto.args.size() > maxNativeParams)
+   {
+      std::cerr << "Externs take at most " << maxNativeParams << " parameters in the bytecode VM: " << name << "\n";
+      return false;
+   }
+   f.native = dlsym(RTLD_DEFAULT, name.c_str());
+   return f.native != nullptr;
+}
+
+std::optional<std::uint16_t> BytecodeVM::callee(Function& out, std::uint32_t id, std::string const& name)
+{
+   if(id == ExprAST::unresolved)
+   {
+      auto it = ids.find(name);
+      if(it == ids.end())
+      {
+         std::cerr << "Unknown function referenced: " << name << "\n";
+         return std::nullopt;
+      }
+      id = it->second;
+   }
+   for(std::size_t i{}; i < out.callees.size(); i++)
+   {
+      if(out.callees[i] == id)
+      {
+         return static_cast<std::uint16_t>(i);
+      }
+   }
+   if(out.callees.size() == operandLimit)
+   {
+      std::cerr << "Function calls too many others for the bytecode VM: " << out.name << "\n";
+      return std::nullopt;
+   }
+   out.callees.push_back(id);
+   return static_cast<std::uint16_t>(out.callees.size() - 1);
+}
+
+// Each node's value goes to the first free temporary when it is visited,
+// its mark, so a node's operands sit at or above its mark and are free
+// again once it is computed.  Parameters are used in place, except as
+// call arguments, which must be consecutive.
+bool BytecodeVM::lower(FunctionAST const& fn, Function& out)
+{
+   PrototypeAST const& proto = *fn.proto;
+   out.name = std::string(proto.name.str());
+   out.params = static_cast<std::uint16_t>(proto.args.size());
+   std::uint32_t next{out.params};
+   std::uint32_t registers{next};
+   pending.clear();
+   results.clear();
+   constantIndex.clear();
+
+   auto emit = [&out](Op op, std::uint32_t a, std::uint32_t b = 0, std::uint32_t c = 0)
+   {
+      out.code.push_back({op, static_cast<std::uint16_t>(a), static_cast<std::uint16_t>(b), static_cast<std::uint16_t>(c)});
+   };
+   // the value of the node at mark is computed
+   auto computed = [&](std::uint32_t mark)
+   {
+      results.push_back(static_cast<std::uint16_t>(mark));
+      next = mark + 1;
+      pending.pop_back();
+   };
+
+   pending.push_back({fn.body.get(), false, next, 0});
+   while(!pending.empty())
+   {
+      Pending& p = pending.back();
+      if(p.mark >= operandLimit || out.constants.size() == operandLimit)
+      {
+         std::cerr << "Function too large for the bytecode VM: " << out.name << "\n";
+         return false;
+      }
+      registers = std::max(registers, p.mark + 1);
+      std::uint32_t const mark{p.mark};
+      switch(p.node->getKind())
+      {
+         case ExprAST::Kind::number:
+         {
+            // by bits: 0 and -0 are distinct constants
+            double const value{llvm::cast<NumberExprAST>(p.node)->value()};
+            std::uint64_t bits{};
+            std::memcpy(&bits, &value, sizeof bits);
+            auto [it, added] = constantIndex.try_emplace(bits, out.constants.size());
+            if(added)
+            {
+               out.constants.push_back(value);
+            }
+            emit(Op::loadk, mark, it->second);
+            computed(mark);
+            break;
+         }
+         case ExprAST::Kind::variable:
+         {
+            std::uint32_t const slot{llvm::cast<VariableExprAST>(p.node)->slot};
+            if(p.own)
+            {
+               emit(Op::move, mark, slot);
+               computed(mark);
+            }
+            else
+            {
+               results.push_back(static_cast<std::uint16_t>(slot));
+               pending.pop_back();
+            }
+            break;
+         }
+         case ExprAST::Kind::binary:
+         {
+            auto const* bin = llvm::cast<BinaryExprAST>(p.node);
+            bool const builtin{isBuiltinOperator(bin->op)};
+            if(p.child < 2)
+            {
+               ExprAST const* operand{p.child++ == 0 ? bin->lhs.get() : bin->rhs.get()};
+               pending.push_back({operand, !builtin, next, 0});
+               break;
+            }
+            std::uint16_t const r{results.back()};
+            results.pop_back();
+            std::uint16_t const l{results.back()};
+            results.pop_back();
+            switch(bin->op)
+            {
+               case '+': emit(Op::add, mark, l, r); break;
+               case '-': emit(Op::sub, mark, l, r); break;
+               case '*': emit(Op::mul, mark, l, r); break;
+               case '<': emit(Op::lt, mark, l, r); break;
+               default:
+               {
+                  // user-defined: a call to its "binary<c>" definition
+                  auto index = callee(out, ExprAST::unresolved, std::string("binary") + bin->op);
+                  if(!index)
+                  {
+                     return false;
+                  }
+                  emit(Op::call, mark, *index);
+               }
+            }
+            computed(mark);
+            break;
+         }
+         case ExprAST::Kind::unary:
+         {
+            auto const* un = llvm::cast<UnaryExprAST>(p.node);
+            if(p.child++ == 0)
+            {
+               pending.push_back({un->operand.get(), true, next, 0});
+               break;
+            }
+            results.pop_back();
+            auto index = callee(out, ExprAST::unresolved, std::string("unary") + un->opcode);
+            if(!index)
+            {
+               return false;
+            }
+            emit(Op::call, mark, *index);
+            computed(mark);
+            break;
+         }
+         case ExprAST::Kind::call:
+         {
+            auto const* call = llvm::cast<CallExprAST>(p.node);
+            if(p.child < call->args.size())
+            {
+               pending.push_back({call->args[p.child++].get(), true, next, 0});
+               break;
+            }
+            results.resize(results.size() - call->args.size());
+            auto index = callee(out, call->calleeId, std::string(call->callee.str()));
+            if(!index)
+            {
+               return false;
+            }
+            emit(Op::call, mark, *index);
+            computed(mark);
+            break;
+         }
+      }
+   }
+   emit(Op::ret, results.back());
+   out.registers = static_cast<std::uint16_t>(std::min(registers, operandLimit - 1));
+   return true;
+}
+
+std::optional<double> BytecodeVM::execute(Function const& entry)
+{
+   frames.clear();
+   if(stack.size() < entry.registers)
+   {
+      stack.resize(entry.registers);
+   }
+   Function const* fn{&entry};
+   Instruction const* pc{entry.code.data()};
+   std::size_t base{0};
+   double* r{stack.data()};
+
+#ifdef KALEIDOSCOPE_THREADED_DISPATCH
+   // in Op order
+   static void* const dispatch[]{&&op_loadk, &&op_move, &&op_add, &&op_sub, &&op_mul, &&op_lt, &&op_call, &&op_ret};
+#define VM_CASE(name) op_##name:
+#define VM_NEXT() goto* dispatch[static_cast<std::uint8_t>(pc->op)]
+   VM_NEXT();
+#else
+#define VM_CASE(name) case Op::name:
+#define VM_NEXT() break
+   for(;;) switch(pc->op) {
+#endif
+
+   VM_CASE(loadk)
+   {
+      r[pc->a] = fn->constants[pc->b];
+      ++pc;
+      VM_NEXT();
+   }
+   VM_CASE(move)
+   {
+      r[pc->a] = r[pc->b];
+      ++pc;
+      VM_NEXT();
+   }
+   VM_CASE(add)
+   {
+      r[pc->a] = r[pc->b] + r[pc->c];
+      ++pc;
+      VM_NEXT();
+   }
+   VM_CASE(sub)
+   {
+      r[pc->a] = r[pc->b] - r[pc->c];
+      ++pc;
+      VM_NEXT();
+   }
+   VM_CASE(mul)
+   {
+      r[pc->a] = r[pc->b] * r[pc->c];
+      ++pc;
+      VM_NEXT();
+   }
+   VM_CASE(lt)
+   {
+      r[pc->a] = !(r[pc->b] >= r[pc->c]) ? 1.0 : 0.0;
+      ++pc;
+      VM_NEXT();
+   }
+   VM_CASE(call)
+   {
+      std::uint32_t const id{fn->callees[pc->b]};
+      Function const* g{id < functions.size() ? &functions[id] : nullptr};
+      if(g && g->native)
+      {
+         r[pc->a] = callNative(g->native, g->params, r + pc->a);
+         ++pc;
+         VM_NEXT();
+      }
+      if(!g || g->code.empty())
+      {
+         std::cerr << "Call of an undefined function: " << (g ? g->name : "#" + std::to_string(id)) << "\n";
+         return std::nullopt;
+      }
+      if(frames.size() == maxFrames)
+      {
+         std::cerr << "Stack overflow calling " << g->name << "\n";
+         return std::nullopt;
+      }
+      // the callee's parameters are the arguments in place
+      frames.push_back({fn, pc + 1, base});
+      base += pc->a;
+      if(stack.size() < base + g->registers)
+      {
+         stack.resize(std::max(2 * stack.size(), base + g->registers));
+      }
+      r = stack.data() + base;
+      fn = g;
+      pc = g->code.data();
+      VM_NEXT();
+   }
+   VM_CASE(ret)
+   {
+      double const value{r[pc->a]};
+      if(frames.empty())
+      {
+         return value;
+      }
+      // into the register the call named, the first of the callee's
+      stack[base] = value;
+      Frame const caller{frames.back()};
+      frames.pop_back();
+      fn = caller.fn;
+      pc = caller.pc;
+      base = caller.base;
+      r = stack.data() + base;
+      VM_NEXT();
+   }
+
+#ifndef KALEIDOSCOPE_THREADED_DISPATCH
+   }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+std::string BytecodeVM::disassemble(std::uint32_t id) const
+{
+   if(id >= functions.size())
+   {
+      return {};
+   }
+   Function const& f = functions[id];
+   std::ostringstream os{};
+   for(Instruction const& i : f.code)
+   {
+      os << mnemonic(i.op) << " r" << i.a;
+      switch(i.op)
+      {
+         case Op::loadk: os << ", " << f.constants[i.b]; break;
+         case Op::move: os << ", r" << i.b; break;
+         case Op::call:
+         {
+            std::uint32_t const callee{f.callees[i.b]};
+            os << ", " << (callee < functions.size() ? functions[callee].name : "#" + std::to_string(callee));
+            break;
+         }
+         case Op::ret: break;
+         default: os << ", r" << i.b << ", r" << i.c;
+      }
+      os << "\n";
+   }
+   return os.str();
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include "resolver.hpp"
+
+namespace
+{
+
+class vm_test : public testing::Test
+{
+   protected:
+      // the value of the last top-level expression in src
+      std::optional<double> run(std::string_view src)
+      {
+         BufferCursor cur{src};
+         Token tok{};
+         gettok(tok, cur);
+         std::optional<double> last{};
+         for(auto& item : parseModule(tok, cur, ops))
+         {
+            if(!resolver.resolve(item))
+            {
+               return std::nullopt;
+            }
+            last = vm.run(item);
+         }
+         return last;
+      }
+
+      std::string disassemble(std::string_view name)
+      {
+         return vm.disassemble(*resolver.lookup(Symbol(std::string(name))));
+      }
+
+      BytecodeVM vm{};
+      Resolver resolver{};
+      // operators stay defined from one run to the next, as in a session
+      OperatorTable ops{};
+};
+
+} // namespace
+
+TEST_F(vm_test, evaluates_expressions)
+{
+   EXPECT_EQ(run("1 + 2*3"), 7.0);
+   EXPECT_EQ(run("def sq(x) x*x\nsq(4) - 1"), 15.0);
+   EXPECT_EQ(run("sq(sq(2))"), 16.0);
+   EXPECT_EQ(run("def lt(a b) a < b\ndef clamp(x) x * lt(x, 10)\nclamp(3) + clamp(12)"), 3.0);
+   EXPECT_EQ(run("def three(a b c) a - b*c\nthree(1, 2, 3) + three(three(9, 1, 1), 0, 0)"), 3.0);
+}
+
+TEST_F(vm_test, externs_call_the_host)
+{
+   EXPECT_EQ(run("extern cos(x)\ncos(0)"), 1.0);
+   EXPECT_EQ(run("extern pow(x y)\ndef cube(x) pow(x, 3)\ncube(2)"), 8.0);
+   // reported when called, as by the JIT
+   EXPECT_FALSE(run("extern nosuchfunction(x)\ndef f(x) nosuchfunction(x)"));
+   EXPECT_FALSE(run("f(1)"));
+}
+
+TEST_F(vm_test, user_operators)
+{
+   EXPECT_EQ(run("def binary| 5 (a b) a + b\ndef unary!(v) 0 - v\n!2 | 10"), 8.0);
+}
+
+TEST_F(vm_test, lowering_uses_parameters_in_place)
+{
+   run("def f(x y) x*y + 2\ndef g(x) f(x, 1)\ndef h(x) x");
+   EXPECT_EQ(disassemble("f"), "mul r2, r0, r1\nloadk r3, 2\nadd r2, r2, r3\nret r2\n");
+   // arguments are consecutive, and the result takes the first's place
+   EXPECT_EQ(disassemble("g"), "move r1, r0\nloadk r2, 1\ncall r1, f\nret r1\n");
+   EXPECT_EQ(disassemble("h"), "ret r0\n");
+}
+
+TEST_F(vm_test, deep_expressions)
+{
+   // left-nested: two temporaries, however long
+   std::string src{"def f(x) x"};
+   for(int i{}; i < 100000; i++)
+   {
+      src += "+1";
+   }
+   EXPECT_EQ(run(src + "\nf(1)"), 100001.0);
+
+   // right-nested: a temporary per level, more than operands can name
+   std::string deep{};
+   for(int i{}; i < 70000; i++)
+   {
+      deep += "1+(";
+   }
+   deep += "1" + std::string(70000, ')');
+   EXPECT_FALSE(run(deep));
+   EXPECT_EQ(run("f(0)"), 100000.0);
+}
+
+TEST_F(vm_test, reports_runaway_recursion)
+{
+   EXPECT_FALSE(run("def f(x) 1 + f(x)\nf(1)"));
+   EXPECT_EQ(run("1 + 1"), 2.0);
+}
+
+TEST_F(vm_test, hash_consed_functions)
+{
+   // all items resolved before any runs, as the driver does with a file
+   auto arena = std::make_shared<AstArena>();
+   arena->setHashConsing(true);
+   std::vector<TopLevelItem> items{};
+   {
+      ArenaScope scope{arena};
+      BufferCursor cur{"def f(x y) x\ndef g(y x) x\nf(1, 2)\ng(1, 2)"};
+      Token tok{};
+      gettok(tok, cur);
+      items = parseModule(tok, cur);
+   }
+   ASSERT_EQ(items.size(), 4u);
+   for(auto& item : items)
+   {
+      ASSERT_TRUE(resolver.resolve(item));
+   }
+   EXPECT_FALSE(vm.run(items[0]));
+   EXPECT_FALSE(vm.run(items[1]));
+   EXPECT_EQ(vm.run(items[2]), 1.0);
+   EXPECT_EQ(vm.run(items[3]), 2.0);
+}
+
+#endif
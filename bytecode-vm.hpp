@@ -0,0 +1,115 @@
+#ifndef __BYTECODE_VM_H_
+#define __BYTECODE_VM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.hpp"
+
+// A backend without LLVM: resolved items are lowered to a compact
+// register bytecode and interpreted, so the first result costs a walk over
+// the AST rather than initializing and running a compiler.  Code runs
+// slower than the JIT's; meant for short scripts.
+//
+// Each function has a window of registers: its parameters first, then
+// temporaries, allocated as a stack by the lowering.  A call's arguments
+// are placed in consecutive registers that become the callee's parameters,
+// and its result lands in the first of them, so calls copy nothing.
+// Instructions are 8 bytes: an opcode and three 16-bit operands, register
+// numbers or indices into the function's constants and callees.  Dispatch
+// is threaded (computed goto) where the compiler supports it.  Calls keep
+// their own frame stack, so running out of it (recursion never ends in a
+// language without conditionals) is reported, not a crash.
+class BytecodeVM
+{
+   public:
+      enum class Op : std::uint8_t
+      {
+         loadk,  // a = constants[b]
+         move,   // a = b
+         add,    // a = b + c
+         sub,    // a = b - c
+         mul,    // a = b * c
+         lt,     // a = b < c (1 or 0, 1 if unordered as in the JIT)
+         call,   // a = callees[b](a, a+1, ...)
+         ret,    // return a
+      };
+
+      struct Instruction
+      {
+         Op op;
+         std::uint16_t a;
+         std::uint16_t b;
+         std::uint16_t c;
+      };
+
+      // Lower item and run it: definitions are lowered, externs bound to
+      // the host's symbol of that name; a top-level expression is lowered,
+      // evaluated and its value returned.  nullopt otherwise, or on failure
+      // (after reporting).  Items must have been resolved.
+      std::optional<double> run(TopLevelItem const& item);
+
+      // the function with the Resolver's id, one instruction per line;
+      // empty if not defined
+      std::string disassemble(std::uint32_t id) const;
+
+   private:
+      struct Function
+      {
+         std::string name;
+         std::uint16_t params{};
+         // params and temporaries
+         std::uint16_t registers{};
+         std::vector<Instruction> code{};
+         std::vector<double> constants{};
+         // Resolver ids
+         std::vector<std::uint32_t> callees{};
+         // an extern: the host function to call instead
+         void* native{nullptr};
+      };
+
+      struct Frame
+      {
+         Function const* fn;
+         Instruction const* pc;
+         std::size_t base;
+      };
+
+      // lowering, post-order with its own stack like the Resolver
+      struct Pending
+      {
+         ExprAST const* node;
+         // the value must end up in a temporary of its own (a call
+         // argument), not in a parameter's register
+         bool own;
+         std::uint32_t mark;
+         std::uint32_t child;
+      };
+
+      // the function for fn's body; false (after reporting) if it cannot
+      // be lowered
+      bool lower(FunctionAST const& fn, Function& out);
+      // the callee index in out for the Resolver's id, or the function
+      // named name
+      std::optional<std::uint16_t> callee(Function& out, std::uint32_t id, std::string const& name);
+      bool bind(PrototypeAST const& proto);
+      std::optional<double> execute(Function const& entry);
+
+      // by the Resolver's id
+      std::vector<Function> functions{};
+      // for user-defined operators, which are called by name
+      std::unordered_map<std::string, std::uint32_t> ids{};
+
+      // reused between calls
+      std::vector<Pending> pending{};
+      std::vector<std::uint16_t> results{};
+      std::unordered_map<std::uint64_t, std::uint32_t> constantIndex{};
+      std::vector<double> stack{};
+      std::vector<Frame> frames{};
+};
+
+#endif // __BYTECODE_VM_H_
@@ -0,0 +1,238 @@
+#include "char-class.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KALEIDOSCOPE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+template< std::uint8_t Cls, bool Member >
+char const* skipScalar(char const* p, char const* end)
+{
+   while(p != end && hasClass(*p, Cls) == Member)
+   {
+      ++p;
+   }
+   return p;
+}
+
+char const* skipSpaceScalar(char const* p, char const* end) { return skipScalar<cc_space, true>(p, end); }
+char const* skipAlnumScalar(char const* p, char const* end) { return skipScalar<cc_alpha | cc_digit, true>(p, end); }
+char const* skipToEolScalar(char const* p, char const* end) { return skipScalar<cc_eol, false>(p, end); }
+
+#ifdef KALEIDOSCOPE_X86_KERNELS
+
+// Byte masks are built with unsigned range checks: x in [lo, lo+n] iff
+// min(x - lo, n) == x - lo.
+
+inline __m128i inRange16(__m128i x, char lo, char n)
+{
+   __m128i t = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+   return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(n)), t);
+}
+
+inline __m128i spaceMask16(__m128i x)
+{
+   return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), inRange16(x, '\t', '\r' - '\t'));
+}
+
+inline __m128i alnumMask16(__m128i x)
+{
+   __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+   return _mm_or_si128(inRange16(x, '0', 9), inRange16(lower, 'a', 25));
+}
+
+inline __m128i eolMask16(__m128i x)
+{
+   return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\r')));
+}
+
+// Member selects whether the run is made of matching bytes (skip while
+// match) or of non-matching bytes (skip until match).
+template< __m128i (*Mask)(__m128i), bool Member, char const* (*Tail)(char const*, char const*) >
+char const* skipSse2(char const* p, char const* end)
+{
+   while(end - p >= 16)
+   {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+      unsigned bits = _mm_movemask_epi8(Mask(x));
+      if(Member)
+      {
+         bits = ~bits & 0xFFFF;
+      }
+      if(bits)
+      {
+         return p + __builtin_ctz(bits);
+      }
+      p += 16;
+   }
+   return Tail(p, end);
+}
+
+__attribute__((target("avx2"))) inline __m256i inRange32(__m256i x, char lo, char n)
+{
+   __m256i t = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+   return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(n)), t);
+}
+
+__attribute__((target("avx2"))) inline __m256i spaceMask32(__m256i x)
+{
+   return _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), inRange32(x, '\t', '\r' - '\t'));
+}
+
+__attribute__((target("avx2"))) inline __m256i alnumMask32(__m256i x)
+{
+   __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+   return _mm256_or_si256(inRange32(x, '0', 9), inRange32(lower, 'a', 25));
+}
+
+__attribute__((target("avx2"))) inline __m256i eolMask32(__m256i x)
+{
+   return _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r')));
+}
+
+template< __m256i (*Mask)(__m256i), bool Member, char const* (*Tail)(char const*, char const*) >
+__attribute__((target("avx2"))) char const* skipAvx2(char const* p, char const* end)
+{
+   while(end - p >= 32)
+   {
+      __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+      unsigned bits = _mm256_movemask_epi8(Mask(x));
+      if(Member)
+      {
+         bits = ~bits;
+      }
+      if(bits)
+      {
+         return p + __builtin_ctz(bits);
+      }
+      p += 32;
+   }
+   return Tail(p, end);
+}
+
+#endif // KALEIDOSCOPE_X86_KERNELS
+
+struct ScanKernels
+{
+   char const* (*space)(char const*, char const*);
+   char const* (*alnum)(char const*, char const*);
+   char const* (*eol)(char const*, char const*);
+   char const* name;
+};
+
+ScanKernels selectKernels()
+{
+#ifdef KALEIDOSCOPE_X86_KERNELS
+   constexpr auto space16 = skipSse2<spaceMask16, true, skipSpaceScalar>;
+   constexpr auto alnum16 = skipSse2<alnumMask16, true, skipAlnumScalar>;
+   constexpr auto eol16 = skipSse2<eolMask16, false, skipToEolScalar>;
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2"))
+   {
+      return {skipAvx2<spaceMask32, true, space16>,
+              skipAvx2<alnumMask32, true, alnum16>,
+              skipAvx2<eolMask32, false, eol16>,
+              "avx2"};
+   }
+   return {space16, alnum16, eol16, "sse2"};
+#else
+   return {skipSpaceScalar, skipAlnumScalar, skipToEolScalar, "scalar"};
+#endif
+}
+
+ScanKernels const kernels{selectKernels()};
+
+} // namespace
+
+// Most runs are a byte or two long (a single space between tokens, short
+// identifiers), so the first byte is always checked inline before paying
+// for the indirect call.
+
+char const* skipSpace(char const* p, char const* end)
+{
+   if(p == end || !isSpaceChar(*p))
+   {
+      return p;
+   }
+   return kernels.space(p + 1, end);
+}
+
+char const* skipAlnum(char const* p, char const* end)
+{
+   if(p == end || !isAlnumChar(*p))
+   {
+      return p;
+   }
+   return kernels.alnum(p + 1, end);
+}
+
+char const* skipToEol(char const* p, char const* end)
+{
+   if(p == end || hasClass(*p, cc_eol))
+   {
+      return p;
+   }
+   return kernels.eol(p + 1, end);
+}
+
+char const* scanKernelName()
+{
+   return kernels.name;
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <cctype>
+#include <string>
+
+TEST(char_class_test, matches_c_locale)
+{
+   for(int c{0}; c < 256; c++)
+   {
+      char ch = static_cast<char>(c);
+      EXPECT_EQ(isSpaceChar(ch), bool(std::isspace(c))) << c;
+      EXPECT_EQ(isAlphaChar(ch), bool(std::isalpha(c))) << c;
+      EXPECT_EQ(isDigitChar(ch), bool(std::isdigit(c))) << c;
+      EXPECT_EQ(isAlnumChar(ch), bool(std::isalnum(c))) << c;
+   }
+}
+
+// every run length and every terminating byte, across the 16/32 byte
+// vector boundaries
+TEST(char_class_test, kernels_match_scalar)
+{
+   for(std::size_t len{0}; len < 80; len++)
+   {
+      for(int stop{0}; stop < 256; stop++)
+      {
+         std::string spaces(len, len % 2 ? ' ' : '\t');
+         std::string ident(len, len % 3 ? 'x' : '7');
+         std::string comment(len, 'c');
+         spaces += char(stop);
+         ident += char(stop);
+         comment += char(stop);
+
+         char const* b = spaces.data();
+         EXPECT_EQ(skipSpace(b, b + spaces.size()), skipSpaceScalar(b, b + spaces.size()));
+         b = ident.data();
+         EXPECT_EQ(skipAlnum(b, b + ident.size()), skipAlnumScalar(b, b + ident.size()));
+         b = comment.data();
+         EXPECT_EQ(skipToEol(b, b + comment.size()), skipToEolScalar(b, b + comment.size()));
+      }
+   }
+}
+
+TEST(char_class_test, kernels_stop_at_end)
+{
+   std::string spaces(100, ' ');
+   char const* b = spaces.data();
+   EXPECT_EQ(skipSpace(b, b + spaces.size()), b + spaces.size());
+   EXPECT_EQ(skipToEol(b, b + spaces.size()), b + spaces.size());
+   EXPECT_EQ(skipAlnum(b, b), b);
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __CHAR_CLASS_H_
+#define __CHAR_CLASS_H_
+
+#include <array>
+#include <cstdint>
+
+// Locale-free character classification for the lexer.  Matches the "C"
+// locale behaviour of isspace/isalpha/isdigit/isalnum for every byte.
+enum CharClass : std::uint8_t
+{
+   cc_space = 1 << 0,
+   cc_alpha = 1 << 1,
+   cc_digit = 1 << 2,
+   cc_eol = 1 << 3,
+};
+
+constexpr std::array<std::uint8_t, 256> makeCharClassTable()
+{
+   std::array<std::uint8_t, 256> table{};
+   for(int c{'\t'}; c <= '\r'; c++)
+   {
+      table[c] |= cc_space;
+   }
+   table[' '] |= cc_space;
+   table['\n'] |= cc_eol;
+   table['\r'] |= cc_eol;
+   for(int c{'a'}; c <= 'z'; c++)
+   {
+      table[c] |= cc_alpha;
+      table[c - 'a' + 'A'] |= cc_alpha;
+   }
+   for(int c{'0'}; c <= '9'; c++)
+   {
+      table[c] |= cc_digit;
+   }
+   return table;
+}
+
+inline constexpr std::array<std::uint8_t, 256> charClassTable{makeCharClassTable()};
+
+inline constexpr bool hasClass(char c, std::uint8_t cls)
+{
+   return charClassTable[static_cast<unsigned char>(c)] & cls;
+}
+
+inline constexpr bool isSpaceChar(char c) { return hasClass(c, cc_space); }
+inline constexpr bool isAlphaChar(char c) { return hasClass(c, cc_alpha); }
+inline constexpr bool isDigitChar(char c) { return hasClass(c, cc_digit); }
+inline constexpr bool isAlnumChar(char c) { return hasClass(c, cc_alpha | cc_digit); }
+
+// Run skippers over [p, end).  Each returns the first byte not in the run
+// (or end).  Backed by SSE2/AVX2 kernels chosen once at runtime, with a
+// scalar fallback on other targets.
+char const* skipSpace(char const* p, char const* end);
+char const* skipAlnum(char const* p, char const* end);
+char const* skipToEol(char const* p, char const* end);
+
+// name of the kernel set in use ("avx2", "sse2" or "scalar")
+char const* scanKernelName();
+
+#endif // __CHAR_CLASS_H_
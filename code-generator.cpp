@@ -0,0 +1,48 @@
+#include "code-generator.hpp"
+
+#include <utility>
+
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Type.h"
+
+CodeGenContext::CodeGenContext(std::string moduleName)
+   : tsc{std::make_unique<llvm::LLVMContext>()}
+   , name{std::move(moduleName)}
+   , mod{std::make_unique<llvm::Module>(name, *tsc.getContext())}
+   , irBuilder{*tsc.getContext()}
+{}
+
+llvm::orc::ThreadSafeModule CodeGenContext::takeModule()
+{
+   llvm::orc::ThreadSafeModule done{std::move(mod), tsc};
+   mod = std::make_unique<llvm::Module>(name, context());
+   return done;
+}
+
+llvm::Function* CodeGenContext::function(Symbol fnName)
+{
+   if(llvm::Function* f = mod->getFunction(fnName.str()))
+   {
+      return f;
+   }
+   auto it = arities.find(fnName);
+   if(it == arities.end())
+   {
+      return nullptr;
+   }
+   llvm::Type* doubleTy = llvm::Type::getDoubleTy(context());
+   std::vector<llvm::Type*> doubles(it->second, doubleTy);
+   llvm::FunctionType* ft = llvm::FunctionType::get(doubleTy, doubles, false);
+   return llvm::Function::Create(ft, llvm::Function::ExternalLinkage, fnName.str(), *mod);
+}
+
+void CodeGenContext::beginFunction(llvm::Function& f)
+{
+   argValues.clear();
+   sharedValues.clear();
+   for(auto& arg : f.args())
+   {
+      argValues.push_back(&arg);
+   }
+}
@@ -0,0 +1,69 @@
+#ifndef __CODE_GENERATOR_H_
+#define __CODE_GENERATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include "symbol-table.hpp"
+
+class ExprAST;
+
+// One code generation session: the LLVM context, the module being filled,
+// the IR builder and the scope of the function being emitted, passed to
+// every codegen().  Sessions share nothing, so independent sessions can
+// generate code on different threads at once; a session itself is used by
+// one thread at a time.
+//
+// The context is an llvm::orc::ThreadSafeContext, so a finished module can
+// be handed to an ORC JIT together with the context that owns it.  While
+// a module taken from the session may be compiled on another thread, hold
+// lock() around codegen.
+class CodeGenContext
+{
+   public:
+      explicit CodeGenContext(std::string moduleName = "kaleidoscope");
+
+      CodeGenContext(CodeGenContext const&) = delete;
+      CodeGenContext& operator=(CodeGenContext const&) = delete;
+
+      llvm::LLVMContext& context() { return *tsc.getContext(); }
+      llvm::Module& module() { return *mod; }
+      llvm::IRBuilder<>& builder() { return irBuilder; }
+      llvm::orc::ThreadSafeContext::Lock lock() { return tsc.getLock(); }
+
+      // The module filled so far, with its context; codegen continues into
+      // a fresh module, where earlier functions are declared again on use
+      llvm::orc::ThreadSafeModule takeModule();
+
+      // name in the current module, declared there from its prototype if it
+      // was emitted into an earlier one; nullptr if no prototype was seen
+      llvm::Function* function(Symbol name);
+      // remember a prototype, for function()
+      void declared(Symbol name, std::size_t arity) { arities[name] = arity; }
+
+      // Scope of the function being emitted: its parameters, indexed by
+      // VariableExprAST::slot, and the values of hash-consed nodes already
+      // emitted in it
+      void beginFunction(llvm::Function& f);
+      std::vector<llvm::Value*> argValues{};
+      std::unordered_map<ExprAST const*, llvm::Value*> sharedValues{};
+
+   private:
+      // declared first, so the module and builder go before their context
+      llvm::orc::ThreadSafeContext tsc;
+      std::string name;
+      std::unique_ptr<llvm::Module> mod;
+      llvm::IRBuilder<> irBuilder;
+      std::unordered_map<Symbol, std::size_t> arities{};
+};
+
+#endif // __CODE_GENERATOR_H_
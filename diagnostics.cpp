@@ -0,0 +1,134 @@
+#include "diagnostics.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <utility>
+
+namespace
+{
+
+thread_local Diagnostics* activeDiagnostics{nullptr};
+
+std::mutex stderrLock{};
+
+} // namespace
+
+void reportError(std::size_t offset, std::string_view message)
+{
+   if(activeDiagnostics)
+   {
+      activeDiagnostics->error(offset, message);
+   }
+   else
+   {
+      printErrors({{offset, std::string(message)}});
+   }
+}
+
+bool collectingDiagnostics()
+{
+   return activeDiagnostics != nullptr;
+}
+
+void printErrors(std::vector<Diagnostic> const& errors)
+{
+   std::string text{};
+   for(Diagnostic const& d : errors)
+   {
+      text += "error at offset " + std::to_string(d.offset) + ": " + d.message + "\n";
+   }
+   std::lock_guard<std::mutex> guard{stderrLock};
+   std::cerr << text << std::flush;
+}
+
+SourceLocation LineMap::locate(std::size_t offset)
+{
+   if(lineStarts.empty())
+   {
+      lineStarts.push_back(0);
+      char const* const first = source.data();
+      char const* const last = first + source.size();
+      for(char const* p = first; (p = static_cast<char const*>(std::memchr(p, '\n', last - p))); )
+      {
+         lineStarts.push_back(++p - first);
+      }
+   }
+   offset = std::min(offset, source.size());
+   auto line = std::upper_bound(lineStarts.begin(), lineStarts.end(), offset) - 1;
+   return {static_cast<std::size_t>(line - lineStarts.begin()) + 1, offset - *line + 1};
+}
+
+void printDiagnostic(std::ostream& os, Diagnostic const& d, std::string_view name, LineMap& lines)
+{
+   SourceLocation loc = lines.locate(d.offset);
+   os << name << ":" << loc.line << ":" << loc.column << ": error: " << d.message << "\n";
+}
+
+DiagnosticScope::DiagnosticScope(Diagnostics& diags)
+   : previous{std::exchange(activeDiagnostics, &diags)}
+{}
+
+DiagnosticScope::~DiagnosticScope()
+{
+   activeDiagnostics = previous;
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <sstream>
+
+TEST(diagnostics_test, scopes_nest)
+{
+   Diagnostics outer{};
+   Diagnostics inner{};
+   {
+      DiagnosticScope a{outer};
+      reportError(3, "first");
+      {
+         DiagnosticScope b{inner};
+         reportError(7, "second");
+      }
+      reportError(9, "third");
+   }
+   ASSERT_EQ(outer.errorCount(), 2u);
+   EXPECT_EQ(outer.all()[0].offset, 3u);
+   EXPECT_EQ(outer.all()[1].message, "third");
+   ASSERT_EQ(inner.errorCount(), 1u);
+   EXPECT_EQ(inner.all()[0].message, "second");
+}
+
+TEST(diagnostics_test, stderr_outside_scope)
+{
+   std::stringstream err{};
+   auto old = std::cerr.rdbuf(err.rdbuf());
+   reportError(0, "Expected ')'");
+   reportError(12, "Unexpected token encountered");
+   std::cerr.rdbuf(old);
+   EXPECT_EQ(err.str(), "error at offset 0: Expected ')'\nerror at offset 12: Unexpected token encountered\n");
+}
+
+TEST(diagnostics_test, line_map)
+{
+   std::string_view src{"def f(x)\n  x +\n\n)"};
+   LineMap lines{src};
+   SourceLocation first = lines.locate(0);
+   EXPECT_EQ(first.line, 1u);
+   EXPECT_EQ(first.column, 1u);
+   SourceLocation paren = lines.locate(src.rfind(')'));
+   EXPECT_EQ(paren.line, 4u);
+   EXPECT_EQ(paren.column, 1u);
+   SourceLocation plus = lines.locate(src.find('+'));
+   EXPECT_EQ(plus.line, 2u);
+   EXPECT_EQ(plus.column, 5u);
+   // the end of the input, where eof errors are reported
+   EXPECT_EQ(lines.locate(src.size()).column, 2u);
+
+   std::stringstream out{};
+   printDiagnostic(out, {src.find('+'), "Unexpected token encountered"}, "f.ks", lines);
+   EXPECT_EQ(out.str(), "f.ks:2:5: error: Unexpected token encountered\n");
+}
+
+#endif
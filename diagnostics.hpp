@@ -0,0 +1,87 @@
+#ifndef __DIAGNOSTICS_H_
+#define __DIAGNOSTICS_H_
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A parse error at a byte offset into the source
+struct Diagnostic
+{
+   std::size_t offset;
+   std::string message;
+};
+
+// Errors collected while parsing, in the order they were reported
+class Diagnostics
+{
+   public:
+      void error(std::size_t offset, std::string_view message) { errors.push_back({offset, std::string(message)}); }
+
+      std::vector<Diagnostic> const& all() const { return errors; }
+      std::size_t errorCount() const { return errors.size(); }
+      bool empty() const { return errors.empty(); }
+      void clear() { errors.clear(); }
+
+   private:
+      std::vector<Diagnostic> errors{};
+};
+
+// Report a parse error to the diagnostics active on this thread, or
+// outside any DiagnosticScope print it as printErrors does.  Cold, so the
+// error paths calling it are laid out away from the parser's hot code.
+[[gnu::cold]] void reportError(std::size_t offset, std::string_view message);
+
+// whether reportError on this thread goes to a DiagnosticScope
+bool collectingDiagnostics();
+
+// Print errors to std::cerr as "error at offset N: message" lines, in one
+// write under a process-wide lock, so threads parsing at once do not
+// interleave their output
+void printErrors(std::vector<Diagnostic> const& errors);
+
+// 1-based line and column (in bytes) of an offset
+struct SourceLocation
+{
+   std::size_t line;
+   std::size_t column;
+};
+
+// Maps offsets into one source to lines and columns.  Diagnostics only
+// carry offsets, which the lexer tracks anyway; the line starts are found
+// on the first lookup, so a clean parse never pays for them.
+class LineMap
+{
+   public:
+      explicit LineMap(std::string_view src)
+         : source{src}
+      {}
+
+      SourceLocation locate(std::size_t offset);
+
+   private:
+      std::string_view source;
+      std::vector<std::size_t> lineStarts{};
+};
+
+// "name:line:column: error: message"
+void printDiagnostic(std::ostream& os, Diagnostic const& d, std::string_view name, LineMap& lines);
+
+// Route reportError on this thread to diags until the scope ends.  Scopes
+// nest; the previous target is restored on exit.
+class DiagnosticScope
+{
+   public:
+      explicit DiagnosticScope(Diagnostics& diags);
+      ~DiagnosticScope();
+
+      DiagnosticScope(DiagnosticScope const&) = delete;
+      DiagnosticScope& operator=(DiagnosticScope const&) = delete;
+
+   private:
+      Diagnostics* previous;
+};
+
+#endif // __DIAGNOSTICS_H_
@@ -1,74 +1,332 @@
-#include <stdio.h>
-#include "lexer.hpp"
+#include <charconv>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ast-image.hpp"
+#include "bytecode-vm.hpp"
+#include "code-generator.hpp"
+#include "driver.hpp"
+#include "jit.hpp"
 #include "parser.hpp"
+#include "resolver.hpp"
+#include "simplifier.hpp"
+#include "source-buffer.hpp"
+#include "stream-reader.hpp"
+
+namespace
+{
 
-void handleDefinition(int& curTok, std::string& startDef)
+struct Report
 {
-   if(parseDefinition(curTok))
+   void operator()(std::unique_ptr<FunctionAST> const&) const { std::cerr << "parsed definition\n"; }
+   void operator()(std::unique_ptr<PrototypeAST> const&) const { std::cerr << "parsed an extern\n"; }
+   void operator()(std::unique_ptr<TopLevelExprAST> const&) const { std::cerr << "parsed a top level expr\n"; }
+};
+
+// What items are resolved against and run in, by the JIT or the VM;
+// without either (no JIT could be built for the host) items are only
+// reported.  Bodies are simplified before codegen unless optimization is
+// off.
+struct Session
+{
+   explicit Session(DriverOptions const& opts)
+      : simplifier{opts.simplifier}
+      , simplifyBodies{opts.optimizer.level > 0}
    {
-      fprintf(stderr, "parsed definition\n");
+      if(opts.backend == Backend::vm)
+      {
+         vm = std::make_unique<BytecodeVM>();
+      }
+      else
+      {
+         ObjectCacheOptions caching{};
+         if(opts.cacheObjects)
+         {
+            caching = opts.objectCache;
+            if(caching.directory.empty())
+            {
+               caching.directory = defaultObjectCacheDirectory();
+            }
+         }
+         jit = KaleidoscopeJIT::create(opts.optimizer, opts.tiering, caching);
+         if(jit)
+         {
+            cg.emplace();
+         }
+      }
    }
-   else
+   ~Session()
+   {
+      if(!jit)
+      {
+         return;
+      }
+      // recompilations still running are reported, and timed
+      jit->waitForTierUps();
+      reportTierUps();
+      if(jit->optimizer().options().timePasses)
+      {
+         jit->optimizer().printPassTimes(std::cerr);
+      }
+   }
+
+   // print the functions recompiled since the last call
+   void reportTierUps()
+   {
+      for(TierUp const& up : jit->takeTierUps())
+      {
+         std::cerr << "tier up: " << up.name << " after " << up.calls << " calls, compiled in "
+                   << up.compileTime.count() << " us\n";
+      }
+   }
+
+   Resolver resolver{};
+   Simplifier simplifier;
+   bool simplifyBodies;
+   // only with the JIT: the VM compiles from the AST itself
+   std::optional<CodeGenContext> cg{};
+   std::unique_ptr<KaleidoscopeJIT> jit{};
+   std::unique_ptr<BytecodeVM> vm{};
+};
+
+// A source file, for locating errors by line and column
+struct SourceFile
+{
+   char const* path;
+   LineMap& lines;
+};
+
+// print the diagnostics reported since the last call, by line and column
+// in a file, by offset on stdin
+void reportErrors(Diagnostics const& diags, std::size_t& shown, SourceFile* file = nullptr)
+{
+   for(; shown < diags.errorCount(); shown++)
+   {
+      Diagnostic const& d = diags.all()[shown];
+      if(file)
+      {
+         printDiagnostic(std::cerr, d, file->path, file->lines);
+      }
+      else
+      {
+         std::cerr << "error at offset " << d.offset << ": " << d.message << "\n";
+      }
+   }
+}
+
+// resolve an item and report on it; false if it cannot be run
+bool handle(TopLevelItem& item, Session& session, Diagnostics& diags, std::size_t& shown,
+            SourceFile* file = nullptr)
+{
+   bool resolved{};
+   {
+      DiagnosticScope scope{diags};
+      resolved = session.resolver.resolve(item);
+   }
+   reportErrors(diags, shown, file);
+   if(resolved)
+   {
+      std::visit(Report{}, item);
+   }
+   return resolved;
+}
+
+// simplify and run a resolved item, printing the value of an expression
+void execute(TopLevelItem& item, Session& session)
+{
+   if(!session.jit && !session.vm)
+   {
+      return;
+   }
+   if(session.simplifyBodies)
+   {
+      session.simplifier.simplify(item);
+   }
+   std::optional<double> value = session.vm ? session.vm->run(item) : session.jit->run(item, *session.cg);
+   if(value)
+   {
+      std::cerr << "evaluated to " << *value << "\n";
+   }
+   if(session.jit)
+   {
+      session.reportTierUps();
+   }
+}
+
+// a whole decimal number
+bool parseNumber(std::string_view n, std::uint64_t& value)
+{
+   auto [end, err] = std::from_chars(n.data(), n.data() + n.size(), value);
+   return !n.empty() && err == std::errc{} && end == n.data() + n.size();
+}
+
+} // namespace
+
+std::string defaultObjectCacheDirectory()
+{
+   if(char const* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+   {
+      return std::string(xdg) + "/kaleidoscope";
+   }
+   if(char const* home = std::getenv("HOME"); home && *home)
    {
-      getNextToken();
+      return std::string(home) + "/.cache/kaleidoscope";
    }
+   return {};
 }
 
-void handleExtern()
+bool parseOption(DriverOptions& opts, std::string_view arg)
 {
-   if(parseExtern())
+   OptimizerOptions& opt = opts.optimizer;
+   if(arg.size() == 3 && arg.substr(0, 2) == "-O" && arg[2] >= '0' && arg[2] <= '3')
+   {
+      opt.level = arg[2] - '0';
+   }
+   else if(arg == "-ffast-math")
+   {
+      opt.reassociate = true;
+      opt.contract = true;
+      opts.simplifier.fastMath = true;
+   }
+   else if(arg == "-fassociative-math")
+   {
+      opt.reassociate = true;
+   }
+   else if(arg == "-ffp-contract=fast")
+   {
+      opt.contract = true;
+   }
+   else if(arg == "-time-passes")
+   {
+      opt.timePasses = true;
+   }
+   else if(arg == "-backend=jit")
+   {
+      opts.backend = Backend::jit;
+   }
+   else if(arg == "-backend=vm")
+   {
+      opts.backend = Backend::vm;
+   }
+   else if(constexpr std::string_view tier{"-tier-threshold="}; arg.substr(0, tier.size()) == tier)
+   {
+      return parseNumber(arg.substr(tier.size()), opts.tiering.threshold);
+   }
+   else if(constexpr std::string_view dir{"-object-cache="}; arg.substr(0, dir.size()) == dir && arg.size() > dir.size())
+   {
+      opts.objectCache.directory = std::string(arg.substr(dir.size()));
+      opts.cacheObjects = true;
+   }
+   else if(constexpr std::string_view size{"-object-cache-size="}; arg.substr(0, size.size()) == size)
+   {
+      return parseNumber(arg.substr(size.size()), opts.objectCache.maxBytes);
+   }
+   else if(arg == "-no-object-cache")
    {
-      fprintf(stderr, "parsed an extern\n");
+      opts.cacheObjects = false;
+   }
+   else if(arg == "-no-ast-image")
+   {
+      opts.astImages = false;
    }
    else
    {
-      getNextToken();
+      return false;
    }
+   return true;
 }
 
-void handleTopLevelExpression()
+void mainLoop(DriverOptions const& opts)
 {
-   if(parseTopLevelExpr())
+   // reads stdin as it arrives, whether a terminal, a pipe or a file
+   ChunkedReader in{STDIN_FILENO};
+   Parser<ChunkedReader> parser{in};
+   Session session{opts};
+   std::size_t shown{};
+   std::cerr << "ready> ";
+   for(TopLevelItem& item : parser)
    {
-      fprintf(stderr, "parsed a top level expr\n");
+      if(handle(item, session, parser.diagnostics(), shown))
+      {
+         execute(item, session);
+      }
+      std::cerr << "ready> ";
    }
+   reportErrors(parser.diagnostics(), shown);
+   std::cerr << "\n";
 }
 
-int main()
+int runFile(char const* path, DriverOptions const& opts)
 {
-   fprintf(stderr, "ready>");
-   std::string tok;
-   int curTok = getNextToken(tok);
-   while(1)
+   std::optional<SourceStamp> stamp = SourceStamp::of(path);
+   if(!stamp)
    {
-      fprintf(stderr, "ready>");
-      switch(curTok)
+      std::cerr << "Unable to open source file: " << path << "\n";
+      return 1;
+   }
+   std::string const imagePath{std::string(path) + ".kast"};
+   Session session{opts};
+   std::size_t shown{};
+
+   if(auto image = opts.astImages ? AstImage::open(imagePath.c_str()) : nullptr; image && image->freshFor(*stamp))
+   {
+      Diagnostics diags{};
+      for(std::size_t i{}; i < image->size(); i++)
       {
-         case(tok_eof):
+         std::optional<TopLevelItem> item{};
          {
-            return 1;
+            DiagnosticScope scope{diags};
+            item = image->item(i);
          }
-         case(';'):
+         if(!item)
          {
-            curTok = getNextToken(tok);
-            break;
-         }
-         case(tok_def):
-         {
-            handleDefinition();
-            break;
-         }
-         case(tok_extern):
-         {
-            handleExtern();
-            break;
+            reportErrors(diags, shown);
+            return 1;
          }
-         default:
+         if(handle(*item, session, diags, shown))
          {
-            handleTopLevelExpression();
-            break;
+            execute(*item, session);
          }
       }
+      return diags.empty() ? 0 : 1;
+   }
+
+   auto source = SourceBuffer::open(path);
+   if(!source)
+   {
+      return 1;
+   }
+   LineMap lines{source->view()};
+   SourceFile file{path, lines};
+   BufferCursor cur{source->view()};
+   Parser<BufferCursor> parser{cur};
+   std::vector<TopLevelItem> items{};
+   std::vector<bool> resolved{};
+   for(TopLevelItem& item : parser)
+   {
+      resolved.push_back(handle(item, session, parser.diagnostics(), shown, &file));
+      items.push_back(std::move(item));
+   }
+   reportErrors(parser.diagnostics(), shown, &file);
+   // an image would hide the errors on the next run
+   bool const clean{parser.diagnostics().empty()};
+   if(clean && opts.astImages)
+   {
+      // as parsed: simplification depends on the options
+      writeAstImage(imagePath.c_str(), items, *stamp);
+   }
+   for(std::size_t i{}; i < items.size(); i++)
+   {
+      if(resolved[i])
+      {
+         execute(items[i], session);
+      }
    }
-   return 1;
+   return clean ? 0 : 1;
 }
@@ -1,2 +1,63 @@
+#ifndef __DRIVER_H_
+#define __DRIVER_H_
 
-void mainLoop();
+#include <string>
+#include <string_view>
+
+#include "jit.hpp"
+#include "object-cache.hpp"
+#include "optimizer.hpp"
+#include "simplifier.hpp"
+
+enum class Backend
+{
+   jit,
+   // the bytecode VM: no LLVM, for short scripts
+   vm,
+};
+
+struct DriverOptions
+{
+   Backend backend{Backend::jit};
+   OptimizerOptions optimizer{};
+   SimplifierOptions simplifier{};
+   TieringOptions tiering{};
+   // the directory defaults to defaultObjectCacheDirectory()
+   ObjectCacheOptions objectCache{};
+   bool cacheObjects{true};
+   // runFile's path.kast images
+   bool astImages{true};
+};
+
+// $XDG_CACHE_HOME/kaleidoscope, or ~/.cache/kaleidoscope; empty if there
+// is no home
+std::string defaultObjectCacheDirectory();
+
+// Apply one command line option: -O0 .. -O3 (-O0 also skips AST
+// simplification), -ffast-math (-fassociative-math and -ffp-contract=fast,
+// and the fast-math AST identities), -time-passes to print the time spent
+// in each optimization pass on exit, and -tier-threshold=N to compile
+// definitions fast first and with the -O level once called N times,
+// printing each recompilation; -backend=jit or -backend=vm picks what runs
+// the program (the JIT options only apply to the JIT); -object-cache=DIR
+// keeps machine code in DIR rather than the default directory,
+// -object-cache-size=N keeps that under N bytes, and -no-object-cache
+// compiles everything every run; -no-ast-image parses source files every
+// run, without reading or writing their images.  false if arg is not an
+// option.
+bool parseOption(DriverOptions& opts, std::string_view arg);
+
+// Parse stdin item by item, reporting each one as it completes and running
+// it in the JIT: definitions are compiled when first called, top-level
+// expressions evaluated and their values printed
+void mainLoop(DriverOptions const& opts = {});
+
+// Report on and run the program in path as mainLoop does, running it once
+// it has been read in full.  When path.kast holds an image written from
+// this version of the file, the items are loaded from it without lexing or
+// parsing; otherwise the file is parsed and, if it had no errors, the
+// image is (re)written for next time, unless opts turns images off.
+// Returns the process exit status.
+int runFile(char const* path, DriverOptions const& opts = {});
+
+#endif // __DRIVER_H_
@@ -0,0 +1,508 @@
+#include "flat-ast.hpp"
+
+#include <iostream>
+
+#include "llvm/IR/Verifier.h"
+
+#include "code-generator.hpp"
+
+FlatAST FlatAST::fromSource(std::string_view src)
+{
+   FlatAST flat{};
+   BufferCursor cur{src};
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, cur);
+   parseItems(tok, cur, ops, [&flat](TopLevelItem item)
+   {
+      std::visit([&flat](auto const& node) { flat.add(*node); }, item);
+   });
+   return flat;
+}
+
+FlatAST::NodeId FlatAST::push(FlatKind k, std::uint32_t opA, std::uint32_t opB, char o)
+{
+   kinds.push_back(k);
+   ops.push_back(o);
+   a.push_back(opA);
+   b.push_back(opB);
+   return kinds.size() - 1;
+}
+
+FlatAST::NodeId FlatAST::add(ExprAST const& expr)
+{
+   switch(expr.getKind())
+   {
+      case ExprAST::Kind::number:
+      {
+         numbers.push_back(llvm::cast<NumberExprAST>(expr).value());
+         return push(FlatKind::number, numbers.size() - 1, 0);
+      }
+      case ExprAST::Kind::variable:
+      {
+         return push(FlatKind::variable, llvm::cast<VariableExprAST>(expr).name.id(), 0);
+      }
+      case ExprAST::Kind::unary:
+      {
+         auto const& un = llvm::cast<UnaryExprAST>(expr);
+         NodeId operand = add(*un.operand);
+         return push(FlatKind::unary, operand, 0, un.opcode);
+      }
+      case ExprAST::Kind::binary:
+      {
+         auto const& bin = llvm::cast<BinaryExprAST>(expr);
+         NodeId l = add(*bin.lhs);
+         NodeId r = add(*bin.rhs);
+         return push(FlatKind::binary, l, r, bin.op);
+      }
+      case ExprAST::Kind::call:
+      default:
+      {
+         auto const& call = llvm::cast<CallExprAST>(expr);
+         std::vector<NodeId> ids{};
+         ids.reserve(call.args.size());
+         for(auto const& arg : call.args)
+         {
+            ids.push_back(add(*arg));
+         }
+         std::uint32_t at = callArgs.size();
+         callArgs.push_back(ids.size());
+         callArgs.insert(callArgs.end(), ids.begin(), ids.end());
+         return push(FlatKind::call, call.callee.id(), at);
+      }
+   }
+}
+
+void FlatAST::add(PrototypeAST const& proto)
+{
+   std::uint32_t first = paramIds.size();
+   for(Symbol arg : proto.args)
+   {
+      paramIds.push_back(arg.id());
+   }
+   fns.push_back({proto.name, first, static_cast<std::uint32_t>(proto.args.size()), none});
+}
+
+void FlatAST::add(FunctionAST const& fn)
+{
+   NodeId body = add(*fn.body);
+   add(*fn.proto);
+   fns.back().body = body;
+}
+
+FlatAST::NodeId FlatAST::subtreeBegin(NodeId n) const
+{
+   // the leftmost leaf comes first in post order
+   while(true)
+   {
+      switch(kind(n))
+      {
+         case FlatKind::unary:
+         {
+            n = operand(n);
+            break;
+         }
+         case FlatKind::binary:
+         {
+            n = lhs(n);
+            break;
+         }
+         case FlatKind::call:
+         {
+            FlatIdList list = args(n);
+            if(list.size() == 0)
+            {
+               return n;
+            }
+            n = list[0];
+            break;
+         }
+         default:
+         {
+            return n;
+         }
+      }
+   }
+}
+
+bool FlatAST::equal(NodeId n, FlatAST const& other, NodeId m) const
+{
+   // post order with child ids taken relative to the range start is a
+   // canonical encoding of the subtree, so compare the ranges column-wise
+   NodeId first = subtreeBegin(n);
+   NodeId otherFirst = other.subtreeBegin(m);
+   if(n - first != m - otherFirst)
+   {
+      return false;
+   }
+   for(NodeId i{}; i <= n - first; i++)
+   {
+      NodeId x = first + i;
+      NodeId y = otherFirst + i;
+      if(kind(x) != other.kind(y))
+      {
+         return false;
+      }
+      switch(kind(x))
+      {
+         case FlatKind::number:
+         {
+            if(number(x) != other.number(y))
+            {
+               return false;
+            }
+            break;
+         }
+         case FlatKind::variable:
+         {
+            if(a[x] != other.a[y])
+            {
+               return false;
+            }
+            break;
+         }
+         case FlatKind::unary:
+         {
+            if(op(x) != other.op(y) || operand(x) - first != other.operand(y) - otherFirst)
+            {
+               return false;
+            }
+            break;
+         }
+         case FlatKind::binary:
+         {
+            if(op(x) != other.op(y) ||
+               lhs(x) - first != other.lhs(y) - otherFirst ||
+               rhs(x) - first != other.rhs(y) - otherFirst)
+            {
+               return false;
+            }
+            break;
+         }
+         case FlatKind::call:
+         {
+            FlatIdList lhsArgs = args(x);
+            FlatIdList rhsArgs = other.args(y);
+            if(a[x] != other.a[y] || lhsArgs.size() != rhsArgs.size())
+            {
+               return false;
+            }
+            for(std::size_t j{}; j < lhsArgs.size(); j++)
+            {
+               if(lhsArgs[j] - first != rhsArgs[j] - otherFirst)
+               {
+                  return false;
+               }
+            }
+            break;
+         }
+      }
+   }
+   return true;
+}
+
+llvm::Function* FlatAST::codegen(FlatFunction const& fn, CodeGenContext& cg) const
+{
+   llvm::LLVMContext& ctx = cg.context();
+   llvm::Module& m = cg.module();
+   llvm::IRBuilder<>& builder = cg.builder();
+   llvm::Type* doubleTy = llvm::Type::getDoubleTy(ctx);
+   FlatIdList paramList = params(fn);
+
+   llvm::Function* func = m.getFunction(fn.name.str());
+   if(!func)
+   {
+      std::vector<llvm::Type*> doubles(fn.paramCount, doubleTy);
+      llvm::FunctionType* ft = llvm::FunctionType::get(doubleTy, doubles, false);
+      func = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, fn.name.str(), m);
+      cg.declared(fn.name, fn.paramCount);
+      unsigned idx{0};
+      for(auto& arg : func->args())
+      {
+         arg.setName(Symbol::fromId(paramList[idx++]).str());
+      }
+   }
+   if(fn.body == none)
+   {
+      return func;
+   }
+   if(!func->empty())
+   {
+      std::cerr << "Function cannot be redefined";
+      return nullptr;
+   }
+
+   llvm::BasicBlock* bb = llvm::BasicBlock::Create(ctx, "entry", func);
+   builder.SetInsertPoint(bb);
+
+   // children precede parents, so one pass in node order sees every
+   // operand's value before its user
+   NodeId first = subtreeBegin(fn.body);
+   std::vector<llvm::Value*> values(fn.body - first + 1);
+   for(NodeId n = first; n <= fn.body; n++)
+   {
+      llvm::Value* value{nullptr};
+      switch(kind(n))
+      {
+         case FlatKind::number:
+         {
+            value = llvm::ConstantFP::get(ctx, llvm::APFloat(number(n)));
+            break;
+         }
+         case FlatKind::variable:
+         {
+            for(std::size_t i{}; i < paramList.size(); i++)
+            {
+               if(paramList[i] == a[n])
+               {
+                  value = func->getArg(i);
+                  break;
+               }
+            }
+            if(!value)
+            {
+               std::cerr << "Unknown variable name: " << symbol(n);
+            }
+            break;
+         }
+         case FlatKind::unary:
+         {
+            llvm::Function* opFunc{cg.function(std::string("unary") + op(n))};
+            if(!opFunc)
+            {
+               std::cerr << "Unknown unary operator";
+               break;
+            }
+            value = builder.CreateCall(opFunc, values[operand(n) - first], "unop");
+            break;
+         }
+         case FlatKind::binary:
+         {
+            llvm::Value* left = values[lhs(n) - first];
+            llvm::Value* right = values[rhs(n) - first];
+            switch(op(n))
+            {
+               case('+'):
+               {
+                  value = builder.CreateFAdd(left, right, "addtmp");
+                  break;
+               }
+               case('-'):
+               {
+                  value = builder.CreateFSub(left, right, "subtmp");
+                  break;
+               }
+               case('*'):
+               {
+                  value = builder.CreateFMul(left, right, "multmp");
+                  break;
+               }
+               case('<'):
+               {
+                  left = builder.CreateFCmpULT(left, right, "cmptmp");
+                  value = builder.CreateUIToFP(left, doubleTy, "booltmp");
+                  break;
+               }
+               default:
+               {
+                  llvm::Function* opFunc{cg.function(std::string("binary") + op(n))};
+                  if(!opFunc)
+                  {
+                     std::cerr << "Invalid binary operator";
+                     break;
+                  }
+                  llvm::Value* ops[] = {left, right};
+                  value = builder.CreateCall(opFunc, ops, "binop");
+                  break;
+               }
+            }
+            break;
+         }
+         case FlatKind::call:
+         {
+            llvm::Function* calleeFunc{cg.function(callee(n))};
+            FlatIdList argList = args(n);
+            if(!calleeFunc)
+            {
+               std::cerr << "Unknown function referenced";
+               break;
+            }
+            if(calleeFunc->arg_size() != argList.size())
+            {
+               std::cerr << "Incorrect number of arugments passed";
+               break;
+            }
+            std::vector<llvm::Value*> argsV{};
+            argsV.reserve(argList.size());
+            for(NodeId arg : argList)
+            {
+               argsV.push_back(values[arg - first]);
+            }
+            value = builder.CreateCall(calleeFunc, argsV, "calltmp");
+            break;
+         }
+      }
+      if(!value)
+      {
+         func->eraseFromParent();
+         return nullptr;
+      }
+      values[n - first] = value;
+   }
+
+   builder.CreateRet(values.back());
+   verifyFunction(*func);
+   return func;
+}
+
+std::size_t FlatAST::memoryBytes() const
+{
+   return kinds.capacity() * sizeof(FlatKind) +
+          ops.capacity() * sizeof(char) +
+          (a.capacity() + b.capacity() + callArgs.capacity() + paramIds.capacity()) * sizeof(std::uint32_t) +
+          numbers.capacity() * sizeof(double) +
+          fns.capacity() * sizeof(FlatFunction);
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <sstream>
+
+namespace
+{
+
+// prints an expression back out, fully parenthesized, using a value stack
+// fed by visitPostOrder
+struct Printer
+{
+   std::vector<std::string> stack{};
+
+   void number(FlatAST::NodeId, double value)
+   {
+      std::ostringstream os{};
+      os << value;
+      stack.push_back(os.str());
+   }
+   void variable(FlatAST::NodeId, Symbol name)
+   {
+      stack.push_back(std::string(name.str()));
+   }
+   void unary(FlatAST::NodeId, char op, FlatAST::NodeId)
+   {
+      stack.back() = op + stack.back();
+   }
+   void binary(FlatAST::NodeId, char op, FlatAST::NodeId, FlatAST::NodeId)
+   {
+      std::string rhs = std::move(stack.back());
+      stack.pop_back();
+      stack.back() = "(" + stack.back() + " " + op + " " + rhs + ")";
+   }
+   void call(FlatAST::NodeId, Symbol callee, FlatIdList args)
+   {
+      std::string text = std::string(callee.str()) + "(";
+      std::size_t first = stack.size() - args.size();
+      for(std::size_t i{first}; i < stack.size(); i++)
+      {
+         text += (i == first ? "" : ", ") + stack[i];
+      }
+      stack.resize(first);
+      stack.push_back(text + ")");
+   }
+};
+
+std::string print(FlatAST const& flat, FlatAST::NodeId root)
+{
+   Printer p{};
+   flat.visitPostOrder(root, p);
+   return p.stack.back();
+}
+
+} // namespace
+
+TEST(flat_ast_test, post_order_layout)
+{
+   auto flat = FlatAST::fromSource("extern sin(a); def foo(x y) x+foo(y, 4.0)*2 < 3;");
+   ASSERT_EQ(flat.functions().size(), 2u);
+   FlatFunction const& ext = flat.functions()[0];
+   FlatFunction const& foo = flat.functions()[1];
+   EXPECT_EQ(ext.name, "sin");
+   EXPECT_EQ(ext.body, FlatAST::none);
+   EXPECT_EQ(foo.name, "foo");
+   ASSERT_EQ(foo.paramCount, 2u);
+   EXPECT_EQ(Symbol::fromId(flat.params(foo)[1]), "y");
+
+   EXPECT_EQ(flat.subtreeBegin(foo.body), 0u);
+   EXPECT_EQ(foo.body, flat.size() - 1);
+   EXPECT_EQ(flat.kind(foo.body), FlatKind::binary);
+   EXPECT_EQ(flat.op(foo.body), '<');
+   for(FlatAST::NodeId n{}; n < flat.size(); n++)
+   {
+      if(flat.kind(n) == FlatKind::binary)
+      {
+         EXPECT_LT(flat.lhs(n), flat.rhs(n));
+         EXPECT_LT(flat.rhs(n), n);
+      }
+   }
+   EXPECT_EQ(print(flat, foo.body), "((x + (foo(y, 4) * 2)) < 3)");
+}
+
+TEST(flat_ast_test, matches_tree)
+{
+   std::string src{"def f(a b) g(a*2, h(b), 1.5e3) - (a - b) * c"};
+   BufferCursor cur{src};
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, cur);
+   auto tree = parseDefinition(tok, cur, ops);
+   ASSERT_TRUE(tree != nullptr);
+
+   FlatAST flat{};
+   flat.add(*tree);
+   EXPECT_EQ(print(flat, flat.functions()[0].body), "(g((a * 2), h(b), 1500) - ((a - b) * c))");
+}
+
+TEST(flat_ast_test, equal)
+{
+   auto lhs = FlatAST::fromSource("def a(x) x*x + f(x, 1); def b(x) x*x + f(x, 1); def c(x) x*x + f(1, x)");
+   auto rhs = FlatAST::fromSource("1+2; def d(x) x*x + f(x, 1)");
+   FlatAST::NodeId a = lhs.functions()[0].body;
+   FlatAST::NodeId b = lhs.functions()[1].body;
+   FlatAST::NodeId c = lhs.functions()[2].body;
+   FlatAST::NodeId d = rhs.functions()[1].body;
+   EXPECT_TRUE(lhs.equal(a, lhs, b));
+   EXPECT_TRUE(lhs.equal(a, rhs, d));
+   EXPECT_FALSE(lhs.equal(a, lhs, c));
+   EXPECT_FALSE(lhs.equal(a, rhs, rhs.functions()[0].body));
+   // a proper subtree against the whole
+   EXPECT_FALSE(lhs.equal(lhs.lhs(a), lhs, a));
+}
+
+TEST(flat_ast_test, codegen)
+{
+   CodeGenContext cg{"flat"};
+
+   auto flat = FlatAST::fromSource("extern g(v); def seven() 1+2*3; def f(x y) x*y < g(x); def bad(x) z");
+   auto const& fns = flat.functions();
+   ASSERT_EQ(fns.size(), 4u);
+   EXPECT_NE(flat.codegen(fns[0], cg), nullptr);
+
+   llvm::Function* seven = flat.codegen(fns[1], cg);
+   ASSERT_NE(seven, nullptr);
+   auto ret = llvm::cast<llvm::ReturnInst>(seven->getEntryBlock().getTerminator());
+   auto folded = llvm::dyn_cast<llvm::ConstantFP>(ret->getReturnValue());
+   ASSERT_NE(folded, nullptr);
+   EXPECT_EQ(folded->getValueAPF().convertToDouble(), 7.0);
+
+   llvm::Function* f = flat.codegen(fns[2], cg);
+   ASSERT_NE(f, nullptr);
+   EXPECT_EQ(f->arg_size(), 2u);
+   EXPECT_FALSE(llvm::verifyFunction(*f, &llvm::errs()));
+
+   EXPECT_EQ(flat.codegen(fns[3], cg), nullptr);
+   EXPECT_EQ(cg.module().getFunction("bad"), nullptr);
+   // redefinition
+   EXPECT_EQ(flat.codegen(fns[2], cg), nullptr);
+}
+
+#endif
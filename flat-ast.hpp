@@ -0,0 +1,143 @@
+#ifndef __FLAT_AST_H_
+#define __FLAT_AST_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "parser.hpp"
+
+enum class FlatKind : std::uint8_t
+{
+   number,
+   variable,
+   unary,
+   binary,
+   call,
+};
+
+// Ids (call arguments or parameter symbols) viewed in a side table
+struct FlatIdList
+{
+   std::uint32_t const* first;
+   std::uint32_t const* last;
+
+   std::uint32_t const* begin() const { return first; }
+   std::uint32_t const* end() const { return last; }
+   std::size_t size() const { return last - first; }
+   std::uint32_t operator[](std::size_t i) const { return first[i]; }
+};
+
+// A definition (body != FlatAST::none) or extern declaration
+struct FlatFunction
+{
+   Symbol name;
+   std::uint32_t firstParam; // into FlatAST::params
+   std::uint32_t paramCount;
+   std::uint32_t body;
+};
+
+// Index-based AST for a whole module, stored structure-of-arrays.  Node n
+// is kinds[n] plus two 32-bit operand columns:
+//
+//    number    a = index into numbers
+//    variable  a = symbol id
+//    unary     a = operand node, ops[n] = user-defined operator
+//    binary    a = lhs node, b = rhs node, ops[n] = operator
+//    call      a = callee symbol id, b = index into callArgs, where the
+//              argument count is followed by the argument node ids
+//
+// Every expression is laid out in post order, so a subtree occupies the
+// contiguous range [subtreeBegin(root), root] with children before their
+// parent.  Walking a function body is a linear scan.
+class FlatAST
+{
+   public:
+      using NodeId = std::uint32_t;
+      static constexpr NodeId none{~0u};
+
+      // Parse src item by item, flattening each one and freeing its tree
+      // before the next is parsed
+      static FlatAST fromSource(std::string_view src);
+
+      // append a tree in post order, returning its root
+      NodeId add(ExprAST const& expr);
+      void add(FunctionAST const& fn);
+      void add(PrototypeAST const& proto);
+
+      std::uint32_t size() const { return kinds.size(); }
+      std::vector<FlatFunction> const& functions() const { return fns; }
+      FlatIdList params(FlatFunction const& fn) const
+      {
+         return {paramIds.data() + fn.firstParam, paramIds.data() + fn.firstParam + fn.paramCount};
+      }
+
+      FlatKind kind(NodeId n) const { return kinds[n]; }
+      double number(NodeId n) const { return numbers[a[n]]; }
+      Symbol symbol(NodeId n) const { return Symbol::fromId(a[n]); }
+      char op(NodeId n) const { return ops[n]; }
+      NodeId operand(NodeId n) const { return a[n]; }
+      NodeId lhs(NodeId n) const { return a[n]; }
+      NodeId rhs(NodeId n) const { return b[n]; }
+      Symbol callee(NodeId n) const { return Symbol::fromId(a[n]); }
+      FlatIdList args(NodeId n) const
+      {
+         std::uint32_t const* first = callArgs.data() + b[n] + 1;
+         return {first, first + callArgs[b[n]]};
+      }
+
+      // first node of the subtree rooted at n
+      NodeId subtreeBegin(NodeId n) const;
+
+      // Dispatch node n to v.number(n, value), v.variable(n, name),
+      // v.unary(n, op, operand), v.binary(n, op, lhs, rhs) or
+      // v.call(n, callee, args)
+      template< class Visitor >
+      decltype(auto) visit(NodeId n, Visitor&& v) const
+      {
+         switch(kind(n))
+         {
+            case FlatKind::number: return v.number(n, number(n));
+            case FlatKind::variable: return v.variable(n, symbol(n));
+            case FlatKind::unary: return v.unary(n, op(n), operand(n));
+            case FlatKind::binary: return v.binary(n, op(n), lhs(n), rhs(n));
+            case FlatKind::call: default: return v.call(n, callee(n), args(n));
+         }
+      }
+
+      // visit every node of the subtree at root, children first
+      template< class Visitor >
+      void visitPostOrder(NodeId root, Visitor&& v) const
+      {
+         for(NodeId n = subtreeBegin(root); n <= root; n++)
+         {
+            visit(n, v);
+         }
+      }
+
+      // structural equality of the subtree at n and other's subtree at m
+      bool equal(NodeId n, FlatAST const& other, NodeId m) const;
+
+      // Emit fn into the session's module: a declaration for an extern, a
+      // definition for a body.  nullptr (with a message on stderr) on an
+      // unknown variable or callee, an arity mismatch, or a redefinition.
+      llvm::Function* codegen(FlatFunction const& fn, CodeGenContext& cg) const;
+
+      // bytes held by the node columns and side tables
+      std::size_t memoryBytes() const;
+
+   private:
+      NodeId push(FlatKind k, std::uint32_t opA, std::uint32_t opB, char o = 0);
+
+      std::vector<FlatKind> kinds{};
+      std::vector<char> ops{};
+      std::vector<std::uint32_t> a{};
+      std::vector<std::uint32_t> b{};
+      std::vector<double> numbers{};
+      std::vector<std::uint32_t> callArgs{};
+      std::vector<std::uint32_t> paramIds{};
+      std::vector<FlatFunction> fns{};
+};
+
+#endif // __FLAT_AST_H_
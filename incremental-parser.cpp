@@ -0,0 +1,275 @@
+#include "incremental-parser.hpp"
+
+#include <algorithm>
+
+#include "parallel-parser.hpp"
+
+IncrementalParser::IncrementalParser(std::string text)
+   : source{std::move(text)}
+{
+   std::size_t begin{0};
+   OperatorTable ops{};
+   do
+   {
+      std::size_t end = nextSplitPoint(source, begin, begin + 1);
+      parsed.push_back(parseRegion(begin, end, ops));
+      begin = end;
+   } while(begin < source.size());
+   reparsed = parsed.size();
+}
+
+IncrementalParser::Region IncrementalParser::parseRegion(std::size_t begin, std::size_t end, OperatorTable& ops) const
+{
+   BufferCursor cur{std::string_view(source).substr(0, end), begin};
+   Token tok{};
+   gettok(tok, cur);
+   auto items = parseModule(tok, cur, ops);
+   return {begin, std::move(items), ops};
+}
+
+void IncrementalParser::edit(std::size_t offset, std::size_t removed, std::string_view inserted)
+{
+   offset = std::min(offset, source.size());
+   removed = std::min(removed, source.size() - offset);
+   std::ptrdiff_t delta = std::ptrdiff_t(inserted.size()) - std::ptrdiff_t(removed);
+
+   // The region holding the edit, and the one before it: an edit at the
+   // very start of a region can turn its leading 'def' into an identifier
+   // and merge it backwards.  Everything before `first` is untouched, and
+   // its begin is a cut that stays valid, so rescanning can start there.
+   auto holding = std::upper_bound(parsed.begin(), parsed.end(), offset,
+                                   [](std::size_t off, Region const& r) { return off < r.begin; });
+   std::size_t first = holding - parsed.begin() - 1;
+   if(first > 0)
+   {
+      --first;
+   }
+   // that region keeps its text if it ends before the edit
+   std::size_t firstEnd = regionEnd(first);
+   bool firstIntact = firstEnd <= offset;
+
+   source.replace(offset, removed, inserted);
+
+   // Old regions starting at or after the end of the removed text are
+   // unchanged apart from a shift by delta.  Rescan until a new cut lands
+   // on one of their starts with the operators defined before it as they
+   // were; from there on the text, and so every later cut and item, is as
+   // before.
+   std::size_t resync = std::lower_bound(parsed.begin() + first + 1, parsed.end(), offset + removed,
+                                         [](Region const& r, std::size_t off) { return r.begin < off; })
+                        - parsed.begin();
+   std::vector<Region> fresh{};
+   reparsed = 0;
+   std::size_t begin = parsed[first].begin;
+   OperatorTable ops = first > 0 ? parsed[first - 1].operators : OperatorTable{};
+   while(true)
+   {
+      std::size_t end = nextSplitPoint(source, begin, begin + 1);
+      if(fresh.empty() && firstIntact && end == firstEnd)
+      {
+         fresh.push_back(std::move(parsed[first]));
+         ops = fresh.back().operators;
+      }
+      else
+      {
+         fresh.push_back(parseRegion(begin, end, ops));
+         ++reparsed;
+      }
+
+      if(end >= source.size())
+      {
+         resync = parsed.size();
+         break;
+      }
+      while(resync < parsed.size() && parsed[resync].begin + delta < end)
+      {
+         ++resync;
+      }
+      if(resync < parsed.size() && parsed[resync].begin + delta == end && parsed[resync - 1].operators == ops)
+      {
+         break;
+      }
+      begin = end;
+   }
+
+   for(std::size_t i{resync}; i < parsed.size(); i++)
+   {
+      parsed[i].begin += delta;
+   }
+   parsed.erase(parsed.begin() + first, parsed.begin() + resync);
+   parsed.insert(parsed.begin() + first, std::make_move_iterator(fresh.begin()), std::make_move_iterator(fresh.end()));
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace
+{
+
+bool sameItem(TopLevelItem const& lhs, TopLevelItem const& rhs)
+{
+   if(lhs.index() != rhs.index())
+   {
+      return false;
+   }
+   return std::visit([&rhs](auto const& node)
+   {
+      return *node == *std::get<std::decay_t<decltype(node)>>(rhs);
+   }, lhs);
+}
+
+// the incremental result must always equal parsing the text from scratch
+void expectMatchesFullParse(IncrementalParser const& inc)
+{
+   BufferCursor cur{inc.text()};
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, cur);
+   auto expected = parseModule(tok, cur, ops);
+   EXPECT_EQ(inc.operators(), ops);
+
+   std::size_t n{};
+   for(auto const& region : inc.regions())
+   {
+      for(auto const& item : region.items)
+      {
+         ASSERT_LT(n, expected.size());
+         ASSERT_TRUE(sameItem(item, expected[n])) << "item " << n << " in:\n" << inc.text();
+         ++n;
+      }
+   }
+   EXPECT_EQ(n, expected.size());
+}
+
+FunctionAST const* functionAt(IncrementalParser const& inc, std::size_t n)
+{
+   for(auto const& region : inc.regions())
+   {
+      for(auto const& item : region.items)
+      {
+         if(n-- == 0)
+         {
+            return std::get<std::unique_ptr<FunctionAST>>(item).get();
+         }
+      }
+   }
+   return nullptr;
+}
+
+class incremental_parser_test : public ::testing::Test
+{
+   public:
+      void SetUp() override { old = std::cerr.rdbuf(sink.rdbuf()); }
+      void TearDown() override { std::cerr.rdbuf(old); }
+
+      std::stringstream sink{};
+      std::streambuf* old{};
+};
+
+} // namespace
+
+TEST_F(incremental_parser_test, initial)
+{
+   IncrementalParser inc{"def a(x) x+1\ndef b(y) y*2; b(3);"};
+   EXPECT_EQ(inc.regions().size(), 3u);
+   expectMatchesFullParse(inc);
+}
+
+TEST_F(incremental_parser_test, keeps_unchanged_functions)
+{
+   IncrementalParser inc{"def a(x) x+1\ndef b(y) y*2\ndef c(z) z-3\ndef d(w) w\n"};
+   FunctionAST const* a = functionAt(inc, 0);
+   FunctionAST const* b = functionAt(inc, 1);
+   FunctionAST const* d = functionAt(inc, 3);
+
+   // "z-3" -> "z-4"
+   inc.edit(inc.text().find("z-3") + 2, 1, "4");
+   expectMatchesFullParse(inc);
+   EXPECT_EQ(functionAt(inc, 0), a);
+   EXPECT_EQ(functionAt(inc, 1), b);
+   EXPECT_EQ(functionAt(inc, 3), d);
+   EXPECT_EQ(inc.lastReparsed(), 1u);
+}
+
+TEST_F(incremental_parser_test, merge_and_split)
+{
+   IncrementalParser inc{"def a(x) x+1\ndef b(y) y*2\n"};
+   // "def b" -> "deff b": one region now
+   inc.edit(inc.text().find("def b") + 3, 0, "f");
+   expectMatchesFullParse(inc);
+   EXPECT_EQ(inc.regions().size(), 1u);
+   // and back
+   inc.edit(inc.text().find("deff") + 3, 1, "");
+   expectMatchesFullParse(inc);
+   EXPECT_EQ(inc.regions().size(), 2u);
+}
+
+TEST_F(incremental_parser_test, comment_out_boundary)
+{
+   IncrementalParser inc{"1+2; def a(x) x\ndef b(y) y\n"};
+   inc.edit(0, 0, "#");
+   expectMatchesFullParse(inc);
+   inc.edit(0, 1, "");
+   expectMatchesFullParse(inc);
+}
+
+TEST_F(incremental_parser_test, operator_definitions)
+{
+   IncrementalParser inc{"def binary| 5 (a b) a\ndef f(x) x | 1\ndef g(y) y\n2 | 3;\n"};
+   expectMatchesFullParse(inc);
+   EXPECT_EQ(inc.operators().precedence('|'), 5);
+   EXPECT_TRUE(llvm::isa<BinaryExprAST>(*functionAt(inc, 1)->body));
+
+   // edited out of the text, the operator no longer parses where it is used
+   inc.edit(0, 0, "#");
+   expectMatchesFullParse(inc);
+   EXPECT_EQ(inc.operators().precedence('|'), -1);
+   EXPECT_TRUE(llvm::isa<VariableExprAST>(*functionAt(inc, 0)->body));
+
+   // and back
+   inc.edit(0, 1, "");
+   expectMatchesFullParse(inc);
+   EXPECT_EQ(inc.operators().precedence('|'), 5);
+
+   // an edit that leaves the operators alone stops where the text resyncs
+   FunctionAST const* g = functionAt(inc, 2);
+   inc.edit(inc.text().find("| 1") + 2, 1, "7");
+   expectMatchesFullParse(inc);
+   EXPECT_EQ(functionAt(inc, 2), g);
+
+   // a new precedence re-parses the uses
+   inc.edit(inc.text().find('5'), 1, "50");
+   expectMatchesFullParse(inc);
+   EXPECT_EQ(inc.operators().precedence('|'), 50);
+}
+
+TEST_F(incremental_parser_test, random_edits)
+{
+   std::string src{};
+   for(int i{}; i < 40; i++)
+   {
+      src += "def f" + std::to_string(i) + "(x y) x*y+" + std::to_string(i) + "; # note\n";
+   }
+   IncrementalParser inc{src};
+   std::mt19937 rng{1234};
+   std::string const snippets[] = {"def ", "extern ", ";", "#", "\n", " ", "x", "(", ")", "1.5", "+"};
+   for(int i{}; i < 500; i++)
+   {
+      std::size_t size = inc.text().size();
+      std::size_t offset = size ? rng() % size : 0;
+      std::size_t removed = rng() % 4;
+      auto const& ins = snippets[rng() % std::size(snippets)];
+      inc.edit(offset, removed, rng() % 3 ? ins : "");
+      expectMatchesFullParse(inc);
+      if(HasFatalFailure())
+      {
+         return;
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef __INCREMENTAL_PARSER_H_
+#define __INCREMENTAL_PARSER_H_
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "parser.hpp"
+
+// Source text kept parsed across edits.  The text is divided into regions
+// at the same top-level boundaries the parallel front end splits on; each
+// region owns the items parseModule produced for it.  An edit re-lexes
+// and re-parses only the regions it can affect and keeps every other
+// region's items, by identity, so unchanged FunctionASTs survive edits.
+// Operator definitions are part of that: a region is re-parsed when the
+// operators defined before it change, so one edited out of the text stops
+// applying to the rest.
+class IncrementalParser
+{
+   public:
+      struct Region
+      {
+         std::size_t begin;
+         std::vector<TopLevelItem> items;
+         // the operators defined by the end of the region
+         OperatorTable operators;
+      };
+
+      explicit IncrementalParser(std::string text);
+
+      // replace text[offset, offset + removed) with inserted
+      void edit(std::size_t offset, std::size_t removed, std::string_view inserted);
+
+      std::string const& text() const { return source; }
+      std::vector<Region> const& regions() const { return parsed; }
+      std::size_t regionEnd(std::size_t i) const
+      {
+         return i + 1 < parsed.size() ? parsed[i + 1].begin : source.size();
+      }
+
+      // regions re-parsed by the most recent edit
+      std::size_t lastReparsed() const { return reparsed; }
+
+      // the operators the text defines
+      OperatorTable const& operators() const { return parsed.back().operators; }
+
+   private:
+      // text[begin, end) parsed with ops, which it then defines its
+      // operators in
+      Region parseRegion(std::size_t begin, std::size_t end, OperatorTable& ops) const;
+
+      std::string source{};
+      std::vector<Region> parsed{};
+      std::size_t reparsed{};
+};
+
+#endif // __INCREMENTAL_PARSER_H_
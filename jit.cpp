@@ -0,0 +1,805 @@
+#include "jit.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+namespace
+{
+
+// marks the modules of the optimized tier
+constexpr char tierFlag[]{"kaleidoscope.tier"};
+// what tier 0 code calls at the threshold
+constexpr char tierUpHook[]{"__kaleidoscope_tier_up"};
+// part of every cache key: change it with the code generated for the AST
+constexpr std::uint64_t cacheVersion{1};
+
+// report and consume an LLVM error; true if there was one
+bool failed(llvm::Error err)
+{
+   if(!err)
+   {
+      return false;
+   }
+   std::cerr << "JIT error: " << llvm::toString(std::move(err)) << "\n";
+   return true;
+}
+
+llvm::CodeGenOpt::Level backendLevel(unsigned level)
+{
+   switch(level)
+   {
+      case 0: return llvm::CodeGenOpt::None;
+      case 1: return llvm::CodeGenOpt::Less;
+      case 2: return llvm::CodeGenOpt::Default;
+      default: return llvm::CodeGenOpt::Aggressive;
+   }
+}
+
+bool isBuiltinOperator(char op)
+{
+   return op == '+' || op == '-' || op == '*' || op == '<';
+}
+
+bool optimizedTier(llvm::Module const& m)
+{
+   return m.getModuleFlag(tierFlag) != nullptr;
+}
+
+// Compiles tier 0 modules fast and those of the optimized tier at the
+// backend level asked for, through the object cache if there is one.  Each
+// tier is compiled on one thread at a time (tier 0 where it is called, the
+// optimized tier on the worker).
+class TieredCompiler : public llvm::orc::IRCompileLayer::IRCompiler
+{
+   public:
+      static llvm::Expected<std::unique_ptr<IRCompiler>> create(llvm::orc::JITTargetMachineBuilder jtmb,
+                                                                llvm::CodeGenOpt::Level level,
+                                                                llvm::ObjectCache* cache)
+      {
+         jtmb.setCodeGenOptLevel(llvm::CodeGenOpt::None);
+         auto fast = jtmb.createTargetMachine();
+         if(!fast)
+         {
+            return fast.takeError();
+         }
+         (*fast)->setFastISel(true);
+         jtmb.setCodeGenOptLevel(level);
+         auto optimized = jtmb.createTargetMachine();
+         if(!optimized)
+         {
+            return optimized.takeError();
+         }
+         return std::unique_ptr<IRCompiler>{new TieredCompiler(std::move(*fast), std::move(*optimized), cache)};
+      }
+
+      llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(llvm::Module& m) override
+      {
+         Tier& tier = optimizedTier(m) ? optimized : fast;
+         std::lock_guard<std::mutex> lock{tier.lock};
+         return llvm::orc::SimpleCompiler{*tier.target, tier.cache}(m);
+      }
+
+   private:
+      TieredCompiler(std::unique_ptr<llvm::TargetMachine> f, std::unique_ptr<llvm::TargetMachine> o,
+                     llvm::ObjectCache* cache)
+         : IRCompiler{llvm::orc::irManglingOptionsFromTargetOptions(f->Options)}
+      {
+         fast.target = std::move(f);
+         optimized.target = std::move(o);
+         optimized.cache = cache;
+      }
+
+      struct Tier
+      {
+         std::unique_ptr<llvm::TargetMachine> target;
+         llvm::ObjectCache* cache{nullptr};
+         std::mutex lock;
+      };
+      Tier fast{};
+      Tier optimized{};
+};
+
+// Rename the definition of name in m to name + suffix, leaving calls to
+// name (the stub) in its place, recursive ones included
+llvm::Function& separateBody(llvm::Module& m, std::string const& name, char const* suffix)
+{
+   llvm::Function* body = m.getFunction(name);
+   body->setName(name + suffix);
+   llvm::Function* stub = llvm::Function::Create(body->getFunctionType(), llvm::Function::ExternalLinkage, name, m);
+   body->replaceAllUsesWith(stub);
+   return *body;
+}
+
+// Count calls of f in *calls on entry, and call the hook with tiered when
+// the count reaches threshold.  The counter is only a heuristic, so
+// increments are not atomic, only its loads and stores.
+void countCalls(llvm::Function& f, std::atomic<std::uint64_t>* calls, std::uint64_t threshold, void* tiered)
+{
+   llvm::LLVMContext& ctx = f.getContext();
+   llvm::Module& m = *f.getParent();
+   llvm::BasicBlock* body = &f.getEntryBlock();
+   llvm::BasicBlock* count = llvm::BasicBlock::Create(ctx, "count", &f, body);
+   llvm::BasicBlock* tierUp = llvm::BasicBlock::Create(ctx, "tierup", &f, body);
+
+   llvm::IRBuilder<> builder{count};
+   llvm::Type* i64 = builder.getInt64Ty();
+   llvm::Value* counter = builder.CreateIntToPtr(builder.getInt64(reinterpret_cast<std::uintptr_t>(calls)), i64->getPointerTo());
+   llvm::LoadInst* n = builder.CreateAlignedLoad(i64, counter, llvm::Align(8), "calls");
+   n->setAtomic(llvm::AtomicOrdering::Monotonic);
+   llvm::Value* next = builder.CreateAdd(n, builder.getInt64(1));
+   builder.CreateAlignedStore(next, counter, llvm::Align(8))->setAtomic(llvm::AtomicOrdering::Monotonic);
+   builder.CreateCondBr(builder.CreateICmpEQ(next, builder.getInt64(threshold)), tierUp, body);
+
+   builder.SetInsertPoint(tierUp);
+   llvm::FunctionCallee hook = m.getOrInsertFunction(tierUpHook, builder.getVoidTy(), builder.getInt8PtrTy());
+   builder.CreateCall(hook, builder.CreateIntToPtr(builder.getInt64(reinterpret_cast<std::uintptr_t>(tiered)), builder.getInt8PtrTy()));
+   builder.CreateBr(body);
+}
+
+} // namespace
+
+KaleidoscopeJIT::KaleidoscopeJIT(std::unique_ptr<llvm::orc::LLLazyJIT> j, std::unique_ptr<Optimizer> o,
+                                 std::unique_ptr<Optimizer> tierUpO, TieringOptions tiers)
+   : opt{std::move(o)}
+   , tierUpOpt{std::move(tierUpO)}
+   , tiering{tiers}
+   , jit{std::move(j)}
+{
+   // Modules are compiled one at a time, on the thread that calls into
+   // them, so an optimizer is never used by two threads at once: the
+   // optimized tier is only compiled on the worker.
+   jit->getIRTransformLayer().setTransform([this](llvm::orc::ThreadSafeModule tsm,
+                                                   llvm::orc::MaterializationResponsibility const&)
+      -> llvm::Expected<llvm::orc::ThreadSafeModule>
+   {
+      tsm.withModuleDo([this](llvm::Module& m)
+      {
+         // to be loaded rather than compiled
+         if(cache && cache->prefetch(m))
+         {
+            return;
+         }
+         (tierUpOpt && optimizedTier(m) ? *tierUpOpt : *opt).run(m);
+      });
+      return tsm;
+   });
+   // every module reaching machine code passes through the compile layer
+   jit->getIRCompileLayer().setNotifyCompiled([this](llvm::orc::MaterializationResponsibility&,
+                                                     llvm::orc::ThreadSafeModule)
+   {
+      compiled.fetch_add(1, std::memory_order_relaxed);
+   });
+   if(tiering.threshold)
+   {
+      stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(jit->getTargetTriple())();
+      worker = std::thread{[this] { tierUpLoop(); }};
+   }
+}
+
+KaleidoscopeJIT::~KaleidoscopeJIT()
+{
+   if(worker.joinable())
+   {
+      {
+         std::lock_guard<std::mutex> lock{tierLock};
+         stopping = true;
+      }
+      tierWork.notify_one();
+      worker.join();
+   }
+}
+
+std::unique_ptr<KaleidoscopeJIT> KaleidoscopeJIT::create(OptimizerOptions const& opts, TieringOptions tiers,
+                                                        ObjectCacheOptions const& caching)
+{
+   static std::once_flag targets{};
+   std::call_once(targets, []
+   {
+      llvm::InitializeNativeTarget();
+      llvm::InitializeNativeTargetAsmPrinter();
+   });
+
+   auto host = llvm::orc::JITTargetMachineBuilder::detectHost();
+   if(!host)
+   {
+      failed(host.takeError());
+      return nullptr;
+   }
+   // with tiering, opts are for the optimized tier; tier 0 keeps only the
+   // fast-math flags, so both tiers compute alike
+   OptimizerOptions first{opts};
+   if(tiers.threshold)
+   {
+      first.level = 0;
+      first.timePasses = false;
+   }
+   host->setCodeGenOptLevel(backendLevel(first.level));
+   auto tm = host->createTargetMachine();
+   if(!tm)
+   {
+      failed(tm.takeError());
+      return nullptr;
+   }
+   auto optimizer = std::make_unique<Optimizer>(first, std::move(*tm));
+   std::unique_ptr<Optimizer> tierUpOptimizer{};
+
+   // without one (after reporting) code is only compiled
+   std::unique_ptr<DiskObjectCache> cache{};
+   if(!caching.directory.empty())
+   {
+      cache = DiskObjectCache::open(caching);
+   }
+   std::uint64_t target{cacheVersion};
+   for(std::string const& s : {host->getTargetTriple().str(), host->getCPU(), host->getFeatures().getString()})
+   {
+      target = hashCombine(target, Symbol(s).stableHash());
+   }
+   target = hashCombine(hashCombine(hashCombine(target, opts.level), opts.reassociate), opts.contract);
+
+   llvm::orc::LLLazyJITBuilder builder{};
+   if(tiers.threshold)
+   {
+      auto tierUpTm = host->createTargetMachine();
+      if(!tierUpTm)
+      {
+         failed(tierUpTm.takeError());
+         return nullptr;
+      }
+      (*tierUpTm)->setOptLevel(backendLevel(opts.level));
+      tierUpOptimizer = std::make_unique<Optimizer>(opts, std::move(*tierUpTm));
+      builder.setCompileFunctionCreator([level = backendLevel(opts.level), c = cache.get()](llvm::orc::JITTargetMachineBuilder jtmb)
+      {
+         return TieredCompiler::create(std::move(jtmb), level, c);
+      });
+   }
+   else if(cache)
+   {
+      builder.setCompileFunctionCreator([c = cache.get()](llvm::orc::JITTargetMachineBuilder jtmb)
+         -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>>
+      {
+         auto target = jtmb.createTargetMachine();
+         if(!target)
+         {
+            return target.takeError();
+         }
+         return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*target), c);
+      });
+   }
+   auto built = builder.setJITTargetMachineBuilder(std::move(*host)).create();
+   if(!built)
+   {
+      failed(built.takeError());
+      return nullptr;
+   }
+   std::unique_ptr<llvm::orc::LLLazyJIT> jit = std::move(*built);
+   auto process = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix());
+   if(!process)
+   {
+      failed(process.takeError());
+      return nullptr;
+   }
+   jit->getMainJITDylib().addGenerator(std::move(*process));
+   if(tiers.threshold)
+   {
+      llvm::orc::SymbolMap hook{{jit->mangleAndIntern(tierUpHook),
+                                 llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&queueTierUp),
+                                                          llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable)}};
+      if(failed(jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(hook)))))
+      {
+         return nullptr;
+      }
+   }
+   std::unique_ptr<llvm::orc::LazyCallThroughManager> callThrough{};
+   if(tiers.threshold)
+   {
+      auto lctm = llvm::orc::createLocalLazyCallThroughManager(jit->getTargetTriple(), jit->getExecutionSession(), 0);
+      if(!lctm)
+      {
+         failed(lctm.takeError());
+         return nullptr;
+      }
+      callThrough = std::move(*lctm);
+   }
+   std::unique_ptr<KaleidoscopeJIT> result{new KaleidoscopeJIT(std::move(jit), std::move(optimizer),
+                                                               std::move(tierUpOptimizer), tiers)};
+   result->callThrough = std::move(callThrough);
+   result->cache = std::move(cache);
+   result->targetKey = target;
+   return result;
+}
+
+bool KaleidoscopeJIT::addModule(llvm::orc::ThreadSafeModule tsm)
+{
+   tsm.withModuleDo([this](llvm::Module& m) { m.setDataLayout(jit->getDataLayout()); });
+   return !failed(jit->addLazyIRModule(std::move(tsm)));
+}
+
+std::optional<double> KaleidoscopeJIT::run(TopLevelItem const& item, CodeGenContext& cg)
+{
+   if(auto const* expr = std::get_if<std::unique_ptr<TopLevelExprAST>>(&item))
+   {
+      return evaluate(**expr, cg);
+   }
+   if(auto const* fn = std::get_if<std::unique_ptr<FunctionAST>>(&item))
+   {
+      prototypes[(*fn)->proto->name] = (*fn)->proto->structuralHash();
+      if((*fn)->codegen(cg))
+      {
+         if(cache)
+         {
+            cg.module().setModuleIdentifier(DiskObjectCache::moduleId(cacheKey(**fn)));
+         }
+         if(tiering.threshold)
+         {
+            addTiered(*(*fn)->proto, cg.takeModule());
+         }
+         else
+         {
+            addModule(cg.takeModule());
+         }
+      }
+      return std::nullopt;
+   }
+   // an extern only needs its prototype; calls declare it where used
+   PrototypeAST& proto = *std::get<std::unique_ptr<PrototypeAST>>(item);
+   prototypes[proto.name] = proto.structuralHash();
+   proto.codegen(cg);
+   return std::nullopt;
+}
+
+// The expression becomes a function of its own, in a module of its own
+// that is compiled eagerly and removed once it has run.
+std::optional<double> KaleidoscopeJIT::evaluate(TopLevelExprAST& expr, CodeGenContext& cg)
+{
+   // whatever the session holds besides (extern declarations) goes first
+   llvm::orc::ThreadSafeModule pending = cg.takeModule();
+   if(!pending.getModuleUnlocked()->empty() && !addModule(std::move(pending)))
+   {
+      return std::nullopt;
+   }
+
+   auto* fn = llvm::cast_or_null<llvm::Function>(expr.codegen(cg));
+   if(!fn)
+   {
+      cg.takeModule();
+      return std::nullopt;
+   }
+   std::string const name{"__anon_expr" + std::to_string(anonymous++)};
+   fn->setName(name);
+   llvm::orc::ThreadSafeModule tsm = cg.takeModule();
+   tsm.withModuleDo([this](llvm::Module& m) { m.setDataLayout(jit->getDataLayout()); });
+
+   llvm::orc::ResourceTrackerSP tracker = jit->getMainJITDylib().createResourceTracker();
+   if(failed(jit->addIRModule(tracker, std::move(tsm))))
+   {
+      return std::nullopt;
+   }
+   std::optional<double> result{};
+   if(auto sym = jit->lookup(name))
+   {
+      auto* entry = reinterpret_cast<double (*)()>(static_cast<std::uintptr_t>(sym->getAddress()));
+      result = entry();
+   }
+   else
+   {
+      failed(sym.takeError());
+   }
+   failed(tracker->remove());
+   return result;
+}
+
+class KaleidoscopeJIT::TierZero : public llvm::orc::MaterializationUnit
+{
+   public:
+      TierZero(KaleidoscopeJIT& j, Tiered& tiered, llvm::orc::SymbolStringPtr body)
+         : MaterializationUnit{Interface{{{std::move(body), llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable}}, nullptr}}
+         , jit{j}
+         , t{tiered}
+      {}
+
+      llvm::StringRef getName() const override { return "TierZero"; }
+
+      // on the thread making the first call, from run(), so the session's
+      // context is not otherwise in use
+      void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> r) override
+      {
+         llvm::orc::ThreadSafeModule tsm = t.pristine.withModuleDo([&](llvm::Module& m)
+         {
+            return llvm::orc::ThreadSafeModule{llvm::CloneModule(m), t.pristine.getContext()};
+         });
+         tsm.withModuleDo([&](llvm::Module& m)
+         {
+            countCalls(separateBody(m, t.name, ".t0"), &t.calls, jit.tiering.threshold, &t);
+            // not for the object cache: it holds this run's addresses
+            m.setModuleIdentifier(t.name + ".t0");
+            m.setDataLayout(jit.jit->getDataLayout());
+         });
+         jit.jit->getIRTransformLayer().emit(std::move(r), std::move(tsm));
+      }
+
+   private:
+      // f.t0 is only ever looked up through f
+      void discard(llvm::orc::JITDylib const&, llvm::orc::SymbolStringPtr const&) override {}
+
+      KaleidoscopeJIT& jit;
+      Tiered& t;
+};
+
+// Instead of the LLLazyJIT's own laziness (which would have to split f.t0
+// out of a copy of the module made up front), f is a lazy reexport of f.t0,
+// built from the module only once called: with the stubs it needs anyway,
+// a definition costs no copy until it runs.
+bool KaleidoscopeJIT::addTiered(PrototypeAST const& proto, llvm::orc::ThreadSafeModule tsm)
+{
+   Tiered& t = *(tiered[proto.id] = std::make_unique<Tiered>());
+   t.jit = this;
+   t.name = std::string(proto.name.str());
+   t.id = proto.id;
+   t.pristine = std::move(tsm);
+
+   llvm::orc::JITDylib& main = jit->getMainJITDylib();
+   llvm::orc::SymbolStringPtr body = jit->mangleAndIntern(t.name + ".t0");
+   llvm::orc::SymbolAliasMap stub{{jit->mangleAndIntern(t.name),
+                                   {body, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable}}};
+   return !failed(main.define(std::make_unique<TierZero>(*this, t, body)))
+      && !failed(main.define(llvm::orc::lazyReexports(*callThrough, *stubs, main, std::move(stub))));
+}
+
+// Calls are to functions of other modules, so what fn's code depends on
+// besides fn itself is how they are declared.  Constants are hashed
+// exactly: the structural hash does not tell 0 from -0.
+std::uint64_t KaleidoscopeJIT::cacheKey(FunctionAST const& fn)
+{
+   std::uint64_t key{hashCombine(targetKey, fn.structuralHash())};
+   auto callee = [&](Symbol name)
+   {
+      auto it = prototypes.find(name);
+      key = hashCombine(key, it != prototypes.end() ? it->second : name.stableHash());
+   };
+   keyWalk.assign(1, fn.body.get());
+   keyVisited.clear();
+   while(!keyWalk.empty())
+   {
+      ExprAST const* e = keyWalk.back();
+      keyWalk.pop_back();
+      if(e->shared && !keyVisited.insert(e).second)
+      {
+         continue;
+      }
+      switch(e->getKind())
+      {
+         case ExprAST::Kind::number:
+         {
+            double const value{llvm::cast<NumberExprAST>(e)->value()};
+            std::uint64_t bits{};
+            std::memcpy(&bits, &value, sizeof bits);
+            key = hashCombine(key, bits);
+            break;
+         }
+         case ExprAST::Kind::variable:
+         {
+            break;
+         }
+         case ExprAST::Kind::unary:
+         {
+            auto const* un = llvm::cast<UnaryExprAST>(e);
+            callee(Symbol(std::string("unary") + un->opcode));
+            keyWalk.push_back(un->operand.get());
+            break;
+         }
+         case ExprAST::Kind::binary:
+         {
+            auto const* bin = llvm::cast<BinaryExprAST>(e);
+            if(!isBuiltinOperator(bin->op))
+            {
+               callee(Symbol(std::string("binary") + bin->op));
+            }
+            keyWalk.push_back(bin->rhs.get());
+            keyWalk.push_back(bin->lhs.get());
+            break;
+         }
+         case ExprAST::Kind::call:
+         {
+            auto const* call = llvm::cast<CallExprAST>(e);
+            callee(call->callee);
+            for(auto it = call->args.rbegin(); it != call->args.rend(); ++it)
+            {
+               keyWalk.push_back(it->get());
+            }
+            break;
+         }
+      }
+   }
+   return key;
+}
+
+std::optional<std::uint64_t> KaleidoscopeJIT::callCount(std::uint32_t id) const
+{
+   auto it = tiered.find(id);
+   if(it == tiered.end())
+   {
+      return std::nullopt;
+   }
+   return it->second->calls.load(std::memory_order_relaxed);
+}
+
+void KaleidoscopeJIT::queueTierUp(void* tiered)
+{
+   auto* t = static_cast<Tiered*>(tiered);
+   KaleidoscopeJIT& self = *t->jit;
+   // called back from run(), as TierZero::materialize
+   t->pristine = llvm::orc::cloneToNewContext(t->pristine);
+   {
+      std::lock_guard<std::mutex> lock{self.tierLock};
+      self.tierQueue.push_back(t);
+   }
+   self.tierWork.notify_one();
+}
+
+std::vector<TierUp> KaleidoscopeJIT::takeTierUps()
+{
+   std::lock_guard<std::mutex> lock{tierLock};
+   return std::exchange(tierUps, {});
+}
+
+void KaleidoscopeJIT::waitForTierUps()
+{
+   std::unique_lock<std::mutex> lock{tierLock};
+   tierIdle.wait(lock, [this] { return tierQueue.empty() && !tierBusy; });
+}
+
+void KaleidoscopeJIT::tierUpLoop()
+{
+   std::unique_lock<std::mutex> lock{tierLock};
+   for(;;)
+   {
+      tierWork.wait(lock, [this] { return stopping || !tierQueue.empty(); });
+      if(stopping)
+      {
+         return;
+      }
+      Tiered* t = tierQueue.front();
+      tierQueue.pop_front();
+      tierBusy = true;
+      std::uint64_t const calls{t->calls.load(std::memory_order_relaxed)};
+      lock.unlock();
+
+      auto const start = std::chrono::steady_clock::now();
+      bool const done = tierUp(*t);
+      auto const time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+      lock.lock();
+      tierBusy = false;
+      if(done)
+      {
+         tierUps.push_back({t->name, t->id, calls, time});
+      }
+      if(tierQueue.empty())
+      {
+         tierIdle.notify_all();
+      }
+   }
+}
+
+// Compile the pristine definition as name.t1 in the optimized tier, then
+// point the stub at it.  Runs on the worker.
+bool KaleidoscopeJIT::tierUp(Tiered& t)
+{
+   llvm::orc::ThreadSafeModule tsm = std::move(t.pristine);
+   tsm.withModuleDo([&](llvm::Module& m)
+   {
+      separateBody(m, t.name, ".t1");
+      m.setModuleIdentifier(m.getModuleIdentifier() + ".t1");
+      m.addModuleFlag(llvm::Module::Warning, tierFlag, 1);
+      m.setDataLayout(jit->getDataLayout());
+   });
+   if(failed(jit->addIRModule(std::move(tsm))))
+   {
+      return false;
+   }
+   auto body = jit->lookup(t.name + ".t1");
+   if(!body)
+   {
+      failed(body.takeError());
+      return false;
+   }
+   return !failed(stubs->updatePointer(*jit->mangleAndIntern(t.name), body->getAddress()));
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <cstdlib>
+
+#include "llvm/Support/FileSystem.h"
+
+#include "resolver.hpp"
+
+namespace
+{
+
+class jit_test : public testing::Test
+{
+   protected:
+      void SetUp() override
+      {
+         jit = KaleidoscopeJIT::create();
+         ASSERT_NE(jit, nullptr);
+      }
+      // the value of the last top-level expression in src
+      std::optional<double> run(std::string_view src)
+      {
+         BufferCursor cur{src};
+         Token tok{};
+         gettok(tok, cur);
+         std::optional<double> last{};
+         for(auto& item : parseModule(tok, cur, ops))
+         {
+            if(!resolver.resolve(item))
+            {
+               return std::nullopt;
+            }
+            if(auto value = jit->run(item, cg))
+            {
+               last = value;
+            }
+         }
+         return last;
+      }
+
+      std::unique_ptr<KaleidoscopeJIT> jit{};
+      CodeGenContext cg{"jit_test"};
+      Resolver resolver{};
+      // operators stay defined from one run to the next, as in a session
+      OperatorTable ops{};
+};
+
+} // namespace
+
+TEST_F(jit_test, evaluates_expressions)
+{
+   EXPECT_EQ(run("1 + 2*3"), 7.0);
+   EXPECT_EQ(run("def sq(x) x*x\nsq(4) - 1"), 15.0);
+   // definitions stay, expressions are gone once they have run
+   EXPECT_EQ(run("sq(sq(2))"), 16.0);
+   EXPECT_EQ(run("def lt(a b) a < b\ndef clamp(x) x * lt(x, 10)\nclamp(3) + clamp(12)"), 3.0);
+}
+
+TEST_F(jit_test, externs_resolve_in_the_host)
+{
+   EXPECT_EQ(run("extern cos(x)\ncos(0)"), 1.0);
+   EXPECT_EQ(run("extern sin(x)\ndef s(x) sin(x) * 2\ns(0)"), 0.0);
+}
+
+TEST_F(jit_test, user_operators)
+{
+   EXPECT_EQ(run("def binary| 5 (a b) a + b\ndef unary!(v) 0 - v\n!2 | 10"), 8.0);
+}
+
+TEST_F(jit_test, optimizes_what_it_compiles)
+{
+   OptimizerOptions opts{3};
+   opts.reassociate = true;
+   opts.contract = true;
+   opts.timePasses = true;
+   jit = KaleidoscopeJIT::create(opts);
+   ASSERT_NE(jit, nullptr);
+   EXPECT_EQ(run("def sq(x) x*x\ndef f(x y) (sq(x)+1)+1 + x*y\nf(3, 2)"), 17.0);
+   EXPECT_TRUE(jit->optimizer().passTimes().count("InstCombinePass"));
+}
+
+TEST_F(jit_test, compiles_on_first_call)
+{
+   std::string src{};
+   for(int i{}; i < 200; i++)
+   {
+      src += "def f" + std::to_string(i) + "(x y) x*y + " + std::to_string(i) + "\n";
+   }
+   EXPECT_FALSE(run(src));
+   EXPECT_EQ(jit->compiledModules(), 0u);
+
+   // the expression and f7, nothing else
+   EXPECT_EQ(run("f7(2, 3)"), 13.0);
+   EXPECT_EQ(jit->compiledModules(), 2u);
+   // f7 is not compiled again
+   EXPECT_EQ(run("f7(1, 1)"), 8.0);
+   EXPECT_EQ(jit->compiledModules(), 3u);
+}
+
+TEST_F(jit_test, tiers_up_hot_functions)
+{
+   TieringOptions tiers{3};
+   jit = KaleidoscopeJIT::create(OptimizerOptions{2}, tiers);
+   ASSERT_NE(jit, nullptr);
+   EXPECT_FALSE(run("def sq(x) x*x\ndef quad(x) sq(sq(x))"));
+   EXPECT_EQ(run("sq(3)"), 9.0);
+   EXPECT_EQ(run("quad(2)"), 16.0);
+   jit->waitForTierUps();
+   // quad was called once, sq three times
+   std::vector<TierUp> ups = jit->takeTierUps();
+   ASSERT_EQ(ups.size(), 1u);
+   EXPECT_EQ(ups[0].name, "sq");
+   EXPECT_EQ(ups[0].calls, 3u);
+   EXPECT_EQ(jit->callCount(ups[0].id), 3u);
+
+   // calls now go to the optimized code, which counts no more
+   EXPECT_EQ(run("quad(3) + quad(1) + sq(0 - 1)"), 83.0);
+   EXPECT_EQ(jit->callCount(ups[0].id), 3u);
+   jit->waitForTierUps();
+   ups = jit->takeTierUps();
+   ASSERT_EQ(ups.size(), 1u);
+   EXPECT_EQ(ups[0].name, "quad");
+   EXPECT_TRUE(jit->takeTierUps().empty());
+   EXPECT_EQ(run("quad(quad(1)) - sq(0.5)"), 0.75);
+}
+
+TEST_F(jit_test, tiers_up_on_first_call)
+{
+   jit = KaleidoscopeJIT::create(OptimizerOptions{3}, TieringOptions{1});
+   ASSERT_NE(jit, nullptr);
+   // loop calls itself through its stub; without if it is never called
+   EXPECT_FALSE(run("def lt(a b) a < b\ndef loop(x) lt(x, 0) * loop(x)\ndef first(x) x + lt(x, 0)"));
+   EXPECT_EQ(run("first(2)"), 2.0);
+   jit->waitForTierUps();
+   std::vector<TierUp> ups = jit->takeTierUps();
+   ASSERT_EQ(ups.size(), 2u);
+   EXPECT_EQ(run("first(0 - 1)"), 0.0);
+}
+
+TEST_F(jit_test, tiering_is_off_by_default)
+{
+   EXPECT_EQ(run("def sq(x) x*x\nsq(2) + sq(3) + sq(4)"), 29.0);
+   jit->waitForTierUps();
+   EXPECT_TRUE(jit->takeTierUps().empty());
+   EXPECT_FALSE(jit->callCount(0));
+}
+
+TEST_F(jit_test, caches_objects_across_sessions)
+{
+   char directory[32]{"/tmp/kaleidoscope-XXXXXX"};
+   ASSERT_NE(mkdtemp(directory), nullptr);
+   std::string const src{"def sq(x) x*x\ndef f(x y) sq(x) + y*0.5\nf(3, 2)"};
+   auto session = [&](std::string_view text, OptimizerOptions opts = {})
+   {
+      jit = KaleidoscopeJIT::create(opts, {}, ObjectCacheOptions{directory});
+      cg.takeModule();
+      resolver = Resolver{};
+      return run(text);
+   };
+
+   EXPECT_EQ(session(src), 10.0);
+   ASSERT_NE(jit->objectCache(), nullptr);
+   EXPECT_EQ(jit->objectCache()->hits(), 0u);
+   EXPECT_EQ(jit->objectCache()->writes(), 2u);
+
+   // both definitions come from the cache, the expression is compiled
+   EXPECT_EQ(session(src), 10.0);
+   EXPECT_EQ(jit->objectCache()->hits(), 2u);
+   EXPECT_EQ(jit->objectCache()->writes(), 0u);
+   EXPECT_EQ(jit->compiledModules(), 3u);
+
+   // a changed constant, or other options, is other code
+   EXPECT_EQ(session("def sq(x) x*x\ndef f(x y) sq(x) + y*0.25\nf(3, 2)"), 9.5);
+   EXPECT_EQ(jit->objectCache()->hits(), 1u);
+   EXPECT_EQ(session(src, OptimizerOptions{1}), 10.0);
+   EXPECT_EQ(jit->objectCache()->hits(), 0u);
+
+   // so is a call to a function declared otherwise
+   EXPECT_EQ(session("def sq(x z) x*z\ndef f(x y) sq(x, x) + y*0.5\nf(3, 2)"), 10.0);
+   EXPECT_EQ(jit->objectCache()->hits(), 0u);
+
+   jit.reset();
+   llvm::sys::fs::remove_directories(directory);
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef __JIT_H_
+#define __JIT_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+
+#include "code-generator.hpp"
+#include "object-cache.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+
+namespace llvm::orc
+{
+class IndirectStubsManager;
+class LazyCallThroughManager;
+}
+
+// Tiered compilation, off by default.  When on, definitions first run code
+// compiled for compile speed (no passes, FastISel) that counts its calls;
+// a function called threshold times is recompiled on a background thread
+// with the optimizer options given to create(), and calls switch to the
+// new code from then on.  Code that runs once is never optimized, code
+// that runs long is.
+struct TieringOptions
+{
+   // calls before a function is recompiled; 0 leaves tiering off
+   std::uint64_t threshold{0};
+};
+
+// A function recompiled in the optimized tier
+struct TierUp
+{
+   std::string name;
+   // the Resolver's id for it
+   std::uint32_t id;
+   // calls counted when its recompilation started
+   std::uint64_t calls;
+   std::chrono::microseconds compileTime;
+};
+
+// Runs generated code with ORC's LLLazyJIT.  Definitions are added as lazy
+// reexports: each function is compiled to machine code the first time it
+// is called, on its own, so starting a program costs what actually runs
+// rather than everything it defines.  Top-level expressions are compiled
+// at once, run, and removed again.  Externs resolve to symbols of the host
+// process (sin, cos, ...).  Each module is optimized for the host just
+// before it is compiled, so only code that runs is optimized too.
+//
+// With tiering on, every definition f is called through an indirect stub
+// named f, pointing first at a lazy call-through, then at the counting
+// f.t0 compiled on the first call and, once f.t1 is compiled, at that; the
+// stub's pointer is swapped atomically, so running code is never stopped.
+//
+// With an object cache, a definition's machine code is kept on disk and
+// loaded, neither optimized nor compiled, when the same definition is
+// compiled again, in this run or a later one.  A definition's key covers
+// its prototype and body (constants exactly), the prototypes of the
+// functions it calls, the host (triple, CPU and features) and the
+// optimizer options; tier 0 code, which holds addresses of this run, is
+// never cached.
+class KaleidoscopeJIT
+{
+   public:
+      // nullptr (after reporting) if no JIT can be built for the host; the
+      // optimization level also sets the backend's
+      static std::unique_ptr<KaleidoscopeJIT> create(OptimizerOptions const& opts = {},
+                                                     TieringOptions tiers = {},
+                                                     ObjectCacheOptions const& caching = {});
+      // drops the recompilations still queued
+      ~KaleidoscopeJIT();
+
+      // Add a module of definitions, lazily.  false (after reporting) on
+      // failure, e.g. a symbol defined twice.  A function called for the
+      // first time is split out of what remains of its module, at a cost
+      // in the size of the module: keep modules small, one definition each
+      // as run() does.
+      bool addModule(llvm::orc::ThreadSafeModule tsm);
+
+      // Generate code for item in cg and run it: definitions are added to
+      // the JIT, externs only declared; a top-level expression is evaluated
+      // and its value returned.  nullopt otherwise, or on failure.  Items
+      // must have been resolved.
+      std::optional<double> run(TopLevelItem const& item, CodeGenContext& cg);
+
+      // Modules compiled to machine code so far: every top-level
+      // expression, one per lazily compiled function and one per
+      // function recompiled in the optimized tier
+      std::size_t compiledModules() const { return compiled; }
+
+      // The optimizer applying the options given to create(); with
+      // tiering, the one the background thread uses, so read its timings
+      // after waitForTierUps()
+      Optimizer const& optimizer() const { return tierUpOpt ? *tierUpOpt : *opt; }
+
+      // nullptr without one
+      DiskObjectCache const* objectCache() const { return cache.get(); }
+
+      // calls so far of the tiered function with the Resolver's id, up to
+      // its recompilation
+      std::optional<std::uint64_t> callCount(std::uint32_t id) const;
+      // the functions recompiled since the last call, in order
+      std::vector<TierUp> takeTierUps();
+      // wait until no recompilation is queued or running
+      void waitForTierUps();
+
+   private:
+      // a function compiled in tiers
+      struct Tiered
+      {
+         KaleidoscopeJIT* jit;
+         std::string name;
+         std::uint32_t id;
+         // counted by the tier 0 code
+         std::atomic<std::uint64_t> calls{0};
+         // the definition as generated: f.t0 is built from a copy, f.t1
+         // from the module itself, in a context of its own once queued
+         llvm::orc::ThreadSafeModule pristine{};
+      };
+      // builds f.t0 when f is first called
+      class TierZero;
+
+      KaleidoscopeJIT(std::unique_ptr<llvm::orc::LLLazyJIT> j, std::unique_ptr<Optimizer> o,
+                      std::unique_ptr<Optimizer> tierUpO, TieringOptions tiers);
+
+      std::optional<double> evaluate(TopLevelExprAST& expr, CodeGenContext& cg);
+      std::uint64_t cacheKey(FunctionAST const& fn);
+
+      bool addTiered(PrototypeAST const& proto, llvm::orc::ThreadSafeModule tsm);
+      // called by tier 0 code reaching the threshold
+      static void queueTierUp(void* tiered);
+      void tierUpLoop();
+      bool tierUp(Tiered& t);
+
+      // declared before the JIT, whose compilers use it
+      std::unique_ptr<DiskObjectCache> cache{};
+      // the host and options, for cache keys
+      std::uint64_t targetKey{};
+      // structural hashes of the prototypes seen, for cache keys
+      std::unordered_map<Symbol, std::uint64_t> prototypes{};
+      std::vector<ExprAST const*> keyWalk{};
+      std::unordered_set<ExprAST const*> keyVisited{};
+
+      std::unique_ptr<Optimizer> opt;
+      // the optimized tier's, used by the worker only
+      std::unique_ptr<Optimizer> tierUpOpt;
+      TieringOptions tiering;
+      std::unique_ptr<llvm::orc::LLLazyJIT> jit;
+      std::unique_ptr<llvm::orc::IndirectStubsManager> stubs{};
+      std::unique_ptr<llvm::orc::LazyCallThroughManager> callThrough{};
+      std::atomic<std::size_t> compiled{0};
+      std::size_t anonymous{0};
+
+      // by the Resolver's id
+      std::unordered_map<std::uint32_t, std::unique_ptr<Tiered>> tiered{};
+      std::mutex tierLock{};
+      std::condition_variable tierWork{};
+      std::condition_variable tierIdle{};
+      std::deque<Tiered*> tierQueue{};
+      std::vector<TierUp> tierUps{};
+      bool tierBusy{false};
+      bool stopping{false};
+      // recompiles queued functions; joined by the destructor
+      std::thread worker{};
+};
+
+#endif // __JIT_H_
@@ -1,14 +1,165 @@
 #include "lexer.hpp"
+#include "char-class.hpp"
 
+#include <array>
+#include <charconv>
 #include <cstdlib>
 
+namespace
+{
+
+// Perfect hash over the keyword set: (first char + length) mod 8 is
+// distinct for every keyword, so recognition is one table probe and at
+// most one compare.
+struct Keyword
+{
+   std::string_view text;
+   TokenType type;
+};
+
+constexpr std::size_t keywordSlot(std::string_view text)
+{
+   return (static_cast<unsigned char>(text[0]) + text.size()) & 7;
+}
+
+constexpr Keyword keywordList[]{
+   {"def", TokenType::def},
+   {"extern", TokenType::ext},
+   {"binary", TokenType::binary},
+   {"unary", TokenType::unary},
+};
+
+constexpr std::array<Keyword, 8> makeKeywordTable()
+{
+   std::array<Keyword, 8> table{};
+   for(auto const& kw : keywordList)
+   {
+      table[keywordSlot(kw.text)] = kw;
+   }
+   return table;
+}
+
+constexpr std::array<Keyword, 8> keywordTable{makeKeywordTable()};
+
+constexpr bool keywordHashIsPerfect()
+{
+   for(auto const& kw : keywordList)
+   {
+      if(keywordTable[keywordSlot(kw.text)].text != kw.text)
+      {
+         return false;
+      }
+   }
+   return true;
+}
+static_assert(keywordHashIsPerfect(), "keyword hash collision, pick a new slot function");
+
+char const* skipDigits(char const* p, char const* last)
+{
+   while(p != last && isDigitChar(*p))
+   {
+      ++p;
+   }
+   return p;
+}
+
+// the rest of a bad literal, so the lexer resumes after all of it
+char const* skipMalformed(char const* p, char const* last)
+{
+   while(p != last && (isAlnumChar(*p) || *p == '.'))
+   {
+      ++p;
+   }
+   return p;
+}
+
+} // namespace
+
+TokenType identifierType(std::string_view text)
+{
+   Keyword const& kw = keywordTable[keywordSlot(text)];
+   return kw.text == text ? kw.type : TokenType::id;
+}
+
+NumberScan scanNumber(char const* first, char const* last)
+{
+   char const* p = skipDigits(first, last);
+   bool mantissa = p != first;
+   if(p != last && *p == '.')
+   {
+      char const* frac = p + 1;
+      p = skipDigits(frac, last);
+      mantissa |= p != frac;
+   }
+   if(!mantissa)
+   {
+      return {skipMalformed(p, last), 0, false};
+   }
+
+   if(p != last && (*p == 'e' || *p == 'E'))
+   {
+      char const* exp = p + 1;
+      if(exp != last && (*exp == '+' || *exp == '-'))
+      {
+         ++exp;
+      }
+      p = skipDigits(exp, last);
+      if(p == exp)
+      {
+         return {skipMalformed(p, last), 0, false};
+      }
+   }
+
+   // a second '.' or exponent continuing the literal
+   if(p != last && (*p == '.' || *p == 'e' || *p == 'E'))
+   {
+      return {skipMalformed(p, last), 0, false};
+   }
+
+   // correctly rounded (Eisel-Lemire fast path in libstdc++/libc++)
+   double value{};
+   auto res = std::from_chars(first, p, value);
+   if(res.ec != std::errc{} || res.ptr != p)
+   {
+      // out of range for a double
+      return {p, 0, false};
+   }
+   return {p, value, true};
+}
+
+
+namespace
+{
+
+// Characters read from the stream so far, kept in the stream itself so
+// offsets continue across calls and each stream counts its own
+long& streamOffset(std::istream& stream)
+{
+   static int const slot{std::ios_base::xalloc()};
+   return stream.iword(slot);
+}
+
+} // namespace
 
 void gettok(Token& tok, std::istream& stream)
 {
    char LastChar = ' ';
+   long& pos = streamOffset(stream);
    tok.type = TokenType::eof;
-   tok.id.clear();
+   tok.id = Symbol{};
    tok.ch = 0;
+   tok.offset = pos;
+
+   // one character, counted
+   auto next = [&]() -> bool
+   {
+      if(stream >> LastChar)
+      {
+         ++pos;
+         return true;
+      }
+      return false;
+   };
 
    if(stream)
    {
@@ -16,63 +167,77 @@ void gettok(Token& tok, std::istream& stream)
       stream >> std::noskipws, LastChar = stream.peek();
       if(stream.good())
       {
-         if(std::isspace(LastChar))
+         if(isSpaceChar(LastChar))
          {
 
             do
             {
-               stream >> LastChar;
+               next();
             }
-            while((LastChar = stream.peek()) && (stream.good()) && std::isspace(LastChar));
+            while((LastChar = stream.peek()) && (stream.good()) && isSpaceChar(LastChar));
+            tok.offset = pos;
             if(!stream.good())
             {
                return;
             }
          }
-         if(isalpha(LastChar))
+         if(isAlphaChar(LastChar))
          {
 
-            tok.type = TokenType::id;
+            // reused across calls, so no allocation once warmed up
+            thread_local std::string name{};
+            name.clear();
             do
             {
-               stream >> LastChar, tok.id += LastChar;
-            } while(isalnum(LastChar = stream.peek()) && (stream.good()));
+               next(), name += LastChar;
+            } while(isAlnumChar(LastChar = stream.peek()) && (stream.good()));
 
-            if(tok.id == "def")
-            {
-               tok.type = TokenType::def;
-            }
-            else if(tok.id == "extern")
-            {
-               tok.type = TokenType::ext;
-            }
+            tok.type = identifierType(name);
+            tok.id = Symbol(name);
             return;
          }
-         else if((std::isdigit(LastChar) || LastChar == '.'))
+         else if((isDigitChar(LastChar) || LastChar == '.'))
          {
 
-            tok.type = TokenType::num;
-            std::string NumStr{};
+            // collect the literal's characters, then scan them in place
+            thread_local std::string digits{};
+            digits.clear();
+            char prev{};
             do
             {
-               NumStr += LastChar;
-               stream >> LastChar;
-            } while((LastChar = stream.peek()) && (stream.good()) && (std::isdigit(LastChar) || LastChar == '.'));
-            tok.num = strtod(NumStr.c_str(), nullptr);
+               next(), digits += LastChar;
+               prev = LastChar;
+               LastChar = stream.peek();
+            } while((stream.good()) &&
+                    (isDigitChar(LastChar) || LastChar == '.' || LastChar == 'e' || LastChar == 'E' ||
+                     ((LastChar == '+' || LastChar == '-') && (prev == 'e' || prev == 'E'))));
+
+            NumberScan scan = scanNumber(digits.data(), digits.data() + digits.size());
+            if(!scan.ok)
+            {
+               // swallow the rest of the malformed run, as the buffer lexer does
+               while((isAlnumChar(LastChar = stream.peek()) || LastChar == '.') && (stream.good()))
+               {
+                  next();
+               }
+            }
+            tok.type = scan.ok ? TokenType::num : TokenType::err;
+            tok.num = scan.value;
             return;
          }
          else if(LastChar == '#')
          {
 
-            while((stream >> LastChar) && (stream) && LastChar != '\n' && LastChar != '\r');
+            while(next() && LastChar != '\n' && LastChar != '\r');
             if(stream)
             {
                return gettok(tok, stream);
             }
+            tok.offset = pos;
          }
          else
          {
-            stream >> LastChar;
+            next();
             tok.ch = LastChar;
             tok.type = TokenType::sym;
          }
@@ -82,6 +247,54 @@ void gettok(Token& tok, std::istream& stream)
    return;
 }
 
+void gettok(Token& tok, BufferCursor& cur)
+{
+   char const* const begin = cur.buf.data();
+   char const* const end = begin + cur.buf.size();
+   char const* p = begin + cur.pos;
+   tok.type = TokenType::eof;
+   tok.id = Symbol{};
+   tok.ch = 0;
+
+   // whitespace and comments
+   while((p = skipSpace(p, end)) != end && *p == '#')
+   {
+      p = skipToEol(p, end);
+   }
+
+   char const* start = p;
+   tok.offset = start - begin;
+   if(p == end)
+   {
+      tok.text = {};
+      cur.pos = tok.offset;
+      return;
+   }
+
+   if(isAlphaChar(*p))
+   {
+      p = skipAlnum(p + 1, end);
+      tok.text = std::string_view(start, p - start);
+      tok.type = identifierType(tok.text);
+      tok.id = Symbol(tok.text);
+   }
+   else if(isDigitChar(*p) || *p == '.')
+   {
+      NumberScan scan = scanNumber(p, end);
+      p = scan.end;
+      tok.text = std::string_view(start, p - start);
+      tok.type = scan.ok ? TokenType::num : TokenType::err;
+      tok.num = scan.value;
+   }
+   else
+   {
+      tok.ch = *p++;
+      tok.text = std::string_view(start, 1);
+      tok.type = TokenType::sym;
+   }
+   cur.pos = p - begin;
+}
+
 #ifdef BUILD_TESTS
 #include "gtest/gtest.h"
 #include <sstream>
@@ -199,6 +412,51 @@ TEST_F(lexer_test, decimal)
    EXPECT_EQ(tok.num, double(1234.567));
 }
 
+TEST_F(lexer_test, exponent)
+{
+   io << "1e-9 2.5E+3 7e2)";
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::num);
+   EXPECT_EQ(tok.num, 1e-9);
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::num);
+   EXPECT_EQ(tok.num, 2.5e3);
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::num);
+   EXPECT_EQ(tok.num, 7e2);
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::sym);
+   EXPECT_EQ(tok.ch, ')');
+}
+
+TEST_F(lexer_test, malformed_number)
+{
+   io << "1.2.3 x 1e+ y";
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::err);
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::id);
+   EXPECT_EQ(tok.id, "x");
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::err);
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::id);
+   EXPECT_EQ(tok.id, "y");
+}
+
+TEST_F(lexer_test, number_then_operator)
+{
+   io << "x-1-2";
+   gettok(tok, io);
+   gettok(tok, io);
+   EXPECT_EQ(tok.ch, '-');
+   gettok(tok, io);
+   EXPECT_EQ(tok.type, TokenType::num);
+   EXPECT_EQ(tok.num, 1.0);
+   gettok(tok, io);
+   EXPECT_EQ(tok.ch, '-');
+}
+
 TEST_F(lexer_test, comment)
 {
    std::stringstream io;
@@ -440,4 +698,201 @@ TEST_F(lexer_test, program)
    EXPECT_EQ(tok.ch, ')');
 }
 
+class buffer_lexer_test : public ::testing::Test
+{
+   public:
+      BufferCursor cur{};
+      Token tok{};
+};
+
+TEST_F(buffer_lexer_test, empty)
+{
+   cur.buf = "";
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::eof);
+   EXPECT_TRUE(tok.text.empty());
+}
+
+TEST_F(buffer_lexer_test, spaces)
+{
+   cur.buf = "   \t\r\n";
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::eof);
+   EXPECT_EQ(cur.pos, 6u);
+}
+
+TEST_F(buffer_lexer_test, id_span)
+{
+   std::string src{"  ABC1 "};
+   cur.buf = src;
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::id);
+   EXPECT_EQ(tok.text, "ABC1");
+   EXPECT_EQ(tok.offset, 2u);
+   // zero copy: the span points into the source
+   EXPECT_EQ(tok.text.data(), src.data() + 2);
+   EXPECT_EQ(tok.id, "ABC1");
+}
+
+TEST_F(buffer_lexer_test, keywords)
+{
+   cur.buf = "def extern binary unary definition";
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::def);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::ext);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::binary);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::unary);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::id);
+   EXPECT_EQ(tok.text, "definition");
+}
+
+TEST_F(buffer_lexer_test, keyword_near_misses)
+{
+   // same hash slot or prefix as a keyword
+   cur.buf = "de define ext externs dfe extirn binarys unar bunary";
+   do
+   {
+      gettok(tok, cur);
+      if(tok.type != TokenType::eof)
+      {
+         EXPECT_EQ(tok.type, TokenType::id) << tok.text;
+      }
+   } while(tok.type != TokenType::eof);
+}
+
+TEST_F(buffer_lexer_test, numbers)
+{
+   cur.buf = "1234.567 4)";
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::num);
+   EXPECT_EQ(tok.num, double(1234.567));
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::num);
+   EXPECT_EQ(tok.num, double(4));
+   EXPECT_EQ(tok.offset, 9u);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::sym);
+   EXPECT_EQ(tok.ch, ')');
+   EXPECT_EQ(tok.offset, 10u);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::eof);
+}
+
+TEST_F(lexer_test, offsets)
+{
+   // characters read from the stream, as in the buffer
+   io << "  ABC1 1234.567 # note\n 4)\n";
+   std::size_t const expected[]{2, 7, 24, 25, 27};
+   for(std::size_t offset : expected)
+   {
+      gettok(tok, io);
+      EXPECT_EQ(tok.offset, offset);
+   }
+   EXPECT_EQ(tok.type, TokenType::eof);
+
+   // and continue across calls on the same stream only
+   io.clear();
+   io << "x";
+   gettok(tok, io);
+   EXPECT_EQ(tok.offset, 27u);
+   std::stringstream other{"y"};
+   gettok(tok, other);
+   EXPECT_EQ(tok.offset, 0u);
+}
+
+TEST(scan_number_test, well_formed)
+{
+   for(std::string_view lit : {"0", "42", "3.25", ".5", "5.", "1e10", "1E-9", "2.5e+3", "0.1", "123456789012345678901234567890"})
+   {
+      NumberScan scan = scanNumber(lit.data(), lit.data() + lit.size());
+      EXPECT_TRUE(scan.ok) << lit;
+      EXPECT_EQ(scan.end, lit.data() + lit.size()) << lit;
+      EXPECT_EQ(scan.value, strtod(std::string(lit).c_str(), nullptr)) << lit;
+   }
+}
+
+TEST(scan_number_test, correctly_rounded)
+{
+   // halfway and near-halfway cases that naive digit accumulation gets wrong
+   std::string_view lit{"9007199254740993"};
+   EXPECT_EQ(scanNumber(lit.data(), lit.data() + lit.size()).value, 9007199254740992.0);
+   lit = "2.2250738585072011e-308";
+   EXPECT_EQ(scanNumber(lit.data(), lit.data() + lit.size()).value, 2.2250738585072011e-308);
+   lit = "0.1";
+   EXPECT_EQ(scanNumber(lit.data(), lit.data() + lit.size()).value, 0.1);
+}
+
+TEST(scan_number_test, malformed)
+{
+   for(std::string_view lit : {".", "1.2.3", "1e", "1e+", "1e5.2", "1e5e3", "3else", "1e999"})
+   {
+      NumberScan scan = scanNumber(lit.data(), lit.data() + lit.size());
+      EXPECT_FALSE(scan.ok) << lit;
+      EXPECT_EQ(scan.end, lit.data() + lit.size()) << lit;
+   }
+}
+
+TEST(scan_number_test, stops_before_identifier)
+{
+   std::string_view lit{"4x"};
+   NumberScan scan = scanNumber(lit.data(), lit.data() + lit.size());
+   EXPECT_TRUE(scan.ok);
+   EXPECT_EQ(scan.end, lit.data() + 1);
+}
+
+TEST_F(buffer_lexer_test, malformed_number)
+{
+   cur.buf = "1.2.3 + 1e-9";
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::err);
+   EXPECT_EQ(tok.text, "1.2.3");
+   gettok(tok, cur);
+   EXPECT_EQ(tok.ch, '+');
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::num);
+   EXPECT_EQ(tok.num, 1e-9);
+}
+
+TEST_F(buffer_lexer_test, comment)
+{
+   cur.buf = "# this is a comment \n foo # trailing";
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::id);
+   EXPECT_EQ(tok.text, "foo");
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::eof);
+}
+
+TEST_F(buffer_lexer_test, matches_stream)
+{
+   std::string src{
+      "# Compute the x'th fibonacci number. \n"
+      "def fib(x) \n"
+      "   if x < 3 then 1 else fib(x-1)+fib(x-2) \n"
+      "fib(40.5)"};
+   std::stringstream io{src};
+   cur.buf = src;
+   Token ref{};
+   do
+   {
+      gettok(ref, io);
+      gettok(tok, cur);
+      EXPECT_EQ(tok.type, ref.type);
+      EXPECT_EQ(tok.ch, ref.ch);
+      EXPECT_EQ(tok.offset, ref.offset);
+      if(ref.type == TokenType::num)
+      {
+         EXPECT_EQ(tok.num, ref.num);
+      }
+      else if(ref.type != TokenType::sym)
+      {
+         EXPECT_EQ(tok.id, ref.id);
+      }
+   } while(ref.type != TokenType::eof);
+}
+
 #endif
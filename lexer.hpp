@@ -1,9 +1,13 @@
 #ifndef __LEXER_H_
 #define __LEXER_H_
 
+#include <cstddef>
 #include <string>
+#include <string_view>
 #include <istream>
 
+#include "symbol-table.hpp"
+
 enum class TokenType
 {
    eof = -1,
@@ -15,18 +19,55 @@ enum class TokenType
    //primary
    id = -4,
    num = -5,
-   sym = -6
+   sym = -6,
+
+   // malformed literal, tok.text/offset locate it in buffer lexing
+   err = -7,
+
+   // operator definitions: def binary<c> <prec> (a b), def unary<c> (v)
+   binary = -8,
+   unary = -9
 };
 
 struct Token
 {
    TokenType type{TokenType::eof};
-   std::string id{}; // identifiers
+   Symbol id{}; // identifiers (interned)
    double num{}; // number types (doubles)
    char ch; // single character
+   std::string_view text{}; // source span (buffer lexing only)
+   std::size_t offset{}; // byte offset of the token in the buffer, or in what was read from the stream
+};
+
+// position in a contiguous source buffer
+struct BufferCursor
+{
+   std::string_view buf{};
+   std::size_t pos{};
 };
 
 
+// TokenType::id, or the keyword's type if text is a keyword
+TokenType identifierType(std::string_view text);
+
+// Result of scanning one numeric literal
+struct NumberScan
+{
+   char const* end; // one past the literal (and past any malformed tail)
+   double value;
+   bool ok;
+};
+
+// Scan a literal of the form  digits [. digits] [(e|E) [+|-] digits]  (either
+// side of the '.' may be empty, but not both) starting at first.  The value
+// is correctly rounded.  Malformed literals such as "1.2.3", "." or "1e+"
+// report !ok with end past the whole malformed run.
+NumberScan scanNumber(char const* first, char const* last);
+
 void gettok(Token& tok, std::istream& stream);
 
+// zero-copy variant; tok.text spans the source, identifiers are interned
+// straight from that span
+void gettok(Token& tok, BufferCursor& cur);
+
 #endif // __LEXER_H_
@@ -1,5 +1,27 @@
+#include <iostream>
 
-int main()
-{
+#include "driver.hpp"
 
+int main(int argc, char** argv)
+{
+   DriverOptions opts{};
+   char const* path{nullptr};
+   for(int i{1}; i < argc; i++)
+   {
+      if(argv[i][0] != '-')
+      {
+         path = argv[i];
+      }
+      else if(!parseOption(opts, argv[i]))
+      {
+         std::cerr << "Unknown option: " << argv[i] << "\n";
+         return 2;
+      }
+   }
+   if(path)
+   {
+      return runFile(path, opts);
+   }
+   mainLoop(opts);
+   return 0;
 }
@@ -0,0 +1,387 @@
+#include "object-cache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "llvm/BinaryFormat/Magic.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace
+{
+
+constexpr char idPrefix[]{"kaleidoscope-object-"};
+constexpr char objectSuffix[]{".o"};
+// written to as path + temporarySuffix + pid.n, then renamed to path
+constexpr char temporarySuffix[]{".tmp."};
+// temporary files older than this were abandoned
+constexpr std::time_t abandoned{60 * 60};
+// eviction goes below the limit, not just to it, not to run on every write
+constexpr unsigned lowWaterPercent{90};
+
+bool endsWith(std::string const& s, char const* suffix)
+{
+   std::size_t const n{std::char_traits<char>::length(suffix)};
+   return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+struct Entry
+{
+   std::string path;
+   std::uint64_t size;
+   struct timespec mtime;
+};
+
+bool olderThan(Entry const& a, Entry const& b)
+{
+   return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec;
+}
+
+// the objects in directory, removing abandoned temporary files on the way
+std::vector<Entry> scan(std::string const& directory)
+{
+   std::vector<Entry> entries{};
+   DIR* dir = opendir(directory.c_str());
+   if(!dir)
+   {
+      return entries;
+   }
+   std::time_t const now{std::time(nullptr)};
+   while(dirent* d = readdir(dir))
+   {
+      std::string name{d->d_name};
+      std::string path{directory + "/" + name};
+      struct stat st{};
+      if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+      {
+         continue;
+      }
+      if(endsWith(name, objectSuffix))
+      {
+         entries.push_back({std::move(path), static_cast<std::uint64_t>(st.st_size), st.st_mtim});
+      }
+      else if(name.find(temporarySuffix) != std::string::npos && now - st.st_mtime > abandoned)
+      {
+         std::remove(path.c_str());
+      }
+   }
+   closedir(dir);
+   return entries;
+}
+
+std::uint64_t total(std::vector<Entry> const& entries)
+{
+   std::uint64_t sum{};
+   for(Entry const& e : entries)
+   {
+      sum += e.size;
+   }
+   return sum;
+}
+
+} // namespace
+
+DiskObjectCache::DiskObjectCache(ObjectCacheOptions const& opts, std::uint64_t inUse)
+   : directory{opts.directory}
+   , maxBytes{opts.maxBytes}
+   , bytes{inUse}
+{}
+
+std::unique_ptr<DiskObjectCache> DiskObjectCache::open(ObjectCacheOptions const& opts)
+{
+   if(std::error_code err = llvm::sys::fs::create_directories(opts.directory))
+   {
+      std::cerr << "Unable to create object cache " << opts.directory << ": " << err.message() << "\n";
+      return nullptr;
+   }
+   std::unique_ptr<DiskObjectCache> cache{new DiskObjectCache(opts, total(scan(opts.directory)))};
+   if(cache->bytes > cache->maxBytes)
+   {
+      cache->evict();
+   }
+   return cache;
+}
+
+std::string DiskObjectCache::moduleId(std::uint64_t key)
+{
+   char hex[17];
+   std::snprintf(hex, sizeof hex, "%016" PRIx64, key);
+   return idPrefix + std::string(hex);
+}
+
+std::string DiskObjectCache::pathFor(llvm::Module const& m) const
+{
+   std::string const& id = m.getModuleIdentifier();
+   if(id.compare(0, sizeof idPrefix - 1, idPrefix) != 0)
+   {
+      return {};
+   }
+   std::string path{directory + "/"};
+   // suffixes added by ORC are not known to be file name safe
+   for(char c : id)
+   {
+      bool const safe{(c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                      c == '-' || c == '_' || c == '.'};
+      path += safe ? c : '_';
+   }
+   return path + objectSuffix;
+}
+
+std::unique_ptr<llvm::MemoryBuffer> DiskObjectCache::load(std::string const& path)
+{
+   auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+   if(!buffer)
+   {
+      return nullptr;
+   }
+   // renamed into place whole, but a crash may still leave a file the
+   // data never reached
+   if(llvm::identify_magic((*buffer)->getBuffer()) == llvm::file_magic::unknown)
+   {
+      std::remove(path.c_str());
+      return nullptr;
+   }
+   // used now, for eviction
+   utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+   return std::move(*buffer);
+}
+
+bool DiskObjectCache::prefetch(llvm::Module const& m)
+{
+   std::string const path{pathFor(m)};
+   if(path.empty())
+   {
+      return false;
+   }
+   std::unique_ptr<llvm::MemoryBuffer> object = load(path);
+   if(!object)
+   {
+      return false;
+   }
+   std::lock_guard<std::mutex> guard{lock};
+   prefetched[m.getModuleIdentifier()] = std::move(object);
+   return true;
+}
+
+std::unique_ptr<llvm::MemoryBuffer> DiskObjectCache::getObject(llvm::Module const* m)
+{
+   std::string const path{pathFor(*m)};
+   if(path.empty())
+   {
+      return nullptr;
+   }
+   std::unique_ptr<llvm::MemoryBuffer> object{};
+   {
+      std::lock_guard<std::mutex> guard{lock};
+      if(auto it = prefetched.find(m->getModuleIdentifier()); it != prefetched.end())
+      {
+         object = std::move(it->second);
+         prefetched.erase(it);
+      }
+   }
+   if(!object)
+   {
+      object = load(path);
+   }
+   (object ? hitCount : missCount).fetch_add(1, std::memory_order_relaxed);
+   return object;
+}
+
+void DiskObjectCache::notifyObjectCompiled(llvm::Module const* m, llvm::MemoryBufferRef obj)
+{
+   std::string const path{pathFor(*m)};
+   if(path.empty())
+   {
+      return;
+   }
+   std::string const temporary{path + temporarySuffix + std::to_string(getpid()) + "." +
+                               std::to_string(temporaries.fetch_add(1, std::memory_order_relaxed))};
+   {
+      std::ofstream out{temporary, std::ios::binary | std::ios::trunc};
+      out.write(obj.getBufferStart(), obj.getBufferSize());
+      if(!out.flush())
+      {
+         std::cerr << "Unable to write to object cache: " << temporary << "\n";
+         std::remove(temporary.c_str());
+         return;
+      }
+   }
+   if(std::rename(temporary.c_str(), path.c_str()) != 0)
+   {
+      std::cerr << "Unable to write to object cache: " << path << "\n";
+      std::remove(temporary.c_str());
+      return;
+   }
+   writeCount.fetch_add(1, std::memory_order_relaxed);
+   if(bytes.fetch_add(obj.getBufferSize()) + obj.getBufferSize() > maxBytes)
+   {
+      evict();
+   }
+}
+
+void DiskObjectCache::evict()
+{
+   std::lock_guard<std::mutex> guard{lock};
+   // other processes write too: count again
+   std::vector<Entry> entries = scan(directory);
+   std::uint64_t size{total(entries)};
+   if(size > maxBytes)
+   {
+      std::sort(entries.begin(), entries.end(), olderThan);
+      std::uint64_t const target{maxBytes / 100 * lowWaterPercent};
+      for(Entry const& e : entries)
+      {
+         if(size <= target)
+         {
+            break;
+         }
+         // gone already if another process evicted it
+         if(std::remove(e.path.c_str()) == 0 || errno == ENOENT)
+         {
+            size -= e.size;
+         }
+      }
+   }
+   bytes = size;
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <cstdlib>
+
+#include "llvm/IR/LLVMContext.h"
+
+namespace
+{
+
+class object_cache_test : public testing::Test
+{
+   protected:
+      void SetUp() override
+      {
+         ASSERT_NE(mkdtemp(directory), nullptr);
+      }
+      void TearDown() override
+      {
+         llvm::sys::fs::remove_directories(directory);
+      }
+
+      // an object file's worth of bytes
+      static std::string object(char fill, std::size_t size)
+      {
+         std::string bytes(size, fill);
+         bytes.replace(0, 4, "\x7f" "ELF");
+         return bytes;
+      }
+
+      std::size_t files()
+      {
+         std::error_code err{};
+         std::size_t n{};
+         for(llvm::sys::fs::directory_iterator it{directory, err}, end{}; !err && it != end; it.increment(err))
+         {
+            n++;
+         }
+         return n;
+      }
+
+      char directory[32]{"/tmp/kaleidoscope-XXXXXX"};
+      llvm::LLVMContext context{};
+};
+
+} // namespace
+
+TEST_F(object_cache_test, stores_and_loads_named_modules)
+{
+   auto cache = DiskObjectCache::open({directory});
+   ASSERT_NE(cache, nullptr);
+   llvm::Module named{DiskObjectCache::moduleId(0x1234), context};
+   llvm::Module anonymous{"kaleidoscope", context};
+   EXPECT_EQ(named.getModuleIdentifier(), "kaleidoscope-object-0000000000001234");
+
+   EXPECT_EQ(cache->getObject(&named), nullptr);
+   std::string const bytes{object('a', 100)};
+   cache->notifyObjectCompiled(&named, llvm::MemoryBufferRef{bytes, "obj"});
+   cache->notifyObjectCompiled(&anonymous, llvm::MemoryBufferRef{bytes, "obj"});
+   EXPECT_EQ(cache->writes(), 1u);
+   EXPECT_EQ(files(), 1u);
+
+   // another process, later
+   auto other = DiskObjectCache::open({directory});
+   auto loaded = other->getObject(&named);
+   ASSERT_NE(loaded, nullptr);
+   EXPECT_EQ(loaded->getBuffer(), bytes);
+   EXPECT_EQ(other->getObject(&anonymous), nullptr);
+   EXPECT_EQ(other->hits(), 1u);
+   EXPECT_EQ(cache->misses(), 1u);
+
+   // split by ORC: cached under its own name
+   llvm::Module part{DiskObjectCache::moduleId(0x1234) + ".submodule.[0x1:f]", context};
+   EXPECT_EQ(other->getObject(&part), nullptr);
+}
+
+TEST_F(object_cache_test, prefetched_objects_survive_eviction)
+{
+   auto cache = DiskObjectCache::open({directory});
+   llvm::Module m{DiskObjectCache::moduleId(1), context};
+   EXPECT_FALSE(cache->prefetch(m));
+   std::string const bytes{object('b', 64)};
+   cache->notifyObjectCompiled(&m, llvm::MemoryBufferRef{bytes, "obj"});
+   EXPECT_TRUE(cache->prefetch(m));
+   llvm::sys::fs::remove_directories(directory);
+   auto loaded = cache->getObject(&m);
+   ASSERT_NE(loaded, nullptr);
+   EXPECT_EQ(loaded->getBuffer(), bytes);
+}
+
+TEST_F(object_cache_test, rejects_damaged_objects)
+{
+   auto cache = DiskObjectCache::open({directory});
+   llvm::Module m{DiskObjectCache::moduleId(2), context};
+   std::string const bytes(64, 'x');
+   cache->notifyObjectCompiled(&m, llvm::MemoryBufferRef{bytes, "obj"});
+   EXPECT_EQ(cache->getObject(&m), nullptr);
+   EXPECT_EQ(files(), 0u);
+}
+
+TEST_F(object_cache_test, evicts_least_recently_used)
+{
+   ObjectCacheOptions opts{directory, 3000};
+   auto cache = DiskObjectCache::open(opts);
+   std::vector<std::unique_ptr<llvm::Module>> modules{};
+   std::string const bytes{object('c', 1000)};
+   for(std::uint64_t key{}; key < 3; key++)
+   {
+      modules.push_back(std::make_unique<llvm::Module>(DiskObjectCache::moduleId(key), context));
+      cache->notifyObjectCompiled(modules.back().get(), llvm::MemoryBufferRef{bytes, "obj"});
+      // mtimes apart
+      struct timespec later{0, 10'000'000};
+      nanosleep(&later, nullptr);
+   }
+   EXPECT_EQ(files(), 3u);
+   // 0 is used again, so 1 is the least recently used
+   EXPECT_NE(cache->getObject(modules[0].get()), nullptr);
+
+   modules.push_back(std::make_unique<llvm::Module>(DiskObjectCache::moduleId(3), context));
+   cache->notifyObjectCompiled(modules.back().get(), llvm::MemoryBufferRef{bytes, "obj"});
+   EXPECT_EQ(files(), 2u);
+   EXPECT_EQ(cache->getObject(modules[1].get()), nullptr);
+   EXPECT_EQ(cache->getObject(modules[2].get()), nullptr);
+   EXPECT_NE(cache->getObject(modules[0].get()), nullptr);
+   EXPECT_NE(cache->getObject(modules[3].get()), nullptr);
+}
+
+#endif
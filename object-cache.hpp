@@ -0,0 +1,84 @@
+#ifndef __OBJECT_CACHE_H_
+#define __OBJECT_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+
+struct ObjectCacheOptions
+{
+   // where objects are kept; empty leaves the cache off
+   std::string directory{};
+   // the size the directory is kept under, by evicting the objects used
+   // least recently
+   std::uint64_t maxBytes{64u << 20};
+};
+
+// Machine code kept on disk between runs, one object file per module.
+// Only modules named by moduleId() are cached, under their name: whoever
+// names a module vouches that its name determines its code (see
+// KaleidoscopeJIT for what goes into the key).  Modules split from a named
+// one (ORC's lazy partitions) keep the name as a prefix.
+//
+// The directory may be shared by processes at once: an object is written
+// to a temporary file and renamed into place, so it is seen whole or not
+// at all, and two processes writing the same one write the same bytes.
+// Loading an object touches its mtime, which orders eviction.  Compile
+// threads may use the cache concurrently.
+class DiskObjectCache : public llvm::ObjectCache
+{
+   public:
+      // the cache in directory, created if need be; nullptr (after
+      // reporting) if it cannot be
+      static std::unique_ptr<DiskObjectCache> open(ObjectCacheOptions const& opts);
+
+      // the module identifier caching a module under key
+      static std::string moduleId(std::uint64_t key);
+
+      // Load the object for m ahead of compiling it, so getObject() will
+      // return it even if the file is evicted meanwhile; false if there is
+      // none.  Lets the JIT skip optimizing a module it will not compile.
+      bool prefetch(llvm::Module const& m);
+
+      std::unique_ptr<llvm::MemoryBuffer> getObject(llvm::Module const* m) override;
+      void notifyObjectCompiled(llvm::Module const* m, llvm::MemoryBufferRef obj) override;
+
+      // Remove the objects used least recently until the directory holds
+      // at most maxBytes, and temporary files abandoned by processes that
+      // died while writing
+      void evict();
+
+      // objects loaded, modules compiled for want of one, objects written
+      std::size_t hits() const { return hitCount; }
+      std::size_t misses() const { return missCount; }
+      std::size_t writes() const { return writeCount; }
+
+   private:
+      DiskObjectCache(ObjectCacheOptions const& opts, std::uint64_t bytes);
+
+      // the object file for m; empty if m is not cached
+      std::string pathFor(llvm::Module const& m) const;
+      std::unique_ptr<llvm::MemoryBuffer> load(std::string const& path);
+
+      std::string directory;
+      std::uint64_t maxBytes;
+      // in the directory, as of the last scan plus what was written since
+      std::atomic<std::uint64_t> bytes;
+      std::atomic<std::size_t> hitCount{0};
+      std::atomic<std::size_t> missCount{0};
+      std::atomic<std::size_t> writeCount{0};
+      // names the temporary files of this process
+      std::atomic<std::uint64_t> temporaries{0};
+
+      std::mutex lock{};
+      // prefetched objects by module identifier, until compiled
+      std::unordered_map<std::string, std::unique_ptr<llvm::MemoryBuffer>> prefetched{};
+};
+
+#endif // __OBJECT_CACHE_H_
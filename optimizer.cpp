@@ -0,0 +1,285 @@
+#include "optimizer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Passes/PassBuilder.h"
+
+namespace
+{
+
+llvm::OptimizationLevel optimizationLevel(unsigned level)
+{
+   switch(level)
+   {
+      case 0: return llvm::OptimizationLevel::O0;
+      case 1: return llvm::OptimizationLevel::O1;
+      case 2: return llvm::OptimizationLevel::O2;
+      default: return llvm::OptimizationLevel::O3;
+   }
+}
+
+} // namespace
+
+Optimizer::Optimizer(OptimizerOptions o, std::unique_ptr<llvm::TargetMachine> tm)
+   : opts{o}
+   , target{std::move(tm)}
+{
+   if(opts.timePasses)
+   {
+      timePasses();
+   }
+   builder = std::make_unique<llvm::PassBuilder>(target.get(), llvm::PipelineTuningOptions(), llvm::None, &instrumentation);
+   builder->registerModuleAnalyses(mam);
+   builder->registerCGSCCAnalyses(cgam);
+   builder->registerFunctionAnalyses(fam);
+   builder->registerLoopAnalyses(lam);
+   builder->crossRegisterProxies(lam, fam, cgam, mam);
+
+   llvm::OptimizationLevel const level = optimizationLevel(opts.level);
+   if(level == llvm::OptimizationLevel::O0)
+   {
+      modulePipeline = builder->buildO0DefaultPipeline(level);
+   }
+   else
+   {
+      modulePipeline = builder->buildPerModuleDefaultPipeline(level);
+      functionPipeline = builder->buildFunctionSimplificationPipeline(level, llvm::ThinOrFullLTOPhase::None);
+   }
+}
+
+Optimizer::~Optimizer() = default;
+
+void Optimizer::run(llvm::Module& m)
+{
+   if(fastMath())
+   {
+      for(llvm::Function& f : m)
+      {
+         markFastMath(f);
+      }
+   }
+   modulePipeline.run(m, mam);
+   // results are cached by IR address, which the next module may reuse
+   lam.clear();
+   fam.clear();
+   cgam.clear();
+   mam.clear();
+}
+
+void Optimizer::run(llvm::Function& f)
+{
+   if(fastMath())
+   {
+      markFastMath(f);
+   }
+   if(!f.isDeclaration())
+   {
+      functionPipeline.run(f, fam);
+   }
+   lam.clear();
+   fam.clear();
+   mam.clear();
+}
+
+void Optimizer::markFastMath(llvm::Function& f) const
+{
+   for(llvm::BasicBlock& bb : f)
+   {
+      for(llvm::Instruction& inst : bb)
+      {
+         if(!llvm::isa<llvm::FPMathOperator>(inst))
+         {
+            continue;
+         }
+         if(opts.reassociate)
+         {
+            inst.setHasAllowReassoc(true);
+            inst.setHasNoSignedZeros(true);
+         }
+         if(opts.contract)
+         {
+            inst.setHasAllowContract(true);
+         }
+      }
+   }
+}
+
+// Passes and analyses nest (adaptors run passes, passes request
+// analyses); each is charged the time it ran minus the time of whatever
+// ran inside it.
+void Optimizer::timePasses()
+{
+   auto begin = [this](llvm::StringRef name, llvm::Any)
+   {
+      running.push_back({name.str(), std::chrono::steady_clock::now(), {}});
+   };
+   auto end = [this]
+   {
+      Running done = std::move(running.back());
+      running.pop_back();
+      auto const elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - done.start);
+      times[done.name] += elapsed - done.nested;
+      if(!running.empty())
+      {
+         running.back().nested += elapsed;
+      }
+   };
+   instrumentation.registerBeforeNonSkippedPassCallback(begin);
+   instrumentation.registerAfterPassCallback([end](llvm::StringRef, llvm::Any, llvm::PreservedAnalyses const&) { end(); });
+   instrumentation.registerAfterPassInvalidatedCallback([end](llvm::StringRef, llvm::PreservedAnalyses const&) { end(); });
+   instrumentation.registerBeforeAnalysisCallback(begin);
+   instrumentation.registerAfterAnalysisCallback([end](llvm::StringRef, llvm::Any) { end(); });
+}
+
+void Optimizer::printPassTimes(std::ostream& os) const
+{
+   std::vector<std::pair<std::string, std::chrono::nanoseconds>> sorted(times.begin(), times.end());
+   std::sort(sorted.begin(), sorted.end(), [](auto const& a, auto const& b) { return a.second > b.second; });
+   std::chrono::nanoseconds total{};
+   for(auto const& [name, time] : sorted)
+   {
+      total += time;
+   }
+   char line[32];
+   for(auto const& [name, time] : sorted)
+   {
+      std::snprintf(line, sizeof line, "%10.3f ms  ", time.count() / 1e6);
+      os << line << name << "\n";
+   }
+   std::snprintf(line, sizeof line, "%10.3f ms  ", total.count() / 1e6);
+   os << line << "total\n";
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <optional>
+#include <sstream>
+
+#include "llvm/IR/Verifier.h"
+
+#include "code-generator.hpp"
+#include "parser.hpp"
+#include "resolver.hpp"
+
+namespace
+{
+
+class optimizer_test : public testing::Test
+{
+   protected:
+      // definitions in src, generated into cg's module
+      llvm::Module& generate(std::string_view src)
+      {
+         BufferCursor cur{src};
+         Token tok{};
+         gettok(tok, cur);
+         for(auto& item : parseModule(tok, cur))
+         {
+            EXPECT_TRUE(resolver.resolve(item));
+            EXPECT_TRUE(std::get<std::unique_ptr<FunctionAST>>(item)->codegen(cg));
+         }
+         return cg.module();
+      }
+
+      std::size_t count(llvm::Function const& f, unsigned opcode)
+      {
+         std::size_t n{};
+         for(auto const& bb : f)
+         {
+            for(auto const& inst : bb)
+            {
+               n += inst.getOpcode() == opcode;
+            }
+         }
+         return n;
+      }
+
+      // the value f returns, if a constant
+      std::optional<double> returnedConstant(llvm::Function const& f)
+      {
+         auto const* ret = llvm::dyn_cast<llvm::ReturnInst>(f.back().getTerminator());
+         auto const* c = ret ? llvm::dyn_cast<llvm::ConstantFP>(ret->getReturnValue()) : nullptr;
+         if(!c)
+         {
+            return std::nullopt;
+         }
+         return c->getValueAPF().convertToDouble();
+      }
+
+      CodeGenContext cg{"optimizer_test"};
+      Resolver resolver{};
+};
+
+} // namespace
+
+TEST_F(optimizer_test, module_pipeline_inlines_and_folds)
+{
+   llvm::Module& m = generate("def sq(x) x*x\ndef nine(x) sq(3)");
+   Optimizer{OptimizerOptions{0}}.run(m);
+   EXPECT_EQ(count(*m.getFunction("nine"), llvm::Instruction::Call), 1u);
+
+   Optimizer{OptimizerOptions{2}}.run(m);
+   EXPECT_FALSE(llvm::verifyModule(m, &llvm::errs()));
+   EXPECT_EQ(count(*m.getFunction("nine"), llvm::Instruction::Call), 0u);
+   EXPECT_EQ(returnedConstant(*m.getFunction("nine")), 9.0);
+}
+
+TEST_F(optimizer_test, function_pipeline)
+{
+   llvm::Module& m = generate("def id(x) x*1");
+   llvm::Function& f = *m.getFunction("id");
+   EXPECT_EQ(count(f, llvm::Instruction::FMul), 1u);
+   Optimizer{OptimizerOptions{1}}.run(f);
+   EXPECT_EQ(count(f, llvm::Instruction::FMul), 0u);
+   EXPECT_EQ(f.back().getTerminator()->getOperand(0), f.getArg(0));
+}
+
+TEST_F(optimizer_test, fast_math_is_opt_in)
+{
+   llvm::Module& m = generate("def a(x) (x+1)+1\ndef b(x) (x+1)+1");
+   // without reassociation two additions of 1 are not one of 2
+   Optimizer{OptimizerOptions{3}}.run(*m.getFunction("a"));
+   EXPECT_EQ(count(*m.getFunction("a"), llvm::Instruction::FAdd), 2u);
+
+   OptimizerOptions fast{3};
+   fast.reassociate = true;
+   fast.contract = true;
+   Optimizer{fast}.run(*m.getFunction("b"));
+   llvm::Function const& b = *m.getFunction("b");
+   ASSERT_EQ(count(b, llvm::Instruction::FAdd), 1u);
+   for(auto const& inst : b.front())
+   {
+      if(inst.getOpcode() == llvm::Instruction::FAdd)
+      {
+         EXPECT_TRUE(inst.hasAllowReassoc());
+         EXPECT_TRUE(inst.hasNoSignedZeros());
+         EXPECT_TRUE(inst.hasAllowContract());
+      }
+   }
+}
+
+TEST_F(optimizer_test, times_passes)
+{
+   llvm::Module& m = generate("def sq(x) x*x\ndef f(x y) sq(x) + sq(y) * (x - y)");
+   Optimizer untimed{};
+   untimed.run(m);
+   EXPECT_TRUE(untimed.passTimes().empty());
+
+   OptimizerOptions timed{};
+   timed.timePasses = true;
+   Optimizer opt{timed};
+   opt.run(m);
+   EXPECT_TRUE(opt.passTimes().count("InstCombinePass"));
+   EXPECT_TRUE(opt.passTimes().count("InlinerPass"));
+   std::ostringstream report{};
+   opt.printPassTimes(report);
+   EXPECT_NE(report.str().find("InstCombinePass\n"), std::string::npos);
+   EXPECT_NE(report.str().find("total\n"), std::string::npos);
+}
+
+#endif
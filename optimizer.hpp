@@ -0,0 +1,95 @@
+#ifndef __OPTIMIZER_H_
+#define __OPTIMIZER_H_
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace llvm
+{
+class PassBuilder;
+}
+
+struct OptimizerOptions
+{
+   // 0 to 3, as -O0 .. -O3
+   unsigned level{2};
+   // Fast-math, off by default since it changes results: reassociation
+   // lets (x+1)+1 become x+2 (and, as -fassociative-math does, ignores the
+   // sign of zeros), contraction lets a*b+c become one fma
+   bool reassociate{false};
+   bool contract{false};
+   // record the time spent in each pass, see passTimes()
+   bool timePasses{false};
+};
+
+// Optimizes generated IR with the new pass manager, between codegen and
+// execution: the standard per-module or per-function pipeline of the
+// chosen level, after marking floating point operations with the
+// fast-math flags asked for.  At -O0 only the flags are applied.  Keeps
+// its analysis managers between runs, so one optimizer is used by one
+// thread at a time.
+class Optimizer
+{
+   public:
+      // tm, if given, lets the passes query the target (vector widths,
+      // costs) and should describe the machine the code will run on
+      explicit Optimizer(OptimizerOptions opts = {}, std::unique_ptr<llvm::TargetMachine> tm = nullptr);
+      ~Optimizer();
+
+      Optimizer(Optimizer const&) = delete;
+      Optimizer& operator=(Optimizer const&) = delete;
+
+      OptimizerOptions const& options() const { return opts; }
+
+      // the per-module pipeline, for a module about to be compiled
+      void run(llvm::Module& m);
+      // the function simplification pipeline only, for one function
+      void run(llvm::Function& f);
+
+      // Exclusive time per pass name over all runs so far, time spent in
+      // nested passes counted for those; empty unless timePasses was set
+      std::map<std::string, std::chrono::nanoseconds> const& passTimes() const { return times; }
+      // passTimes(), slowest first, one line per pass
+      void printPassTimes(std::ostream& os) const;
+
+   private:
+      bool fastMath() const { return opts.reassociate || opts.contract; }
+      void markFastMath(llvm::Function& f) const;
+      void timePasses();
+
+      struct Running
+      {
+         std::string name;
+         std::chrono::steady_clock::time_point start;
+         std::chrono::nanoseconds nested;
+      };
+
+      OptimizerOptions opts;
+      std::unique_ptr<llvm::TargetMachine> target;
+      llvm::PassInstrumentationCallbacks instrumentation{};
+      // the analyses registered with the managers refer back to it
+      std::unique_ptr<llvm::PassBuilder> builder;
+      llvm::LoopAnalysisManager lam{};
+      llvm::FunctionAnalysisManager fam{};
+      llvm::CGSCCAnalysisManager cgam{};
+      llvm::ModuleAnalysisManager mam{};
+      llvm::ModulePassManager modulePipeline{};
+      llvm::FunctionPassManager functionPipeline{};
+      std::vector<Running> running{};
+      std::map<std::string, std::chrono::nanoseconds> times{};
+};
+
+#endif // __OPTIMIZER_H_
@@ -0,0 +1,412 @@
+#include "parallel-parser.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "char-class.hpp"
+
+namespace
+{
+
+// More chunks than workers, so a slow chunk does not leave threads idle.
+constexpr std::size_t chunksPerThread{4};
+
+// Inputs smaller than this are not worth a thread.
+constexpr std::size_t minChunkSize{64 << 10};
+
+bool isKeywordAt(std::string_view src, std::size_t pos, std::string_view kw)
+{
+   if(src.compare(pos, kw.size(), kw) != 0)
+   {
+      return false;
+   }
+   std::size_t after = pos + kw.size();
+   return after == src.size() || !isAlnumChar(src[after]);
+}
+
+// Whether src may define an operator.  A mention inside a comment only
+// costs a pass over the operator prototypes.
+bool definesOperators(std::string_view src)
+{
+   for(std::string_view kw : {std::string_view{"binary"}, std::string_view{"unary"}})
+   {
+      for(std::size_t pos = src.find(kw); pos != std::string_view::npos; pos = src.find(kw, pos + 1))
+      {
+         if((pos == 0 || !isAlnumChar(src[pos - 1])) && isKeywordAt(src, pos, kw))
+         {
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+// The comment state is only known at line starts, so arbitrary targets are
+// first moved forward to one.
+std::size_t lineStartAtOrAfter(std::string_view src, std::size_t pos)
+{
+   while(pos != 0 && pos < src.size() && !hasClass(src[pos - 1], cc_eol))
+   {
+      ++pos;
+   }
+   return pos;
+}
+
+// Run work(i) for every i below count on up to `threads` threads,
+// including the calling one
+template< class Work >
+void runChunks(std::size_t count, unsigned threads, Work const& work)
+{
+   std::atomic<std::size_t> next{0};
+   auto worker = [&]
+   {
+      for(std::size_t i; (i = next.fetch_add(1)) < count;)
+      {
+         work(i);
+      }
+   };
+   std::vector<std::thread> pool{};
+   for(unsigned t{1}; t < std::min<std::size_t>(threads, count); t++)
+   {
+      pool.emplace_back(worker);
+   }
+   worker();
+   for(auto& t : pool)
+   {
+      t.join();
+   }
+}
+
+// The operators the prototypes in src[begin, end) define, in order.  Every
+// 'def' and 'extern' token starts an item (error recovery stops at them),
+// so these are exactly the ones a full parse registers.
+std::vector<std::pair<char, int>> operatorDefinitions(std::string_view src, std::size_t begin, std::size_t end)
+{
+   std::vector<std::pair<char, int>> defs{};
+   BufferCursor cur{src.substr(0, end), begin};
+   Token tok{};
+   // the prototypes are thrown away, and so are their errors: the real
+   // parse reports them
+   Diagnostics ignored{};
+   DiagnosticScope scope{ignored};
+   gettok(tok, cur);
+   while(tok.type != TokenType::eof)
+   {
+      bool const item{tok.type == TokenType::def || tok.type == TokenType::ext};
+      gettok(tok, cur);
+      if(item && (tok.type == TokenType::binary || tok.type == TokenType::unary))
+      {
+         OperatorTable scratch{};
+         if(auto proto = parsePrototype(tok, cur, scratch))
+         {
+            defs.emplace_back(proto->getOperatorName(), proto->isBinaryOp() ? int(proto->precedence) : 0);
+         }
+      }
+   }
+   return defs;
+}
+
+} // namespace
+
+// Comments run from '#' to the end of the line and there are no string
+// literals, so a scan that starts outside a comment tracks comment state
+// exactly.  A keyword must follow whitespace or ';' so that it cannot be
+// the tail of an identifier or of a malformed literal the lexer swallows
+// whole.
+std::size_t nextSplitPoint(std::string_view src, std::size_t from, std::size_t minCut)
+{
+   minCut = std::max<std::size_t>(minCut, 1);
+   std::size_t pos = from;
+   while(pos < src.size())
+   {
+      char c = src[pos];
+      if(c == '#')
+      {
+         while(pos < src.size() && !hasClass(src[pos], cc_eol))
+         {
+            ++pos;
+         }
+         continue;
+      }
+      if(pos >= minCut && (isSpaceChar(src[pos - 1]) || src[pos - 1] == ';') &&
+         (isKeywordAt(src, pos, "def") || isKeywordAt(src, pos, "extern")))
+      {
+         return pos;
+      }
+      if(c == ';' && pos + 1 >= minCut && pos + 1 != src.size())
+      {
+         return pos + 1;
+      }
+      ++pos;
+   }
+   return src.size();
+}
+
+std::vector<std::size_t> findSplitPoints(std::string_view src, std::size_t chunks)
+{
+   std::vector<std::size_t> points{0};
+   if(chunks < 2)
+   {
+      return points;
+   }
+   std::size_t share = src.size() / chunks;
+   for(std::size_t i{1}; i < chunks; i++)
+   {
+      std::size_t target = std::max(share * i, points.back() + 1);
+      if(target >= src.size())
+      {
+         break;
+      }
+      std::size_t line = lineStartAtOrAfter(src, target);
+      std::size_t cut = nextSplitPoint(src, line, line);
+      if(cut >= src.size())
+      {
+         break;
+      }
+      points.push_back(cut);
+   }
+   return points;
+}
+
+std::vector<TopLevelItem> parseModuleParallel(std::string_view src, OperatorTable& ops, unsigned threads)
+{
+   if(threads == 0)
+   {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+   }
+   std::size_t chunks = std::min<std::size_t>(threads * chunksPerThread, src.size() / minChunkSize);
+   std::vector<std::size_t> cuts = findSplitPoints(src, chunks);
+   cuts.push_back(src.size());
+   chunks = cuts.size() - 1;
+
+   // An operator definition changes how the rest of the input parses, so
+   // each chunk starts from the table as of its first byte: the chunks'
+   // operator prototypes are found first (in parallel, and only if there
+   // may be any), then applied in order.
+   std::vector<OperatorTable> tables(chunks, ops);
+   if(chunks > 1 && definesOperators(src))
+   {
+      std::vector<std::vector<std::pair<char, int>>> defined(chunks);
+      runChunks(chunks - 1, threads, [&](std::size_t i)
+      {
+         if(definesOperators(src.substr(cuts[i], cuts[i + 1] - cuts[i])))
+         {
+            defined[i] = operatorDefinitions(src, cuts[i], cuts[i + 1]);
+         }
+      });
+      for(std::size_t i{1}; i < chunks; i++)
+      {
+         tables[i] = tables[i - 1];
+         for(auto [op, prec] : defined[i - 1])
+         {
+            if(prec)
+            {
+               tables[i].defineBinary(op, prec);
+            }
+            else
+            {
+               tables[i].defineUnary(op);
+            }
+         }
+      }
+   }
+
+   std::vector<std::vector<TopLevelItem>> results(chunks);
+   // each chunk's errors are collected apart and reported in order below,
+   // not written from several threads at once
+   std::vector<Diagnostics> errors(chunks);
+   runChunks(chunks, threads, [&](std::size_t i)
+   {
+      // offsets stay relative to the whole source
+      BufferCursor cur{src.substr(0, cuts[i + 1]), cuts[i]};
+      Token tok{};
+      DiagnosticScope scope{errors[i]};
+      gettok(tok, cur);
+      results[i] = parseModule(tok, cur, tables[i]);
+   });
+   ops = tables.back();
+   for(Diagnostics const& chunk : errors)
+   {
+      for(Diagnostic const& d : chunk.all())
+      {
+         reportError(d.offset, d.message);
+      }
+   }
+
+   std::vector<TopLevelItem> items{};
+   if(results.size() == 1)
+   {
+      return std::move(results[0]);
+   }
+   std::size_t total{};
+   for(auto const& r : results)
+   {
+      total += r.size();
+   }
+   items.reserve(total);
+   for(auto& r : results)
+   {
+      std::move(r.begin(), r.end(), std::back_inserter(items));
+   }
+   return items;
+}
+
+std::vector<TopLevelItem> parseModuleParallel(std::string_view src, unsigned threads)
+{
+   OperatorTable ops{};
+   return parseModuleParallel(src, ops, threads);
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+namespace
+{
+
+bool sameItem(TopLevelItem const& lhs, TopLevelItem const& rhs)
+{
+   if(lhs.index() != rhs.index())
+   {
+      return false;
+   }
+   return std::visit([&rhs](auto const& node)
+   {
+      return *node == *std::get<std::decay_t<decltype(node)>>(rhs);
+   }, lhs);
+}
+
+std::string generatedSource(std::size_t items)
+{
+   std::string s{};
+   for(std::size_t i{}; i < items; i++)
+   {
+      switch(i % 5)
+      {
+         case 0: s += "# banner def extern ;\n"; break;
+         case 1: s += "extern sin" + std::to_string(i) + "(a);\n"; break;
+         case 2: s += "def undef" + std::to_string(i) + "(x y) x*y + undef(x, 2.5e-3)\n"; break;
+         case 3: s += "def broken(x) (x+ \n"; break;
+         case 4: s += "undef(" + std::to_string(i) + ", 1.5); 3*4;\n"; break;
+      }
+   }
+   return s;
+}
+
+} // namespace
+
+TEST(parallel_parser_test, split_points_skip_comments_and_identifiers)
+{
+   std::string_view src{"x+1\n# def in comment\nundef(1)\nexterns\n def foo(x) x"};
+   auto points = findSplitPoints(src, 2);
+   ASSERT_EQ(points.size(), 2u);
+   EXPECT_EQ(points[0], 0u);
+   EXPECT_EQ(src.substr(points[1], 3), "def");
+   EXPECT_EQ(points[1], src.find(" def foo") + 1);
+}
+
+TEST(parallel_parser_test, split_points_after_semicolon)
+{
+   std::string_view src{"1+2;\n3*4;\n5-6;\n7"};
+   auto points = findSplitPoints(src, 4);
+   for(std::size_t i{1}; i < points.size(); i++)
+   {
+      EXPECT_EQ(src[points[i] - 1], ';');
+   }
+   EXPECT_GT(points.size(), 1u);
+}
+
+TEST(parallel_parser_test, split_points_none)
+{
+   EXPECT_EQ(findSplitPoints("def foo(x) x", 8), std::vector<std::size_t>{0});
+   EXPECT_EQ(findSplitPoints("", 8), std::vector<std::size_t>{0});
+}
+
+TEST(parallel_parser_test, matches_sequential)
+{
+   std::string src = generatedSource(20000);
+
+   // the errors in the input must come out as a sequential parse reports them
+   Diagnostics expectedErrors{};
+   std::vector<TopLevelItem> expected{};
+   {
+      DiagnosticScope scope{expectedErrors};
+      BufferCursor cur{src};
+      Token tok{};
+      gettok(tok, cur);
+      expected = parseModule(tok, cur);
+   }
+   ASSERT_FALSE(expectedErrors.empty());
+
+   for(unsigned threads : {1u, 2u, 3u, 8u})
+   {
+      Diagnostics errors{};
+      std::vector<TopLevelItem> items{};
+      {
+         DiagnosticScope scope{errors};
+         items = parseModuleParallel(src, threads);
+      }
+      ASSERT_EQ(items.size(), expected.size()) << threads;
+      for(std::size_t i{}; i < items.size(); i++)
+      {
+         ASSERT_TRUE(sameItem(items[i], expected[i])) << "item " << i << " threads " << threads;
+      }
+      ASSERT_EQ(errors.errorCount(), expectedErrors.errorCount()) << threads;
+      for(std::size_t i{}; i < errors.errorCount(); i++)
+      {
+         EXPECT_EQ(errors.all()[i].offset, expectedErrors.all()[i].offset) << "error " << i;
+         EXPECT_EQ(errors.all()[i].message, expectedErrors.all()[i].message) << "error " << i;
+      }
+   }
+}
+
+TEST(parallel_parser_test, operators_defined_midway)
+{
+   // operators defined part way through apply from there on, in whichever
+   // chunk they are used; one only mentioned in a comment never does
+   std::string src = generatedSource(6000);
+   src += "def binary| 5 (a b) a\n# def unary! (v) v\n";
+   src += generatedSource(6000);
+   src += "extern unary~(v);\n";
+   for(int i{}; i < 2000; i++)
+   {
+      src += "def g" + std::to_string(i) + "(x y) x | ~y * 2;\n";
+      src += i % 100 ? "" : "!1;\n";
+   }
+   src += generatedSource(6000);
+
+   Diagnostics expectedErrors{};
+   std::vector<TopLevelItem> expected{};
+   OperatorTable expectedOps{};
+   {
+      DiagnosticScope scope{expectedErrors};
+      BufferCursor cur{src};
+      Token tok{};
+      gettok(tok, cur);
+      expected = parseModule(tok, cur, expectedOps);
+   }
+   ASSERT_EQ(expectedOps.precedence('|'), 5);
+   ASSERT_TRUE(expectedOps.isUnary('~'));
+   ASSERT_FALSE(expectedOps.isUnary('!'));
+
+   for(unsigned threads : {1u, 4u})
+   {
+      Diagnostics errors{};
+      OperatorTable ops{};
+      std::vector<TopLevelItem> items{};
+      {
+         DiagnosticScope scope{errors};
+         items = parseModuleParallel(src, ops, threads);
+      }
+      EXPECT_EQ(ops, expectedOps);
+      ASSERT_EQ(items.size(), expected.size()) << threads;
+      for(std::size_t i{}; i < items.size(); i++)
+      {
+         ASSERT_TRUE(sameItem(items[i], expected[i])) << "item " << i << " threads " << threads;
+      }
+      ASSERT_EQ(errors.errorCount(), expectedErrors.errorCount()) << threads;
+   }
+   EXPECT_GT(findSplitPoints(src, 16).size(), 4u);
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __PARALLEL_PARSER_H_
+#define __PARALLEL_PARSER_H_
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+#include "parser.hpp"
+
+// Byte offsets, strictly increasing and starting at 0, where src can be cut
+// into at most `chunks` pieces that parse independently.  Each cut is
+// placed at or after an even share of the input, at the start of a
+// top-level 'def'/'extern' or just after a ';', never inside a comment.
+std::vector<std::size_t> findSplitPoints(std::string_view src, std::size_t chunks);
+
+// First cut at or after minCut, scanning from `from`, which must be outside
+// any comment (0 or an earlier cut); src.size() if there is none.
+std::size_t nextSplitPoint(std::string_view src, std::size_t from, std::size_t minCut);
+
+// parseModule over src, lexing and parsing the chunks on `threads` worker
+// threads (0 = hardware concurrency).  The result is the same item list,
+// in the same order, as a single-threaded parseModule, and the same errors
+// are reported, in source order, on the calling thread.  Operators are
+// looked up in ops, and those src defines are registered there; without
+// ops, src is parsed with the built-in ones and its own.
+std::vector<TopLevelItem> parseModuleParallel(std::string_view src, OperatorTable& ops, unsigned threads = 0);
+std::vector<TopLevelItem> parseModuleParallel(std::string_view src, unsigned threads = 0);
+
+#endif // __PARALLEL_PARSER_H_
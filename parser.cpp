@@ -1,7 +1,30 @@
+#include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <optional>
 
 #include "parser.hpp"
+#include "char-class.hpp"
+#include "diagnostics.hpp"
 #include "lexer.hpp"
+#include "stream-reader.hpp"
+
+namespace
+{
+
+// TokenType::err is a malformed number, or from ChunkedReader an
+// identifier longer than it keeps
+char const* lexError(Token const& tok)
+{
+   if(!tok.text.empty() && isAlphaChar(tok.text[0]))
+   {
+      return "Identifier too long";
+   }
+   return "Malformed number literal";
+}
+
+} // namespace
 
 
 
@@ -20,78 +43,87 @@
 //}
 
 
-std::unique_ptr<ExprAST> parsePrimary(Token& tok, std::istream& stream)
+template< class Source >
+ExprPtr parsePrimary(Token& tok, Source& stream, OperatorTable const& ops)
 {
    switch(tok.type)
    {
       case TokenType::id:
       {
-         return parseIdentifierExpr(tok, stream);
+         return parseIdentifierExpr(tok, stream, ops);
       }
       case TokenType::num:
       {
          return parseNumberExpr(tok, stream);
       }
+      case TokenType::err:
+      {
+         reportError(tok.offset, lexError(tok));
+         return nullptr;
+      }
       case TokenType::sym:
       {
          if(tok.ch == '(')
          {
-            return parseParenExpr(tok, stream);
+            return parseParenExpr(tok, stream, ops);
          }
       }
       default:
       {
-         std::cerr << "Unexpected token encountered";
+         reportError(tok.offset, "Unexpected token encountered");
          return nullptr;
       }
    }
 }
 
-std::unique_ptr<ExprAST> parseNumberExpr(Token& tok, std::istream& stream)
+template< class Source >
+ExprPtr parseNumberExpr(Token& tok, Source& stream)
 {
-   auto res = std::make_unique<NumberExprAST>(tok.num);
+   auto res = makeExpr<NumberExprAST>(tok.num);
    gettok(tok, stream);
    return std::move(res);
 }
 
-std::unique_ptr<ExprAST> parseParenExpr(Token& tok, std::istream& stream)
+template< class Source >
+ExprPtr parseParenExpr(Token& tok, Source& stream, OperatorTable const& ops)
 {
    gettok(tok, stream);
-   auto V = parseExpression(tok, stream);
+   auto V = parseExpression(tok, stream, ops);
    if(!V)
    {
       return nullptr;
    }
    if(tok.ch != ')')
    {
-      std::cerr << "Expected ')'";
+      reportError(tok.offset, "Expected ')'");
       return nullptr;
    }
    gettok(tok, stream);
    return V;
 }
 
-std::unique_ptr<ExprAST> parseIdentifierExpr(Token& tok, std::istream& stream)
+template< class Source >
+ExprPtr parseIdentifierExpr(Token& tok, Source& stream, OperatorTable const& ops)
 {
 
-   std::string idName = tok.id;
+   Symbol idName = tok.id;
    gettok(tok, stream);
 
    // variable name
    if(tok.ch != '(')
    {
-      return std::make_unique<VariableExprAST>(idName);
+      return makeExpr<VariableExprAST>(idName);
    }
 
    // else it's a function call
    gettok(tok, stream);
 
-   std::vector<std::unique_ptr<ExprAST>> args;
+   std::pmr::vector<ExprPtr> args{currentResource()};
    if(tok.ch != ')')
    {
       while(1)
       {
-         if(auto arg = parseExpression(tok, stream))
+         if(auto arg = parseExpression(tok, stream, ops))
          {
             args.push_back(std::move(arg));
          }
@@ -105,86 +137,340 @@ std::unique_ptr<ExprAST> parseIdentifierExpr(Token& tok, std::istream& stream)
          }
          if(tok.ch != ',')
          {
-            std::cerr << "Expected ')' or ',' in argument list";
+            reportError(tok.offset, "Expected ')' or ',' in argument list");
             return nullptr;
          }
          gettok(tok, stream);
       }
    }
    gettok(tok, stream);
-   return std::make_unique<CallExprAST>(idName, std::move(args));
+   return makeExpr<CallExprAST>(idName, std::move(args));
 }
 
-std::unique_ptr<ExprAST> parseExpression(Token& tok, std::istream& stream)
+namespace
 {
-   auto lhs = parsePrimary(tok, stream);
-   if(!lhs)
+
+// An operator or bracket waiting on the operand stack.  Parentheses and
+// call argument lists are brackets: operators never fold across them.
+struct Pending
+{
+   enum class Kind : std::uint8_t
    {
-      return nullptr;
-   }
-   return parseBinOpRhs(tok, stream, 0, std::move(lhs));
-}
+      unary,
+      binary,
+      paren,
+      call,
+   };
+   Kind kind;
+   char op;
+   int prec;
+   Symbol callee{};
+   std::size_t firstArg{}; // operand index of a call's first argument
+};
+
+// The operand and operator stacks, kept per thread so that parsing an
+// expression reuses their storage instead of allocating.  A nested user
+// finds them taken and starts with empty ones.
+class ExprStacks
+{
+   public:
+      ExprStacks()
+         : operands{std::move(spareOperands)}
+         , pending{std::move(sparePending)}
+      {}
+      ~ExprStacks()
+      {
+         operands.clear();
+         pending.clear();
+         spareOperands = std::move(operands);
+         sparePending = std::move(pending);
+      }
+
+      std::vector<ExprPtr> operands;
+      std::vector<Pending> pending;
 
-std::unique_ptr<ExprAST> parseBinOpRhs(Token& tok, std::istream& stream, int exprPrec, std::unique_ptr<ExprAST> lhs)
+   private:
+      static thread_local std::vector<ExprPtr> spareOperands;
+      static thread_local std::vector<Pending> sparePending;
+};
+
+thread_local std::vector<ExprPtr> ExprStacks::spareOperands{};
+thread_local std::vector<Pending> ExprStacks::sparePending{};
+
+// Expression parser with explicit stacks in place of recursion: operator
+// precedence parsing (shunting-yard) where '(' and a call's argument list
+// push a bracket, so nesting depth costs heap rather than stack.  Builds
+// the same tree, consumes the same tokens and reports the same errors as
+// recursive precedence climbing would.
+//
+// Binary operators that bind less tightly than minPrec end the expression
+// at the outermost level.  Parsing starts from lhs when given, otherwise
+// from the current token.
+template< class Source >
+ExprPtr parseOperators(Token& tok, Source& stream, OperatorTable const& ops, int minPrec, ExprPtr lhs)
 {
+   ExprStacks stacks{};
+   auto& operands = stacks.operands;
+   auto& pending = stacks.pending;
+   std::size_t brackets{0};
+   bool haveOperand = lhs != nullptr;
+   if(lhs)
+   {
+      operands.push_back(std::move(lhs));
+   }
+
+   // fold the binary operators above the innermost bracket that bind at
+   // least as tightly as prec
+   auto reduce = [&](int prec)
+   {
+      while(!pending.empty() && pending.back().kind == Pending::Kind::binary && pending.back().prec >= prec)
+      {
+         ExprPtr rhs = std::move(operands.back());
+         operands.pop_back();
+         operands.back() = makeExpr<BinaryExprAST>(pending.back().op, std::move(operands.back()), std::move(rhs));
+         pending.pop_back();
+      }
+   };
+
    while(1)
    {
-      int tokPrec = getTokPrecedence(tok);
-      if(tokPrec < exprPrec)
+      if(!haveOperand)
       {
-         return lhs;
+         switch(tok.type)
+         {
+            case TokenType::id:
+            {
+               Symbol idName = tok.id;
+               gettok(tok, stream);
+               if(tok.ch != '(')
+               {
+                  operands.push_back(makeExpr<VariableExprAST>(idName));
+                  haveOperand = true;
+                  break;
+               }
+               gettok(tok, stream);
+               if(tok.ch == ')')
+               {
+                  gettok(tok, stream);
+                  operands.push_back(makeExpr<CallExprAST>(idName, std::pmr::vector<ExprPtr>{currentResource()}));
+                  haveOperand = true;
+                  break;
+               }
+               pending.push_back({Pending::Kind::call, 0, 0, idName, operands.size()});
+               brackets++;
+               break;
+            }
+            case TokenType::num:
+            {
+               operands.push_back(parseNumberExpr(tok, stream));
+               haveOperand = true;
+               break;
+            }
+            case TokenType::err:
+            {
+               reportError(tok.offset, lexError(tok));
+               return nullptr;
+            }
+            case TokenType::sym:
+            {
+               if(tok.ch == '(')
+               {
+                  gettok(tok, stream);
+                  pending.push_back({Pending::Kind::paren, 0, 0});
+                  brackets++;
+                  break;
+               }
+               // only registered prefix operators
+               if(ops.isUnary(tok.ch))
+               {
+                  pending.push_back({Pending::Kind::unary, tok.ch, 0});
+                  gettok(tok, stream);
+                  break;
+               }
+            }
+            default:
+            {
+               reportError(tok.offset, "Unexpected token encountered");
+               return nullptr;
+            }
+         }
+         continue;
       }
-      int binOp = tok.ch;
-      gettok(tok, stream);
-      auto rhs = parsePrimary(tok, stream);
-      if(!rhs)
+
+      // a complete operand; prefix operators bind tighter than any binary
+      while(!pending.empty() && pending.back().kind == Pending::Kind::unary)
       {
-         return nullptr;
+         operands.back() = makeExpr<UnaryExprAST>(pending.back().op, std::move(operands.back()));
+         pending.pop_back();
+      }
+
+      // non-symbol tokens carry ch == 0, which is never an operator
+      int tokPrec = ops.precedence(tok.ch);
+      if(tokPrec >= std::max(brackets != 0 ? 0 : minPrec, 0))
+      {
+         // equal precedence folds first: left associative
+         reduce(tokPrec);
+         pending.push_back({Pending::Kind::binary, tok.ch, tokPrec});
+         gettok(tok, stream);
+         haveOperand = false;
+         continue;
+      }
+
+      reduce(0);
+      if(brackets == 0)
+      {
+         return std::move(operands.back());
       }
-      int nextPrec = getTokPrecedence(tok);
-      if(tokPrec < nextPrec)
+      Pending& open = pending.back();
+      if(open.kind == Pending::Kind::paren)
       {
-         rhs = parseBinOpRhs(tok, stream, tokPrec + 1, std::move(rhs));
-         if(!rhs)
+         if(tok.ch != ')')
          {
+            reportError(tok.offset, "Expected ')'");
             return nullptr;
          }
-
+         gettok(tok, stream);
+         pending.pop_back();
+         brackets--;
+         continue;
+      }
+      if(tok.ch == ',')
+      {
+         gettok(tok, stream);
+         haveOperand = false;
+         continue;
       }
-      lhs = std::make_unique<BinaryExprAST>(binOp, std::move(lhs), std::move(rhs));
+      if(tok.ch != ')')
+      {
+         reportError(tok.offset, "Expected ')' or ',' in argument list");
+         return nullptr;
+      }
+      gettok(tok, stream);
+      std::pmr::vector<ExprPtr> args{currentResource()};
+      args.reserve(operands.size() - open.firstArg);
+      std::move(operands.begin() + open.firstArg, operands.end(), std::back_inserter(args));
+      operands.resize(open.firstArg);
+      operands.push_back(makeExpr<CallExprAST>(open.callee, std::move(args)));
+      pending.pop_back();
+      brackets--;
    }
 }
 
-int getTokPrecedence(Token& tok)
+} // namespace
+
+template< class Source >
+ExprPtr parseUnary(Token& tok, Source& stream, OperatorTable const& ops)
 {
-   if(!isascii(tok.ch))
+   // no binary operator binds tightly enough to continue
+   return parseOperators(tok, stream, ops, std::numeric_limits<int>::max(), nullptr);
+}
+
+template< class Source >
+ExprPtr parseExpression(Token& tok, Source& stream, OperatorTable const& ops)
+{
+   return parseOperators(tok, stream, ops, 0, nullptr);
+}
+
+template< class Source >
+ExprPtr parseBinOpRhs(Token& tok, Source& stream, OperatorTable const& ops, int exprPrec, ExprPtr lhs)
+{
+   return parseOperators(tok, stream, ops, exprPrec, std::move(lhs));
+}
+
+namespace
+{
+
+constexpr std::array<std::int8_t, 256> builtinPrecedence()
+{
+   std::array<std::int8_t, 256> table{};
+   for(auto& prec : table)
    {
-      return -1;
+      prec = -1;
    }
-   int tokPrec = BinopPrecedence[tok.ch];
-   if(tokPrec <= 0) return -1;
-   return tokPrec;
+   table['<'] = 10;
+   table['+'] = 20;
+   table['-'] = 20;
+   table['*'] = 40;
+   return table;
 }
 
-std::unique_ptr<PrototypeAST> parsePrototype(Token& tok, std::istream& stream)
+} // namespace
+
+OperatorTable::OperatorTable()
+   : binary{builtinPrecedence()}
+{}
+
+void OperatorTable::define(PrototypeAST const& proto)
 {
-   // precondition - tok is function id
-   if(tok.type != TokenType::id)
+   if(proto.isBinaryOp())
    {
-      std::cerr << "Expected function name in prototype";
-      return nullptr;
+      defineBinary(proto.getOperatorName(), proto.precedence);
+   }
+   else if(proto.isUnaryOp())
+   {
+      defineUnary(proto.getOperatorName());
+   }
+}
+
+template< class Source >
+std::unique_ptr<PrototypeAST> parsePrototype(Token& tok, Source& stream, OperatorTable& ops)
+{
+   // precondition - tok is function id, or 'binary'/'unary' and the
+   // operator character
+   Symbol fnName{};
+   std::size_t operands{0};
+   int precedence{30};
+   std::size_t const offset{tok.offset};
+   switch(tok.type)
+   {
+      case TokenType::id:
+      {
+         // memoize function name
+         fnName = tok.id;
+         gettok(tok, stream);
+         break;
+      }
+      case TokenType::unary:
+      case TokenType::binary:
+      {
+         operands = tok.type == TokenType::unary ? 1 : 2;
+         std::string_view kind = operands == 1 ? "unary" : "binary";
+         gettok(tok, stream);
+         if(tok.type != TokenType::sym || tok.ch == '(' || tok.ch == ')' || tok.ch == ',' || tok.ch == ';')
+         {
+            reportError(tok.offset, "Expected operator character after '" + std::string(kind) + "'");
+            return nullptr;
+         }
+         std::string name{kind};
+         name += tok.ch;
+         fnName = Symbol(name);
+         gettok(tok, stream);
+         if(operands == 2 && tok.type == TokenType::num)
+         {
+            if(tok.num < 1 || tok.num > 100)
+            {
+               reportError(tok.offset, "Invalid precedence: must be 1..100");
+               return nullptr;
+            }
+            precedence = static_cast<int>(tok.num);
+            gettok(tok, stream);
+         }
+         break;
+      }
+      default:
+      {
+         reportError(tok.offset, "Expected function name in prototype");
+         return nullptr;
+      }
    }
-   // memoize function name
-   std::string fnName = tok.id;
-   gettok(tok, stream);
    // should be start of args now
    if(tok.ch != '(')
    {
-      std::cerr << "Expected '(' in prototype";
+      reportError(tok.offset, "Expected '(' in prototype");
       return nullptr;
    }
    // memoize args
-   std::vector<std::string> argNames;
+   std::pmr::vector<Symbol> argNames{currentResource()};
    while((gettok(tok, stream), tok.type) == TokenType::id)
    {
       argNames.push_back(tok.id);
@@ -192,62 +478,247 @@ std::unique_ptr<PrototypeAST> parsePrototype(Token& tok, std::istream& stream)
    // end args
    if(tok.ch != ')')
    {
-      std::cerr << "Expected ')' in prototype";
+      reportError(tok.offset, "Expected ')' in prototype");
       return nullptr;
    }
-   return std::make_unique<PrototypeAST>(fnName, std::move(argNames));
+   if(operands != 0)
+   {
+      if(argNames.size() != operands)
+      {
+         reportError(tok.offset, "Invalid number of operands for operator");
+         return nullptr;
+      }
+      auto proto = std::make_unique<PrototypeAST>(fnName, std::move(argNames), true, operands == 2 ? precedence : 0);
+      proto->offset = offset;
+      // registered here, so the rest of the input already parses with it
+      ops.define(*proto);
+      return proto;
+   }
+   auto proto = std::make_unique<PrototypeAST>(fnName, std::move(argNames));
+   proto->offset = offset;
+   return proto;
 }
 
-std::unique_ptr<FunctionAST> parseDefinition(Token& tok, std::istream& stream)
+template< class Source >
+std::unique_ptr<FunctionAST> parseDefinition(Token& tok, Source& stream, OperatorTable& ops)
 {
    // precondition - tok is "def"
    if(tok.type != TokenType::def)
    {
-      std::cerr << "Expected 'def' keyword";
+      reportError(tok.offset, "Expected 'def' keyword");
       return nullptr;
    }
+   if(AstArena* arena = currentArena())
+   {
+      arena->startItem();
+   }
 
    // advance to next token (should be function prototype starting with id)
    gettok(tok, stream);
-   auto proto = parsePrototype(tok, stream);
+   auto proto = parsePrototype(tok, stream, ops);
    if(!proto)
    {
       return nullptr;
    }
    // advance to next token (should be function definition expression)
    gettok(tok, stream);
-   if(auto expr = parseExpression(tok, stream))
+   if(auto expr = parseExpression(tok, stream, ops))
    {
       return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
    }
    return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> parseExtern(Token& tok, std::istream& stream)
+template< class Source >
+std::unique_ptr<PrototypeAST> parseExtern(Token& tok, Source& stream, OperatorTable& ops)
 {
    gettok(tok, stream);
-   return parsePrototype(tok, stream);
+   return parsePrototype(tok, stream, ops);
 }
 
-std::unique_ptr<FunctionAST> parseTopLevelExpr(Token& tok, std::istream& stream)
+template< class Source >
+std::unique_ptr<TopLevelExprAST> parseTopLevelExpr(Token& tok, Source& stream, OperatorTable const& ops)
 {
-   if(auto expr = parseExpression(tok, stream))
+   if(AstArena* arena = currentArena())
    {
-      auto proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
-      return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
+      arena->startItem();
+   }
+   std::size_t const offset{tok.offset};
+   if(auto expr = parseExpression(tok, stream, ops))
+   {
+      auto proto = std::make_unique<PrototypeAST>(Symbol{}, std::pmr::vector<Symbol>(currentResource()));
+      proto->offset = offset;
+      return std::make_unique<TopLevelExprAST>(std::move(proto), std::move(expr));
    }
    return nullptr;
 }
 
+namespace
+{
+
+// Panic-mode recovery after an error: skip to the next ';' (consumed),
+// 'def' or 'extern', the same boundaries the parallel front end cuts at,
+// so one mistake gives one diagnostic rather than a cascade of errors and
+// bogus items from the rest of the broken item.
+template< class Source >
+void synchronize(Token& tok, Source& stream)
+{
+   while(tok.type != TokenType::eof && tok.type != TokenType::def && tok.type != TokenType::ext)
+   {
+      bool const semicolon{tok.type == TokenType::sym && tok.ch == ';'};
+      gettok(tok, stream);
+      if(semicolon)
+      {
+         break;
+      }
+   }
+}
+
+// Parse up to and including the next complete item, skipping ';' and
+// dropping items that fail; nullopt at eof
+template< class Source >
+std::optional<TopLevelItem> parseNextItem(Token& tok, Source& stream, OperatorTable& ops, bool arenaPerItem)
+{
+   while(tok.type != TokenType::eof)
+   {
+      std::optional<ArenaScope> itemScope{};
+      if(arenaPerItem && !(tok.type == TokenType::sym && tok.ch == ';'))
+      {
+         itemScope.emplace(std::make_shared<AstArena>());
+      }
+      switch(tok.type)
+      {
+         case TokenType::def:
+         {
+            if(auto def = parseDefinition(tok, stream, ops))
+            {
+               return TopLevelItem{std::move(def)};
+            }
+            break;
+         }
+         case TokenType::ext:
+         {
+            if(auto ext = parseExtern(tok, stream, ops))
+            {
+               // parsePrototype stops on the closing ')'
+               gettok(tok, stream);
+               return TopLevelItem{std::move(ext)};
+            }
+            break;
+         }
+         case TokenType::sym:
+         {
+            if(tok.ch == ';')
+            {
+               gettok(tok, stream);
+               continue;
+            }
+         }
+         default:
+         {
+            if(auto expr = parseTopLevelExpr(tok, stream, ops))
+            {
+               return TopLevelItem{std::move(expr)};
+            }
+            break;
+         }
+      }
+      synchronize(tok, stream);
+   }
+   return std::nullopt;
+}
+
+} // namespace
+
+template< class Source >
+void parseItems(Token& tok, Source& stream, OperatorTable& ops, std::function<void(TopLevelItem)> const& sink)
+{
+   // without a DiagnosticScope of the caller's, errors are printed item by
+   // item, in one write each
+   Diagnostics own{};
+   std::optional<DiagnosticScope> scope{};
+   if(!collectingDiagnostics())
+   {
+      scope.emplace(own);
+   }
+   auto flush = [&own]
+   {
+      if(!own.empty())
+      {
+         printErrors(own.all());
+         own.clear();
+      }
+   };
+   bool const arenaPerItem{currentArena() == nullptr};
+   while(auto item = parseNextItem(tok, stream, ops, arenaPerItem))
+   {
+      flush();
+      sink(std::move(*item));
+   }
+   flush();
+}
+
+template< class Source >
+std::vector<TopLevelItem> parseModule(Token& tok, Source& stream, OperatorTable& ops)
+{
+   std::vector<TopLevelItem> items{};
+   parseItems(tok, stream, ops, [&items](TopLevelItem item) { items.push_back(std::move(item)); });
+   return items;
+}
+
+template< class Source >
+std::vector<TopLevelItem> parseModule(Token& tok, Source& stream)
+{
+   OperatorTable ops{};
+   return parseModule(tok, stream, ops);
+}
+
+template< class Source >
+std::optional<TopLevelItem> Parser<Source>::next()
+{
+   DiagnosticScope scope{diags};
+   if(!started)
+   {
+      gettok(tok, stream);
+      started = true;
+   }
+   return parseNextItem(tok, stream, table, currentArena() == nullptr);
+}
+
+#define INSTANTIATE_PARSER(Source) \
+   template std::unique_ptr<PrototypeAST> parsePrototype(Token&, Source&, OperatorTable&); \
+   template std::unique_ptr<FunctionAST> parseDefinition(Token&, Source&, OperatorTable&); \
+   template std::unique_ptr<PrototypeAST> parseExtern(Token&, Source&, OperatorTable&); \
+   template std::unique_ptr<TopLevelExprAST> parseTopLevelExpr(Token&, Source&, OperatorTable const&); \
+   template ExprPtr parseNumberExpr(Token&, Source&); \
+   template ExprPtr parseParenExpr(Token&, Source&, OperatorTable const&); \
+   template ExprPtr parseIdentifierExpr(Token&, Source&, OperatorTable const&); \
+   template ExprPtr parsePrimary(Token&, Source&, OperatorTable const&); \
+   template ExprPtr parseUnary(Token&, Source&, OperatorTable const&); \
+   template ExprPtr parseExpression(Token&, Source&, OperatorTable const&); \
+   template ExprPtr parseBinOpRhs(Token&, Source&, OperatorTable const&, int, ExprPtr); \
+   template void parseItems(Token&, Source&, OperatorTable&, std::function<void(TopLevelItem)> const&); \
+   template std::vector<TopLevelItem> parseModule(Token&, Source&, OperatorTable&); \
+   template std::vector<TopLevelItem> parseModule(Token&, Source&); \
+   template class Parser<Source>;
+
+INSTANTIATE_PARSER(std::istream)
+INSTANTIATE_PARSER(BufferCursor)
+INSTANTIATE_PARSER(TokenCursor)
+INSTANTIATE_PARSER(ChunkedReader)
+
 
 #ifdef BUILD_TESTS
 #include <gtest/gtest.h>
 
+#include <cstring>
+
 class parser_test : public testing::Test
 {
    public:
       std::stringstream io;
       Token tok{};
+      OperatorTable ops{};
 };
 
 TEST_F(parser_test, def1)
@@ -255,7 +726,7 @@ TEST_F(parser_test, def1)
    io << "def foo(x y) x+foo(y, 4.0);"; // function def
    gettok(tok, io);
    ASSERT_EQ(tok.type, TokenType::def);
-   auto p = parseDefinition(tok, io);
+   auto p = parseDefinition(tok, io, ops);
    EXPECT_TRUE(p != nullptr);
 
 
@@ -263,8 +734,9 @@ TEST_F(parser_test, def1)
    auto y = std::make_unique<VariableExprAST>("y");
    auto num4 = std::make_unique<NumberExprAST>(4.0);
 
-   VariableExprAST* uutFooArg0 = dynamic_cast<VariableExprAST*>(uutFooCall->args[0].get());
-   NumberExprAST* uutFooArg1 = dynamic_cast<NumberExprAST*>(uutFooCall->args[1].get());
+   CallExprAST* uutFooCall = llvm::dyn_cast<CallExprAST>(llvm::dyn_cast<BinaryExprAST>(p->body.get())->rhs.get());
+   VariableExprAST* uutFooArg0 = llvm::dyn_cast<VariableExprAST>(uutFooCall->args[0].get());
+   NumberExprAST* uutFooArg1 = llvm::dyn_cast<NumberExprAST>(uutFooCall->args[1].get());
 
    // test y, 4.0
    auto test = *(uutFooArg0) == *y;
@@ -277,14 +749,13 @@ TEST_F(parser_test, def1)
    std::vector<std::unique_ptr<ExprAST>> fooArgs{};
    fooArgs.push_back(std::move(y));
    fooArgs.push_back(std::move(num4));
-   CallExprAST* uutFooCall = dynamic_cast<CallExprAST*>(dynamic_cast<BinaryExprAST*>(p->body.get())->rhs.get());
    auto fooCall = std::make_unique<CallExprAST>("foo", std::move(fooArgs));
    EXPECT_EQ(*(uutFooCall), *(fooCall.get()));
 
    // test x+foo(y, 4.0)
    auto x = std::make_unique<VariableExprAST>("x");
    auto binExp = std::make_unique<BinaryExprAST>('+', std::move(x), std::move(fooCall));
-   BinaryExprAST* uutBinExp = dynamic_cast<BinaryExprAST*>(p->body.get());
+   BinaryExprAST* uutBinExp = llvm::dyn_cast<BinaryExprAST>(p->body.get());
    EXPECT_EQ(*binExp, *uutBinExp);
 
    // test def foo(x y)
@@ -307,9 +778,9 @@ TEST_F(parser_test, def2)
       << " y;"; // primary expression
    gettok(tok, io);
    ASSERT_EQ(tok.type, TokenType::def);
-   auto p = parseDefinition(tok, io);
+   auto p = parseDefinition(tok, io, ops);
    EXPECT_TRUE(p != nullptr);
-   auto p1 = parseTopLevelExpr(tok, io);
+   auto p1 = parseTopLevelExpr(tok, io, ops);
    EXPECT_TRUE(p1 != nullptr);
 
 }
@@ -320,21 +791,497 @@ TEST_F(parser_test, invalid1)
       << " );"; // bad token expression
    gettok(tok, io);
    ASSERT_EQ(tok.type, TokenType::def);
-   auto p = parseDefinition(tok, io);
+   auto p = parseDefinition(tok, io, ops);
    EXPECT_TRUE(p != nullptr);
-   auto p1 = parseTopLevelExpr(tok, io);
+   auto p1 = parseTopLevelExpr(tok, io, ops);
    EXPECT_TRUE(p1 == nullptr);
 }
 
+TEST_F(parser_test, malformed_number)
+{
+   io << "def foo(x) x+1.2.3;";
+   gettok(tok, io);
+   ASSERT_EQ(tok.type, TokenType::def);
+   auto p = parseDefinition(tok, io, ops);
+   EXPECT_TRUE(p == nullptr);
+}
+
 TEST_F(parser_test, extern1)
 {
    io << "extern sin(a)"; // function def
    gettok(tok, io);
    ASSERT_EQ(tok.type, TokenType::ext);
-   auto p = parseExtern(tok, io);
+   auto p = parseExtern(tok, io, ops);
    EXPECT_TRUE(p != nullptr);
 }
 
+TEST_F(parser_test, token_stream)
+{
+   std::string src{"def foo(x y) x+foo(y, 4.0)*2 < 3;"};
+   io << src;
+   gettok(tok, io);
+   auto expected = parseDefinition(tok, io, ops);
+   ASSERT_TRUE(expected != nullptr);
+
+   auto ts = TokenStream::tokenize(src);
+   TokenCursor cur{&ts};
+   Token t{};
+   gettok(t, cur);
+   auto p = parseDefinition(t, cur, ops);
+   ASSERT_TRUE(p != nullptr);
+   EXPECT_EQ(*p, *expected);
+   EXPECT_EQ(t.ch, ';');
+}
+
+TEST_F(parser_test, token_stream_backtrack)
+{
+   auto ts = TokenStream::tokenize("a*(b+c) d");
+   TokenCursor cur{&ts};
+   gettok(tok, cur);
+   std::uint32_t start = cur.current();
+   auto first = parseExpression(tok, cur, ops);
+   ASSERT_TRUE(first != nullptr);
+   EXPECT_EQ(tok.id, "d");
+
+   seek(tok, cur, start);
+   auto second = parseExpression(tok, cur, ops);
+   ASSERT_TRUE(second != nullptr);
+   EXPECT_EQ(*first, *second);
+}
+
+TEST_F(parser_test, buffer_cursor)
+{
+   BufferCursor cur{"extern sin(a)"};
+   gettok(tok, cur);
+   auto p = parseExtern(tok, cur, ops);
+   ASSERT_TRUE(p != nullptr);
+   EXPECT_EQ(p->name, "sin");
+}
+
+TEST_F(parser_test, module)
+{
+   io << "extern sin(a); def foo(x) x+1; foo(2) def bar(y) y*2";
+   gettok(tok, io);
+   auto items = parseModule(tok, io);
+   ASSERT_EQ(items.size(), 4u);
+   EXPECT_EQ(std::get<std::unique_ptr<PrototypeAST>>(items[0])->name, "sin");
+   EXPECT_EQ(std::get<std::unique_ptr<FunctionAST>>(items[1])->proto->name, "foo");
+   EXPECT_TRUE(std::get<std::unique_ptr<TopLevelExprAST>>(items[2])->proto->name.empty());
+   EXPECT_EQ(std::get<std::unique_ptr<FunctionAST>>(items[3])->proto->name, "bar");
+   EXPECT_EQ(tok.type, TokenType::eof);
+}
+
+TEST_F(parser_test, module_resumes_at_def)
+{
+   // the broken body must not swallow the following definition
+   io << "def foo(x) (x+ def bar(y) y";
+   gettok(tok, io);
+   auto items = parseModule(tok, io);
+   ASSERT_EQ(items.size(), 1u);
+   EXPECT_EQ(std::get<std::unique_ptr<FunctionAST>>(items[0])->proto->name, "bar");
+}
+
+TEST_F(parser_test, panic_mode_recovery)
+{
+   // the rest of a broken item is skipped up to the next ';', 'def' or
+   // 'extern', instead of being parsed as items of its own
+   std::string src{"def f(x) x + ) y z\ndef g(x) x; 1 + ; 2 extern h(a) 3 ) 4 5; 6"};
+   BufferCursor cur{src};
+   Parser<BufferCursor> parser{cur};
+   std::vector<TopLevelItem> items{};
+   for(TopLevelItem& item : parser)
+   {
+      items.push_back(std::move(item));
+   }
+   ASSERT_EQ(items.size(), 5u);
+   EXPECT_EQ(std::get<std::unique_ptr<FunctionAST>>(items[0])->proto->name, "g");
+   EXPECT_EQ(std::get<std::unique_ptr<PrototypeAST>>(items[2])->name, "h");
+   // '3' is complete by itself; the error starts at the ')' after it
+   for(auto [i, value] : {std::pair{1, 2.0}, std::pair{3, 3.0}, std::pair{4, 6.0}})
+   {
+      auto const& expr = *std::get<std::unique_ptr<TopLevelExprAST>>(items[i]);
+      EXPECT_EQ(llvm::cast<NumberExprAST>(*expr.body).value(), value);
+   }
+
+   auto const& errors = parser.diagnostics().all();
+   ASSERT_EQ(errors.size(), 3u);
+   EXPECT_EQ(errors[0].offset, src.find(')', src.find("x +")));
+   EXPECT_EQ(errors[1].offset, src.find("; 2"));
+   EXPECT_EQ(errors[2].offset, src.find(") 4"));
+   LineMap lines{src};
+   EXPECT_EQ(lines.locate(errors[1].offset).line, 2u);
+   EXPECT_EQ(lines.locate(errors[1].offset).column, 17u);
+}
+
+TEST_F(parser_test, stream_error_offsets)
+{
+   // errors are located in stream parsing too
+   std::string src{"def f(x) x + ) y;\n1 + ;"};
+   io << src;
+   Parser<std::istream> parser{io};
+   while(parser.next());
+   auto const& errors = parser.diagnostics().all();
+   ASSERT_EQ(errors.size(), 2u);
+   EXPECT_EQ(errors[0].offset, src.find(')', src.find("x +")));
+   EXPECT_EQ(errors[1].offset, src.rfind(';'));
+}
+
+TEST_F(parser_test, module_prints_errors)
+{
+   // outside any DiagnosticScope, each error is printed as a line of its own
+   std::string src{"1 + ; 2 ) 3;"};
+   BufferCursor cur{src};
+   gettok(tok, cur);
+   std::stringstream err{};
+   auto old = std::cerr.rdbuf(err.rdbuf());
+   auto items = parseModule(tok, cur);
+   std::cerr.rdbuf(old);
+   EXPECT_EQ(items.size(), 1u);
+   EXPECT_EQ(err.str(),
+      "error at offset " + std::to_string(src.find(';')) + ": Unexpected token encountered\n"
+      "error at offset " + std::to_string(src.find(')')) + ": Unexpected token encountered\n");
+
+   // inside one, they are collected there instead
+   Diagnostics diags{};
+   DiagnosticScope scope{diags};
+   BufferCursor again{src};
+   gettok(tok, again);
+   err.str("");
+   old = std::cerr.rdbuf(err.rdbuf());
+   parseModule(tok, again);
+   std::cerr.rdbuf(old);
+   EXPECT_EQ(diags.errorCount(), 2u);
+   EXPECT_TRUE(err.str().empty());
+}
+
+TEST_F(parser_test, kinds_and_hash)
+{
+   BufferCursor cur{"x*x + f(x, 1)  x*x + f(x, 1)  x*x + f(1, x)"};
+   gettok(tok, cur);
+   auto a = parseExpression(tok, cur, ops);
+   auto b = parseExpression(tok, cur, ops);
+   auto c = parseExpression(tok, cur, ops);
+   ASSERT_TRUE(a && b && c);
+
+   EXPECT_TRUE(llvm::isa<BinaryExprAST>(a.get()));
+   EXPECT_FALSE(llvm::isa<CallExprAST>(a.get()));
+   auto sum = llvm::cast<BinaryExprAST>(a.get());
+   EXPECT_EQ(sum->op, '+');
+   EXPECT_NE(llvm::dyn_cast<CallExprAST>(sum->rhs.get()), nullptr);
+   EXPECT_EQ(llvm::dyn_cast<NumberExprAST>(sum->rhs.get()), nullptr);
+
+   EXPECT_EQ(a->structuralHash(), b->structuralHash());
+   EXPECT_EQ(*a, *b);
+   EXPECT_NE(a->structuralHash(), c->structuralHash());
+   EXPECT_NE(*a, *c);
+   EXPECT_NE(*a, *sum->lhs);
+
+   // 0.0 and -0.0 compare equal, so they must hash alike
+   auto zero = makeExpr<NumberExprAST>(0.0);
+   auto negZero = makeExpr<NumberExprAST>(-0.0);
+   EXPECT_EQ(zero->structuralHash(), negZero->structuralHash());
+   EXPECT_EQ(*zero, *negZero);
+}
+
+TEST_F(parser_test, arena)
+{
+   std::string src{"def foo(x y) x+foo(y, 4.0)*2 < 3;"};
+   io << src;
+   gettok(tok, io);
+   auto heap = parseDefinition(tok, io, ops);
+   ASSERT_TRUE(heap != nullptr);
+   EXPECT_FALSE(heap->body->arenaOwned);
+
+   std::unique_ptr<FunctionAST> p{};
+   std::weak_ptr<AstArena> weak{};
+   {
+      auto arena = std::make_shared<AstArena>();
+      weak = arena;
+      ArenaScope scope{arena};
+      BufferCursor cur{src};
+      Token t{};
+      gettok(t, cur);
+      p = parseDefinition(t, cur, ops);
+      EXPECT_GT(arena->bytesUsed(), 0u);
+   }
+   ASSERT_TRUE(p != nullptr);
+   // the definition keeps its arena alive past the scope
+   EXPECT_FALSE(weak.expired());
+   EXPECT_TRUE(p->body->arenaOwned);
+   EXPECT_EQ(*p, *heap);
+   p.reset();
+   EXPECT_TRUE(weak.expired());
+}
+
+TEST_F(parser_test, module_arena_per_item)
+{
+   io << "extern sin(a); def foo(x) x+1; foo(2)";
+   gettok(tok, io);
+   auto items = parseModule(tok, io);
+   ASSERT_EQ(items.size(), 3u);
+   auto& foo = std::get<std::unique_ptr<FunctionAST>>(items[1]);
+   auto& call = std::get<std::unique_ptr<TopLevelExprAST>>(items[2]);
+   EXPECT_TRUE(foo->body->arenaOwned);
+   EXPECT_NE(foo->arena, nullptr);
+   EXPECT_NE(foo->arena, call->arena);
+   EXPECT_EQ(currentArena(), nullptr);
+}
+
+TEST_F(parser_test, binary_operator)
+{
+   EXPECT_EQ(ops.precedence('|'), -1);
+   io << "def binary| 5 (a b) a + b def f(x y z) x < y | z * 2";
+   gettok(tok, io);
+   auto op = parseDefinition(tok, io, ops);
+   ASSERT_TRUE(op != nullptr);
+   EXPECT_EQ(op->proto->getName(), "binary|");
+   EXPECT_TRUE(op->proto->isBinaryOp());
+   EXPECT_EQ(op->proto->getOperatorName(), '|');
+   EXPECT_EQ(op->proto->precedence, 5u);
+   EXPECT_EQ(ops.precedence('|'), 5);
+
+   // '|' binds more loosely than '<'
+   auto f = parseDefinition(tok, io, ops);
+   ASSERT_TRUE(f != nullptr);
+   auto* root = llvm::dyn_cast<BinaryExprAST>(f->body.get());
+   ASSERT_TRUE(root != nullptr);
+   EXPECT_EQ(root->op, '|');
+   EXPECT_EQ(llvm::cast<BinaryExprAST>(*root->lhs).op, '<');
+   EXPECT_EQ(llvm::cast<BinaryExprAST>(*root->rhs).op, '*');
+}
+
+TEST_F(parser_test, unary_operator)
+{
+   io << "def unary!(v) 0 - v def g(x) !x * !!2";
+   gettok(tok, io);
+   auto op = parseDefinition(tok, io, ops);
+   ASSERT_TRUE(op != nullptr);
+   EXPECT_TRUE(op->proto->isUnaryOp());
+   EXPECT_TRUE(ops.isUnary('!'));
+
+   auto g = parseDefinition(tok, io, ops);
+   ASSERT_TRUE(g != nullptr);
+   auto& mul = llvm::cast<BinaryExprAST>(*g->body);
+   auto& lhs = llvm::cast<UnaryExprAST>(*mul.lhs);
+   EXPECT_EQ(lhs.opcode, '!');
+   EXPECT_TRUE(llvm::isa<VariableExprAST>(*lhs.operand));
+   auto& rhs = llvm::cast<UnaryExprAST>(*mul.rhs);
+   EXPECT_TRUE(llvm::isa<UnaryExprAST>(*rhs.operand));
+}
+
+TEST_F(parser_test, operator_errors)
+{
+   auto old = std::cerr.rdbuf(nullptr);
+   for(std::string_view src : {"def binary% (a) a", "def unary- (a b) a", "def binary^ 0 (a b) a",
+                               "def binary (a b) a", "def unary;(a) a"})
+   {
+      std::stringstream in{std::string(src)};
+      gettok(tok, in);
+      EXPECT_EQ(parseDefinition(tok, in, ops), nullptr) << src;
+   }
+   std::cerr.rdbuf(old);
+   EXPECT_EQ(ops.precedence('%'), -1);
+   EXPECT_FALSE(ops.isUnary('-'));
+}
+
+TEST_F(parser_test, operators_are_per_parse)
+{
+   std::string const def{"def binary| 5 (a b) a\n1 | 2"};
+   BufferCursor defCur{def};
+   gettok(tok, defCur);
+   EXPECT_EQ(parseModule(tok, defCur).size(), 2u);
+
+   // an unrelated source does not see the operator
+   std::string const use{"1 | 2"};
+   BufferCursor useCur{use};
+   Parser<BufferCursor> parser{useCur};
+   while(parser.next());
+   ASSERT_EQ(parser.diagnostics().errorCount(), 1u);
+   EXPECT_EQ(parser.diagnostics().all()[0].message, "Unexpected token encountered");
+
+   // unless it is given a table holding it
+   BufferCursor defined{def};
+   Parser<BufferCursor> first{defined};
+   while(first.next());
+   EXPECT_EQ(first.operators().precedence('|'), 5);
+   BufferCursor again{use};
+   Parser<BufferCursor> second{again, first.operators()};
+   auto item = second.next();
+   ASSERT_TRUE(item);
+   EXPECT_TRUE(llvm::isa<BinaryExprAST>(*std::get<std::unique_ptr<TopLevelExprAST>>(*item)->body));
+   EXPECT_FALSE(second.next());
+   EXPECT_TRUE(second.diagnostics().empty());
+   EXPECT_EQ(OperatorTable{}.precedence('|'), -1);
+}
+
+namespace
+{
+
+ExprPtr parseExpr(std::string_view src)
+{
+   BufferCursor cur{src};
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, cur);
+   return parseExpression(tok, cur, ops);
+}
+
+} // namespace
+
+TEST_F(parser_test, precedence_and_associativity)
+{
+   std::pair<std::string_view, std::string_view> const same[]{
+      {"a-b-c", "(a-b)-c"},
+      {"a+b*c-d<e", "((a+(b*c))-d)<e"},
+      {"a*b+c*d", "(a*b)+(c*d)"},
+      {"a<b*c+d*e-f", "a<(((b*c)+(d*e))-f)"},
+      {"f(a+b, g(c)*2)-x", "(f((a+b), (g(c)*2)))-x"},
+      {"f()*(g(h(1)))", "f() * g(h(1))"},
+   };
+   for(auto [lhs, rhs] : same)
+   {
+      auto l = parseExpr(lhs);
+      auto r = parseExpr(rhs);
+      ASSERT_TRUE(l && r) << lhs;
+      EXPECT_EQ(*l, *r) << lhs;
+   }
+   EXPECT_NE(*parseExpr("a-b-c"), *parseExpr("a-(b-c)"));
+   EXPECT_NE(*parseExpr("a*b+c"), *parseExpr("a*(b+c)"));
+}
+
+TEST_F(parser_test, expression_errors)
+{
+   std::pair<std::string_view, std::string_view> const errors[]{
+      {"(a+b", "Expected ')'"},
+      {"f(a b)", "Expected ')' or ',' in argument list"},
+      {"a+)", "Unexpected token encountered"},
+      {"f(1, 2.3.4)", "Malformed number literal"},
+   };
+   for(auto [src, message] : errors)
+   {
+      Diagnostics diags{};
+      DiagnosticScope scope{diags};
+      auto e = parseExpr(src);
+      EXPECT_EQ(e, nullptr) << src;
+      ASSERT_EQ(diags.errorCount(), 1u) << src;
+      EXPECT_EQ(diags.all()[0].message, message);
+   }
+
+   // stops at the offending token, as before
+   std::string src{"g(x; def h(y) y"};
+   BufferCursor cur{src};
+   gettok(tok, cur);
+   auto old = std::cerr.rdbuf(nullptr);
+   EXPECT_EQ(parseExpression(tok, cur, ops), nullptr);
+   std::cerr.rdbuf(old);
+   EXPECT_EQ(tok.ch, ';');
+}
+
+TEST_F(parser_test, deep_nesting)
+{
+   constexpr std::size_t depth{200000};
+   std::string parens = std::string(depth, '(') + "x" + std::string(depth, ')');
+   auto e = parseExpr(parens);
+   ASSERT_TRUE(e != nullptr);
+   EXPECT_TRUE(llvm::isa<VariableExprAST>(*e));
+
+   std::string sum{};
+   for(std::size_t i{}; i < depth; i++)
+   {
+      sum += "x+(";
+   }
+   sum += "1" + std::string(depth, ')');
+   e = parseExpr(sum);
+   ASSERT_TRUE(e != nullptr);
+   ExprAST const* node = e.get();
+   std::size_t levels{};
+   while(auto bin = llvm::dyn_cast<BinaryExprAST>(node))
+   {
+      node = bin->rhs.get();
+      levels++;
+   }
+   EXPECT_EQ(levels, depth);
+
+   std::string calls{};
+   for(std::size_t i{}; i < depth; i++)
+   {
+      calls += "f(1, ";
+   }
+   calls += "2" + std::string(depth, ')');
+   e = parseExpr(calls);
+   ASSERT_TRUE(e != nullptr);
+   EXPECT_EQ(llvm::cast<CallExprAST>(*e).args.size(), 2u);
+   // released here, without recursing
+   e.reset();
+}
+
+TEST_F(parser_test, pull_parser)
+{
+   std::string src{"extern sin(a); def foo(x) x+1; foo(2) (x+ def bar(y) y"};
+   BufferCursor cur{src};
+   Parser<BufferCursor> parser{cur};
+   auto sin = parser.next();
+   ASSERT_TRUE(sin && std::holds_alternative<std::unique_ptr<PrototypeAST>>(*sin));
+   auto foo = parser.next();
+   ASSERT_TRUE(foo && std::holds_alternative<std::unique_ptr<FunctionAST>>(*foo));
+   auto expr = parser.next();
+   ASSERT_TRUE(expr && std::holds_alternative<std::unique_ptr<TopLevelExprAST>>(*expr));
+   EXPECT_TRUE(parser.diagnostics().empty());
+
+   // the broken expression is reported, not printed, and skipped
+   auto bar = parser.next();
+   ASSERT_TRUE(bar);
+   EXPECT_EQ(std::get<std::unique_ptr<FunctionAST>>(*bar)->proto->name, "bar");
+   ASSERT_EQ(parser.diagnostics().errorCount(), 1u);
+   EXPECT_EQ(parser.diagnostics().all()[0].message, "Unexpected token encountered");
+   EXPECT_EQ(parser.diagnostics().all()[0].offset, src.find("def bar"));
+
+   EXPECT_FALSE(parser.next());
+   EXPECT_FALSE(parser.next());
+}
+
+TEST_F(parser_test, pull_parser_range)
+{
+   io << "extern sin(a); def foo(x) x+1; foo(2) def bar(y) y";
+   Token expectTok{};
+   std::stringstream copy{io.str()};
+   gettok(expectTok, copy);
+   auto expected = parseModule(expectTok, copy);
+
+   Parser<std::istream> parser{io};
+   std::size_t n{};
+   for(TopLevelItem& item : parser)
+   {
+      ASSERT_LT(n, expected.size());
+      EXPECT_EQ(item.index(), expected[n].index());
+      n++;
+   }
+   EXPECT_EQ(n, expected.size());
+}
+
+TEST_F(parser_test, pull_parser_reads_lazily)
+{
+   std::string src{};
+   for(int i{}; i < 100; i++)
+   {
+      src += "def f" + std::to_string(i) + "(x) x*x + 1\n";
+   }
+   std::size_t consumed{};
+   ChunkedReader in{[&](char* buf, std::size_t size) -> std::size_t
+   {
+      std::size_t n = std::min(size, src.size() - consumed);
+      std::memcpy(buf, src.data() + consumed, n);
+      consumed += n;
+      return n;
+   }, 64};
+   Parser<ChunkedReader> parser{in};
+   auto first = parser.next();
+   ASSERT_TRUE(first);
+   EXPECT_EQ(std::get<std::unique_ptr<FunctionAST>>(*first)->proto->name, "f0");
+   // the first item needs only the start of the source
+   EXPECT_LE(consumed, 128u);
+}
+
 TEST_F(parser_test, program)
 {
    io << \
@@ -351,12 +1298,12 @@ TEST_F(parser_test, program)
    ASSERT_EQ(tok.type, TokenType::def);
    ASSERT_EQ(tok.id, "def");
 
-   auto def = parseDefinition(tok, io);
+   auto def = parseDefinition(tok, io, ops);
    EXPECT_TRUE(def != nullptr);
 
 
 
-   auto p1 = parseTopLevelExpr(tok, io);
+   auto p1 = parseTopLevelExpr(tok, io, ops);
    EXPECT_TRUE(p1 != nullptr);
 
 }
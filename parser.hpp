@@ -1,14 +1,48 @@
+#ifndef __PARSER_H_
+#define __PARSER_H_
+
 #include "abstract-syntax-tree.hpp"
+#include "diagnostics.hpp"
 #include "lexer.hpp"
+#include "token-stream.hpp"
+#include <functional>
+#include <iterator>
 #include <memory>
-#include <map>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <variant>
+#include <vector>
 
-static std::map<char, int> BinopPrecedence
+// The operators a parse knows: binary precedence by character and the
+// prefix operators.  '<', '+', '-' and '*' are built in; parsing
+// `def binary<c> <prec> (a b)` or `def unary<c> (v)` (or the extern forms)
+// registers <c> in the table the parse was given, so the rest of that
+// input parses with it.  Each Parser, session or module parse has a table
+// of its own; nothing is shared between them.
+class OperatorTable
 {
-   {'<', 10},
-   {'+', 20},
-   {'-', 20},
-   {'*', 40},
+   public:
+      OperatorTable();
+
+      // -1 for characters that are not binary operators
+      int precedence(char c) const { return binary[static_cast<unsigned char>(c)]; }
+      bool isUnary(char c) const { return unary[static_cast<unsigned char>(c)]; }
+
+      void defineBinary(char c, int prec) { binary[static_cast<unsigned char>(c)] = static_cast<std::int8_t>(prec); }
+      void defineUnary(char c) { unary[static_cast<unsigned char>(c)] = true; }
+      // register proto's operator; nothing if it does not define one
+      void define(PrototypeAST const& proto);
+
+      friend bool operator==(OperatorTable const& lhs, OperatorTable const& rhs)
+      {
+         return lhs.binary == rhs.binary && lhs.unary == rhs.unary;
+      }
+      friend bool operator!=(OperatorTable const& lhs, OperatorTable const& rhs) { return !(lhs == rhs); }
+
+   private:
+      std::array<std::int8_t, 256> binary;
+      std::array<bool, 256> unary{};
 };
 
 template< class ASTType >
@@ -20,17 +54,132 @@ std::unique_ptr<ASTType> logError(char const* str)
 
 
 int getNextToken(std::string& str);
-int getTokPrecedence(Token& tok);
-std::unique_ptr<PrototypeAST> parsePrototype(Token& tok, std::istream& stream);
-std::unique_ptr<FunctionAST> parseDefinition(Token& tok, std::istream& stream);
-std::unique_ptr<PrototypeAST> parseExtern(Token& tok, std::istream& stream);
-std::unique_ptr<FunctionAST> parseTopLevelExpr(Token& tok, std::istream& stream);
-
-
-std::unique_ptr<ExprAST> parseNumberExpr(Token& tok, std::istream& stream);
-std::unique_ptr<ExprAST> parseParenExpr(Token& tok, std::istream& stream);
-std::unique_ptr<ExprAST> parseIdentifierExpr(Token& tok, std::istream& stream);
-std::unique_ptr<ExprAST> parsePrimary(Token& tok, std::istream& stream);
-std::unique_ptr<ExprAST> parseExpression(Token& tok, std::istream& stream);
-std::unique_ptr<ExprAST> parseBinOpRhs(Token& tok, std::istream& stream,
-                                       int expPrec, std::unique_ptr<ExprAST> lhs);
+
+// The parse functions are templated on the token source: anything with a
+// gettok(Token&, Source&) overload.  parser.cpp instantiates them for
+// std::istream, BufferCursor, TokenCursor and ChunkedReader.  Expressions
+// parse with the operators in ops; prototypes of operators register them
+// there.
+template< class Source >
+std::unique_ptr<PrototypeAST> parsePrototype(Token& tok, Source& stream, OperatorTable& ops);
+template< class Source >
+std::unique_ptr<FunctionAST> parseDefinition(Token& tok, Source& stream, OperatorTable& ops);
+template< class Source >
+std::unique_ptr<PrototypeAST> parseExtern(Token& tok, Source& stream, OperatorTable& ops);
+template< class Source >
+std::unique_ptr<TopLevelExprAST> parseTopLevelExpr(Token& tok, Source& stream, OperatorTable const& ops);
+
+
+template< class Source >
+ExprPtr parseNumberExpr(Token& tok, Source& stream);
+template< class Source >
+ExprPtr parseParenExpr(Token& tok, Source& stream, OperatorTable const& ops);
+template< class Source >
+ExprPtr parseIdentifierExpr(Token& tok, Source& stream, OperatorTable const& ops);
+template< class Source >
+ExprPtr parsePrimary(Token& tok, Source& stream, OperatorTable const& ops);
+template< class Source >
+ExprPtr parseUnary(Token& tok, Source& stream, OperatorTable const& ops);
+template< class Source >
+ExprPtr parseExpression(Token& tok, Source& stream, OperatorTable const& ops);
+template< class Source >
+ExprPtr parseBinOpRhs(Token& tok, Source& stream, OperatorTable const& ops,
+                        int expPrec, ExprPtr lhs);
+
+// A definition, an extern declaration or a top-level expression
+using TopLevelItem = std::variant<std::unique_ptr<FunctionAST>,
+                                  std::unique_ptr<PrototypeAST>,
+                                  std::unique_ptr<TopLevelExprAST>>;
+
+// Parse top-level items until eof, in source order, handing each one to
+// sink as soon as it is complete.  Nothing is retained between items, so
+// with a bounded Source (ChunkedReader) memory stays flat however long the
+// input is.  Items that fail to parse are dropped, and the rest of the
+// broken item is skipped up to the next ';' (consumed), 'def' or 'extern'.
+// Errors go to the caller's DiagnosticScope; without one they are printed
+// with printErrors, those of each item before it reaches sink.  Outside an
+// ArenaScope each item gets an arena of its own, released with the item;
+// inside one, every item shares that arena.  Operators are looked up in and
+// registered with ops.
+template< class Source >
+void parseItems(Token& tok, Source& stream, OperatorTable& ops, std::function<void(TopLevelItem)> const& sink);
+
+// parseItems collecting every item; without ops, the source is parsed with
+// the built-in operators and those it defines itself
+template< class Source >
+std::vector<TopLevelItem> parseModule(Token& tok, Source& stream, OperatorTable& ops);
+template< class Source >
+std::vector<TopLevelItem> parseModule(Token& tok, Source& stream);
+
+// Pull-based parsing: each next() parses up to the end of one more item
+// and returns it, so later stages can start on it while the rest of the
+// source is still unread.  Items are the ones parseItems would produce,
+// with the same arena and recovery rules; parse errors are collected in
+// diagnostics() rather than printed, and operators are registered in the
+// parser's own table, starting from the built-in ones or from ops.  Also a
+// single-pass range:
+//
+//    for(TopLevelItem& item : parser) ...
+template< class Source >
+class Parser
+{
+   public:
+      explicit Parser(Source& s, OperatorTable const& ops = {})
+         : stream{s}
+         , table{ops}
+      {}
+
+      // the next item, or nullopt once the source is exhausted
+      std::optional<TopLevelItem> next();
+
+      Diagnostics& diagnostics() { return diags; }
+      Diagnostics const& diagnostics() const { return diags; }
+
+      // the operators defined so far
+      OperatorTable& operators() { return table; }
+      OperatorTable const& operators() const { return table; }
+
+      class iterator
+      {
+         public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = TopLevelItem;
+            using difference_type = std::ptrdiff_t;
+            using pointer = TopLevelItem*;
+            using reference = TopLevelItem&;
+
+            iterator() = default;
+            explicit iterator(Parser* p)
+               : parser{p}
+               , item{p->next()}
+            {}
+
+            reference operator*() { return *item; }
+            pointer operator->() { return &*item; }
+            iterator& operator++()
+            {
+               item = parser->next();
+               return *this;
+            }
+
+            // only the end of the range is meaningful to compare against
+            friend bool operator==(iterator const& lhs, iterator const& rhs) { return lhs.item.has_value() == rhs.item.has_value(); }
+            friend bool operator!=(iterator const& lhs, iterator const& rhs) { return !(lhs == rhs); }
+
+         private:
+            Parser* parser{nullptr};
+            std::optional<TopLevelItem> item{};
+      };
+
+      iterator begin() { return iterator{this}; }
+      iterator end() { return iterator{}; }
+
+   private:
+      Source& stream;
+      Token tok{};
+      bool started{false};
+      Diagnostics diags{};
+      OperatorTable table;
+};
+
+#endif // __PARSER_H_
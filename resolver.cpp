@@ -0,0 +1,331 @@
+#include "resolver.hpp"
+
+#include <algorithm>
+#include <string>
+
+namespace
+{
+
+bool isBuiltinOperator(char op)
+{
+   return op == '+' || op == '-' || op == '*' || op == '<';
+}
+
+} // namespace
+
+std::optional<std::uint32_t> Resolver::lookup(Symbol name) const
+{
+   auto it = ids.find(name);
+   if(it == ids.end())
+   {
+      return std::nullopt;
+   }
+   return it->second;
+}
+
+std::uint32_t Resolver::declare(PrototypeAST& proto, bool definition)
+{
+   auto [it, added] = ids.try_emplace(proto.name, functions.size());
+   if(added)
+   {
+      functions.push_back({proto.name, static_cast<std::uint32_t>(proto.args.size()), definition});
+      proto.id = it->second;
+      return proto.id;
+   }
+   FunctionInfo& info = functions[it->second];
+   if(info.arity != proto.args.size())
+   {
+      reportError(proto.offset, "Function " + std::string(proto.name.str()) + " redeclared with a different number of arguments");
+      return ExprAST::unresolved;
+   }
+   if(definition && info.defined)
+   {
+      reportError(proto.offset, "Function cannot be redefined: " + std::string(proto.name.str()));
+      return ExprAST::unresolved;
+   }
+   info.defined |= definition;
+   proto.id = it->second;
+   return proto.id;
+}
+
+bool Resolver::resolve(PrototypeAST& proto)
+{
+   return declare(proto, false) != ExprAST::unresolved;
+}
+
+bool Resolver::resolve(FunctionAST& fn)
+{
+   // top-level expressions are anonymous and never called
+   if(fn.proto->name.empty())
+   {
+      return resolveBody(fn);
+   }
+   std::optional<std::uint32_t> existing = lookup(fn.proto->name);
+   std::uint32_t id = declare(*fn.proto, true);
+   if(id == ExprAST::unresolved)
+   {
+      return false;
+   }
+   if(resolveBody(fn))
+   {
+      return true;
+   }
+   // forget the definition; a new one was declared last
+   if(existing)
+   {
+      functions[id].defined = false;
+   }
+   else
+   {
+      ids.erase(fn.proto->name);
+      functions.pop_back();
+   }
+   fn.proto->id = ExprAST::unresolved;
+   return false;
+}
+
+bool Resolver::resolve(TopLevelItem& item)
+{
+   return std::visit([this](auto& node) { return resolve(*node); }, item);
+}
+
+// Walks the body with an explicit stack, like the parser, so depth is no
+// concern; hash-consed nodes are visited once.
+bool Resolver::resolveBody(FunctionAST& fn)
+{
+   auto const& params = fn.proto->args;
+   std::size_t const offset = fn.proto->offset;
+   bool ok{true};
+   auto fail = [&](std::string const& message)
+   {
+      reportError(offset, message);
+      ok = false;
+   };
+
+   pending.clear();
+   visited.clear();
+   pending.push_back(fn.body.get());
+   while(!pending.empty())
+   {
+      ExprAST* node = pending.back();
+      pending.pop_back();
+      if(node->shared && !visited.insert(node).second)
+      {
+         continue;
+      }
+      switch(node->getKind())
+      {
+         case ExprAST::Kind::number:
+         {
+            break;
+         }
+         case ExprAST::Kind::variable:
+         {
+            auto& var = llvm::cast<VariableExprAST>(*node);
+            auto it = std::find(params.begin(), params.end(), var.name);
+            if(it == params.end())
+            {
+               fail("Unknown variable name: " + std::string(var.name.str()));
+               break;
+            }
+            var.slot = it - params.begin();
+            break;
+         }
+         case ExprAST::Kind::unary:
+         {
+            auto& un = llvm::cast<UnaryExprAST>(*node);
+            if(!lookup(Symbol(std::string("unary") + un.opcode)))
+            {
+               fail(std::string("Unknown unary operator: ") + un.opcode);
+            }
+            pending.push_back(un.operand.get());
+            break;
+         }
+         case ExprAST::Kind::binary:
+         {
+            auto& bin = llvm::cast<BinaryExprAST>(*node);
+            if(!isBuiltinOperator(bin.op) && !lookup(Symbol(std::string("binary") + bin.op)))
+            {
+               fail(std::string("Invalid binary operator: ") + bin.op);
+            }
+            // left operand first, so errors come out in source order
+            pending.push_back(bin.rhs.get());
+            pending.push_back(bin.lhs.get());
+            break;
+         }
+         case ExprAST::Kind::call:
+         {
+            auto& call = llvm::cast<CallExprAST>(*node);
+            if(auto id = lookup(call.callee))
+            {
+               if(functions[*id].arity != call.args.size())
+               {
+                  fail("Incorrect number of arguments passed to " + std::string(call.callee.str()) +
+                       ": expected " + std::to_string(functions[*id].arity) +
+                       ", got " + std::to_string(call.args.size()));
+               }
+               call.calleeId = *id;
+            }
+            else
+            {
+               fail("Unknown function referenced: " + std::string(call.callee.str()));
+            }
+            for(auto arg = call.args.rbegin(); arg != call.args.rend(); ++arg)
+            {
+               pending.push_back(arg->get());
+            }
+            break;
+         }
+      }
+   }
+   return ok;
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+namespace
+{
+
+std::vector<TopLevelItem> parseAll(std::string_view src)
+{
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   return parseModule(tok, cur);
+}
+
+} // namespace
+
+TEST(resolver_test, binds_slots_and_ids)
+{
+   auto items = parseAll("extern sin(a); def foo(x y) y*sin(x) + foo(x, 1); foo(1, 2)");
+   ASSERT_EQ(items.size(), 3u);
+   Resolver resolver{};
+   for(auto& item : items)
+   {
+      EXPECT_TRUE(resolver.resolve(item));
+   }
+   ASSERT_EQ(resolver.functionCount(), 2u);
+   EXPECT_EQ(resolver.lookup("sin"), 0u);
+   EXPECT_EQ(resolver.lookup("foo"), 1u);
+   EXPECT_FALSE(resolver.function(0).defined);
+   EXPECT_TRUE(resolver.function(1).defined);
+
+   auto& foo = *std::get<std::unique_ptr<FunctionAST>>(items[1]);
+   EXPECT_EQ(foo.proto->id, 1u);
+   auto& sum = llvm::cast<BinaryExprAST>(*foo.body);
+   auto& product = llvm::cast<BinaryExprAST>(*sum.lhs);
+   EXPECT_EQ(llvm::cast<VariableExprAST>(*product.lhs).slot, 1u);
+   auto& sinCall = llvm::cast<CallExprAST>(*product.rhs);
+   EXPECT_EQ(sinCall.calleeId, 0u);
+   EXPECT_EQ(llvm::cast<VariableExprAST>(*sinCall.args[0]).slot, 0u);
+   EXPECT_EQ(llvm::cast<CallExprAST>(*sum.rhs).calleeId, 1u);
+
+   auto& expr = *std::get<std::unique_ptr<TopLevelExprAST>>(items[2]);
+   EXPECT_EQ(llvm::cast<CallExprAST>(*expr.body).calleeId, 1u);
+   EXPECT_EQ(expr.proto->id, ExprAST::unresolved);
+}
+
+TEST(resolver_test, reports_every_error)
+{
+   std::string src{"def g(a) a\ndef f(x) y + g(x, 1) + h(x) + f(x)"};
+   auto items = parseAll(src);
+   ASSERT_EQ(items.size(), 2u);
+   Resolver resolver{};
+   Diagnostics diags{};
+   {
+      DiagnosticScope scope{diags};
+      EXPECT_TRUE(resolver.resolve(items[0]));
+      EXPECT_FALSE(resolver.resolve(items[1]));
+   }
+   ASSERT_EQ(diags.errorCount(), 3u);
+   EXPECT_EQ(diags.all()[0].message, "Unknown variable name: y");
+   EXPECT_EQ(diags.all()[1].message, "Incorrect number of arguments passed to g: expected 1, got 2");
+   EXPECT_EQ(diags.all()[2].message, "Unknown function referenced: h");
+   EXPECT_EQ(diags.all()[0].offset, src.find("f(x)"));
+   // the failed definition is not kept
+   EXPECT_FALSE(resolver.lookup("f"));
+   EXPECT_EQ(resolver.functionCount(), 1u);
+}
+
+TEST(resolver_test, declarations_must_agree)
+{
+   auto items = parseAll("extern f(a); def f(a b) a; def f(a) a; def f(b) b; extern f(c)");
+   ASSERT_EQ(items.size(), 5u);
+   Resolver resolver{};
+   Diagnostics diags{};
+   DiagnosticScope scope{diags};
+   EXPECT_TRUE(resolver.resolve(items[0]));
+   EXPECT_FALSE(resolver.resolve(items[1]));
+   EXPECT_TRUE(resolver.resolve(items[2]));
+   EXPECT_FALSE(resolver.resolve(items[3]));
+   EXPECT_TRUE(resolver.resolve(items[4]));
+   ASSERT_EQ(diags.errorCount(), 2u);
+   EXPECT_EQ(diags.all()[0].message, "Function f redeclared with a different number of arguments");
+   EXPECT_EQ(diags.all()[1].message, "Function cannot be redefined: f");
+}
+
+TEST(resolver_test, operators)
+{
+   auto items = parseAll("def binary| 5 (a b) a; def unary!(v) v; def g(x) !x | 1");
+   ASSERT_EQ(items.size(), 3u);
+   Resolver resolver{};
+   EXPECT_TRUE(resolver.resolve(items[0]));
+   EXPECT_TRUE(resolver.resolve(items[1]));
+   EXPECT_TRUE(resolver.resolve(items[2]));
+
+   // '&' was never defined
+   FunctionAST h{std::make_unique<PrototypeAST>(Symbol("h"), std::vector<std::string>{"x"}),
+                 std::make_unique<BinaryExprAST>('&', std::make_unique<VariableExprAST>("x"),
+                                                 std::make_unique<NumberExprAST>(1.0))};
+   Diagnostics diags{};
+   DiagnosticScope scope{diags};
+   EXPECT_FALSE(resolver.resolve(h));
+   ASSERT_EQ(diags.errorCount(), 1u);
+   EXPECT_EQ(diags.all()[0].message, "Invalid binary operator: &");
+}
+
+TEST(resolver_test, hash_consed_body)
+{
+   auto arena = std::make_shared<AstArena>();
+   arena->setHashConsing(true);
+   std::vector<TopLevelItem> items{};
+   {
+      ArenaScope scope{arena};
+      items = parseAll("def f(x y) (x*y+1)*(x*y+1)");
+   }
+   ASSERT_EQ(items.size(), 1u);
+   Resolver resolver{};
+   EXPECT_TRUE(resolver.resolve(items[0]));
+   auto& fn = *std::get<std::unique_ptr<FunctionAST>>(items[0]);
+   auto& square = llvm::cast<BinaryExprAST>(*fn.body);
+   ASSERT_EQ(square.lhs.get(), square.rhs.get());
+   auto& sum = llvm::cast<BinaryExprAST>(*square.lhs);
+   auto& product = llvm::cast<BinaryExprAST>(*sum.lhs);
+   EXPECT_EQ(llvm::cast<VariableExprAST>(*product.lhs).slot, 0u);
+   EXPECT_EQ(llvm::cast<VariableExprAST>(*product.rhs).slot, 1u);
+}
+
+TEST(resolver_test, hash_consing_keeps_functions_apart)
+{
+   // x is parameter 0 of f and parameter 1 of g: the two must not share it
+   auto arena = std::make_shared<AstArena>();
+   arena->setHashConsing(true);
+   std::vector<TopLevelItem> items{};
+   {
+      ArenaScope scope{arena};
+      items = parseAll("def f(x y) x*2\ndef g(y x) x*2\nx*2");
+   }
+   ASSERT_EQ(items.size(), 3u);
+   Resolver resolver{};
+   EXPECT_TRUE(resolver.resolve(items[0]));
+   EXPECT_TRUE(resolver.resolve(items[1]));
+   auto& f = *std::get<std::unique_ptr<FunctionAST>>(items[0]);
+   auto& g = *std::get<std::unique_ptr<FunctionAST>>(items[1]);
+   ASSERT_NE(f.body.get(), g.body.get());
+   EXPECT_EQ(llvm::cast<VariableExprAST>(*llvm::cast<BinaryExprAST>(*f.body).lhs).slot, 0u);
+   EXPECT_EQ(llvm::cast<VariableExprAST>(*llvm::cast<BinaryExprAST>(*g.body).lhs).slot, 1u);
+}
+
+#endif
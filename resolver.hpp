@@ -0,0 +1,53 @@
+#ifndef __RESOLVER_H_
+#define __RESOLVER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "parser.hpp"
+
+// A function known to the Resolver, by id
+struct FunctionInfo
+{
+   Symbol name;
+   std::uint32_t arity;
+   bool defined; // has a body, as opposed to an extern
+};
+
+// Name resolution, run on each item after parsing and before codegen.
+// Binds every variable reference to its parameter slot and every call to a
+// function id, and reports unknown variables, unknown functions and
+// operators, arity mismatches and redefinitions through reportError, at the
+// item's offset.  Items must be resolved in source order: a function is
+// known from its own prototype on, so recursion resolves.  A function whose
+// body fails to resolve is forgotten again, as codegen drops it.
+class Resolver
+{
+   public:
+      // false (after reporting every error in it) if the item is invalid
+      bool resolve(PrototypeAST& proto);
+      bool resolve(FunctionAST& fn);
+      bool resolve(TopLevelItem& item);
+
+      std::optional<std::uint32_t> lookup(Symbol name) const;
+      FunctionInfo const& function(std::uint32_t id) const { return functions[id]; }
+      std::size_t functionCount() const { return functions.size(); }
+
+   private:
+      // the id for proto, declaring it if new; unresolved on a conflict
+      std::uint32_t declare(PrototypeAST& proto, bool definition);
+      bool resolveBody(FunctionAST& fn);
+
+      std::unordered_map<Symbol, std::uint32_t> ids{};
+      std::vector<FunctionInfo> functions{};
+
+      // reused between bodies
+      std::vector<ExprAST*> pending{};
+      std::unordered_set<ExprAST const*> visited{};
+};
+
+#endif // __RESOLVER_H_
@@ -0,0 +1,494 @@
+#include "simplifier.hpp"
+
+#include <cmath>
+#include <utility>
+
+namespace
+{
+
+bool isLeaf(ExprAST const& e)
+{
+   return e.getKind() == ExprAST::Kind::number || e.getKind() == ExprAST::Kind::variable;
+}
+
+bool isBuiltinOperator(char op)
+{
+   return op == '+' || op == '-' || op == '*' || op == '<';
+}
+
+bool negativeZero(double v)
+{
+   return v == 0 && std::signbit(v);
+}
+
+// A child for a rebuilt parent.  Arena nodes are never freed one by one,
+// so they are shared with the old parent; a heap node has only the old
+// parent, which is being replaced.
+ExprPtr takeChild(ExprPtr& slot)
+{
+   if(slot->arenaOwned)
+   {
+      return ExprPtr{slot.get()};
+   }
+   return std::move(slot);
+}
+
+// undo takeChild for a parent that is kept after all
+void restoreChild(ExprPtr& slot, ExprPtr& taken)
+{
+   if(!slot)
+   {
+      slot = std::move(taken);
+   }
+   else
+   {
+      taken.release();
+   }
+}
+
+// constants right; otherwise by structural hash, but only past a leaf, so
+// the calls on either side are still made in order
+bool shouldSwap(ExprAST const& l, ExprAST const& r)
+{
+   if(!isLeaf(l) && !isLeaf(r))
+   {
+      return false;
+   }
+   bool const numberLeft = llvm::isa<NumberExprAST>(l);
+   bool const numberRight = llvm::isa<NumberExprAST>(r);
+   if(numberLeft || numberRight)
+   {
+      return numberLeft && !numberRight;
+   }
+   return l.structuralHash() > r.structuralHash();
+}
+
+} // namespace
+
+std::size_t Simplifier::simplify(TopLevelItem& item)
+{
+   return std::visit([this](auto& node) -> std::size_t
+   {
+      if constexpr(std::is_same_v<std::decay_t<decltype(*node)>, PrototypeAST>)
+      {
+         return 0;
+      }
+      else
+      {
+         return simplify(*node);
+      }
+   }, item);
+}
+
+std::size_t Simplifier::simplify(FunctionAST& fn)
+{
+   rewrites = 0;
+   // new nodes go where the body is, the heap included, shared with no
+   // other item's
+   ArenaScope scope{fn.body->arenaOwned ? fn.arena : nullptr};
+   if(AstArena* arena = currentArena())
+   {
+      arena->startItem();
+   }
+   pending.clear();
+   results.clear();
+   memo.clear();
+   pending.push_back({fn.body.get(), false});
+   while(!pending.empty())
+   {
+      Frame frame = pending.back();
+      pending.pop_back();
+      ExprAST* node = frame.node;
+      if(frame.expanded)
+      {
+         Result result = combine(*node);
+         if(node->shared)
+         {
+            memo.emplace(node, Memo{result.node.get(), result.pure});
+         }
+         results.push_back(std::move(result));
+         continue;
+      }
+      if(node->shared)
+      {
+         if(auto it = memo.find(node); it != memo.end())
+         {
+            // shared nodes, and what they became, are arena nodes
+            results.push_back({ExprPtr{it->second.node}, it->second.pure});
+            continue;
+         }
+      }
+      // children are pushed last to first, so their results come in order
+      switch(node->getKind())
+      {
+         case ExprAST::Kind::number:
+         case ExprAST::Kind::variable:
+         {
+            results.push_back({nullptr, true});
+            break;
+         }
+         case ExprAST::Kind::unary:
+         {
+            pending.push_back({node, true});
+            pending.push_back({llvm::cast<UnaryExprAST>(node)->operand.get(), false});
+            break;
+         }
+         case ExprAST::Kind::binary:
+         {
+            auto* bin = llvm::cast<BinaryExprAST>(node);
+            pending.push_back({node, true});
+            pending.push_back({bin->rhs.get(), false});
+            pending.push_back({bin->lhs.get(), false});
+            break;
+         }
+         case ExprAST::Kind::call:
+         {
+            auto& args = llvm::cast<CallExprAST>(node)->args;
+            pending.push_back({node, true});
+            for(auto it = args.rbegin(); it != args.rend(); ++it)
+            {
+               pending.push_back({it->get(), false});
+            }
+            break;
+         }
+      }
+   }
+   if(results.back().node)
+   {
+      fn.body = std::move(results.back().node);
+   }
+   results.clear();
+   return rewrites;
+}
+
+Simplifier::Result Simplifier::combine(ExprAST& node)
+{
+   switch(node.getKind())
+   {
+      case ExprAST::Kind::unary:
+      {
+         auto& un = llvm::cast<UnaryExprAST>(node);
+         Result operand = std::move(results.back());
+         results.pop_back();
+         if(!operand.node)
+         {
+            return {nullptr, false};
+         }
+         return {makeExpr<UnaryExprAST>(un.opcode, std::move(operand.node)), false};
+      }
+      case ExprAST::Kind::binary:
+      {
+         auto& bin = llvm::cast<BinaryExprAST>(node);
+         Result r = std::move(results.back());
+         results.pop_back();
+         Result l = std::move(results.back());
+         results.pop_back();
+         bool const changed = l.node || r.node;
+         ExprPtr lhs = l.node ? std::move(l.node) : takeChild(bin.lhs);
+         ExprPtr rhs = r.node ? std::move(r.node) : takeChild(bin.rhs);
+         if(!isBuiltinOperator(bin.op))
+         {
+            if(changed)
+            {
+               return {makeExpr<BinaryExprAST>(bin.op, std::move(lhs), std::move(rhs)), false};
+            }
+            restoreChild(bin.lhs, lhs);
+            restoreChild(bin.rhs, rhs);
+            return {nullptr, false};
+         }
+         bool const pure = l.pure && r.pure;
+         if(ExprPtr folded = fold(bin.op, lhs, l.pure, rhs, r.pure))
+         {
+            return {std::move(folded), pure};
+         }
+         if(changed)
+         {
+            return {makeExpr<BinaryExprAST>(bin.op, std::move(lhs), std::move(rhs)), pure};
+         }
+         restoreChild(bin.lhs, lhs);
+         restoreChild(bin.rhs, rhs);
+         return {nullptr, pure};
+      }
+      case ExprAST::Kind::call:
+      {
+         auto& call = llvm::cast<CallExprAST>(node);
+         std::size_t const first = results.size() - call.args.size();
+         bool changed{false};
+         for(std::size_t i{first}; i < results.size(); i++)
+         {
+            changed |= results[i].node != nullptr;
+         }
+         if(!changed)
+         {
+            results.resize(first);
+            return {nullptr, false};
+         }
+         std::pmr::vector<ExprPtr> args{currentResource()};
+         args.reserve(call.args.size());
+         for(std::size_t i{}; i < call.args.size(); i++)
+         {
+            ExprPtr& simplified = results[first + i].node;
+            args.push_back(simplified ? std::move(simplified) : takeChild(call.args[i]));
+         }
+         results.resize(first);
+         ExprPtr rebuilt = makeExpr<CallExprAST>(call.callee, std::move(args));
+         llvm::cast<CallExprAST>(*rebuilt).calleeId = call.calleeId;
+         return {std::move(rebuilt), false};
+      }
+      default:
+      {
+         // leaves are never expanded
+         return {nullptr, true};
+      }
+   }
+}
+
+ExprPtr Simplifier::fold(char op, ExprPtr& l, bool pl, ExprPtr& r, bool pr)
+{
+   auto const* nl = llvm::dyn_cast<NumberExprAST>(l.get());
+   auto const* nr = llvm::dyn_cast<NumberExprAST>(r.get());
+   if(nl && nr)
+   {
+      double const a{nl->value()};
+      double const b{nr->value()};
+      double v{};
+      switch(op)
+      {
+         case '+': v = a + b; break;
+         case '-': v = a - b; break;
+         case '*': v = a * b; break;
+         // fcmp ult: true when unordered
+         default: v = (std::isnan(a) || std::isnan(b) || a < b) ? 1.0 : 0.0; break;
+      }
+      // a hash-consing arena would hand back +0 for it
+      if(negativeZero(v) && !opts.fastMath)
+      {
+         return nullptr;
+      }
+      rewrites++;
+      return makeExpr<NumberExprAST>(v);
+   }
+
+   bool const commutative = op == '+' || op == '*';
+   if(commutative && shouldSwap(*l, *r))
+   {
+      std::swap(l, r);
+      rewrites++;
+      if(ExprPtr folded = fold(op, l, pr, r, pl))
+      {
+         return folded;
+      }
+      return makeExpr<BinaryExprAST>(op, std::move(l), std::move(r));
+   }
+
+   if(nr)
+   {
+      double const c{nr->value()};
+      if(op == '*' && c == 1)
+      {
+         rewrites++;
+         return std::move(l);
+      }
+      if(op == '-' && c == 0 && !std::signbit(c))
+      {
+         rewrites++;
+         return std::move(l);
+      }
+      if(op == '-' && c != 0)
+      {
+         // exact: subtraction is addition of the negation
+         rewrites++;
+         ExprPtr negated = makeExpr<NumberExprAST>(-c);
+         if(ExprPtr folded = fold('+', l, pl, negated, true))
+         {
+            return folded;
+         }
+         return makeExpr<BinaryExprAST>('+', std::move(l), std::move(negated));
+      }
+      if(op == '+' && c == 0 && (std::signbit(c) || opts.fastMath))
+      {
+         rewrites++;
+         return std::move(l);
+      }
+      if(opts.fastMath && op == '*' && c == 0 && pl)
+      {
+         rewrites++;
+         return makeExpr<NumberExprAST>(0.0);
+      }
+      // (x op c1) op c2 = x op (c1 op c2)
+      auto* inner = llvm::dyn_cast<BinaryExprAST>(l.get());
+      auto const* c1 = inner ? llvm::dyn_cast<NumberExprAST>(inner->rhs.get()) : nullptr;
+      if(opts.fastMath && commutative && c1 && inner->op == op)
+      {
+         rewrites++;
+         ExprPtr x = takeChild(inner->lhs);
+         ExprPtr k = makeExpr<NumberExprAST>(op == '+' ? c1->value() + c : c1->value() * c);
+         if(ExprPtr folded = fold(op, x, pl, k, true))
+         {
+            return folded;
+         }
+         return makeExpr<BinaryExprAST>(op, std::move(x), std::move(k));
+      }
+   }
+
+   if(opts.fastMath && (op == '-' || op == '<') && pl && *l == *r)
+   {
+      rewrites++;
+      return makeExpr<NumberExprAST>(0.0);
+   }
+   return nullptr;
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include "llvm/IR/Function.h"
+
+#include "code-generator.hpp"
+#include "resolver.hpp"
+
+namespace
+{
+
+std::unique_ptr<FunctionAST> parseItem(std::string_view src)
+{
+   BufferCursor cur{src};
+   Token tok{};
+   gettok(tok, cur);
+   auto items = parseModule(tok, cur);
+   EXPECT_EQ(items.size(), 1u);
+   return std::move(std::get<std::unique_ptr<FunctionAST>>(items.front()));
+}
+
+// the body of src simplified, next to the body of expected
+void expectSimplified(std::string_view src, std::string_view expected, SimplifierOptions opts = {})
+{
+   auto fn = parseItem(src);
+   Simplifier{opts}.simplify(*fn);
+   EXPECT_EQ(*fn->body, *parseItem(expected)->body) << src;
+}
+
+} // namespace
+
+TEST(simplifier_test, folds_constants_and_exact_identities)
+{
+   auto fn = parseItem("def f(x) 2*3+x*1-0");
+   EXPECT_GT(Simplifier{}.simplify(*fn), 0u);
+   EXPECT_EQ(*fn->body, *parseItem("def f(x) x+6")->body);
+
+   expectSimplified("def f(x) (1 < 2) + (2 < 1)*x", "def f(x) x*0 + 1");
+   expectSimplified("def f(x) g(1+1, x*1)", "def f(x) g(2, x)");
+
+   auto sub = parseItem("def f(x) x - 3");
+   Simplifier{}.simplify(*sub);
+   auto const& add = llvm::cast<BinaryExprAST>(*sub->body);
+   EXPECT_EQ(add.op, '+');
+   EXPECT_EQ(llvm::cast<NumberExprAST>(*add.rhs).value(), -3.0);
+}
+
+TEST(simplifier_test, leaves_inexact_identities_alone)
+{
+   for(char const* src : {"def f(x) x+0", "def f(x) x*0", "def f(x) x-x", "def f(x) x<x", "def f(x) (x+1)+2"})
+   {
+      auto fn = parseItem(src);
+      EXPECT_EQ(Simplifier{}.simplify(*fn), 0u) << src;
+      EXPECT_EQ(*fn->body, *parseItem(src)->body);
+   }
+   // would be -0, which the arena cannot tell from +0
+   auto negativeZero = parseItem("def f(x) (0-1)*0");
+   Simplifier{}.simplify(*negativeZero);
+   EXPECT_TRUE(llvm::isa<BinaryExprAST>(*negativeZero->body));
+}
+
+TEST(simplifier_test, fast_math_identities)
+{
+   SimplifierOptions fast{true};
+   expectSimplified("def f(x) x*0", "def f(x) 0", fast);
+   expectSimplified("def f(x) x+0", "def f(x) x", fast);
+   expectSimplified("def f(x y) (x*y)-(x*y)", "def f(x y) 0", fast);
+   expectSimplified("def f(x) (x+1)+2", "def f(x) x+3", fast);
+   expectSimplified("def f(x) (x+1)-1", "def f(x) x", fast);
+   expectSimplified("def f(x) 2*(x*3)", "def f(x) x*6", fast);
+   // the call is still made
+   expectSimplified("def f(x) g(x)*0", "def f(x) g(x)*0", fast);
+   expectSimplified("def f(x) g(x)-g(x)", "def f(x) g(x)-g(x)", fast);
+}
+
+TEST(simplifier_test, canonical_order)
+{
+   auto a = parseItem("def f(x y) x*y + 2*x");
+   auto b = parseItem("def f(x y) y*x + x*2");
+   Simplifier simplifier{};
+   simplifier.simplify(*a);
+   simplifier.simplify(*b);
+   EXPECT_EQ(*a->body, *b->body);
+   expectSimplified("def f(x) 2*x", "def f(x) x*2");
+
+   // calls are not reordered
+   auto calls = parseItem("def f(x) h(x) + g(x)");
+   EXPECT_EQ(simplifier.simplify(*calls), 0u);
+}
+
+TEST(simplifier_test, hash_consed_nodes)
+{
+   auto arena = std::make_shared<AstArena>();
+   arena->setHashConsing(true);
+   std::unique_ptr<FunctionAST> fn{};
+   {
+      ArenaScope scope{arena};
+      fn = parseItem("def f(x) (x*1+2*3)*(x*1+2*3)");
+   }
+   auto const* before = fn->body.get();
+   EXPECT_GT(Simplifier{}.simplify(*fn), 0u);
+   auto const& product = llvm::cast<BinaryExprAST>(*fn->body);
+   EXPECT_EQ(product.lhs.get(), product.rhs.get());
+   EXPECT_EQ(*product.lhs, *parseItem("def g(x) x+6")->body);
+   // the original tree is untouched in the arena
+   EXPECT_EQ(*before, *parseItem("def f(x) (x*1+2*3)*(x*1+2*3)")->body);
+}
+
+TEST(simplifier_test, heap_trees)
+{
+   BufferCursor cur{"def f(x y) (x*1)*(2+3) + y"};
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, cur);
+   auto fn = parseDefinition(tok, cur, ops);
+   ASSERT_FALSE(fn->body->arenaOwned);
+   Simplifier{}.simplify(*fn);
+   EXPECT_FALSE(fn->body->arenaOwned);
+   auto expected = parseItem("def f(x y) x*5 + y");
+   Simplifier{}.simplify(*expected);
+   EXPECT_EQ(*fn->body, *expected->body);
+}
+
+TEST(simplifier_test, deep_nesting)
+{
+   std::string src{"def f(x) x"};
+   for(int i{}; i < 100000; i++)
+   {
+      src += "+1";
+   }
+   auto fn = parseItem(src);
+   EXPECT_EQ(Simplifier{}.simplify(*fn), 0u);
+   Simplifier{SimplifierOptions{true}}.simplify(*fn);
+   EXPECT_EQ(*fn->body, *parseItem("def f(x) x+100000")->body);
+}
+
+TEST(simplifier_test, smaller_ir)
+{
+   auto instructions = [](std::unique_ptr<FunctionAST>& fn)
+   {
+      CodeGenContext cg{"simplifier_test"};
+      Resolver resolver{};
+      EXPECT_TRUE(resolver.resolve(*fn));
+      auto* f = llvm::cast<llvm::Function>(fn->codegen(cg));
+      return f->getEntryBlock().size();
+   };
+   auto fn = parseItem("def f(x) 2*3+x*1-0");
+   EXPECT_EQ(instructions(fn), 4u);
+   Simplifier{}.simplify(*fn);
+   EXPECT_EQ(instructions(fn), 2u);
+}
+
+#endif
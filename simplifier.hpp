@@ -0,0 +1,81 @@
+#ifndef __SIMPLIFIER_H_
+#define __SIMPLIFIER_H_
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.hpp"
+
+struct SimplifierOptions
+{
+   // Also apply identities that only hold without NaNs, infinities and
+   // signed zeros (x*0 = 0, x-x = 0, x+0 = x) and reassociate constants
+   // ((x+1)+2 = x+3), as -ffast-math allows
+   bool fastMath{false};
+};
+
+// Algebraic simplification of function bodies before codegen, on the
+// built-in operators (+ - * <); calls and user-defined operators are left
+// as they are, except for simplifying their operands.
+//  - operations on constants are folded, as the generated code would
+//    compute them;
+//  - identities exact in IEEE arithmetic are applied: x*1 = x, x-0 = x,
+//    x+(-0) = x, and x-c becomes x+(-c);
+//  - commutative operations are put in a canonical order, constants
+//    right, so x*y and y*x become the same tree.  Operands are only
+//    swapped when one is a variable or a constant, so calls are still
+//    made in source order.
+// Identities that drop a subexpression only drop one without calls in it.
+//
+// Nodes are immutable, so changed subtrees are rebuilt, in the body's
+// arena if it has one; hash-consed nodes are simplified once.  Like the
+// parser and the Resolver, the walk keeps its own stack.  Runs on resolved
+// or unresolved items alike.
+class Simplifier
+{
+   public:
+      explicit Simplifier(SimplifierOptions o = {})
+         : opts{o}
+      {}
+
+      // replace fn's body by its simplified form; the number of rewrites
+      std::size_t simplify(FunctionAST& fn);
+      // definitions and top-level expressions; externs have no body
+      std::size_t simplify(TopLevelItem& item);
+
+   private:
+      // the simplified form of a node: nullptr if unchanged; pure if no
+      // call is made in it
+      struct Result
+      {
+         ExprPtr node;
+         bool pure;
+      };
+      struct Frame
+      {
+         ExprAST* node;
+         bool expanded;
+      };
+      struct Memo
+      {
+         ExprAST* node;
+         bool pure;
+      };
+
+      // simplify the node under a frame whose children are done
+      Result combine(ExprAST& node);
+      // the simplified form of l op r, nullptr if no rule applies, with l
+      // and r left as they were
+      ExprPtr fold(char op, ExprPtr& l, bool pl, ExprPtr& r, bool pr);
+
+      SimplifierOptions opts;
+      std::size_t rewrites{};
+
+      // reused between bodies
+      std::vector<Frame> pending{};
+      std::vector<Result> results{};
+      std::unordered_map<ExprAST const*, Memo> memo{};
+};
+
+#endif // __SIMPLIFIER_H_
@@ -0,0 +1,112 @@
+#include "source-buffer.hpp"
+
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SourceBuffer::~SourceBuffer()
+{
+   if(mapping)
+   {
+      munmap(mapping, mappedSize);
+   }
+}
+
+std::unique_ptr<SourceBuffer> SourceBuffer::open(char const* path)
+{
+   int fd = ::open(path, O_RDONLY);
+   if(fd < 0)
+   {
+      std::cerr << "Unable to open source file: " << path << "\n";
+      return nullptr;
+   }
+
+   struct stat st{};
+   if(fstat(fd, &st) != 0)
+   {
+      std::cerr << "Unable to stat source file: " << path << "\n";
+      close(fd);
+      return nullptr;
+   }
+
+   std::unique_ptr<SourceBuffer> res{new SourceBuffer()};
+   if(st.st_size > 0)
+   {
+      void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(m == MAP_FAILED)
+      {
+         std::cerr << "Unable to map source file: " << path << "\n";
+         close(fd);
+         return nullptr;
+      }
+      // the lexer makes a single forward pass
+      madvise(m, st.st_size, MADV_SEQUENTIAL);
+      res->mapping = m;
+      res->mappedSize = st.st_size;
+      res->data = std::string_view(static_cast<char const*>(m), st.st_size);
+   }
+   close(fd);
+   return res;
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+#include "lexer.hpp"
+
+#include <cstdio>
+#include <fstream>
+
+TEST(source_buffer_test, in_memory)
+{
+   SourceBuffer buf{"def foo"};
+   EXPECT_EQ(buf.view(), "def foo");
+}
+
+TEST(source_buffer_test, missing_file)
+{
+   EXPECT_EQ(SourceBuffer::open("/nonexistent/kaleidoscope.ks"), nullptr);
+}
+
+TEST(source_buffer_test, mapped_file)
+{
+   char path[] = "/tmp/kaleidoscope-XXXXXX";
+   int fd = mkstemp(path);
+   ASSERT_GE(fd, 0);
+   close(fd);
+   std::ofstream(path) << "extern sin(a)";
+
+   auto buf = SourceBuffer::open(path);
+   ASSERT_TRUE(buf != nullptr);
+   EXPECT_EQ(buf->view(), "extern sin(a)");
+
+   BufferCursor cur{buf->view()};
+   Token tok{};
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::ext);
+   EXPECT_EQ(tok.text, "extern");
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::id);
+   EXPECT_EQ(tok.text, "sin");
+   EXPECT_EQ(tok.offset, 7u);
+
+   buf.reset();
+   std::remove(path);
+}
+
+TEST(source_buffer_test, empty_file)
+{
+   char path[] = "/tmp/kaleidoscope-XXXXXX";
+   int fd = mkstemp(path);
+   ASSERT_GE(fd, 0);
+   close(fd);
+
+   auto buf = SourceBuffer::open(path);
+   ASSERT_TRUE(buf != nullptr);
+   EXPECT_TRUE(buf->view().empty());
+   std::remove(path);
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __SOURCE_BUFFER_H_
+#define __SOURCE_BUFFER_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Contiguous, read-only view of a whole source text.  Either owns an
+// in-memory string or a read-only memory mapping of a file; the lexer
+// runs directly over view() without copying.
+class SourceBuffer
+{
+   public:
+      explicit SourceBuffer(std::string text)
+         : owned{std::move(text)}
+         , data{owned}
+      {}
+      ~SourceBuffer();
+
+      SourceBuffer(SourceBuffer const&) = delete;
+      SourceBuffer& operator=(SourceBuffer const&) = delete;
+
+      // memory-map the file at path, nullptr on failure
+      static std::unique_ptr<SourceBuffer> open(char const* path);
+
+      std::string_view view() const { return data; }
+
+   private:
+      SourceBuffer() = default;
+
+      std::string owned{};
+      void* mapping{nullptr};
+      std::size_t mappedSize{};
+      std::string_view data{};
+};
+
+#endif // __SOURCE_BUFFER_H_
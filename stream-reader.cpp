@@ -0,0 +1,460 @@
+#include "stream-reader.hpp"
+#include "char-class.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <unistd.h>
+
+namespace
+{
+
+std::size_t roundUpPow2(std::size_t n)
+{
+   std::size_t p{1};
+   while(p < n)
+   {
+      p <<= 1;
+   }
+   return p;
+}
+
+// Store up to the scratch limit of a run, counting all of it
+void keep(ChunkedReader& in, std::size_t& len, char const* first, std::size_t n)
+{
+   if(len < ChunkedReader::maxTokenLength)
+   {
+      std::memcpy(in.scratch() + len, first, std::min(n, ChunkedReader::maxTokenLength - len));
+   }
+   len += n;
+}
+
+std::size_t takeAlnum(ChunkedReader& in)
+{
+   std::size_t len{};
+   for(std::string_view w = in.window(); !w.empty(); w = in.window())
+   {
+      char const* first = w.data();
+      char const* stop = skipAlnum(first, first + w.size());
+      keep(in, len, first, stop - first);
+      in.consume(stop - first);
+      if(stop != first + w.size())
+      {
+         break;
+      }
+   }
+   return len;
+}
+
+// the characters the istream lexer collects for a literal
+std::size_t takeNumber(ChunkedReader& in)
+{
+   std::size_t len{};
+   char prev{};
+   for(std::string_view w = in.window(); !w.empty(); w = in.window())
+   {
+      std::size_t n{};
+      for(; n < w.size(); n++)
+      {
+         char c = w[n];
+         if(!(isDigitChar(c) || c == '.' || c == 'e' || c == 'E' ||
+              ((c == '+' || c == '-') && (prev == 'e' || prev == 'E'))))
+         {
+            break;
+         }
+         prev = c;
+      }
+      keep(in, len, w.data(), n);
+      in.consume(n);
+      if(n != w.size())
+      {
+         break;
+      }
+   }
+   return len;
+}
+
+void takeMalformed(ChunkedReader& in, std::size_t& len)
+{
+   for(std::string_view w = in.window(); !w.empty(); w = in.window())
+   {
+      std::size_t n{};
+      while(n < w.size() && (isAlnumChar(w[n]) || w[n] == '.'))
+      {
+         n++;
+      }
+      keep(in, len, w.data(), n);
+      in.consume(n);
+      if(n != w.size())
+      {
+         break;
+      }
+   }
+}
+
+} // namespace
+
+ChunkedReader::ChunkedReader(ReadFn r, std::size_t capacity)
+   : read{std::move(r)}
+   , ring{new char[roundUpPow2(std::max<std::size_t>(capacity, 1))]}
+   , tokenScratch{new char[maxTokenLength]}
+   , mask{roundUpPow2(std::max<std::size_t>(capacity, 1)) - 1}
+{}
+
+ChunkedReader::ChunkedReader(int fd, std::size_t capacity)
+   : ChunkedReader([fd](char* buf, std::size_t size) -> std::size_t
+      {
+         ssize_t n;
+         while((n = ::read(fd, buf, size)) < 0 && errno == EINTR);
+         if(n < 0)
+         {
+            std::cerr << "Cannot read input: " << std::strerror(errno) << "\n";
+            return 0;
+         }
+         return n;
+      }, capacity)
+{}
+
+ChunkedReader::ChunkedReader(std::istream& in, std::size_t capacity)
+   : ChunkedReader([&in](char* buf, std::size_t size) -> std::size_t
+      {
+         // peek blocks for at least one byte; then take that byte and
+         // whatever else is already buffered, so an interactive stream is
+         // never overread.  A stream synced with stdio (std::cin) buffers
+         // nothing, so readsome() would return 0 here: read() at least the
+         // peeked byte instead.
+         if(in.peek() == std::char_traits<char>::eof())
+         {
+            return 0;
+         }
+         std::streamsize avail = std::max<std::streamsize>(in.rdbuf()->in_avail(), 1);
+         in.read(buf, std::min<std::streamsize>(avail, size));
+         return in.gcount();
+      }, capacity)
+{}
+
+std::string_view ChunkedReader::window()
+{
+   if(head == tail && !fill())
+   {
+      return {};
+   }
+   std::size_t start = head & mask;
+   std::size_t len = std::min<std::uint64_t>(tail - head, capacity() - start);
+   return {ring.get() + start, len};
+}
+
+// Called with the ring drained.  Reads into the free space after tail and,
+// if that piece came back full, on into the wrapped piece before head; a
+// short read means the producer has nothing more right now, so stop there
+// rather than block with data in hand.
+bool ChunkedReader::fill()
+{
+   while(!atEof && tail - head < capacity())
+   {
+      std::size_t start = tail & mask;
+      std::size_t room = std::min<std::uint64_t>(capacity() - (tail - head), capacity() - start);
+      std::size_t n = read(ring.get() + start, room);
+      if(n == 0)
+      {
+         atEof = true;
+         break;
+      }
+      tail += n;
+      if(n < room)
+      {
+         break;
+      }
+   }
+   return head != tail;
+}
+
+void gettok(Token& tok, ChunkedReader& in)
+{
+   tok.type = TokenType::eof;
+   tok.id = Symbol{};
+   tok.ch = 0;
+   tok.text = {};
+
+   // whitespace and comments, either may run across refills
+   bool comment{false};
+   for(std::string_view w = in.window(); !w.empty(); w = in.window())
+   {
+      char const* first = w.data();
+      char const* last = first + w.size();
+      char const* p = comment ? skipToEol(first, last) : skipSpace(first, last);
+      in.consume(p - first);
+      if(p == last)
+      {
+         continue;
+      }
+      if(comment)
+      {
+         // the end of line itself is whitespace
+         comment = false;
+      }
+      else if(*p == '#')
+      {
+         in.consume(1);
+         comment = true;
+      }
+      else
+      {
+         break;
+      }
+   }
+
+   tok.offset = in.offset();
+   std::string_view w = in.window();
+   if(w.empty())
+   {
+      return;
+   }
+
+   char const* text = in.scratch();
+   char c = w[0];
+   if(isAlphaChar(c))
+   {
+      std::size_t len = takeAlnum(in);
+      tok.text = std::string_view(text, std::min(len, ChunkedReader::maxTokenLength));
+      if(len > ChunkedReader::maxTokenLength)
+      {
+         tok.type = TokenType::err;
+         return;
+      }
+      tok.type = identifierType(tok.text);
+      tok.id = Symbol(tok.text);
+   }
+   else if(isDigitChar(c) || c == '.')
+   {
+      std::size_t len = takeNumber(in);
+      NumberScan scan{nullptr, 0, false};
+      if(len <= ChunkedReader::maxTokenLength)
+      {
+         scan = scanNumber(text, text + len);
+      }
+      if(!scan.ok)
+      {
+         // swallow the rest of the malformed run, as the other lexers do
+         takeMalformed(in, len);
+      }
+      tok.text = std::string_view(text, std::min(len, ChunkedReader::maxTokenLength));
+      tok.type = scan.ok ? TokenType::num : TokenType::err;
+      tok.num = scan.value;
+   }
+   else
+   {
+      in.consume(1);
+      in.scratch()[0] = c;
+      tok.text = std::string_view(text, 1);
+      tok.ch = c;
+      tok.type = TokenType::sym;
+   }
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+#include "parser.hpp"
+
+#include <cstdio>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// a reader over an in-memory string, handing out at most step bytes a call
+ChunkedReader::ReadFn stepReader(std::string const& src, std::size_t step)
+{
+   return [&src, step, pos = std::size_t{}](char* buf, std::size_t size) mutable -> std::size_t
+   {
+      std::size_t n = std::min({size, step, src.size() - pos});
+      std::memcpy(buf, src.data() + pos, n);
+      pos += n;
+      return n;
+   };
+}
+
+bool sameItem(TopLevelItem const& lhs, TopLevelItem const& rhs)
+{
+   if(lhs.index() != rhs.index())
+   {
+      return false;
+   }
+   return std::visit([&rhs](auto const& node)
+   {
+      return *node == *std::get<std::decay_t<decltype(node)>>(rhs);
+   }, lhs);
+}
+
+std::string const tricky{
+   "# leading comment def extern\r\n"
+   "def average(first second) (first + second) * 0.5e+0\n"
+   "extern sin(angle);   # trailing comment\n"
+   "   \t  longIdentifierName123 1.5e-3 .25 7. 1e5x 3else 1.2.3 1e+ ;\n"
+   "average(1, 2)#no newline at end"};
+
+} // namespace
+
+TEST(stream_reader_test, matches_buffer_lexer_at_every_capacity)
+{
+   for(std::size_t capacity{1}; capacity <= 64; capacity++)
+   {
+      for(std::size_t step : {std::size_t{1}, std::size_t{3}, std::size_t{1000}})
+      {
+         ChunkedReader in{stepReader(tricky, step), capacity};
+         BufferCursor cur{tricky, 0};
+         Token expect{}, tok{};
+         do
+         {
+            gettok(expect, cur);
+            gettok(tok, in);
+            ASSERT_EQ(tok.type, expect.type) << "capacity " << capacity << " at " << expect.offset;
+            EXPECT_EQ(tok.offset, expect.offset);
+            EXPECT_EQ(tok.text, expect.text);
+            EXPECT_EQ(tok.id, expect.id);
+            EXPECT_EQ(tok.ch, expect.ch);
+            if(tok.type == TokenType::num)
+            {
+               EXPECT_EQ(tok.num, expect.num);
+            }
+         } while(expect.type != TokenType::eof);
+      }
+   }
+}
+
+TEST(stream_reader_test, capacity_is_fixed)
+{
+   std::string src(1 << 20, ' ');
+   src += "x";
+   ChunkedReader in{stepReader(src, 1 << 20), 100};
+   EXPECT_EQ(in.capacity(), 128u);
+   Token tok{};
+   gettok(tok, in);
+   EXPECT_EQ(tok.type, TokenType::id);
+   EXPECT_EQ(tok.offset, 1u << 20);
+   EXPECT_EQ(in.capacity(), 128u);
+}
+
+TEST(stream_reader_test, overlong_token_is_error)
+{
+   std::string src(ChunkedReader::maxTokenLength + 1, 'a');
+   src += " b";
+   ChunkedReader in{stepReader(src, 512), 256};
+   Token tok{};
+   gettok(tok, in);
+   EXPECT_EQ(tok.type, TokenType::err);
+   gettok(tok, in);
+   EXPECT_EQ(tok.type, TokenType::id);
+   EXPECT_EQ(tok.id, "b");
+}
+
+TEST(stream_reader_test, overlong_identifier_message)
+{
+   std::string src(ChunkedReader::maxTokenLength + 1, 'a');
+   src += "+1; 2\n";
+   ChunkedReader in{stepReader(src, 512), 256};
+   std::stringstream err{};
+   auto old = std::cerr.rdbuf(err.rdbuf());
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, in);
+   std::size_t count{};
+   parseItems(tok, in, ops, [&](TopLevelItem) { count++; });
+   std::cerr.rdbuf(old);
+   EXPECT_EQ(count, 1u);
+   EXPECT_NE(err.str().find("Identifier too long"), std::string::npos) << err.str();
+   EXPECT_EQ(err.str().find("Malformed number literal"), std::string::npos) << err.str();
+}
+
+TEST(stream_reader_test, istream)
+{
+   std::stringstream io{tricky};
+   ChunkedReader in{io, 16};
+   BufferCursor cur{tricky, 0};
+   Token expect{}, tok{};
+   do
+   {
+      gettok(expect, cur);
+      gettok(tok, in);
+      ASSERT_EQ(tok.type, expect.type);
+      EXPECT_EQ(tok.offset, expect.offset);
+   } while(expect.type != TokenType::eof);
+}
+
+TEST(stream_reader_test, stdio_synced_cin)
+{
+   std::string const src{"def f(x) x\nf(1)\n"};
+   int fds[2];
+   ASSERT_EQ(pipe(fds), 0);
+   ASSERT_EQ(write(fds[1], src.data(), src.size()), static_cast<ssize_t>(src.size()));
+   close(fds[1]);
+   int saved = dup(0);
+   ASSERT_GE(saved, 0);
+   dup2(fds[0], 0);
+   close(fds[0]);
+
+   std::vector<TopLevelItem> items{};
+   {
+      ChunkedReader in{std::cin};
+      Token tok{};
+      OperatorTable ops{};
+      gettok(tok, in);
+      parseItems(tok, in, ops, [&](TopLevelItem item) { items.push_back(std::move(item)); });
+   }
+
+   dup2(saved, 0);
+   close(saved);
+   std::cin.clear();
+   std::clearerr(stdin);
+   EXPECT_EQ(items.size(), 2u);
+}
+
+TEST(stream_reader_test, parses_items_from_pipe)
+{
+   std::string src{};
+   for(int i{}; i < 2000; i++)
+   {
+      src += "def f" + std::to_string(i % 7) + "(x y) x*y + g(x, 2.5e-3) # c\n";
+      src += "extern g(a b);\n";
+      src += "f1(" + std::to_string(i) + ", 1.5); broken(;\n";
+   }
+
+   int fds[2];
+   ASSERT_EQ(pipe(fds), 0);
+   std::thread writer([&]
+   {
+      // odd-sized writes so items and comments straddle reads
+      for(std::size_t pos{}; pos < src.size(); pos += 1013)
+      {
+         std::size_t n = std::min<std::size_t>(1013, src.size() - pos);
+         ASSERT_EQ(write(fds[1], src.data() + pos, n), static_cast<ssize_t>(n));
+      }
+      close(fds[1]);
+   });
+
+   BufferCursor cur{src, 0};
+   Token expectTok{};
+   gettok(expectTok, cur);
+   auto expect = parseModule(expectTok, cur);
+
+   ChunkedReader in{fds[0], 4096};
+   Token tok{};
+   OperatorTable ops{};
+   gettok(tok, in);
+   std::size_t count{};
+   parseItems(tok, in, ops, [&](TopLevelItem item)
+   {
+      ASSERT_LT(count, expect.size());
+      EXPECT_TRUE(sameItem(item, expect[count]));
+      count++;
+   });
+   writer.join();
+   close(fds[0]);
+   EXPECT_EQ(count, expect.size());
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __STREAM_READER_H_
+#define __STREAM_READER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <string_view>
+
+#include "lexer.hpp"
+
+// Bounded-memory input for the lexer: a fixed-size ring buffer refilled
+// from a file descriptor, an istream or any read callback.  Memory use is
+// capacity() plus one token of scratch no matter how long the input is,
+// so unbounded generated code can be piped through stdin.
+class ChunkedReader
+{
+   public:
+      // longest identifier or literal; longer ones lex as TokenType::err
+      static constexpr std::size_t maxTokenLength{4096};
+      static constexpr std::size_t defaultCapacity{64 << 10};
+
+      // fill buf with up to size bytes, 0 at end of input
+      using ReadFn = std::function<std::size_t(char* buf, std::size_t size)>;
+
+      ChunkedReader(ReadFn read, std::size_t capacity = defaultCapacity);
+      explicit ChunkedReader(int fd, std::size_t capacity = defaultCapacity);
+      explicit ChunkedReader(std::istream& in, std::size_t capacity = defaultCapacity);
+
+      ChunkedReader(ChunkedReader const&) = delete;
+      ChunkedReader& operator=(ChunkedReader const&) = delete;
+
+      // Contiguous unread bytes, refilling if none are buffered.  Ends at the
+      // wrap point of the ring; empty only at end of input.
+      std::string_view window();
+      void consume(std::size_t n) { head += n; }
+
+      // bytes consumed since the start of input
+      std::uint64_t offset() const { return head; }
+      std::size_t capacity() const { return mask + 1; }
+
+      // scratch for a token straddling refills (see gettok)
+      char* scratch() { return tokenScratch.get(); }
+
+   private:
+      bool fill();
+
+      ReadFn read;
+      std::unique_ptr<char[]> ring;
+      std::unique_ptr<char[]> tokenScratch;
+      std::size_t mask{};
+      std::uint64_t head{}; // monotonic; index into ring is head & mask
+      std::uint64_t tail{};
+      bool atEof{false};
+};
+
+// Same tokens as the other lexers.  tok.offset is the absolute stream
+// offset; tok.text views the reader's scratch and stays valid until the
+// next call.
+void gettok(Token& tok, ChunkedReader& in);
+
+#endif // __STREAM_READER_H_
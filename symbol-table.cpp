@@ -0,0 +1,189 @@
+#include "symbol-table.hpp"
+
+#include <mutex>
+
+Symbol::Symbol(std::string_view name)
+   : value{name.empty() ? 0 : symbols().intern(name)}
+{}
+
+std::string_view Symbol::str() const
+{
+   return symbols().name(value);
+}
+
+std::uint64_t Symbol::stableHash() const
+{
+   return symbols().stableHash(value);
+}
+
+SymbolTable::SymbolTable()
+{
+   names.emplace_back();
+   ids.emplace(std::string_view{}, 0);
+}
+
+std::uint32_t SymbolTable::intern(std::string_view name)
+{
+   // Per-thread direct-mapped cache in front of the shared table; the same
+   // few hundred identifiers make up most of any source, and a hit avoids
+   // the lock entirely.  Cached views point into storage, which never moves.
+   struct CacheEntry
+   {
+      SymbolTable const* table;
+      std::string_view name;
+      std::uint32_t id;
+   };
+   thread_local CacheEntry cache[256]{};
+   CacheEntry& slot = cache[std::hash<std::string_view>{}(name) & 255];
+   if(slot.table == this && slot.name == name)
+   {
+      return slot.id;
+   }
+
+   std::string_view stored{};
+   std::uint32_t id = insert(name, stored);
+   slot = {this, stored, id};
+   return id;
+}
+
+std::uint32_t SymbolTable::insert(std::string_view name, std::string_view& stored)
+{
+   {
+      std::shared_lock lock{mutex};
+      auto it = ids.find(name);
+      if(it != ids.end())
+      {
+         stored = it->first;
+         return it->second;
+      }
+   }
+
+   std::unique_lock lock{mutex};
+   // another thread may have won the race since the shared lock was dropped
+   auto it = ids.find(name);
+   if(it != ids.end())
+   {
+      stored = it->first;
+      return it->second;
+   }
+   stored = storage.emplace_back(name);
+   std::uint32_t id = names.size();
+   names.push_back(stored);
+   ids.emplace(stored, id);
+   return id;
+}
+
+std::string_view SymbolTable::name(std::uint32_t id) const
+{
+   std::shared_lock lock{mutex};
+   return id < names.size() ? names[id] : std::string_view{};
+}
+
+std::uint64_t SymbolTable::stableHash(std::uint32_t id) const
+{
+   // AST nodes hash their names on construction; cache per thread like
+   // intern() so the common case takes no lock
+   struct CacheEntry
+   {
+      SymbolTable const* table;
+      std::uint32_t id;
+      std::uint64_t hash;
+   };
+   thread_local CacheEntry cache[256]{};
+   CacheEntry& slot = cache[id & 255];
+   if(slot.table == this && slot.id == id)
+   {
+      return slot.hash;
+   }
+
+   // FNV-1a
+   std::uint64_t h{0xcbf29ce484222325ull};
+   for(char c : name(id))
+   {
+      h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+   }
+   slot = {this, id, h};
+   return h;
+}
+
+std::size_t SymbolTable::size() const
+{
+   std::shared_lock lock{mutex};
+   return names.size();
+}
+
+SymbolTable& symbols()
+{
+   static SymbolTable table{};
+   return table;
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+#include <thread>
+
+TEST(symbol_table_test, empty)
+{
+   Symbol s{};
+   EXPECT_TRUE(s.empty());
+   EXPECT_EQ(s.str(), "");
+   EXPECT_EQ(Symbol(""), s);
+}
+
+TEST(symbol_table_test, interned_once)
+{
+   Symbol a{"alpha"};
+   Symbol b{std::string("alp") + "ha"};
+   EXPECT_EQ(a, b);
+   EXPECT_EQ(a.id(), b.id());
+   EXPECT_EQ(a.str().data(), b.str().data());
+   EXPECT_NE(a, Symbol("beta"));
+   EXPECT_EQ(a, "alpha");
+   EXPECT_NE(a, "beta");
+}
+
+TEST(symbol_table_test, stable_hash)
+{
+   // FNV-1a of the text, independent of interning order
+   EXPECT_EQ(Symbol("a").stableHash(), 0xaf63dc4c8601ec8cull);
+   EXPECT_EQ(Symbol("stable_hash_x").stableHash(), Symbol(std::string("stable_hash_x")).stableHash());
+   EXPECT_NE(Symbol("stable_hash_x").stableHash(), Symbol("stable_hash_y").stableHash());
+}
+
+TEST(symbol_table_test, dense_ids)
+{
+   std::size_t before = symbols().size();
+   Symbol a{"dense_ids_0"};
+   Symbol b{"dense_ids_1"};
+   EXPECT_EQ(a.id(), before);
+   EXPECT_EQ(b.id(), before + 1);
+   EXPECT_EQ(Symbol::fromId(b.id()).str(), "dense_ids_1");
+}
+
+TEST(symbol_table_test, concurrent_intern)
+{
+   std::vector<std::uint32_t> ids(8);
+   std::vector<std::thread> threads{};
+   for(std::size_t t{}; t < ids.size(); t++)
+   {
+      threads.emplace_back([&ids, t]
+      {
+         for(int i{}; i < 1000; i++)
+         {
+            Symbol("concurrent" + std::to_string(i));
+         }
+         ids[t] = Symbol("concurrent500").id();
+      });
+   }
+   for(auto& t : threads)
+   {
+      t.join();
+   }
+   for(auto id : ids)
+   {
+      EXPECT_EQ(id, ids[0]);
+   }
+}
+
+#endif
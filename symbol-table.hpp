@@ -0,0 +1,77 @@
+#ifndef __SYMBOL_TABLE_H_
+#define __SYMBOL_TABLE_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Dense 32-bit handle for an interned identifier.  Two symbols are equal
+// iff their names are equal, so comparisons and hashing are on the id
+// alone.  The default symbol (id 0) is the empty name.
+class Symbol
+{
+   public:
+      Symbol() = default;
+      Symbol(std::string_view name);
+      Symbol(std::string const& name) : Symbol(std::string_view(name)) {}
+      Symbol(char const* name) : Symbol(std::string_view(name)) {}
+
+      static Symbol fromId(std::uint32_t id) { Symbol s; s.value = id; return s; }
+
+      std::uint32_t id() const { return value; }
+      bool empty() const { return value == 0; }
+      std::string_view str() const;
+      // hash of the name, the same in every run (unlike id())
+      std::uint64_t stableHash() const;
+
+      friend bool operator==(Symbol lhs, Symbol rhs) { return lhs.value == rhs.value; }
+      friend bool operator!=(Symbol lhs, Symbol rhs) { return lhs.value != rhs.value; }
+      friend bool operator<(Symbol lhs, Symbol rhs) { return lhs.value < rhs.value; }
+      // compares names without interning
+      friend bool operator==(Symbol lhs, char const* rhs) { return lhs.str() == rhs; }
+      friend bool operator!=(Symbol lhs, char const* rhs) { return lhs.str() != rhs; }
+
+      friend std::ostream& operator<<(std::ostream& os, Symbol s) { return os << s.str(); }
+
+   private:
+      std::uint32_t value{};
+};
+
+template<>
+struct std::hash<Symbol>
+{
+   std::size_t operator()(Symbol s) const noexcept { return s.id(); }
+};
+
+// Process-wide identifier table shared by the lexer, parser and code
+// generator.  Safe to intern from several threads.
+class SymbolTable
+{
+   public:
+      SymbolTable();
+      SymbolTable(SymbolTable const&) = delete;
+      SymbolTable& operator=(SymbolTable const&) = delete;
+
+      std::uint32_t intern(std::string_view name);
+      std::string_view name(std::uint32_t id) const;
+      std::uint64_t stableHash(std::uint32_t id) const;
+      std::size_t size() const;
+
+   private:
+      std::uint32_t insert(std::string_view name, std::string_view& stored);
+
+      mutable std::shared_mutex mutex{};
+      std::deque<std::string> storage{}; // stable backing for the views below
+      std::vector<std::string_view> names{};
+      std::unordered_map<std::string_view, std::uint32_t> ids{};
+};
+
+SymbolTable& symbols();
+
+#endif // __SYMBOL_TABLE_H_
@@ -0,0 +1,189 @@
+#include "token-stream.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <limits>
+
+TokenStream TokenStream::tokenize(std::string_view src)
+{
+   TokenStream ts{};
+   if(src.size() > std::numeric_limits<std::uint32_t>::max())
+   {
+      std::cerr << "Source too large for a token stream";
+      src = {};
+   }
+   ts.src = src;
+
+   // dense expression code runs close to one token per two bytes
+   std::size_t guess = src.size() / 2 + 1;
+   ts.kinds.reserve(guess);
+   ts.offsets.reserve(guess);
+   ts.values.reserve(guess);
+   ts.chars.reserve(guess);
+
+   BufferCursor cur{src};
+   Token tok{};
+   do
+   {
+      gettok(tok, cur);
+      std::uint32_t value{};
+      switch(tok.type)
+      {
+         case TokenType::id:
+         case TokenType::def:
+         case TokenType::ext:
+         case TokenType::binary:
+         case TokenType::unary:
+         {
+            value = tok.id.id();
+            break;
+         }
+         case TokenType::num:
+         {
+            value = ts.numbers.size();
+            ts.numbers.push_back(tok.num);
+            break;
+         }
+         default:
+         {
+            break;
+         }
+      }
+      ts.kinds.push_back(static_cast<std::int8_t>(tok.type));
+      ts.offsets.push_back(tok.offset);
+      ts.values.push_back(value);
+      ts.chars.push_back(tok.ch);
+   } while(tok.type != TokenType::eof);
+   return ts;
+}
+
+void TokenStream::load(Token& tok, std::uint32_t i) const
+{
+   tok.type = kind(i);
+   tok.id = id(i);
+   tok.num = num(i);
+   tok.ch = chars[i];
+   tok.offset = offsets[i];
+   tok.text = {};
+}
+
+void gettok(Token& tok, TokenCursor& cur)
+{
+   cur.stream->load(tok, cur.pos);
+   // stay on the trailing eof, like the lexers do
+   if(cur.pos + 1 < cur.stream->size())
+   {
+      ++cur.pos;
+   }
+}
+
+void seek(Token& tok, TokenCursor& cur, std::uint32_t index)
+{
+   cur.pos = index;
+   gettok(tok, cur);
+}
+
+#ifdef BUILD_TESTS
+#include "gtest/gtest.h"
+
+class token_stream_test : public ::testing::Test
+{
+   public:
+      Token tok{};
+};
+
+TEST_F(token_stream_test, empty)
+{
+   auto ts = TokenStream::tokenize("");
+   ASSERT_EQ(ts.size(), 1u);
+   EXPECT_EQ(ts.kind(0), TokenType::eof);
+}
+
+TEST_F(token_stream_test, arrays)
+{
+   auto ts = TokenStream::tokenize("def foo(x) x*2.5");
+   ASSERT_EQ(ts.size(), 9u);
+   EXPECT_EQ(ts.kind(0), TokenType::def);
+   EXPECT_EQ(ts.kind(1), TokenType::id);
+   EXPECT_EQ(ts.id(1), "foo");
+   EXPECT_EQ(ts.offset(1), 4u);
+   EXPECT_EQ(ts.kind(2), TokenType::sym);
+   EXPECT_EQ(ts.ch(2), '(');
+   EXPECT_EQ(ts.kind(7), TokenType::num);
+   EXPECT_EQ(ts.num(7), 2.5);
+   EXPECT_EQ(ts.offset(7), 13u);
+   EXPECT_EQ(ts.kind(8), TokenType::eof);
+}
+
+TEST_F(token_stream_test, matches_lexer)
+{
+   std::string src{"# fib\ndef fib(x) if x < 3 then 1 else fib(x-1)+fib(x-2)\nfib(40)"};
+   auto ts = TokenStream::tokenize(src);
+   TokenCursor cur{&ts};
+   BufferCursor ref{src};
+   Token expected{};
+   do
+   {
+      gettok(expected, ref);
+      gettok(tok, cur);
+      EXPECT_EQ(tok.type, expected.type);
+      EXPECT_EQ(tok.id, expected.id);
+      EXPECT_EQ(tok.ch, expected.ch);
+      if(expected.type == TokenType::num)
+      {
+         EXPECT_EQ(tok.num, expected.num);
+      }
+      EXPECT_EQ(tok.offset, expected.offset);
+   } while(expected.type != TokenType::eof);
+}
+
+TEST_F(token_stream_test, lookahead_and_backtrack)
+{
+   auto ts = TokenStream::tokenize("foo(1, 2)");
+   TokenCursor cur{&ts};
+   gettok(tok, cur);
+   EXPECT_EQ(tok.id, "foo");
+   EXPECT_EQ(cur.peek(1), TokenType::sym);
+   EXPECT_EQ(cur.peek(2), TokenType::num);
+   EXPECT_EQ(cur.peek(100), TokenType::eof);
+
+   TokenCursor saved = cur;
+   gettok(tok, cur);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.num, 1.0);
+   cur = saved;
+   seek(tok, cur, cur.current());
+   EXPECT_EQ(tok.id, "foo");
+   seek(tok, cur, 4);
+   EXPECT_EQ(tok.num, 2.0);
+}
+
+TEST_F(token_stream_test, operator_keywords_keep_symbol)
+{
+   std::string src{"def binary| 5 (a b) a\ndef unary!(v) v"};
+   auto ts = TokenStream::tokenize(src);
+   BufferCursor ref{src};
+   Token expected{};
+   for(std::uint32_t i{}; i < ts.size(); i++)
+   {
+      gettok(expected, ref);
+      EXPECT_EQ(ts.id(i), expected.id);
+   }
+   EXPECT_EQ(ts.kind(1), TokenType::binary);
+   EXPECT_EQ(ts.id(1), "binary");
+   EXPECT_EQ(ts.kind(10), TokenType::unary);
+   EXPECT_EQ(ts.id(10), "unary");
+}
+
+TEST_F(token_stream_test, stays_at_eof)
+{
+   auto ts = TokenStream::tokenize("x");
+   TokenCursor cur{&ts};
+   gettok(tok, cur);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::eof);
+   gettok(tok, cur);
+   EXPECT_EQ(tok.type, TokenType::eof);
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __TOKEN_STREAM_H_
+#define __TOKEN_STREAM_H_
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "lexer.hpp"
+
+// A whole input tokenized up front, stored structure-of-arrays.  Token i
+// is described by kinds[i], offsets[i], values[i] and chars[i]; values
+// holds the symbol id of identifiers/keywords and the index into numbers
+// of literals.  The last token is always eof.
+class TokenStream
+{
+   public:
+      static TokenStream tokenize(std::string_view src);
+
+      std::uint32_t size() const { return kinds.size(); }
+      std::string_view source() const { return src; }
+
+      TokenType kind(std::uint32_t i) const { return static_cast<TokenType>(kinds[i]); }
+      std::uint32_t offset(std::uint32_t i) const { return offsets[i]; }
+      Symbol id(std::uint32_t i) const { return Symbol::fromId(isIdentifier(i) ? values[i] : 0); }
+      double num(std::uint32_t i) const { return kind(i) == TokenType::num ? numbers[values[i]] : 0; }
+      char ch(std::uint32_t i) const { return chars[i]; }
+
+      // materialize token i into tok
+      void load(Token& tok, std::uint32_t i) const;
+
+   private:
+      bool isIdentifier(std::uint32_t i) const
+      {
+         TokenType k = kind(i);
+         return k == TokenType::id || k == TokenType::def || k == TokenType::ext ||
+                k == TokenType::binary || k == TokenType::unary;
+      }
+
+      std::string_view src{};
+      std::vector<std::int8_t> kinds{};
+      std::vector<std::uint32_t> offsets{};
+      std::vector<std::uint32_t> values{};
+      std::vector<char> chars{};
+      std::vector<double> numbers{};
+};
+
+// Index into a TokenStream.  pos is the index of the next token gettok
+// loads; the cursor is a plain value, so copying it saves a position and
+// assigning it back backtracks.
+struct TokenCursor
+{
+   TokenStream const* stream{};
+   std::uint32_t pos{};
+
+   // kind of the token n places after the current one (clamped to eof)
+   TokenType peek(std::uint32_t n = 1) const
+   {
+      std::uint32_t i = pos - 1 + n;
+      return stream->kind(i < stream->size() ? i : stream->size() - 1);
+   }
+   // index of the token most recently loaded by gettok
+   std::uint32_t current() const { return pos - 1; }
+};
+
+void gettok(Token& tok, TokenCursor& cur);
+
+// reposition so that tok holds token index, O(1)
+void seek(Token& tok, TokenCursor& cur, std::uint32_t index);
+
+#endif // __TOKEN_STREAM_H_